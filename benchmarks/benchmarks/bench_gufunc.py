@@ -0,0 +1,73 @@
+"""End to end benchmarks of gufunc calls, with NumPy's own paths as the
+baseline.
+
+example_gufunc is "(M,N)->(N)", the sum of the rows of each matrix. The
+baselines compute the same thing with np.add.reduce over the core axis and
+with np.matmul (NumPy's gufunc path) against a vector of ones.
+"""
+
+from __future__ import absolute_import, print_function
+
+import numpy as np
+
+from gufunctools import _nonpy_tools, examples
+
+
+OUTER_SIZES = [1, 100, 10000]
+CORE_SIZES = [4, 64]
+DTYPES = ['float64', 'float32', 'int64']
+
+
+class TimeExampleGufunc(object):
+    params = [OUTER_SIZES, CORE_SIZES, DTYPES]
+    param_names = ['outer', 'core', 'dtype']
+
+    def setup(self, outer, core, dtype):
+        if outer*core*core > 10**7:
+            raise NotImplementedError  # skipped, too big
+        self.a = np.ones((outer, core, core), dtype=dtype)
+        self.ones = np.ones(core, dtype=dtype)
+        self.out = np.empty((outer, core), dtype=dtype)
+
+    def time_example_gufunc(self, outer, core, dtype):
+        examples.example_gufunc(self.a, out=self.out)
+
+    def time_numpy_add_reduce(self, outer, core, dtype):
+        np.add.reduce(self.a, axis=-2, out=self.out)
+
+    def time_numpy_matmul(self, outer, core, dtype):
+        np.matmul(self.ones, self.a, out=self.out)
+
+
+class TimeExampleGufuncLayout(object):
+    """the same call on non contiguous operands"""
+    params = [OUTER_SIZES, ['transposed', 'strided']]
+    param_names = ['outer', 'layout']
+
+    def setup(self, outer, layout):
+        a = np.ones((outer, 32, 64))
+        if layout == 'transposed':
+            self.a = a.transpose(0, 2, 1)
+        else:
+            self.a = a[:, :, ::2]
+
+    def time_example_gufunc(self, outer, layout):
+        examples.example_gufunc(self.a)
+
+    def time_numpy_add_reduce(self, outer, layout):
+        np.add.reduce(self.a, axis=-2)
+
+
+class TimeDispatch(object):
+    """KernelRegistry lookups of the example kernels"""
+
+    def setup(self):
+        self.registry = _nonpy_tools.KernelRegistry('(M,N)->(N)')
+        for types, kernel in examples.example_gufunc_kernels.items():
+            self.registry.register(types, kernel)
+
+    def time_lookup_hit(self):
+        self.registry.lookup('dd')
+
+    def time_getitem_hit(self):
+        self.registry['ff']
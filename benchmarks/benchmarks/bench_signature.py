@@ -0,0 +1,77 @@
+"""Benchmarks for signature parsing, boxing and shape resolution.
+
+Written in the asv style (classes with setup and time_* methods, params
+for sweeps). They run under asv from the repository root, or with
+benchmarks/run_benchmarks.py when asv is not available.
+"""
+
+from __future__ import absolute_import, print_function
+
+from gufunctools import _nonpy_tools
+
+
+def make_signature(nargs, dims_per_arg):
+    """a signature with nargs operands of dims_per_arg dimensions each, the
+    last one being the only output"""
+    args = []
+    for a in range(nargs):
+        dims = ', '.join('dim_{0}'.format((a + d) % (dims_per_arg + 3))
+                         for d in range(dims_per_arg))
+        args.append('({0})'.format(dims))
+    return ','.join(args[:-1]) + '->' + args[-1]
+
+
+SIGNATURE_SIZES = [(2, 1), (2, 2), (3, 2), (4, 4), (8, 4), (12, 8)]
+
+
+class TimeParse(object):
+    """parsing plus boxing into a Python object"""
+    params = [SIGNATURE_SIZES]
+    param_names = ['nargs_dims']
+
+    def setup(self, nargs_dims):
+        self.nargs = nargs_dims[0]
+        self.signature = make_signature(*nargs_dims)
+
+    def time_legacy_parse_signature(self, nargs_dims):
+        # no caching: parse and box_signature every time
+        _nonpy_tools.legacy_parse_signature(self.signature, self.nargs - 1,
+                                            self.nargs)
+
+    def time_parse_signature_interned(self, nargs_dims):
+        # hits the interning table and returns the cached boxed tuple
+        _nonpy_tools.parse_signature(self.signature)
+
+    def time_signature_interned(self, nargs_dims):
+        _nonpy_tools.Signature(self.signature)
+
+
+class TimeAccess(object):
+    """reading the data of a Signature from Python"""
+    params = [SIGNATURE_SIZES]
+    param_names = ['nargs_dims']
+
+    def setup(self, nargs_dims):
+        self.signature = _nonpy_tools.Signature(make_signature(*nargs_dims))
+
+    def time_boxed(self, nargs_dims):
+        self.signature.boxed()
+
+    def time_arg_shape_idx(self, nargs_dims):
+        self.signature.arg_shape_idx[0]
+
+
+class TimeResolve(object):
+    """Signature.resolve for matmul like operands"""
+    params = [[0, 2, 4]]
+    param_names = ['outer_ndim']
+
+    def setup(self, outer_ndim):
+        self.signature = _nonpy_tools.Signature('(m,n),(n,p)->(m,p)')
+        # b has one outer dimension less, and they broadcast against a's
+        a_outer = (8, 1, 6, 5)[4 - outer_ndim:]
+        b_outer = (1, 6, 1)[3 - max(outer_ndim - 1, 0):]
+        self.shapes = (a_outer + (4, 3), b_outer + (3, 2))
+
+    def time_resolve(self, outer_ndim):
+        self.signature.resolve(*self.shapes)
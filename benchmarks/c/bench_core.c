@@ -0,0 +1,378 @@
+/* Micro-benchmark of the native gufunc machinery in nonpy_tools, with no
+   Python nor NumPy involved:
+
+   - parse: numpy_parse_signature and parse_signature_in_buffer over
+     signatures of growing length.
+
+   - resolve: resolve_shapes for a few signatures and outer ranks.
+
+   - dispatch: kernel_registry_lookup hits in a populated registry.
+
+   - execute: init_execution_plan + execute_plan of a "(M,N)->(N)" column
+     sum over a sweep of outer sizes and core sizes, contiguous and with a
+     transposed core (which goes through buffered execution).
+
+   Results are written to stdout as JSON lines, one object per measurement:
+
+     {"suite": "c", "benchmark": "...", "params": {...}, "ns": ...}
+
+   where ns is the best time per call over a few repetitions. Build and run
+   with "python setup.py bench", or by hand with something like:
+
+     cc -O2 -std=c99 -Imodules/nonpy_tools/src benchmarks/c/bench_core.c \
+        modules/nonpy_tools/src/signature.c modules/nonpy_tools/src/resolve.c \
+        modules/nonpy_tools/src/dispatch.c modules/nonpy_tools/src/executor.c \
+        modules/nonpy_tools/src/buffered.c modules/nonpy_tools/src/scratch.c \
+        modules/nonpy_tools/src/threadpool.c modules/nonpy_tools/src/stats.c \
+        -lpthread -o bench_core
+     ./bench_core [quick]
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "signature.h"
+#include "resolve.h"
+#include "dispatch.h"
+#include "executor.h"
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/* keeps the compiler from optimizing away the results */
+static volatile size_t sink;
+
+/* number of repetitions, the best one is reported */
+static int repetitions = 5;
+
+typedef void (*bench_func)(void *ctx, size_t iterations);
+
+static double
+time_per_call(bench_func f, void *ctx, size_t iterations)
+{
+    double best = 0.0;
+    for (int rep = 0; rep < repetitions; rep++) {
+        double t0 = now_ns();
+        f(ctx, iterations);
+        double t = (now_ns() - t0)/iterations;
+        if (rep == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+/* params is the inside of a JSON object, already formatted */
+static void
+report(const char *benchmark, const char *params, double ns)
+{
+    printf("{\"suite\": \"c\", \"benchmark\": \"%s\", "
+           "\"params\": {%s}, \"ns\": %.2f}\n", benchmark, params, ns);
+    fflush(stdout);
+}
+
+/* -----------------------------------------------------------------------------
+ * parse
+ */
+
+static void
+bench_numpy_parse(void *ctx, size_t iterations)
+{
+    const char *signature = ctx;
+    for (size_t i = 0; i < iterations; i++) {
+        parsed_signature *ps = numpy_parse_signature(signature, NULL);
+        sink += ps->total_signature_dimensions;
+        release_parsed_signature(ps);
+    }
+}
+
+static void
+bench_in_buffer(void *ctx, size_t iterations)
+{
+    const char *signature = ctx;
+    size_t buffer[1024];
+    for (size_t i = 0; i < iterations; i++) {
+        parse_signature_in_buffer(signature, buffer, sizeof(buffer),
+                                  NULL, NULL);
+        sink += ((parsed_signature *)buffer)->total_signature_dimensions;
+    }
+}
+
+/* nargs operands with dims_per_arg dimensions each, the last one being
+   the only output */
+static char *
+make_signature(size_t nargs, size_t dims_per_arg)
+{
+    size_t cap = nargs*(dims_per_arg*8 + 8) + 16;
+    char *s = malloc(cap);
+    size_t len = 0;
+    for (size_t a = 0; a < nargs; a++) {
+        len += sprintf(s + len, "%s(", a == 0 ? "" :
+                       (a == nargs - 1 ? "->" : ","));
+        for (size_t d = 0; d < dims_per_arg; d++)
+            len += sprintf(s + len, "%sdim_%zu", d ? ", " : "",
+                           (a + d) % (dims_per_arg + 3));
+        len += sprintf(s + len, ")");
+    }
+    return s;
+}
+
+static void
+run_parse(size_t iterations)
+{
+    static const size_t sizes[][2] = {
+        { 2, 1 }, { 2, 2 }, { 3, 2 }, { 4, 4 }, { 8, 4 }, { 12, 8 }
+    };
+    char params[128];
+
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        char *sig = make_signature(sizes[i][0], sizes[i][1]);
+        snprintf(params, sizeof(params),
+                 "\"nargs\": %zu, \"dims_per_arg\": %zu, \"length\": %zu",
+                 sizes[i][0], sizes[i][1], strlen(sig));
+        report("parse.numpy_parse_signature", params,
+               time_per_call(bench_numpy_parse, sig, iterations));
+        report("parse.parse_signature_in_buffer", params,
+               time_per_call(bench_in_buffer, sig, iterations));
+        free(sig);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * resolve
+ */
+
+typedef struct {
+    parsed_signature *ps;
+    size_t arg_ndim[GUFT_MAXARGS];
+    const size_t *arg_shapes[GUFT_MAXARGS];
+} resolve_case;
+
+static void
+bench_resolve(void *ctx, size_t iterations)
+{
+    resolve_case *rc = ctx;
+    size_t dimension_sizes[GUFT_MAX_DIMENSION_VARIABLES];
+    resolved_shapes resolved;
+    resolve_error error;
+
+    resolved.dimension_sizes = dimension_sizes;
+    for (size_t i = 0; i < iterations; i++) {
+        resolve_shapes(rc->ps, rc->arg_ndim, rc->arg_shapes, &resolved,
+                       &error);
+        sink += resolved.element_count;
+    }
+}
+
+static void
+run_resolve(size_t iterations)
+{
+    /* matmul like, with the outer dimensions broadcasting */
+    static const size_t a_shape[] = { 8, 1, 6, 5, 4, 3 };
+    static const size_t b_shape[] = { 1, 6, 1, 3, 2 };
+    char params[128];
+
+    for (size_t outer = 0; outer <= 4; outer += 2) {
+        resolve_case rc;
+        rc.ps = numpy_parse_signature("(m,n),(n,p)->(m,p)", NULL);
+        rc.arg_ndim[0] = outer + 2;
+        rc.arg_ndim[1] = (outer ? outer - 1 : 0) + 2;
+        rc.arg_ndim[2] = 0;
+        rc.arg_shapes[0] = a_shape + 6 - rc.arg_ndim[0];
+        rc.arg_shapes[1] = b_shape + 5 - rc.arg_ndim[1];
+        rc.arg_shapes[2] = NULL; /* output inferred */
+        snprintf(params, sizeof(params),
+                 "\"signature\": \"(m,n),(n,p)->(m,p)\", \"outer_ndim\": %zu",
+                 outer);
+        report("resolve.resolve_shapes", params,
+               time_per_call(bench_resolve, &rc, iterations));
+        release_parsed_signature(rc.ps);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * dispatch
+ */
+
+static void
+dummy_kernel(char **args, guft_intp *dimensions, guft_intp *steps,
+             void *data)
+{
+    (void)args; (void)dimensions; (void)steps; (void)data;
+}
+
+typedef struct {
+    kernel_registry *registry;
+    const char (*types)[3];
+    size_t count;
+} dispatch_case;
+
+static void
+bench_lookup(void *ctx, size_t iterations)
+{
+    dispatch_case *dc = ctx;
+    for (size_t i = 0; i < iterations; i++)
+        sink += kernel_registry_lookup(dc->registry,
+                                       dc->types[i % dc->count]) != NULL;
+}
+
+static void
+run_dispatch(size_t iterations)
+{
+    static const char codes[] = "bhiqBHIQefd?";
+    static char types[144][3];
+    kernel_registry registry;
+    guft_kernel kernel = { dummy_kernel, NULL };
+    dispatch_case dc;
+    char params[64];
+    size_t count = 0;
+
+    kernel_registry_init(&registry, 2, 1, 0);
+    for (size_t a = 0; a < sizeof(codes) - 1; a++) {
+        for (size_t b = 0; b < sizeof(codes) - 1; b++) {
+            void *replaced;
+            types[count][0] = codes[a];
+            types[count][1] = codes[b];
+            types[count][2] = '\0';
+            kernel_registry_insert(&registry, types[count], kernel, NULL,
+                                   &replaced);
+            count++;
+        }
+    }
+
+    dc.registry = &registry;
+    dc.types = (const char (*)[3])types;
+    dc.count = count;
+    snprintf(params, sizeof(params), "\"entries\": %zu", count);
+    report("dispatch.kernel_registry_lookup", params,
+           time_per_call(bench_lookup, &dc, iterations));
+    kernel_registry_clear(&registry);
+}
+
+/* -----------------------------------------------------------------------------
+ * execute
+ */
+
+/* "(M,N)->(N)": sum of the rows of a matrix */
+static void
+column_sum(char **args, guft_intp *dimensions, guft_intp *steps,
+           void *data)
+{
+    guft_intp n = dimensions[0], M = dimensions[1], N = dimensions[2];
+    (void)data;
+    for (guft_intp i = 0; i < n; i++) {
+        char *in = args[0] + i*steps[0], *out = args[1] + i*steps[1];
+        for (guft_intp c = 0; c < N; c++)
+            *(double *)(out + c*steps[4]) = 0.0;
+        for (guft_intp r = 0; r < M; r++) {
+            for (guft_intp c = 0; c < N; c++)
+                *(double *)(out + c*steps[4]) +=
+                    *(double *)(in + r*steps[2] + c*steps[3]);
+        }
+    }
+}
+
+typedef struct {
+    parsed_signature *ps;
+    execution_operand operands[2];
+    size_t buffer_size;
+} execute_case;
+
+static void
+bench_execute(void *ctx, size_t iterations)
+{
+    execute_case *ec = ctx;
+    size_t dimension_sizes[GUFT_MAX_DIMENSION_VARIABLES];
+    size_t arg_ndim[2] = { ec->operands[0].ndim, ec->operands[1].ndim };
+    const size_t *arg_shapes[2] = { ec->operands[0].shape,
+                                    ec->operands[1].shape };
+    guft_kernel kernel = { column_sum, NULL };
+    execution_plan *plan = malloc(execution_plan_size(ec->ps));
+    resolved_shapes resolved;
+    resolve_error error;
+
+    resolved.dimension_sizes = dimension_sizes;
+    for (size_t i = 0; i < iterations; i++) {
+        resolve_shapes(ec->ps, arg_ndim, arg_shapes, &resolved, &error);
+        init_execution_plan(plan, ec->ps, &resolved, ec->operands, kernel);
+        enable_plan_buffering(plan, ec->buffer_size);
+        execute_plan(plan);
+    }
+    free(plan);
+}
+
+static void
+run_execute(size_t iterations)
+{
+    static const size_t outer_sizes[] = { 1, 100, 10000 };
+    static const size_t core_sizes[] = { 4, 64 };
+    char params[160];
+
+    for (size_t o = 0; o < sizeof(outer_sizes)/sizeof(outer_sizes[0]); o++) {
+        for (size_t c = 0; c < sizeof(core_sizes)/sizeof(core_sizes[0]); c++) {
+            size_t outer = outer_sizes[o], core = core_sizes[c];
+            size_t in_shape[3] = { outer, core, core };
+            size_t out_shape[2] = { outer, core };
+            guft_intp in_strides[3], out_strides[2];
+            double *in = calloc(outer*core*core, sizeof(double));
+            double *out = calloc(outer*core, sizeof(double));
+            /* keep the total work per measurement about the same */
+            size_t work = outer*core*core;
+            size_t n = iterations*16/(work < 16 ? 16 : work);
+            execute_case ec;
+
+            ec.ps = numpy_parse_signature("(M,N)->(N)", NULL);
+            ec.buffer_size = GUFT_DEFAULT_BUFFER_SIZE;
+            out_strides[0] = (guft_intp)(core*sizeof(double));
+            out_strides[1] = sizeof(double);
+
+            for (int transposed = 0; transposed < 2; transposed++) {
+                in_strides[0] = (guft_intp)(core*core*sizeof(double));
+                in_strides[1] = (guft_intp)(core*sizeof(double));
+                in_strides[2] = sizeof(double);
+                if (transposed) {
+                    in_strides[1] = sizeof(double);
+                    in_strides[2] = (guft_intp)(core*sizeof(double));
+                }
+                ec.operands[0] = (execution_operand){
+                    (char *)in, 3, in_shape, in_strides, sizeof(double), 0 };
+                ec.operands[1] = (execution_operand){
+                    (char *)out, 2, out_shape, out_strides, sizeof(double), 0 };
+
+                snprintf(params, sizeof(params),
+                         "\"outer\": %zu, \"core\": %zu, \"layout\": \"%s\"",
+                         outer, core, transposed ? "transposed" : "contiguous");
+                report("execute.column_sum", params,
+                       time_per_call(bench_execute, &ec, n ? n : 1));
+            }
+
+            release_parsed_signature(ec.ps);
+            free(in);
+            free(out);
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int quick = argc > 1 && strcmp(argv[1], "quick") == 0;
+    size_t iterations = quick ? 2000 : 200000;
+
+    if (quick)
+        repetitions = 2;
+
+    run_parse(iterations);
+    run_resolve(iterations);
+    run_dispatch(iterations);
+    run_execute(iterations/10);
+    return 0;
+}
@@ -0,0 +1,134 @@
+/* Micro-benchmark comparing the signature parsing paths in nonpy_tools:
+
+   - numpy_parse_signature: the NumPy derived parser (scan + parse + pack,
+     several heap allocations per call).
+
+   - parse_signature_in_buffer: single pass parser writing into a stack
+     buffer with no heap allocation.
+
+   - parse_signature_in_buffer + duplicate_parsed_signature: same, but
+     keeping the result in a heap block of its own (one allocation).
+
+   It does not depend on Python nor NumPy. Build and run with something like:
+
+     cc -O2 -Imodules/nonpy_tools/src benchmarks/c/bench_signature.c \
+        modules/nonpy_tools/src/signature.c -o bench_signature
+     ./bench_signature
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "signature.h"
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/* keeps the compiler from optimizing away the parse results */
+static volatile size_t sink;
+
+static void
+bench_numpy_parse(const char *signature, size_t iterations)
+{
+    for (size_t i = 0; i < iterations; i++) {
+        parsed_signature *ps = numpy_parse_signature(signature, NULL);
+        sink += ps->total_signature_dimensions;
+        release_parsed_signature(ps);
+    }
+}
+
+static void
+bench_in_buffer(const char *signature, size_t iterations)
+{
+    size_t buffer[512];
+    for (size_t i = 0; i < iterations; i++) {
+        parse_signature_in_buffer(signature, buffer, sizeof(buffer),
+                                  NULL, NULL);
+        sink += ((parsed_signature *)buffer)->total_signature_dimensions;
+    }
+}
+
+static void
+bench_in_buffer_dup(const char *signature, size_t iterations)
+{
+    size_t buffer[512];
+    for (size_t i = 0; i < iterations; i++) {
+        parsed_signature *ps;
+        parse_signature_in_buffer(signature, buffer, sizeof(buffer),
+                                  NULL, NULL);
+        ps = duplicate_parsed_signature((parsed_signature *)buffer);
+        sink += ps->total_signature_dimensions;
+        release_parsed_signature(ps);
+    }
+}
+
+typedef void (*bench_func)(const char *, size_t);
+
+static double
+time_per_call(bench_func f, const char *signature, size_t iterations)
+{
+    double best = 0.0;
+    /* best of a few repetitions to filter out noise */
+    for (int rep = 0; rep < 5; rep++) {
+        double t0 = now_ns();
+        f(signature, iterations);
+        double t = (now_ns() - t0)/iterations;
+        if (rep == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static char *
+make_long_signature(size_t nargs, size_t dims_per_arg)
+{
+    size_t cap = nargs*(dims_per_arg*8 + 8) + 16;
+    char *s = malloc(cap);
+    size_t len = 0;
+    for (size_t a = 0; a < nargs; a++) {
+        len += sprintf(s + len, "%s(", a == 0 ? "" :
+                       (a == nargs - 1 ? "->" : ","));
+        for (size_t d = 0; d < dims_per_arg; d++)
+            len += sprintf(s + len, "%sdim_%zu", d ? ", " : "",
+                           (a + d) % (dims_per_arg + 3));
+        len += sprintf(s + len, ")");
+    }
+    return s;
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    char *long_signature = make_long_signature(12, 8);
+    const char *signatures[] = {
+        "(m,n)->(n)",
+        "(m,n),(n,p)->(m,p)",
+        "(m,m)->(m),(m,m)",
+        long_signature,
+    };
+    const char *labels[] = { "short", "matmul", "eig", "long" };
+
+    printf("# ns per call, best of 5, %zu iterations\n", iterations);
+    printf("%-8s %6s %14s %14s %14s\n", "case", "len",
+           "numpy_parse", "in_buffer", "in_buffer+dup");
+    for (size_t i = 0; i < sizeof(signatures)/sizeof(signatures[0]); i++) {
+        const char *sig = signatures[i];
+        printf("%-8s %6zu %14.1f %14.1f %14.1f\n", labels[i], strlen(sig),
+               time_per_call(bench_numpy_parse, sig, iterations),
+               time_per_call(bench_in_buffer, sig, iterations),
+               time_per_call(bench_in_buffer_dup, sig, iterations));
+    }
+
+    free(long_signature);
+    return 0;
+}
@@ -0,0 +1,153 @@
+"""Runs the benchmark suites and writes the results as a JSON document.
+
+The Python suite in benchmarks/benchmarks follows the asv conventions, so it
+can also be run with asv (see asv.conf.json). This runner does not need
+asv: it imports the bench_*.py modules, goes through every parameter
+combination and reports the best time per call. When given the path of the
+C micro-benchmark binary (benchmarks/c/bench_core.c), its results are
+included too.
+
+The output looks like:
+
+    {"metadata": {"gufunctools": ..., "numpy": ..., "python": ...,
+                  "platform": ..., "date": ...},
+     "results": [{"suite": "python", "benchmark": "...",
+                  "params": {...}, "ns": ...}, ...]}
+
+Usually run through "python setup.py bench".
+"""
+
+from __future__ import absolute_import, print_function
+
+import argparse
+import glob
+import importlib
+import itertools
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import time
+import timeit
+
+
+BENCHMARK_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def suite_modules():
+    sys.path.insert(0, BENCHMARK_DIR)
+    pattern = os.path.join(BENCHMARK_DIR, 'benchmarks', 'bench_*.py')
+    for path in sorted(glob.glob(pattern)):
+        name = os.path.splitext(os.path.basename(path))[0]
+        yield importlib.import_module('benchmarks.' + name)
+
+
+def benchmark_classes(module):
+    for name in sorted(dir(module)):
+        obj = getattr(module, name)
+        if isinstance(obj, type) and obj.__module__ == module.__name__ and \
+           any(m.startswith('time_') for m in dir(obj)):
+            yield obj
+
+
+def time_call(func, repeat, min_time):
+    """best time per call in ns, timeit.autorange style"""
+    timer = timeit.Timer(func)
+    number = 1
+    while True:
+        elapsed = timer.timeit(number)
+        if elapsed >= min_time or number >= 10**7:
+            break
+        number *= 10
+    best = min([elapsed] + timer.repeat(repeat - 1, number))
+    return best*1e9/number
+
+
+def run_python_suite(quick, name_filter):
+    repeat, min_time = (2, 0.01) if quick else (5, 0.2)
+    results = []
+    for module in suite_modules():
+        short_module = module.__name__.split('.')[-1]
+        for cls in benchmark_classes(module):
+            params = getattr(cls, 'params', [])
+            param_names = getattr(cls, 'param_names', [])
+            if params and not isinstance(params[0], list):
+                params = [params]
+            methods = sorted(m for m in dir(cls) if m.startswith('time_'))
+            for combination in itertools.product(*params):
+                instance = cls()
+                try:
+                    if hasattr(instance, 'setup'):
+                        instance.setup(*combination)
+                except NotImplementedError:
+                    continue  # asv convention for skipping a combination
+                for method in methods:
+                    name = '.'.join((short_module, cls.__name__, method))
+                    if name_filter and not re.search(name_filter, name):
+                        continue
+                    bound = getattr(instance, method)
+                    ns = time_call(lambda: bound(*combination),
+                                   repeat, min_time)
+                    results.append({
+                        'suite': 'python',
+                        'benchmark': name,
+                        'params': dict(zip(param_names, combination)),
+                        'ns': round(ns, 2),
+                    })
+                    print('{0:<64} {1:<40} {2:>14.1f} ns'.format(
+                        name, str(combination), ns), file=sys.stderr)
+                if hasattr(instance, 'teardown'):
+                    instance.teardown(*combination)
+    return results
+
+
+def run_c_suite(binary, quick):
+    args = [binary] + (['quick'] if quick else [])
+    output = subprocess.check_output(args)
+    return [json.loads(line) for line in output.decode().splitlines()
+            if line.strip()]
+
+
+def metadata():
+    import numpy
+    import gufunctools
+    return {
+        'gufunctools': gufunctools.__version__,
+        'numpy': numpy.__version__,
+        'python': platform.python_version(),
+        'platform': platform.platform(),
+        'machine': platform.machine(),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+    }
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--output', '-o', default=None,
+                        help='file for the JSON results (default: stdout)')
+    parser.add_argument('--c-binary', default=None,
+                        help='path of the bench_core binary to run as well')
+    parser.add_argument('--quick', action='store_true',
+                        help='fewer and shorter repetitions')
+    parser.add_argument('--filter', '-k', default=None,
+                        help='only run python benchmarks matching this regex')
+    options = parser.parse_args(argv)
+
+    results = []
+    if options.c_binary:
+        results.extend(run_c_suite(options.c_binary, options.quick))
+    results.extend(run_python_suite(options.quick, options.filter))
+
+    document = {'metadata': metadata(), 'results': results}
+    if options.output:
+        with open(options.output, 'w') as f:
+            json.dump(document, f, indent=1, sort_keys=True)
+    else:
+        json.dump(document, sys.stdout, indent=1, sort_keys=True)
+        print()
+
+
+if __name__ == '__main__':
+    main()
@@ -3,15 +3,28 @@
 #include <Python.h>
 #include <numpy/arrayobject.h>
 #include <numpy/ufuncobject.h>
-#include <stdio.h>
+#include <string.h>
 
 #include "example_gufuncs.h"
+#include "example_row_add.h"
 
  
 static void example_core_loop_f(char **args,
                                 npy_intp *dimensions,
                                 npy_intp *steps,
                                 void *NPY_UNUSED(user_data));
+static void example_core_loop_d(char **args,
+                                npy_intp *dimensions,
+                                npy_intp *steps,
+                                void *NPY_UNUSED(user_data));
+static void example_core_loop_i(char **args,
+                                npy_intp *dimensions,
+                                npy_intp *steps,
+                                void *NPY_UNUSED(user_data));
+static void example_core_loop_l(char **args,
+                                npy_intp *dimensions,
+                                npy_intp *steps,
+                                void *NPY_UNUSED(user_data));
 
 int
 add_example_gufuncs(PyObject *m)
@@ -66,15 +79,26 @@ add_example_gufuncs(PyObject *m)
      * copy them.
      */
     static PyUFuncGenericFunction core_loops[] = {
-        example_core_loop_f,
+        (PyUFuncGenericFunction)example_core_loop_i,
+        (PyUFuncGenericFunction)example_core_loop_l,
+        (PyUFuncGenericFunction)example_core_loop_f,
+        (PyUFuncGenericFunction)example_core_loop_d,
     };
 
     static void *core_loop_data[] = {
         NULL,
+        NULL,
+        NULL,
+        NULL,
     };
 
+    /* NumPy picks the first loop the inputs can be safely cast to, so
+       smaller types go first */
     static char core_loop_type_table[] = {
-        NPY_FLOAT, NPY_FLOAT
+        NPY_INT32, NPY_INT32,
+        NPY_INT64, NPY_INT64,
+        NPY_FLOAT, NPY_FLOAT,
+        NPY_DOUBLE, NPY_DOUBLE,
     };
 
     const size_t core_loop_count = sizeof(core_loops)/sizeof(core_loops[0]);
@@ -99,6 +123,46 @@ add_example_gufuncs(PyObject *m)
                      "Failed to register gufunc %s.", gufunc_name);
         return -1;
     }                                            
+
+    /* export the kernels so they can be registered in a gufunctools
+       KernelRegistry, keyed by their canonical types */
+    {
+        static const struct {
+            const char *types;
+            PyUFuncGenericFunction func;
+        } exported[] = {
+            { "ii", (PyUFuncGenericFunction)example_core_loop_i },
+            { "qq", (PyUFuncGenericFunction)example_core_loop_l },
+            { "ff", (PyUFuncGenericFunction)example_core_loop_f },
+            { "dd", (PyUFuncGenericFunction)example_core_loop_d },
+        };
+        PyObject *kernels = PyDict_New();
+        if (kernels == NULL)
+            return -1;
+        for (size_t i = 0; i < sizeof(exported)/sizeof(exported[0]); i++) {
+            PyObject *capsule = PyCapsule_New((void *)exported[i].func,
+                                              KERNEL_CAPSULE_NAME, NULL);
+            if (capsule == NULL ||
+                PyDict_SetItemString(kernels, exported[i].types,
+                                     capsule) < 0) {
+                Py_XDECREF(capsule);
+                Py_DECREF(kernels);
+                return -1;
+            }
+            Py_DECREF(capsule);
+        }
+        PyDict_SetItemString(module_dict, "example_gufunc_kernels", kernels);
+        Py_DECREF(kernels);
+    }
+
+    /* expose which SIMD implementation the kernels use, for benchmarks */
+    {
+        PyObject *isa = PyUnicode_FromString(get_row_add_functions()->isa);
+        if (isa == NULL)
+            return -1;
+        PyDict_SetItemString(module_dict, "kernel_isa", isa);
+        Py_DECREF(isa);
+    }
     
     return 0;
 }
@@ -142,43 +206,61 @@ add_example_gufuncs(PyObject *m)
             Note that all steps are given in bytes.
 */
 
-static void example_core_loop_f(char **args,
-                                npy_intp *dimensions,
-                                npy_intp *steps,
-                                void *NPY_UNUSED(user_data))
-{
-    /* signature is (M,N)->(N) */
-    npy_intp outer_step_in = *steps++;
-    npy_intp outer_step_out = *steps++;
-    npy_intp step_in_outer = *steps++;
-    npy_intp step_in_inner = *steps++;
-    npy_intp step_out_inner = *steps;
-    npy_intp LOOP_SIZE = *dimensions++;
-    npy_intp M = dimensions[0];
-    npy_intp N = dimensions[1];
-    char *arg_in = args[0];
-    char *arg_out = args[1];
-
-    printf("LOOP_SIZE: %zd M: %zd N: %zd\n", LOOP_SIZE, M, N);
-    printf("step_in_outer: %zd step_in_inner: %zd step_out_inner: %zd\n",
-           step_in_outer, step_in_inner, step_out_inner);
-    /* outer loop for the operation: for each element */
-    for (npy_intp i = 0; i < LOOP_SIZE; i++) {
-        /* compute base address of the input element and the output element */
-        char *el_in = arg_in + i*outer_step_in;
-        char *el_out = arg_out + i*outer_step_out;
-
-        /* implement the operation for a single element. This dummy gufunc will
-           just accumulate the values in the same column.
-        */
-        for (npy_intp c = 0; c < N; c++) {
-            float acc = 0.0f;
-            for (npy_intp r = 0; r < M; r++) {
-                acc += *(float*)(el_in + r*step_in_outer + c*step_in_inner);
-            }
-            *(float*)(el_out + c*step_out_inner) = acc;
-        }
-        /* end of the operation for a single element. */
+/* The kernels for the example gufunc (M,N)->(N) add up the values in each
+   column. They accumulate row by row rather than column by column: when
+   rows and the output are contiguous every row is streamed through SIMD
+   registers (see example_row_add.c), otherwise a strided scalar loop is
+   used, still in row major order. The accumulation order per column is the
+   same in both cases, so results do not depend on the layout. */
+#define DEFINE_EXAMPLE_CORE_LOOP(name, T, UT, row_add_member)               \
+    static void name(char **args,                                           \
+                     npy_intp *dimensions,                                  \
+                     npy_intp *steps,                                       \
+                     void *NPY_UNUSED(user_data))                           \
+    {                                                                       \
+        /* signature is (M,N)->(N) */                                       \
+        npy_intp outer_step_in = *steps++;                                  \
+        npy_intp outer_step_out = *steps++;                                 \
+        npy_intp step_in_outer = *steps++;                                  \
+        npy_intp step_in_inner = *steps++;                                  \
+        npy_intp step_out_inner = *steps;                                   \
+        npy_intp LOOP_SIZE = *dimensions++;                                 \
+        npy_intp M = dimensions[0];                                         \
+        npy_intp N = dimensions[1];                                         \
+        char *arg_in = args[0];                                             \
+        char *arg_out = args[1];                                            \
+        int contiguous = step_in_inner == (npy_intp)sizeof(T) &&            \
+                         step_out_inner == (npy_intp)sizeof(T);             \
+        const row_add_functions *row_add = get_row_add_functions();         \
+                                                                            \
+        /* outer loop for the operation: for each element */                \
+        for (npy_intp i = 0; i < LOOP_SIZE; i++) {                          \
+            char *el_in = arg_in + i*outer_step_in;                         \
+            char *el_out = arg_out + i*outer_step_out;                      \
+                                                                            \
+            if (contiguous) {                                               \
+                T *out = (T *)el_out;                                       \
+                memset(out, 0, N*sizeof(T));                                \
+                for (npy_intp r = 0; r < M; r++) {                          \
+                    row_add->row_add_member(out,                            \
+                        (const T *)(el_in + r*step_in_outer), N);           \
+                }                                                           \
+            } else {                                                        \
+                for (npy_intp c = 0; c < N; c++)                            \
+                    *(T *)(el_out + c*step_out_inner) = 0;                  \
+                for (npy_intp r = 0; r < M; r++) {                          \
+                    char *row = el_in + r*step_in_outer;                    \
+                    for (npy_intp c = 0; c < N; c++) {                      \
+                        T *out = (T *)(el_out + c*step_out_inner);          \
+                        T value = *(T *)(row + c*step_in_inner);            \
+                        *out = (T)((UT)*out + (UT)value);                   \
+                    }                                                       \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
     }
 
-}
+DEFINE_EXAMPLE_CORE_LOOP(example_core_loop_f, npy_float, npy_float, f32)
+DEFINE_EXAMPLE_CORE_LOOP(example_core_loop_d, npy_double, npy_double, f64)
+DEFINE_EXAMPLE_CORE_LOOP(example_core_loop_i, npy_int32, npy_uint32, i32)
+DEFINE_EXAMPLE_CORE_LOOP(example_core_loop_l, npy_int64, npy_uint64, i64)
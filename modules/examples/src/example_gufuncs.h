@@ -3,6 +3,12 @@
 /* assumes Python.h already included */
 
 
+/*
+ * Name of the capsules used to export kernels to gufunctools. Must match
+ * GUFT_KERNEL_CAPSULE_NAME in the nonpy_tools module.
+ */
+#define KERNEL_CAPSULE_NAME "gufunctools.kernel"
+
 /*
  * Add the example gufuncs. Return 0 on success, non 0 on failure.
  */
@@ -0,0 +1,141 @@
+#define NPY_NO_DEPRECATED_API NPY_API_VERSION
+
+#include <numpy/npy_common.h>
+#include <stdint.h>
+
+#include "example_row_add.h"
+
+/* Row accumulation used by the example gufunc kernels. There is a version
+   per instruction set, compiled with the matching target attribute so no
+   special compiler flags are needed. The one to use is selected at runtime
+   based on what the CPU supports. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_X86_DISPATCH 1
+#  include <immintrin.h>
+#else
+#  define HAVE_X86_DISPATCH 0
+#endif
+
+/* Plain C versions. Integers are added as unsigned to get wrap-around
+   instead of undefined behavior on overflow */
+#define DEFINE_ROW_ADD_SCALAR(name, T, UT)                              \
+    static void                                                         \
+    name(T *acc, const T *row, npy_intp n)                              \
+    {                                                                   \
+        for (npy_intp i = 0; i < n; i++)                                \
+            acc[i] = (T)((UT)acc[i] + (UT)row[i]);                      \
+    }
+
+DEFINE_ROW_ADD_SCALAR(row_add_f32_scalar, float, float)
+DEFINE_ROW_ADD_SCALAR(row_add_f64_scalar, double, double)
+DEFINE_ROW_ADD_SCALAR(row_add_i32_scalar, int32_t, uint32_t)
+DEFINE_ROW_ADD_SCALAR(row_add_i64_scalar, int64_t, uint64_t)
+
+#if HAVE_X86_DISPATCH
+
+/* SIMD versions: full vectors first, the tail with scalar code. Two vectors
+   per iteration to keep both load ports busy */
+#define DEFINE_ROW_ADD_SIMD(name, isa, T, UT, VT, WIDTH, LOAD, STORE, ADD) \
+    static __attribute__((target(isa))) void                            \
+    name(T *acc, const T *row, npy_intp n)                              \
+    {                                                                   \
+        npy_intp i = 0;                                                 \
+        for (; i + 2*(WIDTH) <= n; i += 2*(WIDTH)) {                    \
+            VT a0 = LOAD(acc + i), a1 = LOAD(acc + i + (WIDTH));        \
+            VT r0 = LOAD(row + i), r1 = LOAD(row + i + (WIDTH));        \
+            STORE(acc + i, ADD(a0, r0));                                \
+            STORE(acc + i + (WIDTH), ADD(a1, r1));                      \
+        }                                                               \
+        for (; i + (WIDTH) <= n; i += (WIDTH))                          \
+            STORE(acc + i, ADD(LOAD(acc + i), LOAD(row + i)));          \
+        for (; i < n; i++)                                              \
+            acc[i] = (T)((UT)acc[i] + (UT)row[i]);                      \
+    }
+
+#define LOAD_SI128(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE_SI128(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define LOAD_SI256(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE_SI256(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+#define LOAD_SI512(p) _mm512_loadu_si512((const void *)(p))
+#define STORE_SI512(p, v) _mm512_storeu_si512((void *)(p), (v))
+
+DEFINE_ROW_ADD_SIMD(row_add_f32_sse2, "sse2", float, float, __m128, 4,
+                    _mm_loadu_ps, _mm_storeu_ps, _mm_add_ps)
+DEFINE_ROW_ADD_SIMD(row_add_f64_sse2, "sse2", double, double, __m128d, 2,
+                    _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd)
+DEFINE_ROW_ADD_SIMD(row_add_i32_sse2, "sse2", int32_t, uint32_t, __m128i, 4,
+                    LOAD_SI128, STORE_SI128, _mm_add_epi32)
+DEFINE_ROW_ADD_SIMD(row_add_i64_sse2, "sse2", int64_t, uint64_t, __m128i, 2,
+                    LOAD_SI128, STORE_SI128, _mm_add_epi64)
+
+DEFINE_ROW_ADD_SIMD(row_add_f32_avx2, "avx2", float, float, __m256, 8,
+                    _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps)
+DEFINE_ROW_ADD_SIMD(row_add_f64_avx2, "avx2", double, double, __m256d, 4,
+                    _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd)
+DEFINE_ROW_ADD_SIMD(row_add_i32_avx2, "avx2", int32_t, uint32_t, __m256i, 8,
+                    LOAD_SI256, STORE_SI256, _mm256_add_epi32)
+DEFINE_ROW_ADD_SIMD(row_add_i64_avx2, "avx2", int64_t, uint64_t, __m256i, 4,
+                    LOAD_SI256, STORE_SI256, _mm256_add_epi64)
+
+DEFINE_ROW_ADD_SIMD(row_add_f32_avx512, "avx512f", float, float, __m512, 16,
+                    _mm512_loadu_ps, _mm512_storeu_ps, _mm512_add_ps)
+DEFINE_ROW_ADD_SIMD(row_add_f64_avx512, "avx512f", double, double, __m512d, 8,
+                    _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd)
+DEFINE_ROW_ADD_SIMD(row_add_i32_avx512, "avx512f", int32_t, uint32_t, __m512i,
+                    16, LOAD_SI512, STORE_SI512, _mm512_add_epi32)
+DEFINE_ROW_ADD_SIMD(row_add_i64_avx512, "avx512f", int64_t, uint64_t, __m512i,
+                    8, LOAD_SI512, STORE_SI512, _mm512_add_epi64)
+
+#endif /* HAVE_X86_DISPATCH */
+
+static const row_add_functions scalar_functions = {
+    "scalar",
+    row_add_f32_scalar, row_add_f64_scalar,
+    row_add_i32_scalar, row_add_i64_scalar
+};
+
+#if HAVE_X86_DISPATCH
+static const row_add_functions sse2_functions = {
+    "sse2",
+    row_add_f32_sse2, row_add_f64_sse2,
+    row_add_i32_sse2, row_add_i64_sse2
+};
+
+static const row_add_functions avx2_functions = {
+    "avx2",
+    row_add_f32_avx2, row_add_f64_avx2,
+    row_add_i32_avx2, row_add_i64_avx2
+};
+
+static const row_add_functions avx512_functions = {
+    "avx512f",
+    row_add_f32_avx512, row_add_f64_avx512,
+    row_add_i32_avx512, row_add_i64_avx512
+};
+#endif
+
+const row_add_functions *
+get_row_add_functions(void)
+{
+    /* selection is idempotent, so a race here is harmless */
+    static const row_add_functions *selected = NULL;
+
+    if (selected == NULL) {
+        const row_add_functions *best = &scalar_functions;
+#if HAVE_X86_DISPATCH
+        /* __builtin_cpu_supports checks CPUID, and for AVX also that the
+           OS saves the extended registers */
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            best = &avx512_functions;
+        else if (__builtin_cpu_supports("avx2"))
+            best = &avx2_functions;
+        else if (__builtin_cpu_supports("sse2"))
+            best = &sse2_functions;
+#endif
+        selected = best;
+    }
+
+    return selected;
+}
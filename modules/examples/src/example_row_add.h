@@ -0,0 +1,29 @@
+#ifndef EXAMPLE_ROW_ADD_H_
+#define EXAMPLE_ROW_ADD_H_
+/* assumes numpy/npy_common.h (or any NumPy header) already included */
+
+#include <stdint.h>
+
+/* acc[i] += row[i] for i in [0, n), for contiguous rows. Integer versions
+   wrap on overflow, like NumPy's integer add */
+typedef void (*row_add_f32_func)(float *acc, const float *row, npy_intp n);
+typedef void (*row_add_f64_func)(double *acc, const double *row, npy_intp n);
+typedef void (*row_add_i32_func)(int32_t *acc, const int32_t *row,
+                                 npy_intp n);
+typedef void (*row_add_i64_func)(int64_t *acc, const int64_t *row,
+                                 npy_intp n);
+
+typedef struct {
+    const char *isa; /* name of the selected instruction set */
+    row_add_f32_func f32;
+    row_add_f64_func f64;
+    row_add_i32_func i32;
+    row_add_i64_func i64;
+} row_add_functions;
+
+/* The best implementations for the running CPU. Selected on first use by
+   checking the CPU features (AVX-512, AVX2, SSE2 or plain C) */
+const row_add_functions *
+get_row_add_functions(void);
+
+#endif /* EXAMPLE_ROW_ADD_H_ */
@@ -0,0 +1,43 @@
+#ifndef GUFT_ATOMICS_H
+#define GUFT_ATOMICS_H
+
+#include <stddef.h>
+
+/* Relaxed atomic accesses to module wide words that any thread may change
+   while calls read them: the executor options, kernel_generation and the
+   stats and tuning flags. Free-threaded builds have no GIL to order them.
+
+   Words are size_t or int. Increments are only for size_t ones.
+*/
+
+#if defined(__GNUC__)
+#   define GUFT_ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#   define GUFT_ATOMIC_STORE(x, v) \
+        __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#   define GUFT_ATOMIC_INCREMENT(x) \
+        __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#elif defined(_MSC_VER)
+/* aligned word accesses are atomic there, the volatile keeps them whole.
+   There is no typeof, so the size tells ints from size_ts */
+#   include <intrin.h>
+#   define GUFT_ATOMIC_LOAD(x) \
+        (sizeof(x) == sizeof(int) ? (size_t)*(volatile int *)&(x) \
+                                  : *(volatile size_t *)&(x))
+#   define GUFT_ATOMIC_STORE(x, v) \
+        (sizeof(x) == sizeof(int) ? \
+         (void)(*(volatile int *)&(x) = (int)(v)) : \
+         (void)(*(volatile size_t *)&(x) = (size_t)(v)))
+#   if defined(_WIN64)
+#       define GUFT_ATOMIC_INCREMENT(x) \
+            _InterlockedIncrement64((volatile __int64 *)&(x))
+#   else
+#       define GUFT_ATOMIC_INCREMENT(x) \
+            _InterlockedIncrement((volatile long *)&(x))
+#   endif
+#else
+#   define GUFT_ATOMIC_LOAD(x) (x)
+#   define GUFT_ATOMIC_STORE(x, v) ((x) = (v))
+#   define GUFT_ATOMIC_INCREMENT(x) ((x)++)
+#endif
+
+#endif /* GUFT_ATOMICS_H */
@@ -0,0 +1,177 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+
+#include "background.h"
+
+#if defined(_WIN32)
+
+/* No background threads on this platform yet: jobs run on submit */
+
+int
+background_submit(background_func func, void *ctx)
+{
+    func(ctx);
+    return 0;
+}
+
+size_t
+background_pending(void)
+{
+    return 0;
+}
+
+void
+background_wait_idle(void)
+{
+}
+
+#else /* !_WIN32 */
+
+#include <pthread.h>
+
+typedef struct _background_job_struct {
+    struct _background_job_struct *next;
+    background_func func;
+    void *ctx;
+} background_job;
+
+static struct {
+    pthread_mutex_t lock; /* protects everything below */
+    pthread_cond_t job_cv; /* threads wait here for jobs */
+    pthread_cond_t idle_cv; /* signaled when pending drops to 0 */
+    background_job *head;
+    background_job *tail;
+    size_t pending; /* queued plus running */
+    size_t thread_count;
+} background = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+background_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&background.lock);
+    for (;;) {
+        background_job *job;
+
+        while (background.head == NULL)
+            pthread_cond_wait(&background.job_cv, &background.lock);
+
+        job = background.head;
+        background.head = job->next;
+        if (background.head == NULL)
+            background.tail = NULL;
+        pthread_mutex_unlock(&background.lock);
+
+        job->func(job->ctx);
+        free(job);
+
+        pthread_mutex_lock(&background.lock);
+        if (--background.pending == 0)
+            pthread_cond_broadcast(&background.idle_cv);
+    }
+    return NULL;
+}
+
+/* after a fork only the forking thread survives in the child. Jobs queued
+   in the parent are dropped */
+static void
+reset_after_fork(void)
+{
+    pthread_mutex_init(&background.lock, NULL);
+    pthread_cond_init(&background.job_cv, NULL);
+    pthread_cond_init(&background.idle_cv, NULL);
+    background.head = background.tail = NULL;
+    background.pending = 0;
+    background.thread_count = 0;
+}
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void
+register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, reset_after_fork);
+}
+
+/* must be called with background.lock held */
+static int
+start_threads(void)
+{
+    pthread_attr_t attr;
+
+    if (pthread_attr_init(&attr) != 0)
+        return -1;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (background.thread_count < GUFT_BACKGROUND_THREADS) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, background_main, NULL) != 0)
+            break;
+        background.thread_count++;
+    }
+    pthread_attr_destroy(&attr);
+
+    return background.thread_count > 0 ? 0 : -1;
+}
+
+int
+background_submit(background_func func, void *ctx)
+{
+    background_job *job = malloc(sizeof(background_job));
+
+    if (job == NULL)
+        return -1;
+    job->next = NULL;
+    job->func = func;
+    job->ctx = ctx;
+
+    pthread_once(&atfork_once, register_atfork);
+
+    pthread_mutex_lock(&background.lock);
+    if (background.thread_count == 0 && start_threads() != 0) {
+        pthread_mutex_unlock(&background.lock);
+        free(job);
+        return -1;
+    }
+
+    if (background.tail)
+        background.tail->next = job;
+    else
+        background.head = job;
+    background.tail = job;
+    background.pending++;
+    pthread_cond_signal(&background.job_cv);
+    pthread_mutex_unlock(&background.lock);
+
+    return 0;
+}
+
+size_t
+background_pending(void)
+{
+    size_t pending;
+
+    pthread_mutex_lock(&background.lock);
+    pending = background.pending;
+    pthread_mutex_unlock(&background.lock);
+
+    return pending;
+}
+
+void
+background_wait_idle(void)
+{
+    pthread_mutex_lock(&background.lock);
+    while (background.pending > 0)
+        pthread_cond_wait(&background.idle_cv, &background.lock);
+    pthread_mutex_unlock(&background.lock);
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,34 @@
+#ifndef GUFT_BACKGROUND_H
+#define GUFT_BACKGROUND_H
+
+#include <stddef.h>
+
+/* Background jobs.
+
+   A few threads, started on first use, that run submitted jobs in FIFO
+   order. This is what asynchronous calls run on: the job itself usually
+   goes parallel through the thread pool (see threadpool.h), so only a
+   couple of background threads are needed to keep it busy.
+
+   Jobs must not assume anything about the thread they run in. On
+   platforms with no thread support, jobs run synchronously on submit.
+*/
+
+#define GUFT_BACKGROUND_THREADS 2
+
+typedef void (*background_func)(void *ctx);
+
+/* Queue func(ctx) to run in a background thread. Returns 0 on success and
+   -1 if out of memory or the threads could not be started */
+int
+background_submit(background_func func, void *ctx);
+
+/* Number of jobs queued or running */
+size_t
+background_pending(void);
+
+/* Wait until there are no jobs queued or running */
+void
+background_wait_idle(void);
+
+#endif /* GUFT_BACKGROUND_H */
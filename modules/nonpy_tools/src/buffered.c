@@ -0,0 +1,271 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "atomics.h"
+#include "executor.h"
+#include "scratch.h"
+
+/* Buffered execution of a plan.
+
+   Kernels are usually written for the well behaved case: aligned, native
+   byte order data whose core is contiguous. Operands that are not like that
+   are copied into aligned contiguous buffers a block of elements at a time,
+   so the kernel (and any SIMD code in it) only ever sees packed data. This
+   plays the role of the buffering done by NpyIter.
+
+   Only inputs are gathered, outputs are assumed to be fully written by the
+   kernel and are only scattered back.
+*/
+
+/* alignment the kernels may rely on for an item of the given size: the
+   largest power of two dividing it, up to 16 */
+static size_t
+natural_alignment(size_t itemsize)
+{
+    size_t a = 1;
+    while (a < 16 && itemsize % (2*a) == 0)
+        a *= 2;
+    return a;
+}
+
+static int
+operand_needs_buffer(const execution_plan *plan, size_t op)
+{
+    const plan_operand *po = plan->operands + op;
+    const guft_intp *core_shape = plan->core_shape + po->core_offset;
+    const guft_intp *core_steps = plan->kernel_steps + plan->nops +
+        po->core_offset;
+    size_t align;
+    guft_intp packed;
+
+    if (po->itemsize == 0 || po->element_size == 0)
+        return 0;
+
+    if (po->flags & GUFT_OPERAND_BYTESWAPPED)
+        return 1;
+
+    align = natural_alignment(po->itemsize);
+    if ((uintptr_t)plan->args[op] % align != 0)
+        return 1;
+    for (size_t d = 0; d < plan->outer_ndim; d++) {
+        if (plan->outer_strides[d*plan->nops + op] % (guft_intp)align != 0)
+            return 1;
+    }
+
+    /* core in C order, ignoring dimensions that do not move */
+    packed = (guft_intp)po->itemsize;
+    for (size_t d = po->core_ndim; d-- > 0;) {
+        if (core_shape[d] != 1 && core_steps[d] != packed)
+            return 1;
+        packed *= core_shape[d];
+    }
+
+    return 0;
+}
+
+size_t
+enable_plan_buffering(execution_plan *plan, size_t buffer_size)
+{
+    size_t nops = plan->nops;
+    size_t largest = 0;
+
+    plan->buffered_count = 0;
+    plan->buffer_block = 0;
+    memcpy(plan->buffered_steps, plan->kernel_steps,
+           plan->kernel_step_count*sizeof(guft_intp));
+    for (size_t op = 0; op < nops; op++)
+        plan->operands[op].buffered = 0;
+
+    for (size_t op = 0; op < nops; op++) {
+        plan_operand *po = plan->operands + op;
+        guft_intp *steps = plan->buffered_steps + nops + po->core_offset;
+        guft_intp packed;
+
+        if (!operand_needs_buffer(plan, op))
+            continue;
+        /* byte swapped operands are only right when buffered */
+        if (buffer_size == 0 && !(po->flags & GUFT_OPERAND_BYTESWAPPED))
+            continue;
+
+        po->buffered = 1;
+        plan->buffered_count++;
+        if (po->element_size > largest)
+            largest = po->element_size;
+
+        plan->buffered_steps[op] = (guft_intp)po->element_size;
+        packed = (guft_intp)po->itemsize;
+        for (size_t d = po->core_ndim; d-- > 0;) {
+            steps[d] = packed;
+            packed *= plan->core_shape[po->core_offset + d];
+        }
+    }
+
+    if (plan->buffered_count > 0) {
+        if (buffer_size == 0)
+            buffer_size = GUFT_DEFAULT_BUFFER_SIZE;
+        plan->buffer_block = buffer_size/largest;
+        if (plan->buffer_block == 0)
+            plan->buffer_block = 1;
+    }
+
+    return plan->buffered_count;
+}
+
+/* items are swapped as a whole, so complex types are not supported as
+   byte swapped operands */
+static void
+swap_item(char *item, size_t itemsize)
+{
+    for (char *lo = item, *hi = item + itemsize - 1; lo < hi; lo++, hi--) {
+        char t = *lo;
+        *lo = *hi;
+        *hi = t;
+    }
+}
+
+void
+copy_strided(char *dst, const guft_intp *dst_steps,
+             const char *src, const guft_intp *src_steps,
+             const guft_intp *shape, size_t ndim,
+             size_t itemsize, int swap)
+{
+    if (ndim == 0) {
+        memcpy(dst, src, itemsize);
+        if (swap)
+            swap_item(dst, itemsize);
+        return;
+    }
+
+    if (ndim == 1 && !swap) {
+        guft_intp ds = dst_steps[0], ss = src_steps[0];
+        switch (itemsize) {
+#define COPY_CASE(N) case N:                                     \
+            for (guft_intp i = 0; i < shape[0]; i++)             \
+                memcpy(dst + i*ds, src + i*ss, N);               \
+            return;
+            COPY_CASE(1) COPY_CASE(2) COPY_CASE(4) COPY_CASE(8)
+            COPY_CASE(16)
+#undef COPY_CASE
+        default:
+            break;
+        }
+    }
+
+    for (guft_intp i = 0; i < shape[0]; i++)
+        copy_strided(dst + i*dst_steps[0], dst_steps + 1,
+                     src + i*src_steps[0], src_steps + 1,
+                     shape + 1, ndim - 1, itemsize, swap);
+}
+
+/* moves count elements of an operand between its own layout and a
+   buffer, in the direction given by to_buffer */
+static void
+transfer_operand(const execution_plan *plan, size_t op, char *data,
+                 char *buffer, guft_intp count, int to_buffer)
+{
+    const plan_operand *po = plan->operands + op;
+    size_t nops = plan->nops;
+    const guft_intp *shape = plan->core_shape + po->core_offset;
+    const guft_intp *steps = plan->kernel_steps + nops + po->core_offset;
+    const guft_intp *packed = plan->buffered_steps + nops + po->core_offset;
+    guft_intp step = plan->kernel_steps[op];
+    int swap = (po->flags & GUFT_OPERAND_BYTESWAPPED) != 0;
+
+    for (guft_intp i = 0; i < count; i++) {
+        char *element = data + i*step;
+        char *buffered = buffer + (size_t)i*po->element_size;
+        if (to_buffer)
+            copy_strided(buffered, packed, element, steps, shape,
+                         po->core_ndim, po->itemsize, swap);
+        else
+            copy_strided(element, steps, buffered, packed, shape,
+                         po->core_ndim, po->itemsize, swap);
+    }
+}
+
+#define ROUND_UP(x) (((x) + GUFT_SCRATCH_ALIGNMENT - 1) & \
+                     ~(size_t)(GUFT_SCRATCH_ALIGNMENT - 1))
+
+void
+execute_buffered(const execution_plan *plan, char **args,
+                 guft_intp *dimensions, guft_intp count,
+                 unsigned char *status)
+{
+    size_t nops = plan->nops;
+    size_t block = plan->buffer_block;
+    size_t offsets[GUFT_MAXARGS];
+    size_t total = 0;
+    char *scratch;
+    char *data[GUFT_MAXARGS + 1];
+    char *kernel_args[GUFT_MAXARGS + 1];
+
+    if ((size_t)count < block)
+        block = (size_t)count;
+
+    for (;;) {
+        total = 0;
+        for (size_t op = 0; op < nops; op++) {
+            offsets[op] = total;
+            if (plan->operands[op].buffered)
+                total += ROUND_UP(block*plan->operands[op].element_size);
+        }
+
+        scratch = scratch_acquire(total);
+        if (scratch != NULL)
+            break;
+        if (block == 1) {
+            /* no memory even for a single element: still correct for
+               everything but byte swapped operands, that are left to the
+               caller to report */
+            for (size_t op = 0; op < nops; op++) {
+                if (plan->operands[op].flags & GUFT_OPERAND_BYTESWAPPED) {
+                    /* the plan is shared, only this flag changes */
+                    GUFT_ATOMIC_STORE(((execution_plan *)plan)->out_of_memory,
+                                      1);
+                    return;
+                }
+            }
+            args[nops] = (char *)status;
+            dimensions[0] = count;
+            plan->kernel.func(args, dimensions, plan->kernel_steps,
+                              plan->kernel.data);
+            return;
+        }
+        block = 1;
+    }
+
+    memcpy(data, args, nops*sizeof(char *));
+    for (size_t op = 0; op < nops; op++)
+        kernel_args[op] = plan->operands[op].buffered ?
+            scratch + offsets[op] : data[op];
+
+    while (count > 0) {
+        guft_intp n = (size_t)count < block ? count : (guft_intp)block;
+
+        for (size_t op = 0; op < plan->nin; op++) {
+            if (plan->operands[op].buffered)
+                transfer_operand(plan, op, data[op], kernel_args[op], n, 1);
+        }
+
+        kernel_args[nops] = (char *)status;
+        dimensions[0] = n;
+        plan->kernel.func(kernel_args, dimensions, plan->buffered_steps,
+                          plan->kernel.data);
+
+        for (size_t op = plan->nin; op < nops; op++) {
+            if (plan->operands[op].buffered)
+                transfer_operand(plan, op, data[op], kernel_args[op], n, 0);
+        }
+
+        for (size_t op = 0; op < nops; op++) {
+            data[op] += n*plan->kernel_steps[op];
+            if (!plan->operands[op].buffered)
+                kernel_args[op] = data[op];
+        }
+        if (status)
+            status += n;
+        count -= n;
+    }
+
+    scratch_release(scratch);
+}
@@ -0,0 +1,401 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dispatch.h"
+
+/* Open addressing hash table with linear probing. It only grows, as kernels
+   are never unregistered. The load factor is kept under 1/2 so probe
+   sequences are short. A second table of the same kind indexes the kernels
+   by their input types, for calls that leave out their outputs. */
+
+#define INITIAL_CAPACITY 16
+
+static size_t
+hash_types(const char *types, size_t nops)
+{
+    size_t h = (size_t)14695981039346656037ULL;
+    for (size_t i = 0; i < nops; i++) {
+        h ^= (unsigned char)types[i];
+        h *= (size_t)1099511628211ULL;
+    }
+    return h;
+}
+
+int
+kernel_registry_init(kernel_registry *registry, size_t nops, size_t nin,
+                     size_t dimension_variable_count)
+{
+    if (nops > GUFT_MAXARGS || nin > nops)
+        return -1;
+
+    /* the tables are allocated on the first insertion */
+    registry->nops = nops;
+    registry->nin = nin;
+    registry->dimension_variable_count = dimension_variable_count;
+    registry->count = 0;
+    registry->capacity = 0;
+    registry->entries = NULL;
+    registry->input_count = 0;
+    registry->input_capacity = 0;
+    registry->inputs = NULL;
+
+    return 0;
+}
+
+void
+kernel_registry_clear(kernel_registry *registry)
+{
+    for (size_t i = 0; i < registry->capacity; i++) {
+        kernel_registry_entry *entry = registry->entries + i;
+        if (!entry->used)
+            continue;
+        for (size_t k = 0; k < entry->specialization_count; k++)
+            free(entry->specializations[k].sizes);
+        free(entry->specializations);
+    }
+    free(registry->entries);
+    free(registry->inputs);
+    registry->entries = NULL;
+    registry->count = 0;
+    registry->capacity = 0;
+    registry->inputs = NULL;
+    registry->input_count = 0;
+    registry->input_capacity = 0;
+}
+
+/* slot where types is, or the empty slot where it would go */
+static kernel_registry_entry *
+find_slot(kernel_registry_entry *entries, size_t capacity, size_t nops,
+          const char *types, size_t hash)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+
+    while (entries[i].used &&
+           (entries[i].hash != hash ||
+            memcmp(entries[i].types, types, nops) != 0))
+        i = (i + 1) & mask;
+
+    return entries + i;
+}
+
+const kernel_registry_entry *
+kernel_registry_lookup(const kernel_registry *registry, const char *types)
+{
+    size_t hash;
+    kernel_registry_entry *entry;
+
+    if (registry->count == 0)
+        return NULL;
+
+    hash = hash_types(types, registry->nops);
+    entry = find_slot(registry->entries, registry->capacity, registry->nops,
+                      types, hash);
+    return entry->used ? entry : NULL;
+}
+
+/* slot of the input index where the inputs in types are, or the empty slot
+   where they would go */
+static kernel_input_entry *
+find_input_slot(kernel_input_entry *inputs, size_t capacity, size_t nin,
+                const char *types, size_t hash)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+
+    while (inputs[i].used &&
+           (inputs[i].hash != hash || memcmp(inputs[i].types, types,
+                                             nin) != 0))
+        i = (i + 1) & mask;
+
+    return inputs + i;
+}
+
+const kernel_registry_entry *
+kernel_registry_lookup_inputs(const kernel_registry *registry,
+                              const char *types)
+{
+    kernel_input_entry *input;
+
+    if (registry->input_count == 0)
+        return NULL;
+
+    input = find_input_slot(registry->inputs, registry->input_capacity,
+                            registry->nin,
+                            types, hash_types(types, registry->nin));
+    return input->used ? kernel_registry_lookup(registry, input->types)
+                       : NULL;
+}
+
+static int
+grow_inputs(kernel_registry *registry)
+{
+    size_t capacity = registry->input_capacity ? registry->input_capacity*2
+                                               : INITIAL_CAPACITY;
+    kernel_input_entry *inputs = calloc(capacity, sizeof(kernel_input_entry));
+    if (inputs == NULL)
+        return -1;
+
+    for (size_t i = 0; i < registry->input_capacity; i++) {
+        kernel_input_entry *old = registry->inputs + i;
+        if (old->used)
+            *find_input_slot(inputs, capacity, registry->nin,
+                             old->types, old->hash) = *old;
+    }
+
+    free(registry->inputs);
+    registry->inputs = inputs;
+    registry->input_capacity = capacity;
+    return 0;
+}
+
+/* index types by its inputs, unless a kernel for them is there already.
+   Returns 0 on success and -1 if out of memory */
+static int
+index_inputs(kernel_registry *registry, const char *types)
+{
+    size_t hash = hash_types(types, registry->nin);
+    kernel_input_entry *input;
+
+    if (2*(registry->input_count + 1) > registry->input_capacity &&
+        grow_inputs(registry) != 0)
+        return -1;
+
+    input = find_input_slot(registry->inputs, registry->input_capacity,
+                            registry->nin, types, hash);
+    if (!input->used) {
+        input->used = 1;
+        input->hash = hash;
+        memcpy(input->types, types, registry->nops);
+        registry->input_count++;
+    }
+
+    return 0;
+}
+
+static int
+grow(kernel_registry *registry)
+{
+    size_t capacity = registry->capacity ? registry->capacity*2
+                                         : INITIAL_CAPACITY;
+    kernel_registry_entry *entries = calloc(capacity,
+                                            sizeof(kernel_registry_entry));
+    if (entries == NULL)
+        return -1;
+
+    for (size_t i = 0; i < registry->capacity; i++) {
+        kernel_registry_entry *old = registry->entries + i;
+        if (old->used)
+            *find_slot(entries, capacity, registry->nops,
+                       old->types, old->hash) = *old;
+    }
+
+    free(registry->entries);
+    registry->entries = entries;
+    registry->capacity = capacity;
+    return 0;
+}
+
+/* the entry for types, added with no kernel if it is not there. NULL if
+   out of memory */
+static kernel_registry_entry *
+get_entry(kernel_registry *registry, const char *types)
+{
+    size_t hash = hash_types(types, registry->nops);
+    kernel_registry_entry *entry;
+
+    if (2*(registry->count + 1) > registry->capacity && grow(registry) != 0)
+        return NULL;
+    /* indexed first, so a failure leaves both tables as they were */
+    if (index_inputs(registry, types) != 0)
+        return NULL;
+
+    entry = find_slot(registry->entries, registry->capacity, registry->nops,
+                      types, hash);
+    if (!entry->used) {
+        /* unused slots are all zero */
+        entry->used = 1;
+        entry->hash = hash;
+        memcpy(entry->types, types, registry->nops);
+        registry->count++;
+    }
+
+    return entry;
+}
+
+int
+kernel_registry_insert(kernel_registry *registry,
+                       const char *types,
+                       guft_kernel kernel,
+                       void *owner,
+                       void **replaced_owner)
+{
+    kernel_registry_entry *entry = get_entry(registry, types);
+
+    *replaced_owner = NULL;
+    if (entry == NULL)
+        return -1;
+
+    *replaced_owner = entry->owner;
+    entry->kernel = kernel;
+    entry->owner = owner;
+
+    return 0;
+}
+
+int
+kernel_registry_insert_specialization(kernel_registry *registry,
+                                      const char *types,
+                                      const size_t *sizes,
+                                      guft_kernel kernel,
+                                      void *owner,
+                                      void **replaced_owner)
+{
+    size_t nvars = registry->dimension_variable_count;
+    kernel_registry_entry *entry = get_entry(registry, types);
+    kernel_specialization *specializations, *specialization;
+
+    *replaced_owner = NULL;
+    if (entry == NULL)
+        return -1;
+
+    for (size_t k = 0; k < entry->specialization_count; k++) {
+        specialization = entry->specializations + k;
+        if (memcmp(specialization->sizes, sizes, nvars*sizeof(size_t)) == 0) {
+            *replaced_owner = specialization->owner;
+            specialization->kernel = kernel;
+            specialization->owner = owner;
+            return 0;
+        }
+    }
+
+    specializations = realloc(entry->specializations,
+                              (entry->specialization_count + 1)*
+                              sizeof(kernel_specialization));
+    if (specializations == NULL)
+        return -1;
+    entry->specializations = specializations;
+
+    specialization = specializations + entry->specialization_count;
+    specialization->sizes = malloc(nvars ? nvars*sizeof(size_t) : 1);
+    if (specialization->sizes == NULL)
+        return -1;
+    memcpy(specialization->sizes, sizes, nvars*sizeof(size_t));
+    specialization->fixed_count = 0;
+    for (size_t var = 0; var < nvars; var++) {
+        if (sizes[var] != GUFT_FREE_DIMENSION)
+            specialization->fixed_count++;
+    }
+    specialization->kernel = kernel;
+    specialization->owner = owner;
+    entry->specialization_count++;
+
+    return 0;
+}
+
+const guft_kernel *
+kernel_registry_select(const kernel_registry *registry,
+                       const kernel_registry_entry *entry,
+                       const size_t *dimension_sizes)
+{
+    size_t nvars = registry->dimension_variable_count;
+    const kernel_specialization *best = NULL;
+
+    for (size_t k = 0; k < entry->specialization_count; k++) {
+        const kernel_specialization *specialization =
+            entry->specializations + k;
+        size_t var = 0;
+
+        while (var < nvars &&
+               (specialization->sizes[var] == GUFT_FREE_DIMENSION ||
+                specialization->sizes[var] == dimension_sizes[var]))
+            var++;
+        if (var == nvars &&
+            (best == NULL || specialization->fixed_count >= best->fixed_count))
+            best = specialization;
+    }
+
+    if (best != NULL)
+        return &best->kernel;
+    return entry->kernel.func != NULL ? &entry->kernel : NULL;
+}
+
+char
+canonical_type_code(const char *format, size_t itemsize)
+{
+    int swapped;
+    char code = canonical_type_code_swapped(format, itemsize, &swapped);
+
+    return swapped ? 0 : code;
+}
+
+char
+canonical_type_code_swapped(const char *format, size_t itemsize,
+                            int *swapped)
+{
+    static const char signed_codes[] = { 'b', 'h', 0, 'i', 0, 0, 0, 'q' };
+    static const char unsigned_codes[] = { 'B', 'H', 0, 'I', 0, 0, 0, 'Q' };
+    const unsigned int one = 1;
+    int little_endian = *(const unsigned char *)&one == 1;
+
+    *swapped = 0;
+    if (format == NULL)
+        format = "B";
+
+    /* an explicit order matching the one of the machine is native */
+    switch (*format) {
+    case '@':
+    case '=':
+        format++;
+        break;
+    case '<':
+        *swapped = !little_endian;
+        format++;
+        break;
+    case '>':
+    case '!':
+        *swapped = little_endian;
+        format++;
+        break;
+    }
+
+    if (format[0] == '\0' || format[1] != '\0' || itemsize == 0)
+        return 0;
+    /* single bytes have no order */
+    if (itemsize == 1)
+        *swapped = 0;
+
+    switch (format[0]) {
+    case 'b': case 'h': case 'i': case 'l': case 'q': case 'n':
+        return itemsize <= 8 ? signed_codes[itemsize - 1] : 0;
+    case 'B': case 'H': case 'I': case 'L': case 'Q': case 'N':
+        return itemsize <= 8 ? unsigned_codes[itemsize - 1] : 0;
+    case 'e':
+        return itemsize == 2 ? 'e' : 0;
+    case 'f':
+        return itemsize == 4 ? 'f' : 0;
+    case 'd':
+        return itemsize == 8 ? 'd' : 0;
+    case '?':
+        return itemsize == 1 ? '?' : 0;
+    default:
+        return 0;
+    }
+}
+
+size_t
+type_code_itemsize(char code)
+{
+    switch (code) {
+    case 'b': case 'B': case '?':
+        return 1;
+    case 'h': case 'H': case 'e':
+        return 2;
+    case 'i': case 'I': case 'f':
+        return 4;
+    case 'q': case 'Q': case 'd':
+        return 8;
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,130 @@
+#ifndef GUFT_DISPATCH_H
+#define GUFT_DISPATCH_H
+
+#include <stddef.h>
+
+#include "executor.h"
+
+/* Kernel dispatch registry: maps the types of the operands of a gufunc call
+   to the kernel implementing it, using a hash table so that lookups take
+   constant time no matter how many type combinations there are. Unlike the
+   loop tables of NumPy's ufuncs, entries can be added at any time.
+
+   Types are given as a string with one type code per operand (inputs
+   followed by outputs). Codes are opaque to the registry, but the
+   convention in gufunctools is to use struct module format characters
+   normalized by kind and size (see canonical_type_code). */
+
+/* A kernel specialized for some sizes of the dimension variables, like
+   fully unrolled small matrix kernels. Specializations of the same types
+   are kept in a short list, as there are usually just a few */
+typedef struct _kernel_specialization_struct {
+    guft_kernel kernel;
+    void *owner;
+    size_t fixed_count; /* sizes that are not GUFT_FREE_DIMENSION */
+    size_t *sizes; /* one per dimension variable, GUFT_FREE_DIMENSION for
+                      the ones it works with any size */
+} kernel_specialization;
+
+typedef struct _kernel_registry_entry_struct {
+    size_t hash;
+    int used;
+    char types[GUFT_MAXARGS];
+    guft_kernel kernel; /* NULL func if there are only specializations */
+    void *owner; /* opaque, for the user to keep the kernel alive */
+    size_t stats_site; /* for the user, 0 when added (see stats.h) */
+    size_t specialization_count;
+    kernel_specialization *specializations;
+} kernel_registry_entry;
+
+/* Slot of the index by input types: the types of the first kernel
+   registered for those inputs */
+typedef struct _kernel_input_entry_struct {
+    size_t hash;
+    int used;
+    char types[GUFT_MAXARGS];
+} kernel_input_entry;
+
+typedef struct _kernel_registry_struct {
+    size_t nops;
+    size_t nin;
+    size_t dimension_variable_count;
+    size_t count;
+    size_t capacity; /* always a power of 2 */
+    kernel_registry_entry *entries;
+    /* index by input types, for calls that leave out their outputs */
+    size_t input_count;
+    size_t input_capacity; /* always a power of 2 */
+    kernel_input_entry *inputs;
+} kernel_registry;
+
+/* Returns 0 on success, -1 if nops is too large (or nin larger than
+   nops) */
+int
+kernel_registry_init(kernel_registry *registry, size_t nops, size_t nin,
+                     size_t dimension_variable_count);
+
+/* Releases the table, leaving an empty registry. Owners are not touched:
+   release them before (including the ones of specializations) */
+void
+kernel_registry_clear(kernel_registry *registry);
+
+/* Returns the entry for types (nops codes), or NULL if there is none */
+const kernel_registry_entry *
+kernel_registry_lookup(const kernel_registry *registry, const char *types);
+
+/* Returns the entry of the first kernel registered for the input types in
+   types (the first nin codes), or NULL if there is none */
+const kernel_registry_entry *
+kernel_registry_lookup_inputs(const kernel_registry *registry,
+                              const char *types);
+
+/* Adds or replaces the kernel for types. When replacing, the owner of the
+   previous entry is returned in replaced_owner (NULL otherwise).
+   Returns 0 on success and -1 if out of memory */
+int
+kernel_registry_insert(kernel_registry *registry,
+                       const char *types,
+                       guft_kernel kernel,
+                       void *owner,
+                       void **replaced_owner);
+
+/* Adds or replaces the kernel for types specialized for sizes, with one
+   entry per dimension variable (GUFT_FREE_DIMENSION for any size). The
+   replaced owner is returned as in kernel_registry_insert.
+   Returns 0 on success and -1 if out of memory */
+int
+kernel_registry_insert_specialization(kernel_registry *registry,
+                                      const char *types,
+                                      const size_t *sizes,
+                                      guft_kernel kernel,
+                                      void *owner,
+                                      void **replaced_owner);
+
+/* The kernel of entry to run with the given dimension sizes: the matching
+   specialization with most fixed sizes (the last registered on ties), or
+   the kernel for any sizes. NULL if there is none */
+const guft_kernel *
+kernel_registry_select(const kernel_registry *registry,
+                       const kernel_registry_entry *entry,
+                       const size_t *dimension_sizes);
+
+/* Canonical type code for a struct module style format (as found in
+   Py_buffer) and item size. Integers map by size to b, h, i, q (B, H, I, Q
+   if unsigned), floating point to e, f, d and booleans to '?'. Returns 0
+   for unsupported formats, including non native byte orders */
+char
+canonical_type_code(const char *format, size_t itemsize);
+
+/* Same as canonical_type_code, but a non native byte order maps to the code
+   of the type in native order, with swapped set (to 0 otherwise), for the
+   operands that can go through byte swapping buffers */
+char
+canonical_type_code_swapped(const char *format, size_t itemsize,
+                            int *swapped);
+
+/* Item size of a canonical type code, 0 if it is not one */
+size_t
+type_code_itemsize(char code);
+
+#endif /* GUFT_DISPATCH_H */
@@ -0,0 +1,581 @@
+#include <string.h>
+
+#include "executor.h"
+#include "overlap.h"
+#include "stats.h"
+#include "threadpool.h"
+
+/* ranges running concurrently in the pool may update the same status */
+#if defined(__GNUC__)
+#  define ATOMIC_OR(x, v) __atomic_fetch_or(&(x), (v), __ATOMIC_RELAXED)
+#  define ATOMIC_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#else /* the pool is serial on the platforms with other compilers */
+#  define ATOMIC_OR(x, v) ((x) |= (v))
+#  define ATOMIC_ADD(x, v) ((x) += (v))
+#endif
+
+/* Outer loop execution of gufunc kernels over strided operands.
+
+   This plays the role of the NpyIter based loop in NumPy's
+   PyUFunc_GeneralizedFunction, but with a much cheaper setup: the plan is
+   built with no allocation, in a caller provided block.
+
+   Outer dimensions are coalesced when possible: two adjacent dimensions can
+   be merged when, for every operand, the stride of the outer one is the
+   stride of the inner one times its extent. A fully contiguous batch ends up
+   being a single kernel call.
+*/
+
+size_t
+execution_plan_size(const parsed_signature *ps)
+{
+    size_t nops = ps->arg_count;
+    size_t step_count = nops + ps->total_signature_dimensions;
+    return sizeof(execution_plan) +
+        sizeof(guft_intp)*(nops + /* args */
+                           GUFT_MAXDIMS*nops + /* outer_strides */
+                           1 + ps->dimension_variable_count + /* dims */
+                           step_count + /* kernel_steps */
+                           ps->total_signature_dimensions + /* core_shape */
+                           step_count); /* buffered_steps */
+}
+
+int
+init_execution_plan(execution_plan *plan,
+                    const parsed_signature *ps,
+                    const resolved_shapes *resolved,
+                    const execution_operand *operands,
+                    guft_kernel kernel)
+{
+    size_t nops = ps->arg_count;
+    size_t nvars = ps->dimension_variable_count;
+    size_t outer_ndim = resolved->outer_ndim;
+    size_t ndim = 0;
+    guft_intp *strides, *core_steps;
+
+    if (nops > GUFT_MAXARGS || nvars > GUFT_MAX_DIMENSION_VARIABLES)
+        return -1;
+
+    plan->kernel = kernel;
+    plan->nin = ps->input_count;
+    plan->nops = nops;
+    plan->element_count = resolved->element_count;
+    plan->kernel_dimension_count = 1 + nvars;
+    plan->kernel_step_count = nops + ps->total_signature_dimensions;
+    plan->args = (char **)plan->data;
+    plan->outer_strides = plan->data + nops;
+    plan->kernel_dimensions = plan->outer_strides + GUFT_MAXDIMS*nops;
+    plan->kernel_steps = plan->kernel_dimensions + plan->kernel_dimension_count;
+    plan->core_shape = plan->kernel_steps + plan->kernel_step_count;
+    plan->buffered_steps = plan->core_shape + ps->total_signature_dimensions;
+    plan->buffered_count = 0;
+    plan->buffer_block = 0;
+    plan->stats_site = 0;
+    plan->kernel_stats_site = 0;
+    plan->status = NULL;
+    plan->tile[0] = 0;
+    plan->tile[1] = 0;
+    plan->copies = NULL;
+    plan->thread_limit = 0;
+    plan->out_of_memory = 0;
+    strides = plan->outer_strides;
+
+    /* walk the broadcast outer shape from the innermost dimension. Size 1
+       dimensions are dropped, and every dimension is merged into the
+       previous (inner) one when the strides allow it */
+    for (size_t d = outer_ndim; d-- > 0;) {
+        guft_intp extent = (guft_intp)resolved->outer_shape[d];
+        size_t back = outer_ndim - d; /* position counting from the end */
+        int mergeable = ndim > 0;
+
+        if (extent == 1)
+            continue;
+
+        for (size_t op = 0; op < nops; op++) {
+            const execution_operand *o = operands + op;
+            size_t op_outer_ndim = o->ndim - ps->arg_dimension_count[op];
+            guft_intp stride = 0;
+
+            /* broadcast dimensions (missing or of size 1) get a 0 stride */
+            if (back <= op_outer_ndim) {
+                size_t op_d = op_outer_ndim - back;
+                if (o->shape[op_d] != 1)
+                    stride = o->strides[op_d];
+            }
+
+            strides[ndim*nops + op] = stride;
+            if (mergeable) {
+                guft_intp inner_stride = strides[(ndim - 1)*nops + op];
+                guft_intp inner_extent = plan->outer_shape[ndim - 1];
+                if (stride != inner_stride*inner_extent)
+                    mergeable = 0;
+            }
+        }
+
+        if (mergeable) {
+            plan->outer_shape[ndim - 1] *= extent;
+        } else {
+            plan->outer_shape[ndim] = extent;
+            ndim++;
+        }
+    }
+
+    if (ndim == 0) {
+        /* a single element (or no outer dimensions at all) */
+        plan->outer_shape[0] = 1;
+        for (size_t op = 0; op < nops; op++)
+            strides[op] = 0;
+        ndim = 1;
+    }
+    plan->outer_ndim = ndim;
+
+    /* kernel arguments: base pointers, dimension sizes and steps. The first
+       nops steps are those of the dimension handed to the kernel */
+    core_steps = plan->kernel_steps + nops;
+    for (size_t op = 0; op < nops; op++) {
+        const execution_operand *o = operands + op;
+        plan_operand *po = plan->operands + op;
+        size_t core_ndim = ps->arg_dimension_count[op];
+        size_t core_offset = ps->arg_shape_offsets[op];
+        size_t op_outer_ndim = o->ndim - core_ndim;
+        const size_t *idx = ps->arg_shape_idx + core_offset;
+
+        po->itemsize = o->itemsize;
+        po->flags = o->flags;
+        po->core_ndim = core_ndim;
+        po->core_offset = core_offset;
+        po->element_size = o->itemsize;
+        po->buffered = 0;
+
+        plan->args[op] = o->data;
+        plan->kernel_steps[op] = strides[op];
+        for (size_t d = 0; d < core_ndim; d++) {
+            size_t extent = resolved->dimension_sizes[idx[d]];
+            plan->core_shape[core_offset + d] = (guft_intp)extent;
+            po->element_size *= extent;
+            core_steps[core_offset + d] = o->strides[op_outer_ndim + d];
+        }
+    }
+
+    plan->kernel_dimensions[0] = 0;
+    for (size_t var = 0; var < nvars; var++)
+        plan->kernel_dimensions[1 + var] =
+            (guft_intp)resolved->dimension_sizes[var];
+
+    return 0;
+}
+
+static guft_intp
+abs_stride(guft_intp stride)
+{
+    return stride < 0 ? -stride : stride;
+}
+
+static void
+swap_dimensions(execution_plan *plan, size_t a, size_t b)
+{
+    size_t nops = plan->nops;
+    guft_intp *strides = plan->outer_strides;
+    guft_intp t = plan->outer_shape[a];
+
+    plan->outer_shape[a] = plan->outer_shape[b];
+    plan->outer_shape[b] = t;
+    for (size_t op = 0; op < nops; op++) {
+        t = strides[a*nops + op];
+        strides[a*nops + op] = strides[b*nops + op];
+        strides[b*nops + op] = t;
+    }
+}
+
+/* whether outer dimension b should be walked inside dimension a. Every
+   operand moving along both votes for the one with the smaller stride, with
+   the bytes of its element as weight. Ties keep the current order */
+static int
+walk_inside(const execution_plan *plan, size_t b, size_t a)
+{
+    size_t nops = plan->nops;
+    const guft_intp *strides = plan->outer_strides;
+    size_t inside = 0, outside = 0;
+
+    for (size_t op = 0; op < nops; op++) {
+        guft_intp sa = abs_stride(strides[a*nops + op]);
+        guft_intp sb = abs_stride(strides[b*nops + op]);
+        size_t weight = plan->operands[op].element_size;
+
+        if (sa == 0 || sb == 0)
+            continue;
+        if (weight == 0)
+            weight = 1;
+        if (sb < sa)
+            inside += weight;
+        else if (sb > sa)
+            outside += weight;
+    }
+    return inside > outside;
+}
+
+/* pick the tile for the two innermost dimensions, if the operands disagree
+   on which one to walk inside */
+static void
+choose_tile(execution_plan *plan, size_t tile_size)
+{
+    size_t nops = plan->nops;
+    const guft_intp *strides = plan->outer_strides;
+    size_t n0 = (size_t)plan->outer_shape[0];
+    size_t n1 = (size_t)plan->outer_shape[1];
+    size_t bytes = 0, side = 1;
+    int disagree = 0;
+
+    for (size_t op = 0; op < nops; op++) {
+        guft_intp s0 = abs_stride(strides[op]);
+        guft_intp s1 = abs_stride(strides[nops + op]);
+
+        bytes += plan->operands[op].element_size;
+        if (s0 != 0 && s1 != 0 && s1 < s0)
+            disagree = 1;
+    }
+    if (!disagree || bytes == 0 || n0*n1 <= tile_size/bytes)
+        return;
+
+    /* the largest power of two side with a tile in tile_size bytes. Tiles
+       of less than 8x8 do not get much reuse out of a cache line */
+    while (4*side*side <= tile_size/bytes)
+        side *= 2;
+    if (side < 8)
+        return;
+
+    plan->tile[0] = side < n0 ? side : n0;
+    plan->tile[1] = side < n1 ? side : n1;
+}
+
+void
+order_execution_plan(execution_plan *plan, size_t tile_size)
+{
+    size_t nops = plan->nops;
+    size_t ndim = plan->outer_ndim;
+    guft_intp *strides = plan->outer_strides;
+    size_t kept = 0;
+
+    if (plan->kernel.flags & GUFT_KERNEL_REPORTS_STATUS)
+        return;
+
+    /* flip the dimensions every moving operand walks backwards, starting
+       from the element that was the last one */
+    for (size_t d = 0; d < ndim; d++) {
+        int backwards = 0;
+        for (size_t op = 0; op < nops; op++) {
+            guft_intp stride = strides[d*nops + op];
+            if (stride > 0) {
+                backwards = 0;
+                break;
+            }
+            if (stride < 0)
+                backwards = 1;
+        }
+        if (!backwards)
+            continue;
+        for (size_t op = 0; op < nops; op++) {
+            plan->args[op] += (plan->outer_shape[d] - 1)*strides[d*nops + op];
+            strides[d*nops + op] = -strides[d*nops + op];
+        }
+    }
+
+    /* insertion sort, innermost first. It is stable, so the C order is
+       kept among dimensions the operands do not care about */
+    for (size_t d = 1; d < ndim; d++) {
+        for (size_t e = d; e > 0 && walk_inside(plan, e, e - 1); e--)
+            swap_dimensions(plan, e, e - 1);
+    }
+
+    /* coalesce again, as in init_execution_plan */
+    for (size_t d = 0; d < ndim; d++) {
+        int mergeable = kept > 0;
+        for (size_t op = 0; mergeable && op < nops; op++) {
+            if (strides[d*nops + op] !=
+                strides[(kept - 1)*nops + op]*plan->outer_shape[kept - 1])
+                mergeable = 0;
+        }
+        if (mergeable) {
+            plan->outer_shape[kept - 1] *= plan->outer_shape[d];
+            continue;
+        }
+        if (kept != d) {
+            plan->outer_shape[kept] = plan->outer_shape[d];
+            memcpy(strides + kept*nops, strides + d*nops,
+                   nops*sizeof(guft_intp));
+        }
+        kept++;
+    }
+    plan->outer_ndim = kept;
+    memcpy(plan->kernel_steps, strides, nops*sizeof(guft_intp));
+
+    plan->tile[0] = 0;
+    plan->tile[1] = 0;
+    if (kept >= 2 && tile_size > 0)
+        choose_tile(plan, tile_size);
+}
+
+static void
+call_kernel(const execution_plan *plan, char **args, guft_intp *dimensions,
+            guft_intp n, unsigned char *status)
+{
+    if (plan->buffered_count > 0) {
+        execute_buffered(plan, args, dimensions, n, status);
+    } else {
+        args[plan->nops] = (char *)status;
+        dimensions[0] = n;
+        plan->kernel.func(args, dimensions, plan->kernel_steps,
+                          plan->kernel.data);
+    }
+}
+
+/* Adds the failures in the n status bytes of elements [position,
+   position + n) to the plan status. The check for no failures is a scan
+   a word at a time; the rest only costs in proportion to the failures */
+static void
+collect_status(const execution_plan *plan, const unsigned char *status,
+               size_t position, size_t n)
+{
+    execution_status *es = plan->status;
+    size_t failures = 0;
+    size_t i = 0;
+    uint64_t any = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, status + i, 8);
+        any |= word;
+    }
+    for (; i < n; i++)
+        any |= status[i];
+    if (any == 0 || es == NULL)
+        return;
+
+    for (i = 0; i < n; i++) {
+        size_t element = position + i;
+        if (!status[i])
+            continue;
+        ATOMIC_OR(es->mask[element/8], (unsigned char)(1u << (element % 8)));
+        failures++;
+    }
+    ATOMIC_ADD(es->failures, failures);
+}
+
+/* Calls the kernel on n elements, in blocks with a status array for the
+   kernels that report status */
+static void
+run_kernel(const execution_plan *plan, char **args, guft_intp *dimensions,
+           guft_intp n, size_t position)
+{
+    unsigned char status[GUFT_STATUS_BLOCK];
+    char *block_args[GUFT_MAXARGS + 1];
+    size_t nops = plan->nops;
+
+    if (!(plan->kernel.flags & GUFT_KERNEL_REPORTS_STATUS)) {
+        call_kernel(plan, args, dimensions, n, NULL);
+        return;
+    }
+
+    memcpy(block_args, args, nops*sizeof(char *));
+    while (n > 0) {
+        guft_intp block = n < GUFT_STATUS_BLOCK ? n : GUFT_STATUS_BLOCK;
+
+        memset(status, 0, (size_t)block);
+        call_kernel(plan, block_args, dimensions, block, status);
+        collect_status(plan, status, position, (size_t)block);
+
+        for (size_t op = 0; op < nops; op++)
+            block_args[op] += block*plan->kernel_steps[op];
+        position += (size_t)block;
+        n -= block;
+    }
+}
+
+void
+execute_plan_range(const execution_plan *plan, size_t start, size_t count)
+{
+    if (plan->copies != NULL)
+        execute_copied_range(plan, start, count);
+    else
+        execute_plan_range_at(plan, plan->args, start, count);
+}
+
+/* execute_plan_range_at for tiled plans. The tiles of outer dimensions 0
+   and 1 are visited in C order, and so are the elements of every tile, so
+   the position of an element is that of its tile plus its index in it. A
+   kernel call is a row of a tile */
+static void
+execute_tiled_range(const execution_plan *plan, char *const *base,
+                    size_t start, size_t count)
+{
+    size_t nops = plan->nops;
+    size_t ndim = plan->outer_ndim;
+    const guft_intp *shape = plan->outer_shape;
+    const guft_intp *strides = plan->outer_strides;
+    size_t n0 = (size_t)shape[0], n1 = (size_t)shape[1];
+    size_t t0 = plan->tile[0], t1 = plan->tile[1];
+    guft_intp dimensions[1 + GUFT_MAX_DIMENSION_VARIABLES];
+    char *args[GUFT_MAXARGS + 1];
+
+    memcpy(dimensions, plan->kernel_dimensions,
+           plan->kernel_dimension_count*sizeof(guft_intp));
+
+    while (count > 0) {
+        size_t rest = start/(n0*n1);
+        size_t p = start%(n0*n1);
+        /* a band of tile rows, then a tile in it, then a row in the tile.
+           Only the last band and tile of a band may be smaller */
+        size_t band = p/(t1*n0);
+        size_t height = n1 - band*t1 < t1 ? n1 - band*t1 : t1;
+        size_t r = p - band*t1*n0;
+        size_t column = r/(height*t0);
+        size_t width = n0 - column*t0 < t0 ? n0 - column*t0 : t0;
+        size_t i0, i1, n;
+
+        r -= column*height*t0;
+        i1 = band*t1 + r/width;
+        i0 = column*t0 + r%width;
+        n = width - r%width;
+        if (n > count)
+            n = count;
+
+        for (size_t op = 0; op < nops; op++)
+            args[op] = base[op] + (guft_intp)i0*strides[op] +
+                (guft_intp)i1*strides[nops + op];
+        for (size_t d = 2; d < ndim; d++) {
+            guft_intp index = (guft_intp)(rest % (size_t)shape[d]);
+            rest /= (size_t)shape[d];
+            for (size_t op = 0; op < nops; op++)
+                args[op] += index*strides[d*nops + op];
+        }
+
+        run_kernel(plan, args, dimensions, (guft_intp)n, start);
+        start += n;
+        count -= n;
+    }
+}
+
+void
+execute_plan_range_at(const execution_plan *plan, char *const *base,
+                      size_t start, size_t count)
+{
+    size_t nops = plan->nops;
+    size_t ndim = plan->outer_ndim;
+    size_t position = start;
+    const guft_intp *shape = plan->outer_shape;
+    const guft_intp *strides = plan->outer_strides;
+    guft_intp index[GUFT_MAXDIMS];
+    guft_intp dimensions[1 + GUFT_MAX_DIMENSION_VARIABLES];
+    char *args[GUFT_MAXARGS + 1];
+
+    if (count == 0)
+        return;
+    if (plan->tile[0] != 0) {
+        execute_tiled_range(plan, base, start, count);
+        return;
+    }
+
+    /* every range needs its own dimensions as the first one changes from
+       call to call */
+    memcpy(dimensions, plan->kernel_dimensions,
+           plan->kernel_dimension_count*sizeof(guft_intp));
+
+    /* position the pointers at the start of the range */
+    memcpy(args, base, nops*sizeof(char *));
+    for (size_t d = 0; d < ndim; d++) {
+        index[d] = (guft_intp)(start % (size_t)shape[d]);
+        start /= (size_t)shape[d];
+        for (size_t op = 0; op < nops; op++)
+            args[op] += index[d]*strides[d*nops + op];
+    }
+
+    for (;;) {
+        guft_intp n = shape[0] - index[0];
+        if ((size_t)n > count)
+            n = (guft_intp)count;
+
+        run_kernel(plan, args, dimensions, n, position);
+
+        position += (size_t)n;
+        count -= (size_t)n;
+        if (count == 0)
+            break;
+
+        /* the range continues, so the inner dimension was exhausted: move
+           to the next row, carrying into outer dimensions as needed */
+        for (size_t op = 0; op < nops; op++)
+            args[op] -= index[0]*strides[op];
+        index[0] = 0;
+        for (size_t d = 1; d < ndim; d++) {
+            index[d]++;
+            for (size_t op = 0; op < nops; op++)
+                args[op] += strides[d*nops + op];
+            if (index[d] < shape[d])
+                break;
+            for (size_t op = 0; op < nops; op++)
+                args[op] -= index[d]*strides[d*nops + op];
+            index[d] = 0;
+        }
+    }
+}
+
+/* whether an execution of plan is to be timed and counted */
+static int
+plan_stats_wanted(const execution_plan *plan)
+{
+    return GUFT_ATOMIC_LOAD(stats_enabled) &&
+        (plan->stats_site || plan->kernel_stats_site);
+}
+
+static void
+record_plan_stats(const execution_plan *plan, uint64_t ns)
+{
+    uint64_t elements = plan->element_count;
+    uint64_t bytes = 0;
+
+    for (size_t op = 0; op < plan->nops; op++)
+        bytes += elements*plan->operands[op].element_size;
+
+    if (plan->stats_site) {
+        stats_record_call(plan->stats_site, elements, bytes);
+        stats_record_phase(plan->stats_site, GUFT_PHASE_EXECUTE, ns);
+    }
+    if (plan->kernel_stats_site) {
+        stats_record_call(plan->kernel_stats_site, elements, bytes);
+        stats_record_phase(plan->kernel_stats_site, GUFT_PHASE_EXECUTE, ns);
+    }
+}
+
+void
+execute_plan(const execution_plan *plan)
+{
+    if (plan_stats_wanted(plan)) {
+        uint64_t start = stats_now();
+        execute_plan_range(plan, 0, plan->element_count);
+        record_plan_stats(plan, stats_now() - start);
+    } else {
+        execute_plan_range(plan, 0, plan->element_count);
+    }
+}
+
+static void
+plan_range_func(void *ctx, size_t start, size_t count)
+{
+    execute_plan_range((const execution_plan *)ctx, start, count);
+}
+
+void
+execute_plan_parallel(const execution_plan *plan, size_t min_chunk)
+{
+    if (plan_stats_wanted(plan)) {
+        uint64_t start = stats_now();
+        threadpool_parallel_for_limited(plan->element_count, min_chunk,
+                                        plan->thread_limit, plan_range_func,
+                                        (void *)plan);
+        record_plan_stats(plan, stats_now() - start);
+    } else {
+        threadpool_parallel_for_limited(plan->element_count, min_chunk,
+                                        plan->thread_limit, plan_range_func,
+                                        (void *)plan);
+    }
+}
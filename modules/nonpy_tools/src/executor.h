@@ -0,0 +1,254 @@
+#ifndef GUFT_EXECUTOR_H
+#define GUFT_EXECUTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "signature.h"
+#include "resolve.h"
+
+/* Maximum number of operands (inputs plus outputs) of an executed gufunc.
+   Same as the classic NPY_MAXARGS */
+#define GUFT_MAXARGS 32
+
+/* Maximum number of dimension variables of an executed gufunc */
+#define GUFT_MAX_DIMENSION_VARIABLES 64
+
+/* Same as npy_intp, so kernels written for NumPy can be used as is */
+typedef intptr_t guft_intp;
+
+/* The classic gufunc kernel ABI, as used by NumPy:
+
+   - args: one pointer per operand to its first element.
+
+   - dimensions: the number of elements to process in this call followed by
+     the size of every dimension variable.
+
+   - steps: the step (in bytes) between elements for every operand, followed
+     by the steps of the core dimensions of every operand, in order.
+*/
+typedef void (*guft_kernel_func)(char **args,
+                                 guft_intp *dimensions,
+                                 guft_intp *steps,
+                                 void *data);
+
+/* Kernels flagged with GUFT_KERNEL_REPORTS_STATUS get one more pointer in
+   args, after the operands: an array of dimensions[0] bytes, all 0, where
+   they set to non zero the elements that failed. The outputs of failed
+   elements are left to the kernel. Calls to these kernels are of at most
+   GUFT_STATUS_BLOCK elements */
+#define GUFT_KERNEL_REPORTS_STATUS 0x1
+#define GUFT_STATUS_BLOCK 1024
+
+typedef struct _guft_kernel_struct {
+    guft_kernel_func func;
+    void *data;
+    unsigned int flags;
+} guft_kernel;
+
+/* Status of a partially successful execution. The mask has a bit per
+   outer element in C order (bit i of byte i/8 for element i, least
+   significant bit first), set when the element failed. The caller provides
+   it zero filled, with room for (element_count + 7)/8 bytes */
+typedef struct _execution_status_struct {
+    unsigned char *mask;
+    size_t failures; /* number of bits set in mask */
+} execution_status;
+
+/* operand flags */
+#define GUFT_OPERAND_BYTESWAPPED 0x1 /* data is in non native byte order */
+
+/* An operand as seen by the executor: a data pointer plus a strided layout.
+   The shape is the one of the operand itself (outer dimensions followed by
+   core dimensions), before broadcasting. Strides are in bytes. itemsize
+   may be 0 if unknown, but then the operand can not be buffered */
+typedef struct _execution_operand_struct {
+    char *data;
+    size_t ndim;
+    const size_t *shape;
+    const guft_intp *strides;
+    size_t itemsize;
+    unsigned int flags;
+} execution_operand;
+
+/* Per operand information kept in a plan */
+typedef struct _plan_operand_struct {
+    size_t itemsize;
+    unsigned int flags;
+    size_t core_ndim;
+    size_t core_offset; /* of its core dimensions in core_shape and in the
+                           core steps */
+    size_t element_size; /* bytes of a packed (contiguous) element */
+    int buffered; /* goes through buffers in buffered execution */
+} plan_operand;
+
+/* An execution plan contains everything needed to drive a kernel over the
+   outer shape. The outer dimensions are stored innermost first, and
+   adjacent dimensions that can be walked with a single stride for every
+   operand are merged, so the kernel is called with as many elements as
+   possible each time.
+
+   Like parsed_signature, it is a packed structure with variable length
+   data. Use execution_plan_size to know how much memory it needs. */
+typedef struct _execution_plan_struct {
+    guft_kernel kernel;
+    size_t nin;
+    size_t nops;
+    size_t element_count;
+
+    /* coalesced outer shape, innermost first. Dimension 0 is the one handed
+       to the kernel */
+    size_t outer_ndim;
+    guft_intp outer_shape[GUFT_MAXDIMS];
+
+    size_t kernel_dimension_count; /* 1 + dimension_variable_count */
+    size_t kernel_step_count; /* nops + total_signature_dimensions */
+
+    char **args; /* nops base pointers */
+    guft_intp *outer_strides; /* outer_ndim*nops, [dim*nops + op] */
+    guft_intp *kernel_dimensions; /* kernel_dimension_count */
+    guft_intp *kernel_steps; /* kernel_step_count */
+
+    plan_operand operands[GUFT_MAXARGS];
+    guft_intp *core_shape; /* total_signature_dimensions */
+
+    /* buffered execution (see enable_plan_buffering). With no buffered
+       operands the kernel always works on the operands directly */
+    size_t buffered_count;
+    size_t buffer_block; /* elements per buffered kernel call */
+    guft_intp *buffered_steps; /* kernel_step_count */
+
+    /* stats sites execution is accounted to (see stats.h), usually the
+       gufunc and the kernel. 0 for none */
+    size_t stats_site;
+    size_t kernel_stats_site;
+
+    /* where failures reported by the kernel go, NULL to ignore them */
+    execution_status *status;
+
+    /* elements along outer dimensions 0 and 1 in a tile (see
+       order_execution_plan). 0 when the outer shape is walked in rows */
+    size_t tile[2];
+
+    /* copies of the blocks of inputs overlapping outputs (see overlap.h),
+       NULL when inputs are read in place */
+    const struct _overlap_copies_struct *copies;
+
+    /* most threads execute_plan_parallel runs it in, 0 for all of the pool
+       (see tuner.h) */
+    size_t thread_limit;
+
+    /* set by buffered execution when there was no memory for the buffers
+       of byte swapped operands, that can not run without them: some
+       elements were not computed */
+    int out_of_memory;
+
+    guft_intp data[];
+} execution_plan;
+
+size_t
+execution_plan_size(const parsed_signature *ps);
+
+/* Build an execution plan for a resolved call. operands has one entry per
+   argument of the signature. plan must point to at least
+   execution_plan_size(ps) bytes.
+
+   Returns 0 on success, -1 if the call exceeds GUFT_MAXARGS operands or
+   GUFT_MAX_DIMENSION_VARIABLES dimension variables. */
+int
+init_execution_plan(execution_plan *plan,
+                    const parsed_signature *ps,
+                    const resolved_shapes *resolved,
+                    const execution_operand *operands,
+                    guft_kernel kernel);
+
+/* Reorder the outer dimensions of a plan so that the operands are walked
+   in memory order, like NpyIter does for ufuncs. The operands vote with
+   their byte strides (weighted by the size of their elements) for the
+   dimension that goes inside, dimensions that every operand walks
+   backwards are flipped, and the result is coalesced again, so Fortran
+   ordered or transposed operands run as well as C ordered ones.
+
+   When the operands disagree on the innermost dimension (say a C ordered
+   output of a transposed input) and the two innermost dimensions do not
+   fit in tile_size bytes, they are walked in square tiles of about
+   tile_size bytes, so every operand gets reused from cache. 0 disables
+   tiling.
+
+   Elements are no longer visited in C order after this, so it does nothing
+   for kernels that report status, and plans reordered must not be run
+   with execute_plan_range_at on packed operands. Call it before
+   enable_plan_buffering */
+void
+order_execution_plan(execution_plan *plan, size_t tile_size);
+
+/* Default working set of a tile in bytes, about what fits in L2 */
+#define GUFT_DEFAULT_TILE_SIZE 131072
+
+/* Run the kernel over elements [start, start + count) of the outer shape,
+   in C order (or the order set by order_execution_plan). Different ranges
+   can be executed concurrently */
+void
+execute_plan_range(const execution_plan *plan, size_t start, size_t count);
+
+/* Same as execute_plan_range, with base instead of the base pointers of the
+   plan: base[op] is where element 0 of operand op would be. Used to run a
+   plan on operands that only exist for a range (see fusion.h) */
+void
+execute_plan_range_at(const execution_plan *plan, char *const *base,
+                      size_t start, size_t count);
+
+/* Run the kernel over all the elements */
+void
+execute_plan(const execution_plan *plan);
+
+/* Run the kernel over all the elements using the thread pool (see
+   threadpool.h). The outer elements are split in chunks of at least
+   min_chunk elements; calls with less than two chunks of work run in the
+   calling thread, and no more threads than the thread_limit of the plan
+   take part. Kernels must be safe to run concurrently on different
+   elements. Does not touch Python objects, so the GIL can be released */
+void
+execute_plan_parallel(const execution_plan *plan, size_t min_chunk);
+
+/* Default minimum chunk size for parallel execution */
+#define GUFT_DEFAULT_MIN_CHUNK 1024
+
+/* Enable buffered execution in a plan. Operands that are byte swapped,
+   misaligned or whose core is not contiguous are gathered (inputs) into
+   aligned contiguous buffers of about buffer_size bytes before calling the
+   kernel, and scattered back (outputs) after it. Buffers come from the per
+   thread scratch pool (see scratch.h). Operands already contiguous are
+   passed directly. A buffer_size of 0 disables buffering, except for byte
+   swapped operands that can not run without it: those still use buffers
+   of GUFT_DEFAULT_BUFFER_SIZE bytes.
+
+   Returns the number of operands that will be buffered. When it is 0,
+   execution is exactly the same as without buffering. */
+size_t
+enable_plan_buffering(execution_plan *plan, size_t buffer_size);
+
+/* Default size of the buffers in buffered execution, in bytes */
+#define GUFT_DEFAULT_BUFFER_SIZE 32768
+
+/* Internal: run the kernel on count elements starting at args, going
+   through the buffers. status is the status array for the kernel if it
+   reports status (see GUFT_KERNEL_REPORTS_STATUS), NULL otherwise. Without
+   memory for buffers the kernel runs on the operands directly, unless any
+   is byte swapped: then it is skipped and out_of_memory set in the plan.
+   Used by execute_plan_range */
+void
+execute_buffered(const execution_plan *plan, char **args,
+                 guft_intp *dimensions, guft_intp count,
+                 unsigned char *status);
+
+/* Internal: copy an N-d block of items between two strided layouts,
+   byte swapping them if swap is set. Used by buffered execution and
+   reductions */
+void
+copy_strided(char *dst, const guft_intp *dst_steps,
+             const char *src, const guft_intp *src_steps,
+             const guft_intp *shape, size_t ndim,
+             size_t itemsize, int swap);
+
+#endif /* GUFT_EXECUTOR_H */
@@ -0,0 +1,111 @@
+#include <stdint.h>
+
+#include "fusion.h"
+#include "scratch.h"
+#include "threadpool.h"
+
+#define ROUND_UP(n) \
+    (((n) + GUFT_SCRATCH_ALIGNMENT - 1) & ~(size_t)(GUFT_SCRATCH_ALIGNMENT - 1))
+
+/* Fused execution runs the stages one after the other on each block, so
+   the temporaries written by a stage are still in cache when the next one
+   reads them. The blocks are much larger than a single element to keep
+   the kernel call overhead low, but small enough for all the temporaries
+   of a block to fit in the L1 or L2 caches. */
+
+void
+init_fused_group(fused_group *group, size_t buffer_size)
+{
+    size_t per_element = 0;
+    size_t offset = 0;
+
+    for (size_t t = 0; t < group->temporary_count; t++)
+        per_element += group->temporary_sizes[t];
+
+    group->block = per_element > 0 ? buffer_size/per_element : 0;
+    if (group->block == 0)
+        group->block = per_element > 0 ? 1 : group->element_count;
+    if (group->block > group->element_count)
+        group->block = group->element_count;
+    if (group->block == 0)
+        group->block = 1;
+
+    for (size_t t = 0; t < group->temporary_count; t++) {
+        group->temporary_offsets[t] = offset;
+        offset += ROUND_UP(group->block*group->temporary_sizes[t]);
+    }
+    group->scratch_size = offset;
+    group->out_of_memory = 0;
+}
+
+/* base pointers of the operands of stage for a block of the temporaries
+   starting at element start */
+static void
+stage_base(const fused_group *group, const fused_stage *stage,
+           char *scratch, size_t start, char **base)
+{
+    const execution_plan *plan = stage->plan;
+
+    for (size_t op = 0; op < plan->nops; op++) {
+        int t = stage->temporaries[op];
+        if (t < 0) {
+            base[op] = plan->args[op];
+        } else {
+            /* where element 0 would be, so that element start lands at the
+               beginning of the temporary */
+            uintptr_t block = (uintptr_t)(scratch +
+                                          group->temporary_offsets[t]);
+            base[op] = (char *)(block - start*group->temporary_sizes[t]);
+        }
+    }
+}
+
+void
+execute_fused_range(fused_group *group, size_t start, size_t count)
+{
+    char *base[GUFT_MAXARGS];
+    char *scratch = NULL;
+
+    if (count == 0)
+        return;
+
+    if (group->scratch_size > 0) {
+        scratch = scratch_acquire(group->scratch_size);
+        if (scratch == NULL) {
+            group->out_of_memory = 1;
+            return;
+        }
+    }
+
+    while (count > 0) {
+        size_t n = count < group->block ? count : group->block;
+
+        for (size_t s = 0; s < group->stage_count; s++) {
+            const fused_stage *stage = group->stages + s;
+            stage_base(group, stage, scratch, start, base);
+            execute_plan_range_at(stage->plan, base, start, n);
+        }
+
+        start += n;
+        count -= n;
+    }
+
+    if (scratch != NULL)
+        scratch_release(scratch);
+}
+
+static void
+fused_range_func(void *ctx, size_t start, size_t count)
+{
+    execute_fused_range((fused_group *)ctx, start, count);
+}
+
+void
+execute_fused_parallel(fused_group *group, size_t min_chunk)
+{
+    /* chunks of whole blocks, so that only the last one is partial */
+    if (min_chunk < group->block)
+        min_chunk = group->block;
+    threadpool_parallel_for(group->element_count, min_chunk,
+                            fused_range_func, group);
+}
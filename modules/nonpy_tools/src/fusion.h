@@ -0,0 +1,63 @@
+#ifndef GUFT_FUSION_H
+#define GUFT_FUSION_H
+
+#include <stddef.h>
+
+#include "executor.h"
+
+/* Fused execution of chains of gufunc calls.
+
+   When the output of a call is only consumed by another call over the same
+   outer shape, there is no need to materialize it: both can run one block
+   of outer elements at a time, with the intermediate living in a per block
+   temporary small enough to stay in cache. A fused group is a set of such
+   calls (stages), each with its own execution plan, where some operands
+   are temporaries instead of memory of the caller.
+
+   Temporaries are packed: element i of the block is at i times the element
+   size of the temporary, with the core of every element contiguous in C
+   order. They come from the per thread scratch pool (see scratch.h).
+*/
+
+typedef struct _fused_stage_struct {
+    const execution_plan *plan;
+    /* for every operand, the temporary it uses or -1 if it is an operand
+       of the caller (the base pointer in the plan). The plan of a stage
+       must be built with the packed layout for its temporaries over the
+       whole outer shape, and any data pointer for them */
+    int temporaries[GUFT_MAXARGS];
+} fused_stage;
+
+typedef struct _fused_group_struct {
+    size_t element_count; /* the same for all the stages */
+    size_t stage_count;
+    const fused_stage *stages; /* in execution order */
+    size_t temporary_count;
+    const size_t *temporary_sizes; /* bytes per element of every temporary */
+
+    /* filled by init_fused_group */
+    size_t block; /* elements per block */
+    size_t *temporary_offsets; /* of every temporary in the scratch block,
+                                  temporary_count entries from the caller */
+    size_t scratch_size;
+
+    /* set when there was no memory for the temporaries of a single element
+       and part of the execution was skipped */
+    int out_of_memory;
+} fused_group;
+
+/* Choose the block so that the temporaries take about buffer_size bytes,
+   and lay them out */
+void
+init_fused_group(fused_group *group, size_t buffer_size);
+
+/* Run all the stages over elements [start, start + count), one block at a
+   time. Different ranges can be executed concurrently */
+void
+execute_fused_range(fused_group *group, size_t start, size_t count);
+
+/* Same as execute_plan_parallel, for a fused group */
+void
+execute_fused_parallel(fused_group *group, size_t min_chunk);
+
+#endif /* GUFT_FUSION_H */
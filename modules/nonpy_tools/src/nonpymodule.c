@@ -5,43 +5,59 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "signature.h"
+#include "resolve.h"
+#include "executor.h"
+#include "threadpool.h"
+#include "nonpymodule.h"
 
-/* Use this macro to set up the module name. Do not use quotes.
-   This name will be used in various places like the init function
-   name as well as to generate the string to be placed in the Python
-   module
-*/
+/* -----------------------------------------------------------------------------
+ * Module state
+ */
 
-#define THIS_MODULE_PATH "gufunctools"
-#define THIS_MODULE_NAME _nonpy_tools
-
-/* Some misc macros */
-#define _CONCAT(a,b) a ## b
-#define CONCAT(a,b) _CONCAT(a,b)
-#define _STR(a) # a
-#define STR(a) _STR(a)
-
-#if defined(__GNUC__)
-#  define UNUSED_VAR(x) CONCAT(UNUSED_, x) __attribute__((unused))
-#elif defined(__LCLINT__)
-#  define UNUSED_VAR(x) /*@unused@*/ CONCAT(UNUSED_, x)
-#elif defined(__cplusplus)
-#  define UNUSED_VAR(x)
-#else
-#  define UNUSED_VAR(x) CONCAT(UNUSED_, x)
-#endif 
-
-/* Python 3 support */
-#if PY_MAJOR_VERSION >= 3
-#   define PYTHON3
-#   define MOD_INIT(name) PyMODINIT_FUNC CONCAT(PyInit_, name)(void)
-#   define MOD_RETURN(val) do { return val; } while(0)
+static struct PyModuleDef moduledef;
+
+guft_module_state *
+get_module_state(PyObject *module)
+{
+    return (guft_module_state *)PyModule_GetState(module);
+}
+
+guft_module_state *
+get_state_by_type(PyTypeObject *type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject *module = PyType_GetModuleByDef(type, &moduledef);
+    return module != NULL ? get_module_state(module) : NULL;
 #else
-#   define MOD_INIT(name) PyMODINIT_FUNC CONCAT(init, name)(void)
-#   define MOD_RETURN(val) do {} while(0)
+    /* what PyType_GetModuleByDef does */
+    PyObject *mro = type->tp_mro;
+    for (Py_ssize_t i = 0; mro != NULL && i < PyTuple_GET_SIZE(mro); i++) {
+        PyTypeObject *base = (PyTypeObject *)PyTuple_GET_ITEM(mro, i);
+        PyObject *module;
+        if (!PyType_HasFeature(base, Py_TPFLAGS_HEAPTYPE))
+            continue;
+        module = ((PyHeapTypeObject *)base)->ht_module;
+        if (module != NULL && PyModule_GetDef(module) == &moduledef)
+            return get_module_state(module);
+    }
+    PyErr_Format(PyExc_TypeError, "'%s' is not a type of %s", type->tp_name,
+                 THIS_MODULE_PATH"."STR(THIS_MODULE_NAME));
+    return NULL;
 #endif
+}
+
+static int
+set_size_attribute(PyObject *obj, const char *name, size_t value)
+{
+    PyObject *boxed = PyLong_FromSize_t(value);
+    int rv = boxed ? PyObject_SetAttrString(obj, name, boxed) : -1;
+    Py_XDECREF(boxed);
+    return rv;
+}
 
 /* Box a signature in a Python structure.
    The structure used is a tuple containing:
@@ -49,6 +65,7 @@
    - an integer with the number of dimension variables
    - a tuple with the tuples for each argument and their bindings to the
      dimension variables
+   Fixed sizes are not part of it, see box_fixed_sizes.
 */
 static PyObject *
 box_signature(parsed_signature *ps)
@@ -80,67 +97,885 @@ box_signature(parsed_signature *ps)
 
             PyTuple_SET_ITEM(rv, 2, arg_dim_tuple);
         }
+
+        /* the result gets cached, so it must not have holes */
+        if (PyErr_Occurred())
+            Py_CLEAR(rv);
+    }
+
+    return rv;
+}
+
+/* a tuple with the fixed size of each dimension variable, None for the
+   ones that can take any size */
+static PyObject *
+box_fixed_sizes(const parsed_signature *ps)
+{
+    size_t var_count = ps->dimension_variable_count;
+    PyObject *rv = PyTuple_New(var_count);
+
+    for (size_t var = 0; rv != NULL && var < var_count; var++) {
+        size_t size = ps->dimension_fixed_sizes[var];
+        PyObject *item = Py_None;
+
+        if (size != GUFT_FREE_DIMENSION)
+            item = PyLong_FromSize_t(size);
+        else
+            Py_INCREF(item);
+        if (item == NULL)
+            Py_CLEAR(rv);
+        else
+            PyTuple_SET_ITEM(rv, var, item);
     }
 
     return rv;
 }
 
 /* -----------------------------------------------------------------------------
- * Boxed signature object
+ * Signature interning
+ *
+ * Signature strings are interned in a dict of the module state so that
+ * parsing happens only once per distinct signature. The dict maps signature
+ * strings to the Signature object owning the parsed data. Both the string
+ * as given and its normalized form (whitespace removed) are used as keys, so
+ * repeated lookups with the same string object are a single dict probe
+ * using the cached hash of the string: no parsing and no allocation.
+ *
+ * Threads racing to intern the same new signature may both parse it, but
+ * the first one inserted is the one every thread gets.
+ *
+ * The table is bounded, so processes building signatures on the fly do not
+ * grow it forever: when it is full it is emptied and starts over. Signatures
+ * in use are kept alive by their references, and the ones used again are
+ * just parsed once more.
  */
 
-typedef struct {
-    PyObject_HEAD
-    parsed_signature *the_signature;
-} guft_SignatureObject;
+/* keys in the interning table (a signature takes one or two) */
+#define GUFT_SIGNATURE_CACHE_SIZE 4096
+
+/* new reference to the Signature interned for key. NULL if there is none,
+   with no exception set, or on error */
+static guft_SignatureObject *
+cache_lookup(guft_module_state *state, PyObject *key)
+{
+    PyObject *rv;
 
+#if PY_VERSION_HEX >= 0x030D0000
+    if (PyDict_GetItemRef(state->signature_cache, key, &rv) < 0)
+        return NULL;
+#else
+    rv = PyDict_GetItemWithError(state->signature_cache, key);
+    Py_XINCREF(rv);
+#endif
+    return (guft_SignatureObject *)rv;
+}
+
+/* intern signature for key unless there is one already. Returns a new
+   reference to the one interned, NULL on error. Steals the reference to
+   signature */
+static guft_SignatureObject *
+cache_insert(guft_module_state *state, PyObject *key,
+             guft_SignatureObject *signature)
+{
+    PyObject *rv;
+
+    if (PyDict_GET_SIZE(state->signature_cache) >= GUFT_SIGNATURE_CACHE_SIZE)
+        PyDict_Clear(state->signature_cache);
+
+#if PY_VERSION_HEX >= 0x030D0000
+    if (PyDict_SetDefaultRef(state->signature_cache, key,
+                             (PyObject *)signature, &rv) < 0)
+        rv = NULL;
+#else
+    rv = PyDict_SetDefault(state->signature_cache, key, (PyObject *)signature);
+    Py_XINCREF(rv);
+#endif
+    Py_DECREF(signature);
+    return (guft_SignatureObject *)rv;
+}
+
+/* raise SignatureError for an error of the parsers, with the signature,
+   the position and the reason as attributes */
 static void
-Signature_dealloc(guft_SignatureObject *self)
+raise_signature_error(guft_module_state *state, const char *signature,
+                      const signature_parse_error *error)
 {
-    /* the wrapper is owner of the underlying object */
-    release_parsed_signature(self->the_signature);
-    Py_TYPE(self)->tp_free((PyObject*)self);
+    const char *reason = error->message ? error->message : "unknown error";
+    PyObject *exc, *text, *reason_obj;
+    int failed;
+
+    exc = PyObject_CallFunction(state->SignatureError, "N",
+                                PyUnicode_FromFormat(
+                                    "Parse error on signature '%s': %s at "
+                                    "position %zu", signature, reason,
+                                    error->position));
+    if (exc == NULL)
+        return;
+    text = PyUnicode_FromString(signature);
+    reason_obj = PyUnicode_FromString(reason);
+    failed = text == NULL || reason_obj == NULL ||
+        PyObject_SetAttrString(exc, "signature", text) < 0 ||
+        set_size_attribute(exc, "position", error->position) < 0 ||
+        PyObject_SetAttrString(exc, "reason", reason_obj) < 0;
+    Py_XDECREF(text);
+    Py_XDECREF(reason_obj);
+
+    if (!failed)
+        PyErr_SetObject(state->SignatureError, exc);
+    Py_DECREF(exc);
 }
 
+/* return a new reference to a str with all the whitespace the parser would
+   skip removed */
 static PyObject *
-Signature_new(PyTypeObject *type,
-              PyObject *args,
-              PyObject *kwds)
+normalize_signature_string(const char *signature, Py_ssize_t len)
+{
+    PyObject *rv;
+    char *buff = PyMem_Malloc(len + 1);
+    Py_ssize_t out = 0;
+
+    if (buff == NULL)
+        return PyErr_NoMemory();
+
+    for (Py_ssize_t i = 0; i < len; i++) {
+        if (signature[i] != ' ' && signature[i] != '\t')
+            buff[out++] = signature[i];
+    }
+
+    rv = PyUnicode_FromStringAndSize(buff, out);
+    PyMem_Free(buff);
+    return rv;
+}
+
+static guft_SignatureObject *
+create_signature_object(PyTypeObject *type, parsed_signature *ps,
+                        PyObject *text)
 {
     guft_SignatureObject *self;
 
     self = (guft_SignatureObject *) type->tp_alloc(type, 0);
     if (self != NULL) {
-        self->the_signature = NULL;
+        self->the_signature = ps;
+        self->owner = NULL;
+        Py_XINCREF(text);
+        self->text = text;
+        self->hash = -1;
+        self->boxed = NULL;
+    } else {
+        release_parsed_signature(ps);
     }
 
+    return self;
+}
+
+/* an instance of type sharing the parsed signature of owner, used for
+   subclasses. Steals the reference to owner */
+static PyObject *
+share_signature_object(PyTypeObject *type, guft_SignatureObject *owner)
+{
+    guft_SignatureObject *self;
+
+    self = (guft_SignatureObject *) type->tp_alloc(type, 0);
+    if (self == NULL) {
+        Py_DECREF(owner);
+        return NULL;
+    }
+    self->the_signature = owner->the_signature;
+    Py_XINCREF(owner->text);
+    self->text = owner->text;
+    self->owner = (PyObject *)owner;
+    self->hash = -1;
+    self->boxed = NULL;
+
     return (PyObject *)self;
 }
 
+/* parse a signature into a new parsed_signature. Parsing happens in a stack
+   buffer, only falling back to the heap for unusually large signatures, and
+   the result is copied into a block of the exact size. No Python is
+   involved, so it runs without the GIL. Sets a Python exception on error */
+static parsed_signature *
+parse_signature_string(guft_module_state *state, const char *signature)
+{
+    size_t stack_buffer[256];
+    void *buffer = stack_buffer;
+    size_t required_size = 0;
+    signature_parse_error error = { NULL, 0 };
+    parsed_signature *ps = NULL;
+    int status;
+
+    Py_BEGIN_ALLOW_THREADS
+    status = parse_signature_in_buffer(signature, buffer, sizeof(stack_buffer),
+                                       &required_size, &error);
+    if (status == 1) {
+        buffer = malloc(required_size);
+        if (buffer != NULL)
+            status = parse_signature_in_buffer(signature, buffer,
+                                               required_size, NULL, &error);
+    }
+    if (status == 0)
+        ps = duplicate_parsed_signature((parsed_signature *)buffer);
+    if (buffer != stack_buffer)
+        free(buffer);
+    Py_END_ALLOW_THREADS
+
+    if (status == -1)
+        raise_signature_error(state, signature, &error);
+    else if (ps == NULL)
+        PyErr_NoMemory();
+
+    return ps;
+}
+
+/* return a new reference to the interned Signature for signature_str */
+guft_SignatureObject *
+intern_signature(guft_module_state *state, PyObject *signature_str)
+{
+    PyObject *normalized = NULL;
+    guft_SignatureObject *rv;
+    parsed_signature *ps;
+    const char *signature;
+    Py_ssize_t len;
+
+    /* fast path: this exact string was seen before */
+    rv = cache_lookup(state, signature_str);
+    if (rv != NULL || PyErr_Occurred())
+        return rv;
+
+    signature = PyUnicode_AsUTF8AndSize(signature_str, &len);
+    if (signature == NULL)
+        return NULL;
+
+    normalized = normalize_signature_string(signature, len);
+    if (normalized == NULL)
+        return NULL;
+
+    rv = cache_lookup(state, normalized);
+    if (rv == NULL && !PyErr_Occurred()) {
+        ps = parse_signature_string(state, signature);
+        if (ps == NULL)
+            goto fail;
+
+        rv = create_signature_object(state->SignatureType, ps, normalized);
+        if (rv == NULL)
+            goto fail;
+        rv = cache_insert(state, normalized, rv);
+    }
+    if (rv == NULL)
+        goto fail;
+
+    /* alias the original string as well */
+    rv = cache_insert(state, signature_str, rv);
+
+ fail:
+    Py_DECREF(normalized);
+    return rv;
+}
+
+guft_SignatureObject *
+signature_from_object(guft_module_state *state, PyObject *obj)
+{
+    if (PyObject_TypeCheck(obj, state->SignatureType)) {
+        Py_INCREF(obj);
+        return (guft_SignatureObject *)obj;
+    }
+    if (PyUnicode_Check(obj))
+        return intern_signature(state, obj);
+
+    PyErr_SetString(PyExc_TypeError, "expected a Signature or a str");
+    return NULL;
+}
+
 static int
-Signature_init(guft_SignatureObject *self,
-               PyObject *args,
-               PyObject *kwds)
+Signature_traverse(guft_SignatureObject *self, visitproc visit, void *arg)
 {
-    const char *signature_str = NULL;
+    /* the type refers to the module and the module to its interned
+       Signatures */
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->owner);
+    Py_VISIT(self->boxed);
+    return 0;
+}
+
+static void
+Signature_dealloc(guft_SignatureObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    if (self->owner != NULL) {
+        /* the parsed signature belongs to the interned object */
+        Py_DECREF(self->owner);
+    } else {
+        /* the wrapper is owner of the underlying object */
+        release_parsed_signature(self->the_signature);
+    }
+    Py_XDECREF(self->text);
+    Py_XDECREF(self->boxed);
+    type->tp_free((PyObject*)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+Signature_new(PyTypeObject *type,
+              PyObject *args,
+              PyObject *kwds)
+{
+    guft_module_state *state = get_state_by_type(type);
+    PyObject *signature_str = NULL;
+    guft_SignatureObject *interned;
 
     static char *kwlist[] = { "id",  NULL };
 
-    if (! PyArg_ParseTupleAndKeywords(args, kwds, "s|", kwlist,
+    if (state == NULL)
+        return NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "U|", kwlist,
                                       &signature_str))
-        return -1;
+        return NULL;
+
+    interned = intern_signature(state, signature_str);
+    if (interned == NULL || type == state->SignatureType)
+        return (PyObject *)interned;
+
+    /* subclasses get their own instance, but still share the parsed data */
+    return share_signature_object(type, interned);
+}
+
+/* Signature(id) goes straight to the interning table, with no argument
+   tuple. Other calls take the tp_new path for its errors. Only used for
+   Signature itself, as subclasses do not inherit it, so its module is the
+   one of the type */
+static PyObject *
+Signature_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+                     PyObject *kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    Py_ssize_t nkwargs = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0;
+    PyObject *tuple, *dict = NULL, *rv = NULL;
 
-    if (signature_str) {
-        self->the_signature = numpy_parse_signature(signature_str);
+    if (nargs == 1 && nkwargs == 0 && PyUnicode_Check(args[0]))
+        return (PyObject *)intern_signature(
+            PyType_GetModuleState((PyTypeObject *)type), args[0]);
+
+    tuple = PyTuple_New(nargs);
+    if (tuple == NULL)
+        return NULL;
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        Py_INCREF(args[i]);
+        PyTuple_SET_ITEM(tuple, i, args[i]);
+    }
+    if (nkwargs > 0) {
+        dict = PyDict_New();
+        if (dict == NULL)
+            goto done;
+        for (Py_ssize_t i = 0; i < nkwargs; i++) {
+            if (PyDict_SetItem(dict, PyTuple_GET_ITEM(kwnames, i),
+                               args[nargs + i]) < 0)
+                goto done;
+        }
     }
+    rv = Signature_new((PyTypeObject *)type, tuple, dict);
 
-    return 0;
+ done:
+    Py_DECREF(tuple);
+    Py_XDECREF(dict);
+    return rv;
+}
+
+static Py_hash_t
+Signature_hash(guft_SignatureObject *self)
+{
+    if (self->hash == -1) {
+        Py_hash_t h = (Py_hash_t)parsed_signature_hash(self->the_signature);
+        self->hash = (h == -1) ? -2 : h;
+    }
+    return self->hash;
+}
+
+static PyObject *
+Signature_richcompare(PyObject *a, PyObject *b, int op)
+{
+    guft_module_state *state;
+    int equal;
+
+    if (op != Py_EQ && op != Py_NE)
+        Py_RETURN_NOTIMPLEMENTED;
+    /* the slot of a is the one called, so a is a Signature */
+    state = get_state_by_type(Py_TYPE(a));
+    if (state == NULL)
+        return NULL;
+    if (!PyObject_TypeCheck(b, state->SignatureType))
+        Py_RETURN_NOTIMPLEMENTED;
+
+    equal = parsed_signature_equal(
+        ((guft_SignatureObject *)a)->the_signature,
+        ((guft_SignatureObject *)b)->the_signature);
+
+    if (equal == (op == Py_EQ))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+/* built once: its tuples and ints are immutable, so every call can share
+   them. Instances sharing the data of an interned Signature share its box
+   as well. Owners are either Signatures or loaded tables */
+static PyObject *
+signature_boxed(guft_SignatureObject *self)
+{
+    PyObject *rv;
+
+    if (self->owner != NULL && !PyCapsule_CheckExact(self->owner))
+        return signature_boxed((guft_SignatureObject *)self->owner);
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    if (self->boxed == NULL)
+        self->boxed = box_signature(self->the_signature);
+    rv = self->boxed;
+    Py_XINCREF(rv);
+    GUFT_END_CRITICAL_SECTION();
+    return rv;
 }
 
 static PyObject *
 Signature_boxed(guft_SignatureObject *self)
 {
-    return box_signature(self->the_signature);
+    return signature_boxed(self);
+}
+
+/* -----------------------------------------------------------------------------
+ * Signature arrays
+ *
+ * Read only views of the size_t arrays of a parsed signature, exported
+ * through the buffer protocol with format 'N', so that Python code can read
+ * them through a memoryview without boxing them. The exporter keeps the
+ * Signature, and with it the data, alive.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *signature;
+    const size_t *data;
+    Py_ssize_t count;
+    Py_ssize_t itemsize; /* the stride, as the data is contiguous */
+} guft_SignatureArrayObject;
+
+static PyObject *
+signature_array_view(guft_SignatureObject *signature, const size_t *data,
+                     size_t count)
+{
+    guft_module_state *state = get_state_by_type(Py_TYPE(signature));
+    guft_SignatureArrayObject *array;
+    PyObject *rv;
+
+    if (state == NULL)
+        return NULL;
+    array = PyObject_New(guft_SignatureArrayObject,
+                         state->SignatureArrayType);
+    if (array == NULL)
+        return NULL;
+    Py_INCREF(signature);
+    array->signature = (PyObject *)signature;
+    array->data = data;
+    array->count = (Py_ssize_t)count;
+    array->itemsize = (Py_ssize_t)sizeof(size_t);
+
+    rv = PyMemoryView_FromObject((PyObject *)array);
+    Py_DECREF(array);
+    return rv;
+}
+
+static void
+SignatureArray_dealloc(guft_SignatureArrayObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_DECREF(self->signature);
+    PyObject_Del(self);
+    Py_DECREF(type);
+}
+
+static int
+SignatureArray_getbuffer(guft_SignatureArrayObject *self, Py_buffer *view,
+                         int flags)
+{
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "signature data is read only");
+        view->obj = NULL;
+        return -1;
+    }
+
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = (void *)self->data;
+    view->len = self->count*self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? "N" : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->count : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ?
+        &self->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyType_Slot guft_SignatureArray_slots[] = {
+    {Py_tp_dealloc, (void *)SignatureArray_dealloc},
+    {Py_bf_getbuffer, (void *)SignatureArray_getbuffer},
+    {Py_tp_doc, (void *)"Exporter of an array of a Signature"},
+    {0, NULL}
+};
+
+PyType_Spec guft_SignatureArray_spec = {
+    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".SignatureArray", /* name */
+    sizeof(guft_SignatureArrayObject),                    /* basicsize */
+    0,                                                    /* itemsize */
+    Py_TPFLAGS_DEFAULT | GUFT_TPFLAGS_NO_NEW,             /* flags */
+    guft_SignatureArray_slots,                            /* slots */
+};
+
+static PyObject *
+Signature_get_arg_dimension_count(guft_SignatureObject *self,
+                                  void *UNUSED_VAR(closure))
+{
+    return signature_array_view(self, self->the_signature->arg_dimension_count,
+                                self->the_signature->arg_count);
+}
+
+static PyObject *
+Signature_get_arg_shape_offsets(guft_SignatureObject *self,
+                                void *UNUSED_VAR(closure))
+{
+    return signature_array_view(self, self->the_signature->arg_shape_offsets,
+                                self->the_signature->arg_count);
+}
+
+static PyObject *
+Signature_get_arg_shape_idx(guft_SignatureObject *self,
+                            void *UNUSED_VAR(closure))
+{
+    return signature_array_view(
+        self, self->the_signature->arg_shape_idx,
+        self->the_signature->total_signature_dimensions);
+}
+
+static PyObject *
+Signature_get_fixed_sizes(guft_SignatureObject *self,
+                          void *UNUSED_VAR(closure))
+{
+    return box_fixed_sizes(self->the_signature);
+}
+
+static PyGetSetDef guft_SignatureObject_getset[] = {
+    {"arg_dimension_count", (getter)Signature_get_arg_dimension_count, NULL,
+     "read only memoryview with the number of core dimensions of every "
+     "argument", NULL},
+    {"arg_shape_offsets", (getter)Signature_get_arg_shape_offsets, NULL,
+     "read only memoryview with the offset of the core dimensions of every "
+     "argument in arg_shape_idx", NULL},
+    {"arg_shape_idx", (getter)Signature_get_arg_shape_idx, NULL,
+     "read only memoryview with the dimension variable of every core "
+     "dimension", NULL},
+    {"fixed_sizes", (getter)Signature_get_fixed_sizes, NULL,
+     "tuple with the fixed size of every dimension variable, None for the "
+     "ones that can take any size", NULL},
+    {NULL} /* Sentinel */
+};
+
+static PyObject *
+box_zu_tuple(const size_t *values, size_t count)
+{
+    PyObject *rv = PyTuple_New(count);
+    if (rv) {
+        for (size_t i = 0; i < count; i++) {
+            PyObject *item = PyLong_FromSize_t(values[i]);
+            if (item == NULL) {
+                Py_DECREF(rv);
+                return NULL;
+            }
+            PyTuple_SET_ITEM(rv, i, item);
+        }
+    }
+    return rv;
+}
+
+/* Signature.resolve(*shapes): resolve a call with the given argument
+   shapes. Shapes are sequences of ints. Outputs may be omitted or passed as
+   None to have their shape inferred.
+
+   Returns a tuple with the outer shape, the sizes of the dimension
+   variables and the full shape of every argument. Mostly useful for
+   inspection, as C code can call resolve_shapes directly.
+*/
+static PyObject *
+Signature_resolve(guft_SignatureObject *self, PyObject *args)
+{
+    parsed_signature *ps = self->the_signature;
+    Py_ssize_t given = PyTuple_GET_SIZE(args);
+    size_t arg_count = ps->arg_count;
+    size_t *buffer = NULL, *dim_storage, *scratch;
+    size_t *arg_ndim;
+    const size_t **arg_shapes;
+    resolved_shapes resolved;
+    resolve_error error = { NULL, 0, 0 };
+    PyObject *rv = NULL, *all_shapes = NULL;
+    int status;
+
+    if (given < (Py_ssize_t)ps->input_count || given > (Py_ssize_t)arg_count) {
+        return PyErr_Format(PyExc_TypeError,
+                            "resolve takes between %zu and %zu shapes "
+                            "(%zd given)", ps->input_count, arg_count, given);
+    }
+
+    /* one block for the dimension sizes, the argument ndims, the shape
+       pointers, room for every argument shape and a scratch shape for the
+       results */
+    buffer = PyMem_Malloc(sizeof(size_t)*(ps->dimension_variable_count +
+                                          2*arg_count) +
+                          sizeof(size_t)*(arg_count + 1)*GUFT_MAXDIMS +
+                          sizeof(size_t)*ps->total_signature_dimensions*2);
+    if (buffer == NULL)
+        return PyErr_NoMemory();
+    resolved.dimension_sizes = buffer;
+    arg_ndim = buffer + ps->dimension_variable_count;
+    arg_shapes = (const size_t **)(arg_ndim + arg_count);
+    dim_storage = (size_t *)(arg_shapes + arg_count);
+    scratch = dim_storage + arg_count*GUFT_MAXDIMS +
+        ps->total_signature_dimensions;
+
+    for (size_t arg = 0; arg < arg_count; arg++) {
+        PyObject *shape = arg < (size_t)given ? PyTuple_GET_ITEM(args, arg)
+                                              : Py_None;
+        PyObject *seq;
+        size_t max_ndim = GUFT_MAXDIMS + ps->arg_dimension_count[arg];
+
+        arg_shapes[arg] = NULL;
+        arg_ndim[arg] = 0;
+        if (shape == Py_None)
+            continue;
+
+        seq = PySequence_Fast(shape, "shapes must be sequences of ints");
+        if (seq == NULL)
+            goto done;
+        if ((size_t)PySequence_Fast_GET_SIZE(seq) > max_ndim) {
+            Py_DECREF(seq);
+            PyErr_Format(PyExc_ValueError,
+                         "too many dimensions in argument %zu", arg);
+            goto done;
+        }
+        arg_ndim[arg] = PySequence_Fast_GET_SIZE(seq);
+        for (size_t d = 0; d < arg_ndim[arg]; d++) {
+            dim_storage[d] = PyLong_AsSize_t(PySequence_Fast_GET_ITEM(seq, d));
+            if (dim_storage[d] == (size_t)-1 && PyErr_Occurred()) {
+                Py_DECREF(seq);
+                goto done;
+            }
+        }
+        Py_DECREF(seq);
+        arg_shapes[arg] = dim_storage;
+        dim_storage += arg_ndim[arg];
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = resolve_shapes(ps, arg_ndim, arg_shapes, &resolved, &error);
+    Py_END_ALLOW_THREADS
+    if (status != 0) {
+        PyErr_Format(PyExc_ValueError, "%s (argument %zu, axis %zu)",
+                     error.message, error.arg, error.axis);
+        goto done;
+    }
+
+    all_shapes = PyTuple_New(arg_count);
+    if (all_shapes == NULL)
+        goto done;
+    for (size_t arg = 0; arg < arg_count; arg++) {
+        size_t ndim = resolved_arg_shape(ps, &resolved, arg, scratch);
+        PyObject *item = box_zu_tuple(scratch, ndim);
+        if (item == NULL)
+            goto done;
+        PyTuple_SET_ITEM(all_shapes, arg, item);
+    }
+
+    rv = Py_BuildValue("(NNO)",
+                       box_zu_tuple(resolved.outer_shape, resolved.outer_ndim),
+                       box_zu_tuple(resolved.dimension_sizes,
+                                    ps->dimension_variable_count),
+                       all_shapes);
+
+ done:
+    Py_XDECREF(all_shapes);
+    PyMem_Free(buffer);
+    return rv;
+}
+
+/* -----------------------------------------------------------------------------
+ * Serialized signatures
+ *
+ * Signatures convert to and from the relocatable records of signature.h
+ * with no parsing: Signature.to_bytes and Signature.from_bytes, that are
+ * also what pickling uses. pack_signatures and load_signatures do the same
+ * for a whole table of signatures, and load_signatures uses the records in
+ * place, so that a table in a mmap'd file is loaded without copying it.
+ *
+ * Records carrying a signature string go into the interning table, so
+ * later uses of the string do not parse it either. This also means that a
+ * loaded table stays alive (and its buffer exported) for the rest of the
+ * process.
+ */
+
+/* return a new reference to the Signature for the record attached in
+   header: the interned one if the string of the record was seen before,
+   a new one otherwise. owner is the object keeping the record alive to use
+   it in place, or NULL to copy it */
+static guft_SignatureObject *
+intern_record(guft_module_state *state,
+              const serialized_signature *record,
+              parsed_signature *header,
+              PyObject *owner)
+{
+    PyObject *text = NULL;
+    guft_SignatureObject *rv = NULL;
+
+    if (record->text_length > 0) {
+        text = PyUnicode_DecodeUTF8((const char *)record + record->text,
+                                    (Py_ssize_t)record->text_length, NULL);
+        if (text == NULL)
+            return NULL;
+
+        rv = cache_lookup(state, text);
+        if (rv != NULL) {
+            if (!parsed_signature_equal(rv->the_signature, header)) {
+                PyErr_Format(PyExc_ValueError,
+                             "record for '%U' does not match the interned "
+                             "signature", text);
+                Py_CLEAR(rv);
+            }
+            goto done;
+        } else if (PyErr_Occurred()) {
+            goto done;
+        }
+    }
+
+    if (owner == NULL) {
+        parsed_signature *ps = duplicate_parsed_signature(header);
+        if (ps == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        rv = create_signature_object(state->SignatureType, ps, text);
+    } else {
+        rv = (guft_SignatureObject *)
+            state->SignatureType->tp_alloc(state->SignatureType, 0);
+        if (rv != NULL) {
+            rv->the_signature = header;
+            Py_INCREF(owner);
+            rv->owner = owner;
+            Py_XINCREF(text);
+            rv->text = text;
+            rv->hash = -1;
+        }
+    }
+
+    if (rv != NULL && text != NULL)
+        rv = cache_insert(state, text, rv);
+
+ done:
+    Py_XDECREF(text);
+    return rv;
+}
+
+/* Signature.to_bytes(): the record of the signature */
+static PyObject *
+Signature_to_bytes(guft_SignatureObject *self)
+{
+    const char *text = NULL;
+    Py_ssize_t text_length = 0;
+    size_t size;
+    void *buffer;
+    PyObject *rv;
+
+    if (self->text != NULL) {
+        text = PyUnicode_AsUTF8AndSize(self->text, &text_length);
+        if (text == NULL)
+            return NULL;
+    }
+
+    /* PyMem blocks are aligned for a size_t, bytes objects need not be */
+    size = serialized_signature_size(self->the_signature,
+                                     (size_t)text_length);
+    buffer = PyMem_Malloc(size);
+    if (buffer == NULL)
+        return PyErr_NoMemory();
+
+    serialize_parsed_signature(self->the_signature, text,
+                               (size_t)text_length, buffer);
+    rv = PyBytes_FromStringAndSize(buffer, (Py_ssize_t)size);
+    PyMem_Free(buffer);
+    return rv;
+}
+
+/* Signature.from_bytes(data): the Signature for a record, from any object
+   supporting the buffer protocol */
+static PyObject *
+Signature_from_bytes(PyTypeObject *type, PyObject *data)
+{
+    guft_module_state *state = get_state_by_type(type);
+    Py_buffer view;
+    void *copy = NULL;
+    const void *record;
+    parsed_signature header;
+    const char *error = NULL;
+    guft_SignatureObject *rv = NULL;
+
+    if (state == NULL || PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0)
+        return NULL;
+
+    record = view.buf;
+    if ((uintptr_t)record % sizeof(size_t) != 0) {
+        copy = PyMem_Malloc(view.len);
+        if (copy == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        memcpy(copy, view.buf, view.len);
+        record = copy;
+    }
+
+    if (attach_serialized_signature(record, (size_t)view.len, &header,
+                                    &error) < 0) {
+        PyErr_Format(PyExc_ValueError, "invalid signature record: %s", error);
+        goto done;
+    }
+    rv = intern_record(state, record, &header, NULL);
+
+ done:
+    PyMem_Free(copy);
+    PyBuffer_Release(&view);
+    if (rv == NULL || type == state->SignatureType)
+        return (PyObject *)rv;
+    return share_signature_object(type, rv);
+}
+
+/* pickled as its record, so unpickling does not parse */
+static PyObject *
+Signature_reduce(guft_SignatureObject *self)
+{
+    PyObject *from_bytes, *record;
+
+    from_bytes = PyObject_GetAttrString((PyObject *)Py_TYPE(self),
+                                        "from_bytes");
+    if (from_bytes == NULL)
+        return NULL;
+
+    record = Signature_to_bytes(self);
+    if (record == NULL) {
+        Py_DECREF(from_bytes);
+        return NULL;
+    }
+
+    return Py_BuildValue("(N(N))", from_bytes, record);
 }
 
 #if SIZEOF_UINTPTR_T == SIZEOF_LONG
@@ -160,135 +995,731 @@ static PyMethodDef guft_SignatureObject_methods[] = {
     {"boxed", (PyCFunction)Signature_boxed, METH_NOARGS,
      "Returns signature data boxed in python tuples"
     },
+    {"resolve", (PyCFunction)Signature_resolve, METH_VARARGS,
+     "Resolves the outer shape, dimension sizes and argument shapes for "
+     "a call with the given argument shapes"
+    },
+    {"to_bytes", (PyCFunction)Signature_to_bytes, METH_NOARGS,
+     "Returns the relocatable binary record of the signature"
+    },
+    {"from_bytes", (PyCFunction)Signature_from_bytes, METH_O | METH_CLASS,
+     "Returns the signature for a record made by to_bytes, without parsing"
+    },
+    {"__reduce__", (PyCFunction)Signature_reduce, METH_NOARGS, NULL},
     {NULL} /* Sentinel */
 };
 
+static PyType_Slot guft_Signature_slots[] = {
+    {Py_tp_dealloc, (void *)Signature_dealloc},
+    {Py_tp_traverse, (void *)Signature_traverse},
+    {Py_tp_hash, (void *)Signature_hash},
+    {Py_tp_richcompare, (void *)Signature_richcompare},
+    {Py_tp_methods, guft_SignatureObject_methods},
+    {Py_tp_members, guft_SignatureObject_members},
+    {Py_tp_getset, guft_SignatureObject_getset},
+    {Py_tp_new, (void *)Signature_new},
+    {Py_tp_doc, (void *)"Dimension signature objects"},
+    {0, NULL}
+};
 
-static PyTypeObject guft_SignatureType = {
-    PyVarObject_HEAD_INIT(NULL,0)
-    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".Signature", /* tp_name */
-    sizeof(guft_SignatureObject),                         /* tp_basicsize */
-    0,                                                    /* tp_itemsize */
-    (destructor)Signature_dealloc,                        /* tp_dealloc */
-    0,                                                    /* tp_print */
-    0,                                                    /* tp_getattr */
-    0,                                                    /* tp_setattr */
-    0,                                                    /* tp_reserved */
-    0,                                                    /* tp_repr */
-    0,                                                    /* tp_as_number */
-    0,                                                    /* tp_as_sequence */
-    0,                                                    /* tp_as_mapping */
-    0,                                                    /* tp_hash */
-    0,                                                    /* tp_call */
-    0,                                                    /* tp_str */
-    0,                                                    /* tp_getattro */
-    0,                                                    /* tp_setattro */
-    0,                                                    /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,             /* tp_flags */
-    "Dimension signature objects",                        /* tp_doc */
-    0,                                                    /* tp_traverse */
-    0,                                                    /* tp_clear */
-    0,                                                    /* tp_richcompare */
-    0,                                                    /* tp_weaklistoffset */
-    0,                                                    /* tp_iter */
-    0,                                                    /* tp_iternext */
-    guft_SignatureObject_methods,                         /* tp_methods */
-    guft_SignatureObject_members,                         /* tp_members */
-    0,                                                    /* tp_getset */
-    0,                                                    /* tp_base */
-    0,                                                    /* tp_dict */
-    0,                                                    /* tp_descr_get */
-    0,                                                    /* tp_descr_set */
-    0,                                                    /* tp_dictoffset */
-    (initproc)Signature_init,                             /* tp_init */
-    0,                                                    /* tp_alloc */
-    Signature_new,                                        /* tp_new */
+/* the module sets Signature_vectorcall on the type it creates */
+PyType_Spec guft_Signature_spec = {
+    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".Signature", /* name */
+    sizeof(guft_SignatureObject),                         /* basicsize */
+    0,                                                    /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* flags */
+    guft_Signature_slots,                                 /* slots */
 };
 
 
 /* return the data from the signature boxed in some Python structure.
 */
 static PyObject *
-legacy_parse_signature(PyObject *UNUSED_VAR(self),
-                       PyObject *args,
-                       PyObject *UNUSED_VAR(kwargs))
+legacy_parse(guft_module_state *state, const char *signature, long int nin,
+             long int nargs)
 {
+    signature_parse_error error = { NULL, 0 };
     parsed_signature *ps;
-    long int nin, nargs;
-    char *signature;
-    if (!PyArg_ParseTuple(args, "sll", &signature, &nin, &nargs))
+    PyObject *rv;
+
+    Py_BEGIN_ALLOW_THREADS
+    ps = legacy_numpy_parse_signature(signature, nin, nargs, &error);
+    Py_END_ALLOW_THREADS
+
+    if (ps == NULL) {
+        raise_signature_error(state, signature, &error);
         return NULL;
+    }
+    rv = box_signature(ps);
+    release_parsed_signature(ps);
+    return rv;
+}
 
-    ps = legacy_numpy_parse_signature(signature, nin, nargs);
+/* legacy_parse_signature(signature, nin, nargs), without an argument
+   tuple */
+static PyObject *
+legacy_parse_signature(PyObject *self,
+                       PyObject *const *args,
+                       Py_ssize_t nargs)
+{
+    const char *signature;
+    Py_ssize_t length;
+    long int nin, arg_count;
 
-    if (ps) {
-        return box_signature(ps);
-    } else {
-        return PyErr_Format(PyExc_RuntimeError, "Parse error on signature '%s'", signature);
+    if (nargs != 3) {
+        PyErr_Format(PyExc_TypeError,
+                     "legacy_parse_signature() takes 3 arguments (%zd given)",
+                     nargs);
+        return NULL;
+    }
+    if (!PyUnicode_Check(args[0])) {
+        PyErr_Format(PyExc_TypeError,
+                     "legacy_parse_signature() argument 1 must be str, "
+                     "not %.100s", Py_TYPE(args[0])->tp_name);
+        return NULL;
+    }
+    signature = PyUnicode_AsUTF8AndSize(args[0], &length);
+    if (signature == NULL)
+        return NULL;
+    if (strlen(signature) != (size_t)length) {
+        PyErr_SetString(PyExc_ValueError, "embedded null character");
+        return NULL;
+    }
+    nin = PyLong_AsLong(args[1]);
+    if (nin == -1 && PyErr_Occurred())
+        return NULL;
+    arg_count = PyLong_AsLong(args[2]);
+    if (arg_count == -1 && PyErr_Occurred())
+        return NULL;
+    /* the parser takes them as int */
+    if (nin < 0 || nin > arg_count || arg_count > INT_MAX) {
+        PyErr_Format(PyExc_ValueError,
+                     "legacy_parse_signature() needs 0 <= nin <= nargs <= %d, "
+                     "got nin=%ld and nargs=%ld", INT_MAX, nin, arg_count);
+        return NULL;
     }
+
+    return legacy_parse(get_module_state(self), signature, nin, arg_count);
 }
 
+/* parse_signature goes through the interning table, so repeated calls with
+   the same signature do not parse it again, and return the same cached
+   boxed tuple */
 static PyObject *
-parse_signature(PyObject *UNUSED_VAR(self),
-                       PyObject *args,
-                       PyObject *UNUSED_VAR(kwargs))
+parse_signature(PyObject *self, PyObject *signature)
 {
-    parsed_signature *ps;
-    char *signature;
-    if (!PyArg_ParseTuple(args, "s", &signature))
+    guft_SignatureObject *interned;
+    PyObject *rv;
+
+    if (!PyUnicode_Check(signature)) {
+        PyErr_Format(PyExc_TypeError,
+                     "parse_signature() argument must be str, not %.100s",
+                     Py_TYPE(signature)->tp_name);
         return NULL;
+    }
 
-    ps = numpy_parse_signature(signature);
+    interned = intern_signature(get_module_state(self), signature);
+    if (interned == NULL)
+        return NULL;
 
-    if (ps) {
-        return box_signature(ps);
-    } else {
-        return PyErr_Format(PyExc_RuntimeError, "Parse error on signature '%s'", signature);
+    rv = signature_boxed(interned);
+    Py_DECREF(interned);
+    return rv;
+}
+
+/* pack_signatures(signatures): a table with the records of a sequence of
+   Signatures or signature strings, to be loaded by load_signatures */
+static PyObject *
+pack_signatures(PyObject *self, PyObject *arg)
+{
+    guft_module_state *state = get_module_state(self);
+    PyObject *seq, *rv = NULL;
+    Py_ssize_t count;
+    guft_SignatureObject **objects = NULL;
+    const parsed_signature **signatures = NULL;
+    const char **texts = NULL;
+    size_t *text_lengths = NULL;
+    void *buffer = NULL;
+    size_t size;
+
+    seq = PySequence_Fast(arg, "expected a sequence of signatures");
+    if (seq == NULL)
+        return NULL;
+
+    count = PySequence_Fast_GET_SIZE(seq);
+    objects = PyMem_Calloc(count + 1, sizeof(*objects));
+    signatures = PyMem_Calloc(count + 1, sizeof(*signatures));
+    texts = PyMem_Calloc(count + 1, sizeof(*texts));
+    text_lengths = PyMem_Calloc(count + 1, sizeof(*text_lengths));
+    if (objects == NULL || signatures == NULL || texts == NULL ||
+        text_lengths == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (Py_ssize_t i = 0; i < count; i++) {
+        guft_SignatureObject *signature =
+            signature_from_object(state, PySequence_Fast_GET_ITEM(seq, i));
+        if (signature == NULL)
+            goto done;
+        objects[i] = signature;
+        signatures[i] = signature->the_signature;
+        if (signature->text != NULL) {
+            Py_ssize_t len;
+            texts[i] = PyUnicode_AsUTF8AndSize(signature->text, &len);
+            if (texts[i] == NULL)
+                goto done;
+            text_lengths[i] = (size_t)len;
+        }
+    }
+
+    size = signature_table_size(signatures, text_lengths, (size_t)count);
+    buffer = PyMem_Malloc(size);
+    if (buffer == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    write_signature_table(signatures, texts, text_lengths, (size_t)count,
+                          buffer);
+    rv = PyBytes_FromStringAndSize(buffer, (Py_ssize_t)size);
+
+ done:
+    if (objects != NULL) {
+        for (Py_ssize_t i = 0; i < count; i++)
+            Py_XDECREF(objects[i]);
+    }
+    PyMem_Free(buffer);
+    PyMem_Free(text_lengths);
+    PyMem_Free(texts);
+    PyMem_Free(signatures);
+    PyMem_Free(objects);
+    Py_DECREF(seq);
+    return rv;
+}
+
+/* a table loaded by load_signatures, kept alive by the Signatures using
+   its records */
+typedef struct {
+    Py_buffer view; /* released right away if the table had to be copied */
+    void *copy; /* aligned copy of the table, if the buffer was not */
+    char *headers; /* a parsed_signature for every record */
+} loaded_table;
+
+#define LOADED_TABLE_CAPSULE_NAME "gufunctools.signature_table"
+
+static void
+release_loaded_table(PyObject *capsule)
+{
+    loaded_table *table = PyCapsule_GetPointer(capsule,
+                                               LOADED_TABLE_CAPSULE_NAME);
+    PyBuffer_Release(&table->view);
+    PyMem_Free(table->copy);
+    PyMem_Free(table->headers);
+    PyMem_Free(table);
+}
+
+/* load_signatures(table): tuple with the Signatures in a table made by
+   pack_signatures, from any object supporting the buffer protocol. The
+   records are used in place, with no parsing */
+static PyObject *
+load_signatures(PyObject *self, PyObject *arg)
+{
+    loaded_table *table;
+    PyObject *capsule, *rv = NULL;
+    const void *data;
+    size_t size, count;
+    const char *error = NULL;
+
+    table = PyMem_Calloc(1, sizeof(loaded_table));
+    if (table == NULL)
+        return PyErr_NoMemory();
+    capsule = PyCapsule_New(table, LOADED_TABLE_CAPSULE_NAME,
+                            release_loaded_table);
+    if (capsule == NULL) {
+        PyMem_Free(table);
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(arg, &table->view, PyBUF_SIMPLE) < 0)
+        goto done;
+    data = table->view.buf;
+    size = (size_t)table->view.len;
+    if ((uintptr_t)data % sizeof(size_t) != 0) {
+        table->copy = PyMem_Malloc(size);
+        if (table->copy == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        memcpy(table->copy, data, size);
+        data = table->copy;
+        PyBuffer_Release(&table->view);
+    }
+
+    if (check_signature_table(data, size, &count, &error) < 0) {
+        PyErr_Format(PyExc_ValueError, "invalid signature table: %s", error);
+        goto done;
+    }
+
+    table->headers = PyMem_Malloc(sizeof(parsed_signature)*(count + 1));
+    if (table->headers == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    rv = PyTuple_New((Py_ssize_t)count);
+    for (size_t i = 0; rv != NULL && i < count; i++) {
+        const serialized_signature *record = signature_table_entry(data, i);
+        parsed_signature *header = (parsed_signature *)
+            (table->headers + i*sizeof(parsed_signature));
+        guft_SignatureObject *item;
+
+        /* already checked, can not fail */
+        attach_serialized_signature(record, record->record_size, header,
+                                    NULL);
+        item = intern_record(get_module_state(self), record, header,
+                             capsule);
+        if (item == NULL)
+            Py_CLEAR(rv);
+        else
+            PyTuple_SET_ITEM(rv, (Py_ssize_t)i, (PyObject *)item);
+    }
+
+ done:
+    Py_DECREF(capsule);
+    return rv;
+}
+
+/* -----------------------------------------------------------------------------
+ * Partial success
+ *
+ * When a kernel reports failures for some elements, the call raises
+ * PartialSuccessError instead of discarding everything. The exception
+ * carries:
+ *
+ *   - mask: bytes with a bit per outer element in C order, least
+ *     significant bit first, set for the elements that failed (so
+ *     numpy.unpackbits(mask, bitorder='little') gives one flag per element).
+ *   - failures: number of failed elements.
+ *   - element_count: number of outer elements.
+ *   - outputs: the outputs, valid for every element not in the mask.
+ *
+ * It derives from RuntimeError, while calls that can not run at all raise
+ * other exceptions, so both cases can be told apart.
+ */
+
+PyObject *
+raise_partial_success(guft_module_state *state,
+                      const execution_status *status, size_t element_count,
+                      PyObject *outputs)
+{
+    PyObject *exc, *mask;
+
+    mask = PyBytes_FromStringAndSize((const char *)status->mask,
+                                     (Py_ssize_t)((element_count + 7)/8));
+    if (mask == NULL)
+        return NULL;
+
+    exc = PyObject_CallFunction(state->PartialSuccessError, "s",
+                                "some elements failed");
+    if (exc == NULL ||
+        PyObject_SetAttrString(exc, "mask", mask) < 0 ||
+        PyObject_SetAttrString(exc, "outputs", outputs) < 0 ||
+        set_size_attribute(exc, "failures", status->failures) < 0 ||
+        set_size_attribute(exc, "element_count", element_count) < 0) {
+        Py_XDECREF(exc);
+        Py_DECREF(mask);
+        return NULL;
+    }
+    Py_DECREF(mask);
+
+    PyErr_SetObject(state->PartialSuccessError, exc);
+    Py_DECREF(exc);
+    return NULL;
+}
+
+/* failed_indices(mask, element_count): list of the indices of the elements
+   set in a status mask. Skips clear bytes, so it is cheap when failures are
+   few */
+static PyObject *
+failed_indices(PyObject *UNUSED_VAR(self), PyObject *args)
+{
+    Py_buffer mask;
+    Py_ssize_t element_count;
+    PyObject *rv;
+    const unsigned char *bytes;
+
+    if (!PyArg_ParseTuple(args, "y*n", &mask, &element_count))
+        return NULL;
+
+    if (element_count < 0 || (mask.len*8 < element_count)) {
+        PyBuffer_Release(&mask);
+        PyErr_SetString(PyExc_ValueError, "mask too short for element_count");
+        return NULL;
+    }
+
+    rv = PyList_New(0);
+    bytes = mask.buf;
+    for (Py_ssize_t i = 0; rv != NULL && i < (element_count + 7)/8; i++) {
+        if (bytes[i] == 0)
+            continue;
+        for (int bit = 0; bit < 8; bit++) {
+            Py_ssize_t element = i*8 + bit;
+            PyObject *index;
+            if (!(bytes[i] & (1u << bit)) || element >= element_count)
+                continue;
+            index = PyLong_FromSsize_t(element);
+            if (index == NULL || PyList_Append(rv, index) < 0)
+                Py_CLEAR(rv);
+            Py_XDECREF(index);
+            if (rv == NULL)
+                break;
+        }
     }
+
+    PyBuffer_Release(&mask);
+    return rv;
+}
+
+/* -----------------------------------------------------------------------------
+ * Executor options
+ */
+
+/* minimum number of outer elements per chunk in parallel execution */
+size_t executor_min_chunk = GUFT_DEFAULT_MIN_CHUNK;
+
+/* size in bytes of the buffers in buffered execution, 0 disables it */
+size_t executor_buffer_size = GUFT_DEFAULT_BUFFER_SIZE;
+
+/* size in bytes of the tiles of outer loops the operands walk in different
+   orders, 0 disables tiling */
+size_t executor_tile_size = GUFT_DEFAULT_TILE_SIZE;
+
+static PyObject *
+get_executor_options(PyObject *UNUSED_VAR(self),
+                     PyObject *UNUSED_VAR(args))
+{
+    return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+                         "thread_count",
+                         (Py_ssize_t)threadpool_get_thread_count(),
+                         "min_chunk",
+                         (Py_ssize_t)GUFT_ATOMIC_LOAD(executor_min_chunk),
+                         "buffer_size",
+                         (Py_ssize_t)GUFT_ATOMIC_LOAD(executor_buffer_size),
+                         "tile_size",
+                         (Py_ssize_t)GUFT_ATOMIC_LOAD(executor_tile_size));
+}
+
+/* set_executor_options(thread_count=None, min_chunk=None, buffer_size=None,
+                        tile_size=None)
+
+   thread_count is the number of threads used by parallel execution,
+   including the calling one. 0 means one per online CPU. min_chunk is the
+   minimum number of outer elements a thread processes at a time.
+   buffer_size is the size in bytes of the buffers used for misaligned,
+   byte swapped or non contiguous operands. 0 disables buffering, but
+   byte swapped operands still go through buffers of the default size.
+   tile_size is the size in bytes of the tiles used when operands walk the
+   outer dimensions in different orders. 0 disables tiling.
+   Returns the previous options. */
+static PyObject *
+set_executor_options(PyObject *UNUSED_VAR(self),
+                     PyObject *args,
+                     PyObject *kwargs)
+{
+    PyObject *thread_count = Py_None, *min_chunk = Py_None;
+    PyObject *buffer_size = Py_None, *tile_size = Py_None;
+    PyObject *previous;
+    size_t new_thread_count = 0, new_min_chunk = 0, new_buffer_size = 0;
+    size_t new_tile_size = 0;
+
+    static char *kwlist[] = { "thread_count", "min_chunk", "buffer_size",
+                              "tile_size", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO", kwlist,
+                                     &thread_count, &min_chunk,
+                                     &buffer_size, &tile_size))
+        return NULL;
+
+    if (thread_count != Py_None) {
+        new_thread_count = PyLong_AsSize_t(thread_count);
+        if (new_thread_count == (size_t)-1 && PyErr_Occurred())
+            return NULL;
+    }
+    if (min_chunk != Py_None) {
+        new_min_chunk = PyLong_AsSize_t(min_chunk);
+        if (new_min_chunk == (size_t)-1 && PyErr_Occurred())
+            return NULL;
+        if (new_min_chunk == 0) {
+            PyErr_SetString(PyExc_ValueError, "min_chunk must be positive");
+            return NULL;
+        }
+    }
+    if (buffer_size != Py_None) {
+        new_buffer_size = PyLong_AsSize_t(buffer_size);
+        if (new_buffer_size == (size_t)-1 && PyErr_Occurred())
+            return NULL;
+    }
+    if (tile_size != Py_None) {
+        new_tile_size = PyLong_AsSize_t(tile_size);
+        if (new_tile_size == (size_t)-1 && PyErr_Occurred())
+            return NULL;
+    }
+
+    previous = get_executor_options(NULL, NULL);
+    if (previous == NULL)
+        return NULL;
+
+    if (thread_count != Py_None) {
+        /* stopping the workers may wait for a running loop */
+        Py_BEGIN_ALLOW_THREADS
+        threadpool_set_thread_count(new_thread_count);
+        Py_END_ALLOW_THREADS
+    }
+    if (min_chunk != Py_None)
+        GUFT_ATOMIC_STORE(executor_min_chunk, new_min_chunk);
+    if (buffer_size != Py_None)
+        GUFT_ATOMIC_STORE(executor_buffer_size, new_buffer_size);
+    if (tile_size != Py_None)
+        GUFT_ATOMIC_STORE(executor_tile_size, new_tile_size);
+
+    return previous;
 }
 
 /* The method table */
 static struct PyMethodDef methods[] = {
     { "legacy_parse_signature",
       (PyCFunction)legacy_parse_signature,
-      METH_VARARGS, NULL },
+      METH_FASTCALL, NULL },
     { "parse_signature",
       (PyCFunction)parse_signature,
+      METH_O, NULL },
+    { "pack_signatures",
+      (PyCFunction)pack_signatures,
+      METH_O, NULL },
+    { "load_signatures",
+      (PyCFunction)load_signatures,
+      METH_O, NULL },
+    { "get_executor_options",
+      (PyCFunction)get_executor_options,
+      METH_NOARGS, NULL },
+    { "set_executor_options",
+      (PyCFunction)set_executor_options,
+      METH_VARARGS | METH_KEYWORDS, NULL },
+    { "failed_indices",
+      (PyCFunction)failed_indices,
+      METH_VARARGS, NULL },
+    { "set_stats_enabled",
+      (PyCFunction)set_stats_enabled,
+      METH_VARARGS, NULL },
+    { "get_stats",
+      (PyCFunction)get_stats,
+      METH_NOARGS, NULL },
+    { "reset_stats",
+      (PyCFunction)reset_stats,
+      METH_NOARGS, NULL },
+    { "set_tuning_enabled",
+      (PyCFunction)set_tuning_enabled,
+      METH_VARARGS | METH_KEYWORDS, NULL },
+    { "get_tuning",
+      (PyCFunction)get_tuning,
+      METH_NOARGS, NULL },
+    { "reset_tuning",
+      (PyCFunction)reset_tuning,
+      METH_NOARGS, NULL },
+    { "load_tuning",
+      (PyCFunction)load_tuning,
+      METH_VARARGS, NULL },
+    { "save_tuning",
+      (PyCFunction)save_tuning,
+      METH_VARARGS, NULL },
+    { "tune",
+      (PyCFunction)tune,
       METH_VARARGS, NULL },
+    { "wait_for_futures",
+      (PyCFunction)wait_for_futures,
+      METH_NOARGS, NULL },
     { NULL, NULL, 0, NULL }   /* sentinel */
 };
 
-#if defined(PYTHON3)
+static int
+module_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    guft_module_state *state = get_module_state(module);
+
+    Py_VISIT(state->SignatureType);
+    Py_VISIT(state->SignatureArrayType);
+    Py_VISIT(state->KernelRegistryType);
+    Py_VISIT(state->FutureType);
+    Py_VISIT(state->LazyType);
+    Py_VISIT(state->BufferType);
+    Py_VISIT(state->ProcessPoolType);
+    Py_VISIT(state->PartialSuccessError);
+    Py_VISIT(state->SignatureError);
+    Py_VISIT(state->signature_cache);
+    return 0;
+}
+
+static int
+module_clear(PyObject *module)
+{
+    guft_module_state *state = get_module_state(module);
+
+    Py_CLEAR(state->SignatureType);
+    Py_CLEAR(state->SignatureArrayType);
+    Py_CLEAR(state->KernelRegistryType);
+    Py_CLEAR(state->FutureType);
+    Py_CLEAR(state->LazyType);
+    Py_CLEAR(state->BufferType);
+    Py_CLEAR(state->ProcessPoolType);
+    Py_CLEAR(state->PartialSuccessError);
+    Py_CLEAR(state->SignatureError);
+    Py_CLEAR(state->signature_cache);
+    return 0;
+}
+
+static void
+module_free(void *module)
+{
+    module_clear((PyObject *)module);
+}
+
+/* a heap type for spec, created with module and added to it unless
+   internal. NULL with an exception set on failure */
+static PyTypeObject *
+add_type(PyObject *module, PyType_Spec *spec, int internal)
+{
+    PyTypeObject *type;
+
+    type = (PyTypeObject *)PyType_FromModuleAndSpec(module, spec, NULL);
+    if (type == NULL)
+        return NULL;
+#if PY_VERSION_HEX < 0x030A0000
+    if (spec->flags & GUFT_TPFLAGS_NO_NEW)
+        type->tp_new = NULL;
+#endif
+    if (!internal && PyModule_AddType(module, type) < 0) {
+        Py_DECREF(type);
+        return NULL;
+    }
+    return type;
+}
+
+/* an exception class, added to module */
+static PyObject *
+add_exception(PyObject *module, const char *name, const char *doc,
+              PyObject *base)
+{
+    PyObject *exc;
+
+    exc = PyErr_NewExceptionWithDoc(name, doc, base, NULL);
+    if (exc == NULL)
+        return NULL;
+    Py_INCREF(exc);
+    if (PyModule_AddObject(module, strrchr(name, '.') + 1, exc) < 0) {
+        Py_DECREF(exc);
+        Py_DECREF(exc);
+        return NULL;
+    }
+    return exc;
+}
+
+static int
+module_exec(PyObject *module)
+{
+    guft_module_state *state = get_module_state(module);
+    PyObject *bases, *atexit, *wait, *rv = NULL;
+
+    state->signature_cache = PyDict_New();
+    if (state->signature_cache == NULL)
+        return -1;
+
+    state->SignatureType = add_type(module, &guft_Signature_spec, 0);
+    if (state->SignatureType == NULL)
+        return -1;
+    state->SignatureType->tp_vectorcall = Signature_vectorcall;
+
+    state->SignatureArrayType = add_type(module, &guft_SignatureArray_spec,
+                                         1);
+    state->KernelRegistryType = add_type(module, &guft_KernelRegistry_spec,
+                                         0);
+    state->FutureType = add_type(module, &guft_Future_spec, 0);
+    state->LazyType = add_type(module, &guft_Lazy_spec, 0);
+    state->BufferType = add_type(module, &guft_Buffer_spec, 0);
+    if (state->SignatureArrayType == NULL ||
+        state->KernelRegistryType == NULL || state->FutureType == NULL ||
+        state->LazyType == NULL || state->BufferType == NULL)
+        return -1;
+#if defined(GUFT_HAVE_PROCPOOL)
+    state->ProcessPoolType = add_type(module, &guft_ProcessPool_spec, 0);
+    if (state->ProcessPoolType == NULL)
+        return -1;
+#endif
+
+    state->PartialSuccessError = add_exception(
+        module, THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".PartialSuccessError",
+        "Some elements of a gufunc call failed. See mask, failures, "
+        "element_count and outputs",
+        PyExc_RuntimeError);
+    if (state->PartialSuccessError == NULL)
+        return -1;
+
+    /* a ValueError, like the signature errors of NumPy, and a RuntimeError
+       as parse errors used to be */
+    bases = PyTuple_Pack(2, PyExc_ValueError, PyExc_RuntimeError);
+    if (bases == NULL)
+        return -1;
+    state->SignatureError = add_exception(
+        module, THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".SignatureError",
+        "A signature could not be parsed. See signature, position and reason",
+        bases);
+    Py_DECREF(bases);
+    if (state->SignatureError == NULL)
+        return -1;
+
+    /* background calls need the interpreter to finish */
+    atexit = PyImport_ImportModule("atexit");
+    wait = PyObject_GetAttrString(module, "wait_for_futures");
+    if (atexit != NULL && wait != NULL)
+        rv = PyObject_CallMethod(atexit, "register", "O", wait);
+    Py_XDECREF(atexit);
+    Py_XDECREF(wait);
+    if (rv == NULL)
+        return -1;
+    Py_DECREF(rv);
+
+    return 0;
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    { Py_mod_exec, (void *)module_exec },
+#if PY_VERSION_HEX >= 0x030C0000
+    /* the thread pool, the background threads and the stats are process
+       wide, and futures finish through PyGILState, that only knows the main
+       interpreter */
+    { Py_mod_multiple_interpreters,
+      Py_MOD_MULTIPLE_INTERPRETERS_NOT_SUPPORTED },
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    /* shared mutable objects are guarded by critical sections, and the C
+       core by its own locks */
+    { Py_mod_gil, Py_MOD_GIL_NOT_USED },
+#endif
+    { 0, NULL }
+};
+
 static struct PyModuleDef moduledef = {
     PyModuleDef_HEAD_INIT,
     STR(THIS_MODULE_NAME),
     NULL,
-    -1,
+    sizeof(guft_module_state),
     methods,
-    NULL,
-    NULL,
-    NULL,
-    NULL
+    module_slots,
+    module_traverse,
+    module_clear,
+    module_free
 };
-#endif 
 
 MOD_INIT(_nonpy_tools)
 {
-    PyObject *m = NULL;
-
-    guft_SignatureType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&guft_SignatureType) < 0)
-        MOD_RETURN(m);
-
-#if defined(PYTHON3)
-    m = PyModule_Create(&moduledef);
-#else
-    m = Py_InitModule(STR(THIS_MODULE_NAME), methods);
-#endif /* PYTHON3 */
-
-    Py_INCREF(&guft_SignatureType);
-
-    PyModule_AddObject(m, "Signature", (PyObject*) &guft_SignatureType);
-
-    MOD_RETURN(m);
+    return PyModuleDef_Init(&moduledef);
 }
@@ -0,0 +1,432 @@
+#ifndef GUFT_NONPYMODULE_H
+#define GUFT_NONPYMODULE_H
+/* Internal declarations shared by the source files of the _nonpy_tools
+   module. Assumes Python.h already included */
+
+#include "atomics.h"
+#include "signature.h"
+#include "dispatch.h"
+#include "executor.h"
+#include "overlap.h"
+#include "procpool.h"
+
+/* Use this macro to set up the module name. Do not use quotes.
+   This name will be used in various places like the init function
+   name as well as to generate the string to be placed in the Python
+   module
+*/
+
+#define THIS_MODULE_PATH "gufunctools"
+#define THIS_MODULE_NAME _nonpy_tools
+
+/* Some misc macros */
+#define _CONCAT(a,b) a ## b
+#define CONCAT(a,b) _CONCAT(a,b)
+#define _STR(a) # a
+#define STR(a) _STR(a)
+
+#if defined(__GNUC__)
+#  define UNUSED_VAR(x) CONCAT(UNUSED_, x) __attribute__((unused))
+#elif defined(__LCLINT__)
+#  define UNUSED_VAR(x) /*@unused@*/ CONCAT(UNUSED_, x)
+#elif defined(__cplusplus)
+#  define UNUSED_VAR(x)
+#else
+#  define UNUSED_VAR(x) CONCAT(UNUSED_, x)
+#endif 
+
+/* multi-phase initialization, heap types created with their module and
+   the vectorcall protocol need Python 3.9 */
+#if PY_VERSION_HEX < 0x03090000
+#   error "gufunctools._nonpy_tools needs Python 3.9 or later"
+#endif
+#define MOD_INIT(name) PyMODINIT_FUNC CONCAT(PyInit_, name)(void)
+
+/* heap types inherit tp_new from object unless told not to. Python 3.9
+   has no flag for it, so the module clears it after creating them */
+#if PY_VERSION_HEX >= 0x030A0000
+#   define GUFT_TPFLAGS_NO_NEW Py_TPFLAGS_DISALLOW_INSTANTIATION
+#else
+#   define GUFT_TPFLAGS_NO_NEW 0
+#endif
+
+/* Critical sections protect the mutable state of objects in free-threaded
+   builds, where several threads run Python code at once. With the GIL they
+   are just a block */
+#if defined(Py_GIL_DISABLED)
+#   define GUFT_BEGIN_CRITICAL_SECTION(op) Py_BEGIN_CRITICAL_SECTION(op)
+#   define GUFT_END_CRITICAL_SECTION() Py_END_CRITICAL_SECTION()
+#else
+#   define GUFT_BEGIN_CRITICAL_SECTION(op) {
+#   define GUFT_END_CRITICAL_SECTION() }
+#endif
+
+
+/* -----------------------------------------------------------------------------
+ * Module state (nonpymodule.c)
+ *
+ * Everything the module creates lives in its state, so every module object
+ * (a new one each time the module is imported from scratch) is independent,
+ * with its own types and interning table. Types are heap
+ * types created with the module: their methods find the state from the type
+ * of the object, module functions from the module itself.
+ */
+
+typedef struct {
+    PyTypeObject *SignatureType;
+    PyTypeObject *SignatureArrayType;
+    PyTypeObject *KernelRegistryType;
+    PyTypeObject *FutureType;
+    PyTypeObject *LazyType;
+    PyTypeObject *BufferType;
+    PyTypeObject *ProcessPoolType; /* NULL where there are no pools */
+    PyObject *PartialSuccessError;
+    PyObject *SignatureError;
+    /* interning table, see intern_signature */
+    PyObject *signature_cache;
+} guft_module_state;
+
+guft_module_state *
+get_module_state(PyObject *module);
+
+/* state of the module that created type, or a base of it. NULL with an
+   exception set if it is not one of ours */
+guft_module_state *
+get_state_by_type(PyTypeObject *type);
+
+/* -----------------------------------------------------------------------------
+ * Signature objects (nonpymodule.c)
+ */
+
+typedef struct {
+    PyObject_HEAD
+    parsed_signature *the_signature;
+    /* for instances that share the parsed signature of an interned
+       Signature, the interned object that owns it. NULL if this object is
+       the owner */
+    PyObject *owner;
+    /* the normalized signature string (no whitespace), NULL if not known */
+    PyObject *text;
+    Py_hash_t hash; /* cached, -1 if not computed yet */
+    PyObject *boxed; /* cached boxed() tuple, NULL if not built yet */
+} guft_SignatureObject;
+
+extern PyType_Spec guft_Signature_spec;
+
+/* exporter of the arrays of a Signature as read only buffers */
+extern PyType_Spec guft_SignatureArray_spec;
+
+/* return a new reference to the interned Signature for signature_str */
+guft_SignatureObject *
+intern_signature(guft_module_state *state, PyObject *signature_str);
+
+/* return a new reference to a Signature for obj, that can either be a
+   Signature or a signature string */
+guft_SignatureObject *
+signature_from_object(guft_module_state *state, PyObject *obj);
+
+
+/* -----------------------------------------------------------------------------
+ * Kernels and kernel registries (pydispatch.c)
+ */
+
+/* name of the capsules holding kernels. The capsule pointer is the kernel
+   function and its context the kernel data */
+#define GUFT_KERNEL_CAPSULE_NAME "gufunctools.kernel"
+
+/* same, for kernels that report per element status (see
+   GUFT_KERNEL_REPORTS_STATUS) */
+#define GUFT_STATUS_KERNEL_CAPSULE_NAME "gufunctools.status_kernel"
+
+typedef struct {
+    PyObject_HEAD
+    kernel_registry registry; /* entry owners are the kernel objects */
+    PyObject *signature;
+    PyObject *generator;
+    PyObject *name; /* str, for the stats */
+    size_t stats_site; /* 0 until first needed */
+} guft_KernelRegistryObject;
+
+extern PyType_Spec guft_KernelRegistry_spec;
+
+/* changes whenever a kernel is registered in any registry, so that worker
+   processes forked before (see pyprocpool.c) can be replaced */
+extern size_t kernel_generation;
+
+/* Get the kernel in a kernel object. Returns 0 on success, -1 with an
+   exception set */
+int
+kernel_from_object(PyObject *obj, guft_kernel *kernel);
+
+/* Find the kernel for types (one code per operand), calling the generator
+   on a miss. Returns NULL with an exception set if there is none */
+const kernel_registry_entry *
+registry_find_kernel(guft_KernelRegistryObject *self, const char *types);
+
+/* Same, for calls where only the input types are known. types has room
+   for all the operands, and the output types are filled in from the
+   kernel found: one with the inputs types, preferring outputs of the type
+   of the first input */
+const kernel_registry_entry *
+registry_find_kernel_for_inputs(guft_KernelRegistryObject *self, char *types);
+
+/* The kernel of entry for the dimension sizes of a call (see
+   kernel_registry_select). NULL with an exception set if there is none */
+const guft_kernel *
+registry_select_kernel(guft_KernelRegistryObject *self,
+                       const kernel_registry_entry *entry,
+                       const size_t *dimension_sizes);
+
+/* The stats sites of a registry (named after it) and of one of its
+   kernels (the name followed by the types in brackets). Registered on
+   first use, 0 if that is not possible */
+size_t
+registry_stats_site(guft_KernelRegistryObject *self);
+
+size_t
+registry_kernel_stats_site(guft_KernelRegistryObject *self,
+                           const kernel_registry_entry *entry);
+
+/* The kernel of a call: found with registry_find_kernel, or with
+   registry_find_kernel_for_inputs if outputs_known is 0, and selected for
+   its dimension sizes. Entries are only valid until the registry changes,
+   which other threads can do at any time in free-threaded builds, so the
+   kernel is copied out, with a new reference to the object it was
+   registered as in owner, that the caller must keep while the kernel runs
+   (a later register() may replace it), and with the stats site of its
+   entry when the stats are enabled or need_site is set (0 otherwise).
+   need_site also claims the site for tuning (see tuning_claim). Returns 0
+   on success, -1 with an exception set */
+int
+registry_get_kernel(guft_KernelRegistryObject *self, char *types,
+                    int outputs_known, const size_t *dimension_sizes,
+                    int need_site, guft_kernel *kernel, PyObject **owner,
+                    size_t *kernel_stats_site);
+
+
+/* -----------------------------------------------------------------------------
+ * Executor options (nonpymodule.c)
+ */
+
+extern size_t executor_min_chunk;
+extern size_t executor_buffer_size;
+extern size_t executor_tile_size;
+
+
+/* -----------------------------------------------------------------------------
+ * Prepared calls (pycall.c)
+ */
+
+/* operand dimensions: outer plus core */
+#define GUFT_CALL_MAXNDIM (2*GUFT_MAXDIMS)
+
+typedef struct {
+    guft_KernelRegistryObject *registry;
+    const parsed_signature *signature; /* the one of registry */
+    PyObject *operand_objects; /* tuple, inputs followed by outputs */
+    size_t nops;
+    size_t view_count; /* views held */
+    size_t min_chunk;
+    execution_plan *plan;
+    PyObject *kernel_owner; /* keeps the kernel of the plan alive */
+    execution_status status;
+    resolved_shapes resolved;
+    overlap_copies overlap; /* of inputs sharing memory with outputs */
+    int out_of_memory; /* for the overlap copies, set by run */
+    size_t buffered; /* operands buffered with the default buffer size */
+    /* autotuning (see tuner.h): the kernel and core size bucket of the
+       call, and the trial it runs as, 0 if it is not one */
+    size_t tuning_site;
+    size_t tuning_bucket;
+    size_t tuning_trial;
+
+    /* not cleared by prepare_call */
+    char types[GUFT_MAXARGS];
+    Py_buffer views[GUFT_MAXARGS];
+    execution_operand operands[GUFT_MAXARGS];
+    size_t dimension_sizes[GUFT_MAX_DIMENSION_VARIABLES];
+    size_t shapes[GUFT_MAXARGS][GUFT_CALL_MAXNDIM];
+    guft_intp strides[GUFT_MAXARGS][GUFT_CALL_MAXNDIM];
+} prepared_call;
+
+/* The strides of a buffer view, ndim of them. Some exporters (ctypes) leave
+   them out for C contiguous memory even when asked for them */
+void
+get_view_strides(const Py_buffer *view, guft_intp *strides);
+
+/* prepare_call flags */
+#define GUFT_CALL_IN_ORDER 0x1 /* the plan walks the elements in C order */
+#define GUFT_CALL_UNALLOCATED 0x2 /* outputs left out are not allocated but
+                                     laid out C contiguous with a NULL data
+                                     pointer, for the caller to place */
+#define GUFT_CALL_TUNE 0x4 /* run as a tuning trial if the kernel is not
+                              tuned, even with tuning disabled */
+
+/* Prepare a call to the gufunc of registry on operands, a tuple with all of
+   its inputs and outputs as buffer protocol objects. Outputs can be left
+   out (all of them) to have them allocated as Buffers. Returns 0 on
+   success, -1 with an exception set (and nothing to release) */
+int
+prepare_call(prepared_call *call, guft_KernelRegistryObject *registry,
+             PyObject *operands, unsigned int flags);
+
+/* Use the tuned execution parameters for the kernel of site (its stats
+   site) in a prepared call, or a candidate for them when the call is to
+   run as a trial, with learn set and the kernel not tuned yet. Done by
+   prepare_call when tuning is enabled */
+void
+tune_prepared_call(prepared_call *call, size_t site, int learn);
+
+/* Execute a prepared call. Does not need the GIL. Calls running as tuning
+   trials time themselves, and save the cache of tuned parameters when they
+   finish tuning their kernel */
+void
+run_prepared_call(prepared_call *call);
+
+/* The result of a call that ran: its output, or a tuple of them if there
+   are several. NULL with an exception set on failure */
+PyObject *
+finish_prepared_call(prepared_call *call);
+
+void
+release_prepared_call(prepared_call *call);
+
+/* KernelRegistry.__call__(*operands): prepares, runs without the GIL and
+   finishes a call */
+PyObject *
+registry_call(guft_KernelRegistryObject *self, PyObject *args,
+              PyObject *kwargs);
+
+
+/* -----------------------------------------------------------------------------
+ * Streamed calls (pystream.c)
+ */
+
+/* KernelRegistry.stream(*operands, sink=None, budget=None) */
+PyObject *
+registry_stream(guft_KernelRegistryObject *self, PyObject *args,
+                PyObject *kwargs);
+
+
+/* -----------------------------------------------------------------------------
+ * Reductions (pyreduce.c)
+ */
+
+/* KernelRegistry.reduce(operand, axes=0, identity=None, out=None,
+   associative=True, deterministic=False) */
+PyObject *
+registry_reduce(guft_KernelRegistryObject *self, PyObject *args,
+                PyObject *kwargs);
+
+
+/* -----------------------------------------------------------------------------
+ * Buffers (pybuffer.c)
+ */
+
+extern PyType_Spec guft_Buffer_spec;
+
+/* a new zero filled, C contiguous Buffer of a canonical type code. NULL
+   with an exception set on failure */
+PyObject *
+new_buffer(guft_module_state *state, char type, size_t ndim,
+           const size_t *shape);
+
+/* a Buffer for a struct format and a sequence of dimensions, in shared
+   memory if shared is set (only where there are process pools) */
+PyObject *
+buffer_from_format(guft_module_state *state, const char *format,
+                   PyObject *shape_obj, int shared);
+
+#if defined(GUFT_HAVE_PROCPOOL)
+/* same as new_buffer, in a shared memory segment (see procpool.h) */
+PyObject *
+new_shared_buffer(guft_module_state *state, char type, size_t ndim,
+                  const size_t *shape);
+#endif
+
+
+/* -----------------------------------------------------------------------------
+ * Futures (pyfuture.c)
+ */
+
+extern PyType_Spec guft_Future_spec;
+
+/* KernelRegistry.call_async(*operands) */
+PyObject *
+registry_call_async(guft_KernelRegistryObject *self, PyObject *args);
+
+/* wait_for_futures(): waits until no asynchronous call is running */
+PyObject *
+wait_for_futures(PyObject *self, PyObject *args);
+
+
+/* -----------------------------------------------------------------------------
+ * Lazy expressions (pylazy.c)
+ */
+
+extern PyType_Spec guft_Lazy_spec;
+
+/* KernelRegistry.lazy(*inputs) */
+PyObject *
+registry_lazy(guft_KernelRegistryObject *self, PyObject *args);
+
+
+/* -----------------------------------------------------------------------------
+ * Process pools (pyprocpool.c)
+ */
+
+#if defined(GUFT_HAVE_PROCPOOL)
+extern PyType_Spec guft_ProcessPool_spec;
+#endif
+
+
+/* -----------------------------------------------------------------------------
+ * Partial success (nonpymodule.c)
+ */
+
+/* Raise PartialSuccessError for an execution of element_count elements
+   where status reports some failures. outputs is the tuple of outputs,
+   complete but for the failed elements. Always returns NULL */
+PyObject *
+raise_partial_success(guft_module_state *state,
+                      const execution_status *status, size_t element_count,
+                      PyObject *outputs);
+
+
+/* -----------------------------------------------------------------------------
+ * Autotuning (pytuning.c)
+ */
+
+PyObject *
+set_tuning_enabled(PyObject *self, PyObject *args, PyObject *kwargs);
+
+PyObject *
+get_tuning(PyObject *self, PyObject *args);
+
+PyObject *
+reset_tuning(PyObject *self, PyObject *args);
+
+PyObject *
+load_tuning(PyObject *self, PyObject *args);
+
+PyObject *
+save_tuning(PyObject *self, PyObject *args);
+
+PyObject *
+tune(PyObject *self, PyObject *args);
+
+
+/* -----------------------------------------------------------------------------
+ * Runtime stats (pystats.c)
+ */
+
+PyObject *
+set_stats_enabled(PyObject *self, PyObject *args);
+
+PyObject *
+get_stats(PyObject *self, PyObject *args);
+
+PyObject *
+reset_stats(PyObject *self, PyObject *args);
+
+#endif /* GUFT_NONPYMODULE_H */
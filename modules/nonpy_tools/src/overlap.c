@@ -0,0 +1,451 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "overlap.h"
+#include "scratch.h"
+
+/* Overlap analysis works on extents: a base pointer plus the shape and the
+   strides of everything reachable from it. Two extents surely do not share
+   memory when their bounds are disjoint, which is what most calls get.
+   Deciding it exactly in general is an integer programming problem (NumPy
+   solves a bounded Diophantine equation), so here it is only done where it
+   is cheap: contiguous extents, whose bounds are exact, interleaved ones,
+   told apart by the gcd of their strides, and small extents, whose items
+   are just listed and compared. Anything else is taken as
+   overlapping, which costs a copy but is never wrong. */
+
+void
+memory_extent_bounds(const memory_extent *extent, uintptr_t *low,
+                     uintptr_t *high)
+{
+    uintptr_t l = (uintptr_t)extent->data;
+    uintptr_t h = l + extent->itemsize;
+
+    for (size_t d = 0; d < extent->ndim; d++) {
+        guft_intp span;
+        if (extent->shape[d] == 0) {
+            *low = *high = (uintptr_t)extent->data;
+            return;
+        }
+        span = (extent->shape[d] - 1)*extent->strides[d];
+        if (span < 0)
+            l -= (uintptr_t)-span;
+        else
+            h += (uintptr_t)span;
+    }
+    *low = l;
+    *high = h;
+}
+
+/* number of distinct positions of an extent, not counting the dimensions
+   that do not move */
+static size_t
+extent_items(const memory_extent *extent)
+{
+    size_t items = 1;
+
+    for (size_t d = 0; d < extent->ndim; d++) {
+        if (extent->strides[d] == 0)
+            continue;
+        if (items > SIZE_MAX/(size_t)extent->shape[d])
+            return SIZE_MAX;
+        items *= (size_t)extent->shape[d];
+    }
+    return items;
+}
+
+/* whether the items of an extent fill its bounds with no gaps, that is
+   whether its moving dimensions sorted by stride are contiguous */
+static int
+extent_is_contiguous(const memory_extent *extent)
+{
+    guft_intp expected = (guft_intp)extent->itemsize;
+    int done[GUFT_EXTENT_MAXDIMS] = { 0 };
+
+    for (;;) {
+        size_t next = extent->ndim;
+        for (size_t d = 0; d < extent->ndim; d++) {
+            guft_intp stride = extent->strides[d];
+            if (done[d] || extent->shape[d] == 1 || stride == 0)
+                continue;
+            if (stride == expected || -stride == expected) {
+                next = d;
+                break;
+            }
+        }
+        if (next == extent->ndim)
+            break;
+        done[next] = 1;
+        expected *= extent->shape[next];
+    }
+
+    /* every moving dimension has to be part of the chain */
+    for (size_t d = 0; d < extent->ndim; d++) {
+        if (!done[d] && extent->shape[d] != 1 && extent->strides[d] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+/* the offsets from low of the items of an extent, in no particular order */
+static void
+list_items(const memory_extent *extent, uintptr_t low, uintptr_t *offsets)
+{
+    guft_intp index[GUFT_EXTENT_MAXDIMS] = { 0 };
+    uintptr_t position = (uintptr_t)extent->data - low;
+    size_t ndim = 0;
+    size_t dims[GUFT_EXTENT_MAXDIMS];
+    size_t n = 0;
+
+    for (size_t d = 0; d < extent->ndim; d++) {
+        if (extent->strides[d] != 0 && extent->shape[d] != 1)
+            dims[ndim++] = d;
+    }
+
+    for (;;) {
+        size_t k;
+        offsets[n++] = position;
+        for (k = 0; k < ndim; k++) {
+            size_t d = dims[k];
+            position += (uintptr_t)extent->strides[d];
+            if (++index[d] < extent->shape[d])
+                break;
+            position -= (uintptr_t)(index[d]*extent->strides[d]);
+            index[d] = 0;
+        }
+        if (k == ndim)
+            break;
+    }
+}
+
+static uintptr_t
+gcd(uintptr_t a, uintptr_t b)
+{
+    while (b != 0) {
+        uintptr_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* The items of an extent start at its data plus multiples of the gcd of
+   its strides. With g the gcd of the strides of both extents, when their
+   items taken modulo g fall in disjoint ranges they can not share a byte.
+   This is exact for interleaved operands, like the fields of an array of
+   structures or the real and imaginary parts of complex numbers */
+static int
+residues_disjoint(const memory_extent *a, const memory_extent *b)
+{
+    const memory_extent *e[2] = { a, b };
+    uintptr_t g = 0, ra, rb;
+
+    for (size_t k = 0; k < 2; k++) {
+        for (size_t d = 0; d < e[k]->ndim; d++) {
+            guft_intp stride = e[k]->strides[d];
+            if (e[k]->shape[d] != 1 && stride != 0)
+                g = gcd(g, (uintptr_t)(stride < 0 ? -stride : stride));
+        }
+    }
+    if (g == 0 || a->itemsize + b->itemsize > g)
+        return 0;
+
+    ra = (uintptr_t)a->data % g;
+    rb = (uintptr_t)b->data % g;
+    return (rb - ra + g) % g >= a->itemsize &&
+        (ra - rb + g) % g >= b->itemsize;
+}
+
+static int
+compare_offsets(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* exact check, listing the items of both extents. -1 if out of memory */
+static int
+items_overlap(const memory_extent *a, size_t na, const memory_extent *b,
+              size_t nb, uintptr_t low)
+{
+    uintptr_t *oa = malloc((na + nb)*sizeof(uintptr_t));
+    uintptr_t *ob = oa + na;
+    size_t j = 0;
+    int overlap = 0;
+
+    if (oa == NULL)
+        return -1;
+    list_items(a, low, oa);
+    list_items(b, low, ob);
+    qsort(oa, na, sizeof(uintptr_t), compare_offsets);
+    qsort(ob, nb, sizeof(uintptr_t), compare_offsets);
+
+    /* for every item of a, the first item of b not ending before it
+       starts is the only candidate */
+    for (size_t i = 0; i < na && !overlap; i++) {
+        while (j < nb && ob[j] + b->itemsize <= oa[i])
+            j++;
+        if (j == nb)
+            break;
+        overlap = ob[j] < oa[i] + a->itemsize;
+    }
+
+    free(oa);
+    return overlap;
+}
+
+int
+memory_extents_overlap(const memory_extent *a, const memory_extent *b,
+                       size_t max_items)
+{
+    uintptr_t alow, ahigh, blow, bhigh;
+    size_t na, nb;
+
+    memory_extent_bounds(a, &alow, &ahigh);
+    memory_extent_bounds(b, &blow, &bhigh);
+    if (alow == ahigh || blow == bhigh || ahigh <= blow || bhigh <= alow)
+        return 0;
+
+    if (extent_is_contiguous(a) && extent_is_contiguous(b))
+        return 1;
+    if (residues_disjoint(a, b))
+        return 0;
+
+    na = extent_items(a);
+    nb = extent_items(b);
+    if (na <= max_items && nb <= max_items - na &&
+        items_overlap(a, na, b, nb, alow < blow ? alow : blow) == 0)
+        return 0;
+    return 1;
+}
+
+/* the extent of operand op over the whole plan: its outer dimensions
+   (broadcast ones with a 0 stride) followed by its core */
+static void
+plan_extent(const execution_plan *plan, size_t op, memory_extent *extent)
+{
+    const plan_operand *po = plan->operands + op;
+    size_t nops = plan->nops;
+    size_t ndim = 0;
+
+    extent->data = plan->args[op];
+    extent->itemsize = po->itemsize;
+    for (size_t d = 0; d < plan->outer_ndim; d++) {
+        extent->shape[ndim] = plan->outer_shape[d];
+        extent->strides[ndim++] = plan->outer_strides[d*nops + op];
+    }
+    for (size_t d = 0; d < po->core_ndim; d++) {
+        extent->shape[ndim] = plan->core_shape[po->core_offset + d];
+        extent->strides[ndim++] = plan->kernel_steps[nops + po->core_offset +
+                                                     d];
+    }
+    extent->ndim = ndim;
+}
+
+/* items in the core of an operand */
+static guft_intp
+core_items(const execution_plan *plan, size_t op)
+{
+    const plan_operand *po = plan->operands + op;
+    guft_intp items = 1;
+
+    for (size_t d = 0; d < po->core_ndim; d++)
+        items *= plan->core_shape[po->core_offset + d];
+    return items;
+}
+
+/* whether output out can be written in place over input in: every element
+   at the same place in both, with a core of a single item of the same
+   size, and no two elements of the output at the same place */
+static int
+runs_in_place(const execution_plan *plan, size_t in, size_t out)
+{
+    size_t nops = plan->nops;
+
+    if (plan->args[in] != plan->args[out] ||
+        plan->operands[in].itemsize != plan->operands[out].itemsize ||
+        core_items(plan, in) != 1 || core_items(plan, out) != 1)
+        return 0;
+
+    for (size_t d = 0; d < plan->outer_ndim; d++) {
+        guft_intp stride = plan->outer_strides[d*nops + out];
+        if (plan->outer_shape[d] == 1)
+            continue;
+        if (stride == 0 || stride != plan->outer_strides[d*nops + in])
+            return 0;
+    }
+    return 1;
+}
+
+size_t
+analyze_plan_overlap(const execution_plan *plan, overlap_copies *copies,
+                     size_t block_size)
+{
+    size_t nin = plan->nin;
+    size_t nops = plan->nops;
+    size_t dimension = plan->outer_ndim - 1;
+    size_t rows_total = (size_t)plan->outer_shape[dimension];
+    size_t row_bytes = 0;
+    memory_extent input, output;
+
+    memset(copies, 0, sizeof(*copies));
+    if (plan->element_count == 0)
+        return 0;
+
+    for (size_t in = 0; in < nin; in++) {
+        uint32_t outputs = 0;
+
+        plan_extent(plan, in, &input);
+        for (size_t out = nin; out < nops; out++) {
+            if (runs_in_place(plan, in, out))
+                continue;
+            plan_extent(plan, out, &output);
+            if (memory_extents_overlap(&input, &output,
+                                       GUFT_OVERLAP_EXACT_ITEMS))
+                outputs |= (uint32_t)1 << (out - nin);
+        }
+        if (outputs == 0)
+            continue;
+
+        copies->inputs[copies->input_count] = in;
+        copies->outputs[copies->input_count] = outputs;
+        copies->input_count++;
+        row_bytes += plan->element_count/rows_total*
+            plan->operands[in].element_size;
+    }
+    if (copies->input_count == 0)
+        return 0;
+
+    /* rows of the outermost dimension are a contiguous range of elements,
+       even in tiled plans if whole bands of tiles are taken */
+    copies->dimension = dimension;
+    copies->rows = row_bytes > 0 ? block_size/row_bytes : rows_total;
+    if (copies->rows == 0)
+        copies->rows = 1;
+    if (dimension == 1 && plan->tile[1] != 0)
+        copies->rows = (copies->rows + plan->tile[1] - 1)/plan->tile[1]*
+            plan->tile[1];
+    if (copies->rows > rows_total)
+        copies->rows = rows_total;
+    copies->block = plan->element_count/rows_total*copies->rows;
+    copies->block_count = (rows_total + copies->rows - 1)/copies->rows;
+    return copies->input_count;
+}
+
+/* the extent of input in in block index */
+static void
+block_extent(const execution_plan *plan, const overlap_copies *copies,
+             size_t in, size_t index, memory_extent *extent)
+{
+    size_t d = copies->dimension;
+    size_t first = index*copies->rows;
+    size_t rows = (size_t)plan->outer_shape[d] - first;
+
+    plan_extent(plan, in, extent);
+    if (rows > copies->rows)
+        rows = copies->rows;
+    extent->data += (guft_intp)first*extent->strides[d];
+    extent->shape[d] = (guft_intp)rows;
+}
+
+int
+copy_overlapping_blocks(overlap_copies *copies, const execution_plan *plan)
+{
+    size_t n = copies->block_count*copies->input_count;
+    size_t total = 0;
+    uintptr_t *bounds; /* of the block copied, low == high if it is not */
+    memory_extent input, output;
+
+    copies->base = calloc(n + 1, sizeof(char *));
+    bounds = malloc((2*n + 1)*sizeof(uintptr_t));
+    if (copies->base == NULL || bounds == NULL)
+        goto fail;
+
+    /* first find the blocks to copy and how much memory they need, so
+       that they take a single allocation */
+    for (size_t k = 0; k < n; k++) {
+        size_t i = k%copies->input_count;
+        size_t in = copies->inputs[i];
+        int overlap = 0;
+
+        block_extent(plan, copies, in, k/copies->input_count, &input);
+        for (size_t out = plan->nin; !overlap && out < plan->nops; out++) {
+            if (copies->outputs[i] & ((uint32_t)1 << (out - plan->nin))) {
+                plan_extent(plan, out, &output);
+                overlap = memory_extents_overlap(&input, &output,
+                                                 GUFT_OVERLAP_EXACT_ITEMS);
+            }
+        }
+        bounds[2*k] = bounds[2*k + 1] = 0;
+        if (overlap) {
+            memory_extent_bounds(&input, bounds + 2*k, bounds + 2*k + 1);
+            /* room to keep the alignment of the input */
+            total += bounds[2*k + 1] - bounds[2*k] + GUFT_SCRATCH_ALIGNMENT;
+        }
+    }
+
+    copies->memory = malloc(total + 1);
+    if (copies->memory == NULL)
+        goto fail;
+    copies->copied_bytes = 0;
+
+    /* then copy the bounds of the blocks as they are, so that the strides
+       of the plan work on the copies: the base pointer of the input just
+       moves by the distance from the block to its copy */
+    for (size_t k = 0; k < n; k++) {
+        size_t in = copies->inputs[k%copies->input_count];
+        uintptr_t low = bounds[2*k];
+        size_t size = (size_t)(bounds[2*k + 1] - low);
+        uintptr_t copy = (uintptr_t)(copies->memory + copies->copied_bytes);
+
+        if (size == 0)
+            continue;
+        copy += (low - copy) % GUFT_SCRATCH_ALIGNMENT;
+        memcpy((char *)copy, (const char *)low, size);
+        copies->base[k] = plan->args[in] + (copy - low);
+        copies->copied_bytes += size + GUFT_SCRATCH_ALIGNMENT;
+    }
+
+    free(bounds);
+    return 0;
+
+ fail:
+    free(bounds);
+    release_overlap_copies(copies);
+    return -1;
+}
+
+void
+release_overlap_copies(overlap_copies *copies)
+{
+    free(copies->base);
+    free(copies->memory);
+    copies->base = NULL;
+    copies->memory = NULL;
+    copies->copied_bytes = 0;
+}
+
+void
+execute_copied_range(const execution_plan *plan, size_t start, size_t count)
+{
+    const overlap_copies *copies = plan->copies;
+    char *base[GUFT_MAXARGS];
+
+    memcpy(base, plan->args, plan->nops*sizeof(char *));
+    while (count > 0) {
+        size_t b = start/copies->block;
+        size_t n = (b + 1)*copies->block - start;
+        char *const *block_base = copies->base + b*copies->input_count;
+
+        if (n > count)
+            n = count;
+        for (size_t i = 0; i < copies->input_count; i++) {
+            size_t in = copies->inputs[i];
+            base[in] = block_base[i] != NULL ? block_base[i] : plan->args[in];
+        }
+        execute_plan_range_at(plan, base, start, n);
+
+        start += n;
+        count -= n;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef GUFT_OVERLAP_H
+#define GUFT_OVERLAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "executor.h"
+
+/* Memory overlap between the operands of a call.
+
+   Inputs are read only and kernels run on the elements in any order (and
+   concurrently), so an output sharing memory with an input would have the
+   kernel read data already overwritten. NumPy copies such inputs whole
+   before running; here the analysis is finer:
+
+   - an input whose every element is exactly at the place of the output
+     element computed from it, with a core of a single item, runs in place:
+     each kernel call reads an item before writing it, and no other element
+     touches it.
+
+   - otherwise the input is split in blocks (slabs along the outermost
+     dimension of the plan) and only the blocks that share memory with an
+     output are copied before execution starts. The kernel reads the rest
+     of the input where it is.
+
+   Outputs overlapping each other are not detected: what ends up in memory
+   is undefined, as in NumPy.
+*/
+
+/* dimensions of an extent: the outer ones of a plan plus a core */
+#define GUFT_EXTENT_MAXDIMS (3*GUFT_MAXDIMS)
+
+/* Extents with no more items than this in total are compared item by item,
+   other non contiguous ones just by their bounds */
+#define GUFT_OVERLAP_EXACT_ITEMS 4096
+
+/* Bytes of an input in a block of overlap copies */
+#define GUFT_OVERLAP_BLOCK_SIZE (1024*1024)
+
+/* The memory touched by a strided layout: items of itemsize bytes at data
+   plus any combination of index times stride. Strides are in bytes and may
+   be negative or 0 */
+typedef struct _memory_extent_struct {
+    const char *data;
+    size_t ndim;
+    guft_intp shape[GUFT_EXTENT_MAXDIMS];
+    guft_intp strides[GUFT_EXTENT_MAXDIMS];
+    size_t itemsize;
+} memory_extent;
+
+/* The bytes [low, high) an extent lies in. low == high if it is empty */
+void
+memory_extent_bounds(const memory_extent *extent, uintptr_t *low,
+                     uintptr_t *high);
+
+/* Whether two extents share any byte. Extents with disjoint bounds do not,
+   and for contiguous ones (in any order of their dimensions) the bounds are
+   exact. Others with at most max_items items between both are compared item
+   by item, and the rest are assumed to overlap when their bounds do */
+int
+memory_extents_overlap(const memory_extent *a, const memory_extent *b,
+                       size_t max_items);
+
+/* How the inputs of a plan are to be read when some of them overlap its
+   outputs. See analyze_plan_overlap */
+typedef struct _overlap_copies_struct {
+    /* inputs that need their overlapping blocks copied, and for every one
+       of them a bit per output (1 << (op - nin)) to check the blocks
+       against */
+    size_t input_count;
+    size_t inputs[GUFT_MAXARGS];
+    uint32_t outputs[GUFT_MAXARGS];
+
+    /* blocks are rows [i*rows, (i + 1)*rows) of outer dimension dimension
+       of the plan, that is elements [i*block, (i + 1)*block) */
+    size_t dimension;
+    size_t rows;
+    size_t block;
+    size_t block_count;
+
+    /* set by copy_overlapping_blocks: base pointers for every block and
+       input, block_count*input_count of them, NULL for the blocks read in
+       place */
+    char **base;
+    char *memory; /* of the copies */
+    size_t copied_bytes;
+} overlap_copies;
+
+/* Find the inputs of a plan sharing memory with its outputs. Inputs
+   running in place need nothing. Returns the number of inputs needing
+   copies (copies->input_count); when not 0, set plan->copies to copies and
+   call copy_overlapping_blocks before executing the plan.
+
+   Kernels reporting status (that run in C order) work the same. Call it
+   after order_execution_plan */
+size_t
+analyze_plan_overlap(const execution_plan *plan, overlap_copies *copies,
+                     size_t block_size);
+
+/* Copy the blocks of the inputs found by analyze_plan_overlap that share
+   memory with the outputs. Must be called right before executing the plan,
+   as they are a snapshot of the inputs. Returns 0 on success and -1 if out
+   of memory */
+int
+copy_overlapping_blocks(overlap_copies *copies, const execution_plan *plan);
+
+/* Free the copies. They can be made again */
+void
+release_overlap_copies(overlap_copies *copies);
+
+/* Internal: execute_plan_range for plans with copies, reading every block
+   from its copies. Used by execute_plan_range */
+void
+execute_copied_range(const execution_plan *plan, size_t start, size_t count);
+
+#endif /* GUFT_OVERLAP_H */
@@ -0,0 +1,720 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE /* MAP_ANONYMOUS */
+#endif
+
+#include "procpool.h"
+
+#if defined(GUFT_HAVE_PROCPOOL)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Pools of worker processes running execution plans.
+
+   The control block of a pool is anonymous shared memory mapped before the
+   workers are forked, so they all see it at the same address. It holds the
+   task of the running call, written by the parent before starting the
+   workers, and a slot per worker with a pair of process shared semaphores
+   to start it and to wait for it, its range of elements and its results.
+
+   Operands are in named shared memory segments, that workers map on first
+   use and keep mapped (up to WORKER_MAPPINGS of them) until told that the
+   segment is gone. */
+
+/* commands of a slot */
+#define PROCPOOL_RUN 1
+#define PROCPOOL_QUIT 2
+
+/* segments a worker keeps mapped. More than the operands of a call */
+#define WORKER_MAPPINGS 64
+
+/* how often a parent waiting for a worker checks that it is alive, and an
+   idle worker that its parent is, in nanoseconds */
+#define LIVENESS_PERIOD 100000000L
+#define WORKER_PERIOD 1000000000L
+
+typedef struct {
+    sem_t start;
+    sem_t done;
+    int command;
+    size_t first; /* elements to run */
+    size_t count;
+    int result; /* 0 or -1 */
+    size_t failures;
+
+    /* segments destroyed since the previous task, or more than
+       GUFT_PROCPOOL_MAX_DEAD to drop them all */
+    size_t dead_count;
+    uint64_t dead[GUFT_PROCPOOL_MAX_DEAD];
+
+    /* the signature of the task when it is a new one for the worker, 0 to
+       keep the previous one */
+    size_t signature_size;
+    size_t signature[GUFT_PROCPOOL_MAX_SIGNATURE/sizeof(size_t)];
+} procpool_slot;
+
+struct _procpool_shared_struct {
+    procpool_task task;
+    procpool_slot slots[];
+};
+
+/* -----------------------------------------------------------------------------
+ * Segments
+ */
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_segment *segments; /* live ones */
+static size_t segment_count;
+static size_t segment_capacity;
+static uint64_t next_segment_id = 1;
+static procpool *pools; /* to tell about destroyed segments */
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/* a forked child must not inherit a held lock */
+static void
+prepare_fork(void)
+{
+    pthread_mutex_lock(&registry_lock);
+}
+
+static void
+after_fork(void)
+{
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void
+register_atfork(void)
+{
+    pthread_atfork(prepare_fork, after_fork, after_fork);
+}
+
+static void
+segment_name(char *name, size_t size, pid_t owner, uint64_t id)
+{
+    snprintf(name, size, "/guft-%ld-%llu", (long)owner,
+             (unsigned long long)id);
+}
+
+int
+create_shared_segment(shared_segment *segment, size_t size)
+{
+    char name[64];
+    uint64_t id;
+    void *data;
+    int fd, saved;
+
+    pthread_once(&atfork_once, register_atfork);
+
+    pthread_mutex_lock(&registry_lock);
+    id = next_segment_id++;
+    if (segment_count == segment_capacity) {
+        size_t capacity = segment_capacity > 0 ? 2*segment_capacity : 16;
+        shared_segment *grown = realloc(segments,
+                                        capacity*sizeof(shared_segment));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&registry_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        segments = grown;
+        segment_capacity = capacity;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    /* empty segments still get a page, so that they have an address */
+    if (size == 0)
+        size = 1;
+    segment_name(name, sizeof(name), getpid(), id);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+    /* the new pages are zero filled, and only take memory once touched */
+    if (ftruncate(fd, (off_t)size) != 0) {
+        saved = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = saved;
+        return -1;
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    saved = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        shm_unlink(name);
+        errno = saved;
+        return -1;
+    }
+
+    segment->id = id;
+    segment->data = data;
+    segment->size = size;
+
+    pthread_mutex_lock(&registry_lock);
+    segments[segment_count++] = *segment;
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+void
+destroy_shared_segment(shared_segment *segment)
+{
+    char name[64];
+
+    if (segment->id == 0)
+        return;
+
+    pthread_mutex_lock(&registry_lock);
+    for (size_t i = 0; i < segment_count; i++) {
+        if (segments[i].id == segment->id) {
+            segments[i] = segments[--segment_count];
+            break;
+        }
+    }
+    for (procpool *pool = pools; pool != NULL; pool = pool->next) {
+        if (pool->dead_count < GUFT_PROCPOOL_MAX_DEAD)
+            pool->dead[pool->dead_count] = segment->id;
+        if (pool->dead_count <= GUFT_PROCPOOL_MAX_DEAD)
+            pool->dead_count++;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    munmap(segment->data, segment->size);
+    segment_name(name, sizeof(name), getpid(), segment->id);
+    shm_unlink(name);
+    segment->id = 0;
+    segment->data = NULL;
+    segment->size = 0;
+}
+
+int
+find_shared_segment(uintptr_t low, uintptr_t high, uint64_t *id,
+                    size_t *offset)
+{
+    int rv = -1;
+
+    pthread_mutex_lock(&registry_lock);
+    for (size_t i = 0; i < segment_count; i++) {
+        uintptr_t start = (uintptr_t)segments[i].data;
+
+        if (low >= start && high <= start + segments[i].size) {
+            *id = segments[i].id;
+            *offset = low - start;
+            rv = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return rv;
+}
+
+/* wait on sem for at most period nanoseconds. Returns 0 if it was
+   posted, -1 with errno set otherwise */
+static int
+timed_wait(sem_t *sem, long period)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += period;
+    while (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return sem_timedwait(sem, &deadline);
+}
+
+/* -----------------------------------------------------------------------------
+ * Workers
+ */
+
+typedef struct {
+    uint64_t id;
+    char *data;
+    size_t size;
+    size_t task; /* last one that used it */
+} worker_mapping;
+
+typedef struct {
+    procpool *pool;
+    procpool_slot *slot;
+    size_t task; /* count of tasks run */
+    size_t mapping_count;
+    worker_mapping mappings[WORKER_MAPPINGS];
+    size_t *signature; /* copy of the record, and the header into it */
+    parsed_signature header;
+} worker;
+
+static void
+unmap_segment(worker *w, size_t index)
+{
+    munmap(w->mappings[index].data, w->mappings[index].size);
+    w->mappings[index] = w->mappings[--w->mapping_count];
+}
+
+/* drop the mappings of the segments destroyed since the previous task */
+static void
+forget_dead_segments(worker *w)
+{
+    procpool_slot *slot = w->slot;
+
+    if (slot->dead_count > GUFT_PROCPOOL_MAX_DEAD) {
+        while (w->mapping_count > 0)
+            unmap_segment(w, 0);
+        slot->dead_count = 0;
+        return;
+    }
+    for (size_t i = 0; i < slot->dead_count; i++) {
+        for (size_t m = 0; m < w->mapping_count; m++) {
+            if (w->mappings[m].id == slot->dead[i]) {
+                unmap_segment(w, m);
+                break;
+            }
+        }
+    }
+    slot->dead_count = 0;
+}
+
+/* the address of segment id in the worker, NULL if it can not be mapped */
+static char *
+map_segment(worker *w, uint64_t id)
+{
+    worker_mapping *mapping;
+    char name[64];
+    struct stat st;
+    void *data;
+    int fd;
+
+    for (size_t m = 0; m < w->mapping_count; m++) {
+        if (w->mappings[m].id == id) {
+            w->mappings[m].task = w->task;
+            return w->mappings[m].data;
+        }
+    }
+
+    /* room for it, unmapping the least recently used segment that this
+       task does not need */
+    if (w->mapping_count == WORKER_MAPPINGS) {
+        size_t oldest = 0;
+        for (size_t m = 1; m < w->mapping_count; m++) {
+            if (w->mappings[m].task < w->mappings[oldest].task)
+                oldest = m;
+        }
+        if (w->mappings[oldest].task == w->task)
+            return NULL;
+        unmap_segment(w, oldest);
+    }
+
+    segment_name(name, sizeof(name), w->pool->owner, id);
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    mapping = w->mappings + w->mapping_count++;
+    mapping->id = id;
+    mapping->data = data;
+    mapping->size = (size_t)st.st_size;
+    mapping->task = w->task;
+    return data;
+}
+
+/* take the signature shipped with the task, if any */
+static int
+update_signature(worker *w)
+{
+    procpool_slot *slot = w->slot;
+    size_t *record;
+
+    if (slot->signature_size == 0)
+        return w->signature != NULL ? 0 : -1;
+
+    record = malloc(slot->signature_size);
+    if (record == NULL)
+        return -1;
+    memcpy(record, slot->signature, slot->signature_size);
+    if (attach_serialized_signature(record, slot->signature_size, &w->header,
+                                    NULL) != 0) {
+        free(record);
+        return -1;
+    }
+    free(w->signature);
+    w->signature = record;
+    return 0;
+}
+
+/* run the range of the slot. Returns 0 on success, -1 on failure */
+static int
+run_worker_task(worker *w)
+{
+    const procpool_task *task = &w->pool->shared->task;
+    procpool_slot *slot = w->slot;
+    execution_operand operands[GUFT_MAXARGS];
+    resolved_shapes resolved;
+    execution_status status;
+    execution_plan *plan;
+    int rv;
+
+    w->task++;
+    forget_dead_segments(w);
+    if (update_signature(w) != 0 || task->nops != w->header.arg_count)
+        return -1;
+
+    for (size_t op = 0; op < task->nops; op++) {
+        const procpool_operand *o = task->operands + op;
+        char *data = map_segment(w, o->segment);
+
+        if (data == NULL)
+            return -1;
+        operands[op].data = data + o->offset;
+        operands[op].ndim = o->ndim;
+        operands[op].shape = o->shape;
+        operands[op].strides = o->strides;
+        operands[op].itemsize = o->itemsize;
+        operands[op].flags = o->flags;
+    }
+
+    status.mask = NULL;
+    status.failures = 0;
+    if (task->status_segment != 0) {
+        char *data = map_segment(w, task->status_segment);
+        if (data == NULL)
+            return -1;
+        status.mask = (unsigned char *)data + task->status_offset;
+    }
+
+    resolved.outer_ndim = task->outer_ndim;
+    memcpy(resolved.outer_shape, task->outer_shape,
+           sizeof(resolved.outer_shape));
+    resolved.element_count = task->element_count;
+    resolved.dimension_sizes = (size_t *)task->dimension_sizes;
+
+    plan = malloc(execution_plan_size(&w->header));
+    if (plan == NULL)
+        return -1;
+    if (init_execution_plan(plan, &w->header, &resolved, operands,
+                            task->kernel) != 0) {
+        free(plan);
+        return -1;
+    }
+    /* every worker orders the plan the same way, so the ranges split the
+       elements in the order the parent expects */
+    order_execution_plan(plan, task->tile_size);
+    enable_plan_buffering(plan, task->buffer_size);
+    if (status.mask != NULL)
+        plan->status = &status;
+
+    execute_plan_range(plan, slot->first, slot->count);
+    rv = plan->out_of_memory ? -1 : 0;
+    free(plan);
+    slot->failures = status.failures;
+    return rv;
+}
+
+void
+run_procpool_worker(procpool *pool, size_t index)
+{
+    procpool_slot *slot = pool->shared->slots + index;
+    worker w;
+
+    memset(&w, 0, sizeof(w));
+    w.pool = pool;
+    w.slot = slot;
+
+    /* the mappings of segments inherited with the fork would keep their
+       memory alive after they are destroyed: the worker maps what it uses */
+    for (size_t i = 0; i < segment_count; i++)
+        munmap(segments[i].data, segments[i].size);
+    segment_count = 0;
+
+    for (;;) {
+        /* waiting for work, but not for a parent that went away */
+        while (timed_wait(&slot->start, WORKER_PERIOD) != 0) {
+            if ((errno != ETIMEDOUT && errno != EINTR) ||
+                getppid() != pool->owner)
+                goto done;
+        }
+        if (slot->command != PROCPOOL_RUN)
+            break;
+        slot->failures = 0;
+        slot->result = run_worker_task(&w);
+        sem_post(&slot->done);
+    }
+
+ done:
+    while (w.mapping_count > 0)
+        unmap_segment(&w, 0);
+    free(w.signature);
+}
+
+/* -----------------------------------------------------------------------------
+ * Pools
+ */
+
+int
+init_procpool(procpool *pool, size_t worker_count)
+{
+    size_t size;
+    void *shared;
+
+    if (worker_count == 0 || worker_count > GUFT_PROCPOOL_MAX_WORKERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size = sizeof(procpool_shared) + worker_count*sizeof(procpool_slot);
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return -1;
+
+    memset(pool, 0, sizeof(procpool));
+    pool->shared = shared;
+    pool->shared_size = size;
+    pool->worker_count = worker_count;
+    pool->owner = getpid();
+    for (size_t i = 0; i < worker_count; i++) {
+        procpool_slot *slot = pool->shared->slots + i;
+        if (sem_init(&slot->start, 1, 0) != 0 ||
+            sem_init(&slot->done, 1, 0) != 0) {
+            int saved = errno;
+            munmap(shared, size);
+            errno = saved;
+            return -1;
+        }
+    }
+
+    pthread_once(&atfork_once, register_atfork);
+    pthread_mutex_lock(&registry_lock);
+    pool->next = pools;
+    pools = pool;
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+procpool_task *
+procpool_task_of(procpool *pool)
+{
+    return &pool->shared->task;
+}
+
+/* ship signature to worker index unless it already has it. Returns 0 on
+   success, -1 if the record does not fit or there is no memory */
+static int
+ship_signature(procpool *pool, size_t index, const void *record,
+               size_t size)
+{
+    procpool_slot *slot = pool->shared->slots + index;
+    void *copy;
+
+    slot->signature_size = 0;
+    if (pool->worker_signatures[index] != NULL &&
+        pool->worker_signature_sizes[index] == size &&
+        memcmp(pool->worker_signatures[index], record, size) == 0)
+        return 0;
+
+    copy = malloc(size);
+    if (copy == NULL)
+        return -1;
+    memcpy(copy, record, size);
+    memcpy(slot->signature, record, size);
+    slot->signature_size = size;
+    free(pool->worker_signatures[index]);
+    pool->worker_signatures[index] = copy;
+    pool->worker_signature_sizes[index] = size;
+    return 0;
+}
+
+/* wait for worker index to be done. Returns 0, or -1 if it died */
+static int
+wait_worker(procpool *pool, size_t index)
+{
+    procpool_slot *slot = pool->shared->slots + index;
+
+    for (;;) {
+        if (timed_wait(&slot->done, LIVENESS_PERIOD) == 0)
+            return 0;
+        if (errno != ETIMEDOUT && errno != EINTR)
+            return -1;
+        if (waitpid(pool->pids[index], NULL, WNOHANG) != 0) {
+            /* reaped, or not a child any more */
+            pool->pids[index] = 0;
+            return -1;
+        }
+    }
+}
+
+int
+run_procpool(procpool *pool, const parsed_signature *signature,
+             size_t min_chunk, size_t *failures)
+{
+    size_t count = pool->shared->task.element_count;
+    size_t workers, share, record_size;
+    size_t *record;
+    int rv = 0, died = 0;
+
+    *failures = 0;
+    if (count == 0)
+        return 0;
+
+    record_size = serialized_signature_size(signature, 0);
+    if (record_size > GUFT_PROCPOOL_MAX_SIGNATURE)
+        return -1;
+    record = malloc(record_size);
+    if (record == NULL)
+        return -1;
+    serialize_parsed_signature(signature, NULL, 0, record);
+
+    /* ranges of whole status bytes, so that workers never share one */
+    if (min_chunk < 8)
+        min_chunk = 8;
+    workers = (count + min_chunk - 1)/min_chunk;
+    if (workers > pool->worker_count)
+        workers = pool->worker_count;
+    share = (count + workers - 1)/workers;
+    share = (share + 7)/8*8;
+
+    /* the segments destroyed since the last call are added to what every
+       worker has to forget, that it clears when it runs a task */
+    pthread_mutex_lock(&registry_lock);
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        procpool_slot *slot = pool->shared->slots + i;
+        for (size_t k = 0; k < pool->dead_count; k++) {
+            if (k >= GUFT_PROCPOOL_MAX_DEAD) {
+                slot->dead_count = GUFT_PROCPOOL_MAX_DEAD + 1;
+                break;
+            }
+            if (slot->dead_count < GUFT_PROCPOOL_MAX_DEAD)
+                slot->dead[slot->dead_count] = pool->dead[k];
+            if (slot->dead_count <= GUFT_PROCPOOL_MAX_DEAD)
+                slot->dead_count++;
+        }
+    }
+    pool->dead_count = 0;
+    pthread_mutex_unlock(&registry_lock);
+
+    for (size_t i = 0; i < workers; i++) {
+        procpool_slot *slot = pool->shared->slots + i;
+        size_t first = i*share;
+
+        if (first >= count) {
+            workers = i;
+            break;
+        }
+        if (ship_signature(pool, i, record, record_size) != 0) {
+            workers = i;
+            rv = -1;
+            break;
+        }
+        slot->command = PROCPOOL_RUN;
+        slot->first = first;
+        slot->count = count - first < share ? count - first : share;
+        sem_post(&slot->start);
+    }
+    free(record);
+
+    for (size_t i = 0; i < workers; i++) {
+        procpool_slot *slot = pool->shared->slots + i;
+
+        if (wait_worker(pool, i) != 0) {
+            died = 1;
+            continue;
+        }
+        if (slot->result != 0)
+            rv = -1;
+        *failures += slot->failures;
+    }
+
+    if (died) {
+        stop_procpool(pool);
+        return -2;
+    }
+    return rv;
+}
+
+void
+stop_procpool(procpool *pool)
+{
+    if (!pool->started)
+        return;
+
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        procpool_slot *slot = pool->shared->slots + i;
+        if (pool->pids[i] <= 0)
+            continue;
+        slot->command = PROCPOOL_QUIT;
+        sem_post(&slot->start);
+    }
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        if (pool->pids[i] > 0) {
+            while (waitpid(pool->pids[i], NULL, 0) < 0 && errno == EINTR)
+                ;
+        }
+        pool->pids[i] = 0;
+        free(pool->worker_signatures[i]);
+        pool->worker_signatures[i] = NULL;
+        pool->worker_signature_sizes[i] = 0;
+    }
+
+    /* fresh semaphores, whatever the workers left in them */
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        procpool_slot *slot = pool->shared->slots + i;
+        sem_destroy(&slot->start);
+        sem_destroy(&slot->done);
+        sem_init(&slot->start, 1, 0);
+        sem_init(&slot->done, 1, 0);
+    }
+
+    /* new workers map what they use */
+    pthread_mutex_lock(&registry_lock);
+    pool->dead_count = 0;
+    pthread_mutex_unlock(&registry_lock);
+    pool->started = 0;
+}
+
+void
+release_procpool(procpool *pool)
+{
+    procpool **link;
+
+    if (pool->shared == NULL)
+        return;
+    stop_procpool(pool);
+
+    pthread_mutex_lock(&registry_lock);
+    for (link = &pools; *link != NULL; link = &(*link)->next) {
+        if (*link == pool) {
+            *link = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        procpool_slot *slot = pool->shared->slots + i;
+        sem_destroy(&slot->start);
+        sem_destroy(&slot->done);
+    }
+    munmap(pool->shared, pool->shared_size);
+    pool->shared = NULL;
+}
+
+#endif /* GUFT_HAVE_PROCPOOL */
@@ -0,0 +1,168 @@
+#ifndef GUFT_PROCPOOL_H
+#define GUFT_PROCPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "executor.h"
+
+/* Execution of plans in a pool of worker processes, for kernels that can
+   not run concurrently in threads of a process (they hold a lock, like the
+   GIL, or use global state).
+
+   Operands live in POSIX shared memory segments, that every process maps,
+   so nothing is pickled or copied per task: a task is the description of a
+   call (the kernel, shapes, and the segment, offset and strides of every
+   operand) plus a range of elements, and each worker builds its own plan
+   from it and runs its range. Workers are forked from the process using
+   the pool, so kernels are called through the same pointers as there. A
+   worker gets the serialized signature (see signature.h) of a call only
+   when it is not the one of its previous call.
+
+   The pool only exists on Linux: elsewhere GUFT_HAVE_PROCPOOL is not
+   defined and none of this is available. */
+#if defined(__linux__)
+#  define GUFT_HAVE_PROCPOOL 1
+#endif
+
+#if defined(GUFT_HAVE_PROCPOOL)
+
+#include <semaphore.h>
+#include <sys/types.h>
+
+#define GUFT_PROCPOOL_MAX_WORKERS 64
+
+/* bytes of the largest serialized signature a task can carry */
+#define GUFT_PROCPOOL_MAX_SIGNATURE 16384
+
+/* segments destroyed between two tasks that workers are told about one by
+   one. More than that and they drop all their mappings */
+#define GUFT_PROCPOOL_MAX_DEAD 256
+
+/* operand dimensions: outer plus core */
+#define GUFT_PROCPOOL_MAXNDIM (2*GUFT_MAXDIMS)
+
+/* -----------------------------------------------------------------------------
+ * Shared memory segments
+ *
+ * Named POSIX shared memory objects, mapped where created and, lazily, by
+ * the workers of every pool. The creating process keeps a registry of the
+ * live ones, so that memory of an operand can be told to be in a segment
+ * (and which) from its address.
+ */
+
+typedef struct _shared_segment_struct {
+    uint64_t id; /* 0 for none. Unique in the creating process */
+    char *data;
+    size_t size;
+} shared_segment;
+
+/* Create a zero filled segment of size bytes. Returns 0 on success, -1 on
+   failure (with errno set) */
+int
+create_shared_segment(shared_segment *segment, size_t size);
+
+/* Unmap and remove a segment. Pools tell their workers before their next
+   task, so that they unmap it too */
+void
+destroy_shared_segment(shared_segment *segment);
+
+/* Find the live segment holding the bytes [low, high). Returns 0 and the
+   segment id and the offset of low in it, or -1 if there is none */
+int
+find_shared_segment(uintptr_t low, uintptr_t high, uint64_t *id,
+                    size_t *offset);
+
+/* -----------------------------------------------------------------------------
+ * Pools
+ */
+
+/* an operand as shipped to the workers */
+typedef struct _procpool_operand_struct {
+    uint64_t segment;
+    size_t offset; /* of its data pointer in the segment */
+    size_t ndim;
+    size_t shape[GUFT_PROCPOOL_MAXNDIM];
+    guft_intp strides[GUFT_PROCPOOL_MAXNDIM];
+    size_t itemsize;
+    unsigned int flags;
+} procpool_operand;
+
+/* a call, as run by all the workers */
+typedef struct _procpool_task_struct {
+    guft_kernel kernel;
+    size_t nops;
+    size_t outer_ndim;
+    size_t outer_shape[GUFT_MAXDIMS];
+    size_t element_count;
+    size_t dimension_sizes[GUFT_MAX_DIMENSION_VARIABLES];
+    procpool_operand operands[GUFT_MAXARGS];
+    /* status mask (see execution_status), segment 0 if the kernel does not
+       report status */
+    uint64_t status_segment;
+    size_t status_offset;
+    size_t buffer_size;
+    size_t tile_size;
+} procpool_task;
+
+typedef struct _procpool_shared_struct procpool_shared;
+
+typedef struct _procpool_struct {
+    procpool_shared *shared; /* mapped in the workers too */
+    size_t shared_size;
+    size_t worker_count;
+    int started;
+    pid_t owner; /* the process that created the segments */
+    pid_t pids[GUFT_PROCPOOL_MAX_WORKERS];
+
+    /* the signature record each worker has, to only ship new ones */
+    void *worker_signatures[GUFT_PROCPOOL_MAX_WORKERS];
+    size_t worker_signature_sizes[GUFT_PROCPOOL_MAX_WORKERS];
+
+    /* segments destroyed since the last task (guarded by the registry
+       lock) */
+    size_t dead_count;
+    uint64_t dead[GUFT_PROCPOOL_MAX_DEAD];
+
+    struct _procpool_struct *next; /* in the list of live pools */
+} procpool;
+
+/* Set up a pool of worker_count workers (at most
+   GUFT_PROCPOOL_MAX_WORKERS). The workers are not started: fork once per
+   worker and call run_procpool_worker in the children, recording the pids
+   in the parent, then set started. Returns 0 on success, -1 on failure
+   (with errno set) */
+int
+init_procpool(procpool *pool, size_t worker_count);
+
+/* The loop of worker index, in a child. Returns when told to quit or when
+   its parent goes away; the child should _exit then */
+void
+run_procpool_worker(procpool *pool, size_t index);
+
+/* The task the next run_procpool will execute, for the caller to fill */
+procpool_task *
+procpool_task_of(procpool *pool);
+
+/* Run the task over all its elements, split among the workers in ranges of
+   at least min_chunk elements. signature is the one of the call. Blocks
+   until done. Returns 0 on success, with the number of failures of a
+   status kernel in failures, -1 if a worker failed to map a segment or is
+   out of memory, -2 if a worker died, in which case the workers are
+   stopped */
+int
+run_procpool(procpool *pool, const parsed_signature *signature,
+             size_t min_chunk, size_t *failures);
+
+/* Tell the workers to quit and wait for them. The pool can be started
+   again */
+void
+stop_procpool(procpool *pool);
+
+/* Stop the workers and release the pool */
+void
+release_procpool(procpool *pool);
+
+#endif /* GUFT_HAVE_PROCPOOL */
+
+#endif /* GUFT_PROCPOOL_H */
@@ -0,0 +1,311 @@
+#include <Python.h>
+
+#include <stdlib.h>
+
+#include "dispatch.h"
+#include "procpool.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Buffer objects
+ *
+ * The minimal container used for the outputs that calls allocate: a zero
+ * filled, C contiguous block of a single type, exported through the buffer
+ * protocol with its shape and format, so memoryview, array libraries or
+ * other gufunc calls can use it without copying. Unlike memoryview casts,
+ * shapes with zeros and every type code of the registries are supported.
+ *
+ * Buffer(format, shape) creates one from Python. Buffers of a ProcessPool
+ * are the same in a shared memory segment, that its workers use in place.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    size_t size; /* in bytes */
+    size_t itemsize;
+    int ndim;
+    char format[2];
+    Py_ssize_t shape[GUFT_CALL_MAXNDIM];
+    Py_ssize_t strides[GUFT_CALL_MAXNDIM];
+#if defined(GUFT_HAVE_PROCPOOL)
+    shared_segment segment; /* id 0 unless data is in shared memory */
+#endif
+} guft_BufferObject;
+
+static PyObject *
+alloc_buffer(guft_module_state *state, char type, size_t ndim,
+             const size_t *shape, int shared)
+{
+    guft_BufferObject *self;
+    size_t itemsize = type_code_itemsize(type);
+    size_t size = itemsize;
+
+    if (itemsize == 0) {
+        PyErr_Format(PyExc_TypeError, "unsupported type '%c'", type);
+        return NULL;
+    }
+    if (ndim > GUFT_CALL_MAXNDIM) {
+        PyErr_SetString(PyExc_ValueError, "too many dimensions");
+        return NULL;
+    }
+    for (size_t d = 0; d < ndim; d++) {
+        if (shape[d] != 0 && size > (size_t)PY_SSIZE_T_MAX/shape[d]) {
+            PyErr_SetString(PyExc_ValueError, "buffer too large");
+            return NULL;
+        }
+        size *= shape[d];
+    }
+
+    self = PyObject_New(guft_BufferObject, state->BufferType);
+    if (self == NULL)
+        return NULL;
+
+    self->data = NULL;
+#if defined(GUFT_HAVE_PROCPOOL)
+    self->segment.id = 0;
+    if (shared) {
+        if (create_shared_segment(&self->segment, size) != 0) {
+            self->size = 0;
+            Py_DECREF(self);
+            return PyErr_SetFromErrno(PyExc_OSError);
+        }
+        self->data = self->segment.data;
+    }
+#endif
+    /* calloc, as large blocks come from zeroed pages without touching
+       them */
+    if (!shared)
+        self->data = calloc(size > 0 ? size : 1, 1);
+    if (self->data == NULL) {
+        self->size = 0;
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    self->size = size;
+    self->itemsize = itemsize;
+    self->ndim = (int)ndim;
+    self->format[0] = type;
+    self->format[1] = '\0';
+    for (size_t d = ndim, stride = itemsize; d-- > 0;) {
+        self->shape[d] = (Py_ssize_t)shape[d];
+        self->strides[d] = (Py_ssize_t)stride;
+        stride *= shape[d];
+    }
+
+    return (PyObject *)self;
+}
+
+PyObject *
+new_buffer(guft_module_state *state, char type, size_t ndim,
+           const size_t *shape)
+{
+    return alloc_buffer(state, type, ndim, shape, 0);
+}
+
+#if defined(GUFT_HAVE_PROCPOOL)
+PyObject *
+new_shared_buffer(guft_module_state *state, char type, size_t ndim,
+                  const size_t *shape)
+{
+    return alloc_buffer(state, type, ndim, shape, 1);
+}
+#endif
+
+/* item size of a single character struct format, 0 if unknown. Sizes are
+   native, or the standard ones of the struct module after a byte order
+   character */
+static size_t
+format_itemsize(const char *format)
+{
+    int standard = 0;
+
+    switch (format[0]) {
+    case '@':
+        format++;
+        break;
+    case '=': case '<': case '>': case '!':
+        standard = 1;
+        format++;
+        break;
+    }
+    if (format[0] == '\0' || format[1] != '\0')
+        return 0;
+
+    switch (format[0]) {
+    case 'b': case 'B': case '?':
+        return 1;
+    case 'h': case 'H': case 'e':
+        return 2;
+    case 'i': case 'I':
+        return standard ? 4 : sizeof(int);
+    case 'l': case 'L':
+        return standard ? 4 : sizeof(long);
+    case 'q': case 'Q':
+        return standard ? 8 : sizeof(long long);
+    case 'n': case 'N':
+        return standard ? 0 : sizeof(size_t);
+    case 'f':
+        return sizeof(float);
+    case 'd':
+        return sizeof(double);
+    default:
+        return 0;
+    }
+}
+
+PyObject *
+buffer_from_format(guft_module_state *state, const char *format,
+                   PyObject *shape_obj, int shared)
+{
+    PyObject *seq;
+    size_t shape[GUFT_CALL_MAXNDIM];
+    Py_ssize_t ndim;
+    char type_code;
+
+    type_code = canonical_type_code(format, format_itemsize(format));
+    if (type_code == 0) {
+        PyErr_Format(PyExc_TypeError, "unsupported format '%s'", format);
+        return NULL;
+    }
+
+    seq = PySequence_Fast(shape_obj, "shape must be a sequence of ints");
+    if (seq == NULL)
+        return NULL;
+    ndim = PySequence_Fast_GET_SIZE(seq);
+    if (ndim > GUFT_CALL_MAXNDIM) {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "too many dimensions");
+        return NULL;
+    }
+    for (Py_ssize_t d = 0; d < ndim; d++) {
+        shape[d] = PyLong_AsSize_t(PySequence_Fast_GET_ITEM(seq, d));
+        if (shape[d] == (size_t)-1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+
+    return alloc_buffer(state, type_code, (size_t)ndim, shape, shared);
+}
+
+static PyObject *
+Buffer_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    guft_module_state *state = get_state_by_type(type);
+    const char *format;
+    PyObject *shape_obj;
+
+    static char *kwlist[] = { "format", "shape", NULL };
+
+    if (state == NULL)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sO", kwlist,
+                                     &format, &shape_obj))
+        return NULL;
+
+    return buffer_from_format(state, format, shape_obj, 0);
+}
+
+static void
+Buffer_dealloc(guft_BufferObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+#if defined(GUFT_HAVE_PROCPOOL)
+    if (self->segment.id != 0) {
+        destroy_shared_segment(&self->segment);
+        self->data = NULL;
+    }
+#endif
+    free(self->data);
+    PyObject_Del(self);
+    Py_DECREF(type);
+}
+
+static int
+Buffer_getbuffer(guft_BufferObject *self, Py_buffer *view, int flags)
+{
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = (Py_ssize_t)self->size;
+    view->readonly = 0;
+    view->itemsize = (Py_ssize_t)self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+    /* C contiguous, so simple requests get the plain bytes */
+    if (flags & PyBUF_ND) {
+        view->ndim = self->ndim;
+        view->shape = self->shape;
+    } else {
+        view->ndim = 1;
+        view->shape = NULL;
+    }
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ?
+        self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyObject *
+Buffer_get_format(guft_BufferObject *self, void *UNUSED_VAR(closure))
+{
+    return PyUnicode_FromString(self->format);
+}
+
+static PyObject *
+Buffer_get_shape(guft_BufferObject *self, void *UNUSED_VAR(closure))
+{
+    PyObject *rv = PyTuple_New(self->ndim);
+    for (int d = 0; rv != NULL && d < self->ndim; d++) {
+        PyObject *item = PyLong_FromSsize_t(self->shape[d]);
+        if (item == NULL)
+            Py_CLEAR(rv);
+        else
+            PyTuple_SET_ITEM(rv, d, item);
+    }
+    return rv;
+}
+
+static PyObject *
+Buffer_repr(guft_BufferObject *self)
+{
+    PyObject *shape = Buffer_get_shape(self, NULL);
+    PyObject *rv;
+
+    if (shape == NULL)
+        return NULL;
+    rv = PyUnicode_FromFormat("<%s format='%s' shape=%R>",
+                              Py_TYPE(self)->tp_name, self->format, shape);
+    Py_DECREF(shape);
+    return rv;
+}
+
+static PyGetSetDef guft_BufferObject_getset[] = {
+    {"format", (getter)Buffer_get_format, NULL, "struct format of the items",
+     NULL},
+    {"shape", (getter)Buffer_get_shape, NULL, "tuple with the dimensions",
+     NULL},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot guft_Buffer_slots[] = {
+    {Py_tp_dealloc, (void *)Buffer_dealloc},
+    {Py_tp_repr, (void *)Buffer_repr},
+    {Py_bf_getbuffer, (void *)Buffer_getbuffer},
+    {Py_tp_getset, guft_BufferObject_getset},
+    {Py_tp_new, (void *)Buffer_new},
+    {Py_tp_doc, (void *)"Buffer(format, shape): zero filled C contiguous "
+     "memory exported through the buffer protocol"},
+    {0, NULL}
+};
+
+PyType_Spec guft_Buffer_spec = {
+    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".Buffer",   /* name */
+    sizeof(guft_BufferObject),                            /* basicsize */
+    0,                                                    /* itemsize */
+    Py_TPFLAGS_DEFAULT,                                   /* flags */
+    guft_Buffer_slots,                                    /* slots */
+};
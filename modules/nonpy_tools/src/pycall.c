@@ -0,0 +1,425 @@
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "executor.h"
+#include "stats.h"
+#include "tuner.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Prepared calls
+ *
+ * A gufunc call on buffer protocol objects, split in steps so that the
+ * execution can happen without the GIL and in another thread:
+ *
+ *   prepare_call: with the GIL. Gets the buffers, resolves the shapes,
+ *     finds the kernel in the registry and builds the execution plan. The
+ *     operand objects are referenced and their buffers held until release,
+ *     so they can not go away nor be resized meanwhile.
+ *
+ *   run_prepared_call: no Python involved, the GIL is not needed. Inputs
+ *     sharing memory with outputs have the blocks that overlap copied
+ *     first (see overlap.h).
+ *
+ *   finish_prepared_call: with the GIL. Returns the outputs or raises.
+ *
+ *   release_prepared_call: with the GIL. Releases everything.
+ */
+
+void
+get_view_strides(const Py_buffer *view, guft_intp *strides)
+{
+    guft_intp stride = (guft_intp)view->itemsize;
+
+    if (view->strides != NULL) {
+        for (int d = 0; d < view->ndim; d++)
+            strides[d] = (guft_intp)view->strides[d];
+        return;
+    }
+    for (int d = view->ndim; d-- > 0;) {
+        strides[d] = stride;
+        stride *= (guft_intp)view->shape[d];
+    }
+}
+
+static void
+release_views(prepared_call *call)
+{
+    for (size_t op = 0; op < call->view_count; op++)
+        PyBuffer_Release(call->views + op);
+    call->view_count = 0;
+}
+
+static int
+get_operand(prepared_call *call, size_t op, PyObject *obj, char *type)
+{
+    const parsed_signature *ps = call->signature;
+    int is_output = op >= ps->input_count;
+    int flags = is_output ? PyBUF_RECORDS : PyBUF_RECORDS_RO;
+    Py_buffer *view = call->views + op;
+    execution_operand *operand = call->operands + op;
+    int swapped;
+
+    if (PyObject_GetBuffer(obj, view, flags) < 0)
+        return -1;
+    call->view_count++;
+
+    if ((size_t)view->ndim > GUFT_CALL_MAXNDIM) {
+        PyErr_Format(PyExc_ValueError, "too many dimensions in operand %zu",
+                     op);
+        return -1;
+    }
+
+    /* non native byte orders are swapped in the buffers of the executor */
+    *type = canonical_type_code_swapped(view->format, (size_t)view->itemsize,
+                                        &swapped);
+    if (*type == 0) {
+        PyErr_Format(PyExc_TypeError,
+                     "unsupported format '%s' in operand %zu",
+                     view->format ? view->format : "B", op);
+        return -1;
+    }
+
+    for (int d = 0; d < view->ndim; d++)
+        call->shapes[op][d] = (size_t)view->shape[d];
+    get_view_strides(view, call->strides[op]);
+
+    operand->data = view->buf;
+    operand->ndim = (size_t)view->ndim;
+    operand->shape = call->shapes[op];
+    operand->strides = call->strides[op];
+    operand->itemsize = (size_t)view->itemsize;
+    operand->flags = swapped ? GUFT_OPERAND_BYTESWAPPED : 0;
+    return 0;
+}
+
+/* allocate output op with the shape resolved for the call */
+static int
+allocate_output(guft_module_state *state, prepared_call *call, size_t op,
+                char type)
+{
+    size_t shape[GUFT_CALL_MAXNDIM];
+    size_t ndim;
+    PyObject *output;
+    char output_type;
+
+    ndim = resolved_arg_shape(call->signature, &call->resolved, op, shape);
+    if (ndim > GUFT_CALL_MAXNDIM) {
+        PyErr_Format(PyExc_ValueError, "too many dimensions in operand %zu",
+                     op);
+        return -1;
+    }
+    output = new_buffer(state, type, ndim, shape);
+    if (output == NULL)
+        return -1;
+    PyTuple_SET_ITEM(call->operand_objects, op, output);
+
+    return get_operand(call, op, output, &output_type);
+}
+
+/* lay out output op C contiguous with the shape resolved for the call, for
+   callers that place its elements themselves */
+static int
+lay_out_output(prepared_call *call, size_t op, char type)
+{
+    execution_operand *operand = call->operands + op;
+    size_t ndim;
+    guft_intp stride = (guft_intp)type_code_itemsize(type);
+
+    ndim = resolved_arg_shape(call->signature, &call->resolved, op,
+                              call->shapes[op]);
+    if (ndim > GUFT_CALL_MAXNDIM) {
+        PyErr_Format(PyExc_ValueError, "too many dimensions in operand %zu",
+                     op);
+        return -1;
+    }
+    operand->data = NULL;
+    operand->ndim = ndim;
+    operand->shape = call->shapes[op];
+    operand->strides = call->strides[op];
+    operand->itemsize = (size_t)stride;
+    operand->flags = 0;
+    for (size_t d = ndim; d-- > 0;) {
+        call->strides[op][d] = stride;
+        stride *= (guft_intp)call->shapes[op][d];
+    }
+    return 0;
+}
+
+int
+prepare_call(prepared_call *call, guft_KernelRegistryObject *registry,
+             PyObject *operands, unsigned int flags)
+{
+    const parsed_signature *ps =
+        ((guft_SignatureObject *)registry->signature)->the_signature;
+    size_t nops = ps->arg_count;
+    size_t arg_ndim[GUFT_MAXARGS];
+    const size_t *arg_shapes[GUFT_MAXARGS];
+    char *types = call->types;
+    resolve_error error = { NULL, 0, 0 };
+    guft_kernel kernel;
+    size_t kernel_stats_site;
+    size_t given;
+    int tune;
+    uint64_t start = 0;
+
+    memset(call, 0, offsetof(prepared_call, views));
+    call->signature = ps;
+    call->nops = nops;
+
+    given = (size_t)PyTuple_GET_SIZE(operands);
+    if (given != nops && given != ps->input_count) {
+        PyErr_Format(PyExc_TypeError,
+                     "the gufunc takes %zu inputs and optionally %zu outputs "
+                     "(%zu operands given)", ps->input_count,
+                     ps->output_count, given);
+        return -1;
+    }
+    if (ps->dimension_variable_count > GUFT_MAX_DIMENSION_VARIABLES) {
+        PyErr_Format(PyExc_ValueError,
+                     "gufuncs are limited to %d dimension variables",
+                     GUFT_MAX_DIMENSION_VARIABLES);
+        return -1;
+    }
+
+    Py_INCREF(registry);
+    call->registry = registry;
+    if (given == nops) {
+        Py_INCREF(operands);
+        call->operand_objects = operands;
+    } else {
+        /* the outputs are added once allocated */
+        call->operand_objects = PyTuple_New((Py_ssize_t)nops);
+        if (call->operand_objects == NULL)
+            goto fail;
+        for (size_t op = 0; op < given; op++) {
+            PyObject *obj = PyTuple_GET_ITEM(operands, op);
+            Py_INCREF(obj);
+            PyTuple_SET_ITEM(call->operand_objects, op, obj);
+        }
+    }
+
+    for (size_t op = 0; op < nops; op++) {
+        arg_ndim[op] = 0;
+        arg_shapes[op] = NULL;
+        if (op >= given)
+            continue;
+        if (get_operand(call, op, PyTuple_GET_ITEM(operands, op),
+                        types + op) != 0)
+            goto fail;
+        arg_ndim[op] = call->operands[op].ndim;
+        arg_shapes[op] = call->shapes[op];
+    }
+
+    if (GUFT_ATOMIC_LOAD(stats_enabled))
+        start = stats_now();
+    call->resolved.dimension_sizes = call->dimension_sizes;
+    if (resolve_shapes(ps, arg_ndim, arg_shapes, &call->resolved,
+                       &error) != 0) {
+        PyErr_Format(PyExc_ValueError, "%s (argument %zu, axis %zu)",
+                     error.message, error.arg, error.axis);
+        goto fail;
+    }
+    if (GUFT_ATOMIC_LOAD(stats_enabled))
+        stats_record_phase(registry_stats_site(registry), GUFT_PHASE_RESOLVE,
+                           stats_now() - start);
+
+    /* kernels are tuned per stats site */
+    tune = (flags & GUFT_CALL_TUNE) || GUFT_ATOMIC_LOAD(tuning_enabled);
+    if (registry_get_kernel(registry, types, given == nops,
+                            call->dimension_sizes, tune, &kernel,
+                            &call->kernel_owner, &kernel_stats_site) != 0)
+        goto fail;
+
+    if (given < nops && (flags & GUFT_CALL_UNALLOCATED)) {
+        for (size_t op = given; op < nops; op++) {
+            if (lay_out_output(call, op, types[op]) != 0)
+                goto fail;
+        }
+    } else if (given < nops) {
+        guft_module_state *state = get_state_by_type(Py_TYPE(registry));
+        if (state == NULL)
+            goto fail;
+        for (size_t op = given; op < nops; op++) {
+            if (allocate_output(state, call, op, types[op]) != 0)
+                goto fail;
+        }
+    }
+
+    call->plan = malloc(execution_plan_size(ps));
+    if (call->plan == NULL) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+    if (init_execution_plan(call->plan, ps, &call->resolved, call->operands,
+                            kernel) != 0) {
+        PyErr_SetString(PyExc_ValueError, "can not execute this gufunc");
+        goto fail;
+    }
+    if (!(flags & GUFT_CALL_IN_ORDER))
+        order_execution_plan(call->plan,
+                             GUFT_ATOMIC_LOAD(executor_tile_size));
+    if (analyze_plan_overlap(call->plan, &call->overlap,
+                             GUFT_OVERLAP_BLOCK_SIZE) > 0)
+        call->plan->copies = &call->overlap;
+    call->buffered = enable_plan_buffering(
+        call->plan, GUFT_ATOMIC_LOAD(executor_buffer_size));
+    if (GUFT_ATOMIC_LOAD(stats_enabled)) {
+        call->plan->stats_site = registry_stats_site(registry);
+        call->plan->kernel_stats_site = kernel_stats_site;
+    }
+
+    if (kernel.flags & GUFT_KERNEL_REPORTS_STATUS) {
+        call->status.mask = calloc((call->resolved.element_count + 7)/8 + 1,
+                                   1);
+        if (call->status.mask == NULL) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        call->plan->status = &call->status;
+    }
+
+    call->min_chunk = GUFT_ATOMIC_LOAD(executor_min_chunk);
+    if (tune && kernel_stats_site != 0)
+        tune_prepared_call(call, kernel_stats_site,
+                           (flags & GUFT_CALL_TUNE) ||
+                           GUFT_ATOMIC_LOAD(tuning_learn));
+    return 0;
+
+ fail:
+    release_prepared_call(call);
+    return -1;
+}
+
+void
+tune_prepared_call(prepared_call *call, size_t site, int learn)
+{
+    execution_plan *plan = call->plan;
+    tuned_params defaults, params;
+    size_t element_bytes = 0;
+
+    for (size_t op = 0; op < plan->nops; op++)
+        element_bytes += plan->operands[op].element_size;
+
+    defaults.thread_count = 0;
+    defaults.min_chunk = GUFT_ATOMIC_LOAD(executor_min_chunk);
+    defaults.buffer_size = GUFT_ATOMIC_LOAD(executor_buffer_size);
+    call->tuning_site = site;
+    call->tuning_bucket = tuning_bucket(element_bytes);
+    tuning_params(site, call->tuning_bucket, &defaults, call->buffered > 0,
+                  learn, &params, &call->tuning_trial);
+
+    call->min_chunk = params.min_chunk;
+    plan->thread_limit = params.thread_count;
+    if (params.buffer_size != defaults.buffer_size && call->buffered > 0)
+        enable_plan_buffering(plan, params.buffer_size);
+}
+
+void
+run_prepared_call(prepared_call *call)
+{
+    uint64_t start = 0;
+
+    /* the copies are a snapshot of the inputs, so they are made right
+       before running, not when the call is prepared */
+    if (call->plan->copies != NULL &&
+        copy_overlapping_blocks(&call->overlap, call->plan) != 0) {
+        call->out_of_memory = 1;
+        return;
+    }
+    if (call->tuning_trial != 0)
+        start = stats_now();
+    execute_plan_parallel(call->plan, call->min_chunk);
+    if (call->plan->out_of_memory)
+        call->out_of_memory = 1;
+    if (call->tuning_trial != 0 &&
+        tuning_report(call->tuning_site, call->tuning_bucket,
+                      call->tuning_trial, stats_now() - start,
+                      call->resolved.element_count) == 1)
+        tuning_save_cache();
+    release_overlap_copies(&call->overlap);
+}
+
+PyObject *
+finish_prepared_call(prepared_call *call)
+{
+    const parsed_signature *ps = call->signature;
+    size_t nin = ps->input_count;
+    PyObject *outputs;
+
+    if (call->out_of_memory)
+        return PyErr_NoMemory();
+
+    if (ps->output_count == 1) {
+        outputs = PyTuple_GET_ITEM(call->operand_objects, nin);
+        Py_INCREF(outputs);
+    } else {
+        outputs = PyTuple_GetSlice(call->operand_objects, (Py_ssize_t)nin,
+                                   (Py_ssize_t)call->nops);
+        if (outputs == NULL)
+            return NULL;
+    }
+
+    if (call->status.failures > 0) {
+        guft_module_state *state = get_state_by_type(Py_TYPE(call->registry));
+        if (state != NULL)
+            raise_partial_success(state, &call->status,
+                                  call->resolved.element_count, outputs);
+        Py_DECREF(outputs);
+        return NULL;
+    }
+
+    return outputs;
+}
+
+void
+release_prepared_call(prepared_call *call)
+{
+    release_views(call);
+    release_overlap_copies(&call->overlap);
+    free(call->plan);
+    free(call->status.mask);
+    call->plan = NULL;
+    call->status.mask = NULL;
+    Py_CLEAR(call->kernel_owner);
+    Py_CLEAR(call->operand_objects);
+    Py_CLEAR(call->registry);
+}
+
+PyObject *
+registry_call(guft_KernelRegistryObject *self, PyObject *args,
+              PyObject *kwargs)
+{
+    prepared_call *call;
+    PyObject *rv;
+
+    if (kwargs != NULL && PyDict_GET_SIZE(kwargs) != 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "gufunc calls take no keyword arguments");
+        return NULL;
+    }
+    if (self->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        return NULL;
+    }
+
+    /* too large for the stack */
+    call = malloc(sizeof(prepared_call));
+    if (call == NULL)
+        return PyErr_NoMemory();
+    if (prepare_call(call, self, args, 0) != 0) {
+        free(call);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    run_prepared_call(call);
+    Py_END_ALLOW_THREADS
+
+    rv = finish_prepared_call(call);
+    release_prepared_call(call);
+    free(call);
+    return rv;
+}
@@ -0,0 +1,734 @@
+#include <Python.h>
+#include <structmember.h>
+
+#include <string.h>
+
+#include "dispatch.h"
+#include "stats.h"
+#include "tuner.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Kernel objects
+ *
+ * From Python, kernels are passed around as PyCapsules named
+ * GUFT_KERNEL_CAPSULE_NAME, holding the kernel function as pointer and its
+ * data as context. Capsules named GUFT_STATUS_KERNEL_CAPSULE_NAME are the
+ * same for kernels reporting per element status. For convenience, plain
+ * integer addresses (like the ones from ctypes) and objects with an integer
+ * "address" attribute (like numba cfuncs) are accepted as well, with NULL
+ * data.
+ */
+
+int
+kernel_from_object(PyObject *obj, guft_kernel *kernel)
+{
+    PyObject *address = NULL;
+    void *func;
+
+    kernel->flags = 0;
+
+    if (PyCapsule_CheckExact(obj)) {
+        const char *name = PyCapsule_GetName(obj);
+        if (name != NULL && strcmp(name, GUFT_STATUS_KERNEL_CAPSULE_NAME) == 0)
+            kernel->flags = GUFT_KERNEL_REPORTS_STATUS;
+        else
+            name = GUFT_KERNEL_CAPSULE_NAME;
+        func = PyCapsule_GetPointer(obj, name);
+        if (func == NULL)
+            return -1;
+        kernel->func = (guft_kernel_func)func;
+        kernel->data = PyCapsule_GetContext(obj);
+        return 0;
+    }
+
+    if (PyLong_Check(obj)) {
+        Py_INCREF(obj);
+        address = obj;
+    } else {
+        address = PyObject_GetAttrString(obj, "address");
+        if (address == NULL || !PyLong_Check(address)) {
+            Py_XDECREF(address);
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError,
+                         "a kernel must be a '%s' capsule, an address or "
+                         "an object with an address attribute, not '%.200s'",
+                         GUFT_KERNEL_CAPSULE_NAME, Py_TYPE(obj)->tp_name);
+            return -1;
+        }
+    }
+
+    func = PyLong_AsVoidPtr(address);
+    Py_DECREF(address);
+    if (func == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "NULL kernel address");
+        return -1;
+    }
+
+    kernel->func = (guft_kernel_func)func;
+    kernel->data = NULL;
+    return 0;
+}
+
+
+/* -----------------------------------------------------------------------------
+ * KernelRegistry objects
+ *
+ * KernelRegistry(signature, generator=None, name=None) maps operand types
+ * to kernels for a gufunc with the given signature. Lookups are a hash
+ * table probe. When a lookup misses and there is a generator, it is called
+ * with the types string and whatever kernel it returns is registered, so it
+ * is only called once per type combination. This is the hook for tools that
+ * compile kernels on demand, like numba.
+ *
+ * The name identifies the gufunc in the runtime stats (and its kernels in
+ * the autotuner, see tuner.h). Registries with the same name share their
+ * counters, so names must be unique. Registries with no name are not
+ * counted: a default like the signature would mix unrelated gufuncs.
+ *
+ * Kernels can also be registered for some sizes of the dimension variables
+ * with register(types, kernel, sizes), where sizes has an int (or None for
+ * any size) per dimension variable. Calls use the matching specialization
+ * with most fixed sizes, then the kernel for any sizes. The generator is
+ * only called for types with nothing registered at all.
+ *
+ * Calling the registry runs the gufunc on buffer protocol objects
+ * (memoryview, array.array or anything exporting PEP 3118 buffers): shapes,
+ * strides and formats come from the buffers and the kernel works on their
+ * memory, with no copies nor NumPy involved. The outputs can be left out to
+ * have them allocated as Buffer objects. The execution releases the GIL and
+ * uses the thread pool.
+ *
+ * The kernel table is only changed and read within critical sections of the
+ * registry, and calls copy their kernel out, so registries can be shared by
+ * threads in free-threaded builds.
+ */
+
+/* Normalize a types string into one code per operand: "ff->f", "ff,f" and
+   "fff" are all the same. Returns 0 on success, -1 with an exception set */
+static int
+normalize_types(guft_KernelRegistryObject *self, PyObject *types_obj,
+                char *types)
+{
+    size_t nops = self->registry.nops;
+    size_t count = 0;
+    Py_ssize_t len;
+    const char *str;
+
+    if (!PyUnicode_Check(types_obj)) {
+        PyErr_SetString(PyExc_TypeError, "types must be a str");
+        return -1;
+    }
+    str = PyUnicode_AsUTF8AndSize(types_obj, &len);
+    if (str == NULL)
+        return -1;
+
+    for (Py_ssize_t i = 0; i < len; i++) {
+        char ch = str[i];
+        if (ch == ' ' || ch == ',')
+            continue;
+        if (ch == '-' && i + 1 < len && str[i+1] == '>') {
+            i++;
+            continue;
+        }
+        if (count == nops) {
+            count++;
+            break;
+        }
+        types[count++] = ch;
+    }
+
+    if (count != nops) {
+        PyErr_Format(PyExc_ValueError,
+                     "types '%s' do not have %zu operands", str, nops);
+        return -1;
+    }
+    return 0;
+}
+
+size_t kernel_generation;
+
+static int
+register_kernel(guft_KernelRegistryObject *self, const char *types,
+                PyObject *kernel_obj)
+{
+    guft_kernel kernel;
+    void *replaced = NULL;
+
+    if (kernel_from_object(kernel_obj, &kernel) != 0)
+        return -1;
+
+    Py_INCREF(kernel_obj);
+    if (kernel_registry_insert(&self->registry, types, kernel, kernel_obj,
+                               &replaced) != 0) {
+        Py_DECREF(kernel_obj);
+        PyErr_NoMemory();
+        return -1;
+    }
+    GUFT_ATOMIC_INCREMENT(kernel_generation);
+    Py_XDECREF((PyObject *)replaced);
+    return 0;
+}
+
+/* Get the sizes of a specialization from a sequence with an int or None
+   per dimension variable. Returns the number of fixed sizes, or -1 with an
+   exception set */
+static Py_ssize_t
+specialization_sizes(guft_KernelRegistryObject *self, PyObject *sizes_obj,
+                     size_t *sizes)
+{
+    const parsed_signature *ps =
+        ((guft_SignatureObject *)self->signature)->the_signature;
+    size_t nvars = ps->dimension_variable_count;
+    Py_ssize_t fixed_count = 0;
+    PyObject *seq;
+
+    seq = PySequence_Fast(sizes_obj, "sizes must be a sequence");
+    if (seq == NULL)
+        return -1;
+    if ((size_t)PySequence_Fast_GET_SIZE(seq) != nvars) {
+        PyErr_Format(PyExc_ValueError, "sizes must have %zu entries, one per "
+                     "dimension variable", nvars);
+        Py_DECREF(seq);
+        return -1;
+    }
+
+    for (size_t var = 0; var < nvars; var++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, var);
+        size_t fixed = ps->dimension_fixed_sizes[var];
+
+        sizes[var] = GUFT_FREE_DIMENSION;
+        if (item == Py_None)
+            continue;
+        sizes[var] = PyLong_AsSize_t(item);
+        if (sizes[var] == (size_t)-1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        if (fixed != GUFT_FREE_DIMENSION && fixed != sizes[var]) {
+            PyErr_Format(PyExc_ValueError, "dimension variable %zu has size "
+                         "%zu in the signature", var, fixed);
+            Py_DECREF(seq);
+            return -1;
+        }
+        fixed_count++;
+    }
+
+    Py_DECREF(seq);
+    return fixed_count;
+}
+
+static int
+register_specialization(guft_KernelRegistryObject *self, const char *types,
+                        const size_t *sizes, PyObject *kernel_obj)
+{
+    guft_kernel kernel;
+    void *replaced = NULL;
+
+    if (kernel_from_object(kernel_obj, &kernel) != 0)
+        return -1;
+
+    Py_INCREF(kernel_obj);
+    if (kernel_registry_insert_specialization(&self->registry, types, sizes,
+                                              kernel, kernel_obj,
+                                              &replaced) != 0) {
+        Py_DECREF(kernel_obj);
+        PyErr_NoMemory();
+        return -1;
+    }
+    GUFT_ATOMIC_INCREMENT(kernel_generation);
+    Py_XDECREF((PyObject *)replaced);
+    return 0;
+}
+
+const guft_kernel *
+registry_select_kernel(guft_KernelRegistryObject *self,
+                       const kernel_registry_entry *entry,
+                       const size_t *dimension_sizes)
+{
+    const guft_kernel *kernel = kernel_registry_select(&self->registry, entry,
+                                                       dimension_sizes);
+
+    if (kernel == NULL) {
+        PyObject *types = PyUnicode_FromStringAndSize(entry->types,
+                                                      self->registry.nops);
+        if (types != NULL) {
+            PyErr_Format(PyExc_KeyError, "no kernel for types '%U' with "
+                         "these core sizes", types);
+            Py_DECREF(types);
+        }
+    }
+    return kernel;
+}
+
+size_t
+registry_stats_site(guft_KernelRegistryObject *self)
+{
+    if (self->stats_site == 0 && self->name != NULL) {
+        const char *name = PyUnicode_AsUTF8(self->name);
+        if (name == NULL)
+            PyErr_Clear();
+        else
+            self->stats_site = stats_site(name);
+    }
+    return self->stats_site;
+}
+
+size_t
+registry_kernel_stats_site(guft_KernelRegistryObject *self,
+                           const kernel_registry_entry *entry)
+{
+    if (entry->stats_site == 0 && self->name != NULL) {
+        PyObject *types = PyUnicode_FromStringAndSize(entry->types,
+                                                      self->registry.nops);
+        PyObject *name = types ? PyUnicode_FromFormat("%U[%U]", self->name,
+                                                      types) : NULL;
+        const char *str = name ? PyUnicode_AsUTF8(name) : NULL;
+        Py_XDECREF(types);
+        if (str == NULL)
+            PyErr_Clear();
+        else /* the entry is ours, lookups just hand it out as const */
+            ((kernel_registry_entry *)entry)->stats_site = stats_site(str);
+        Py_XDECREF(name);
+    }
+    return entry->stats_site;
+}
+
+static const kernel_registry_entry *
+find_kernel(guft_KernelRegistryObject *self, const char *types)
+{
+    const kernel_registry_entry *entry;
+    PyObject *types_obj, *generated;
+
+    entry = kernel_registry_lookup(&self->registry, types);
+    if (entry != NULL)
+        return entry;
+
+    types_obj = PyUnicode_FromStringAndSize(types, self->registry.nops);
+    if (types_obj == NULL)
+        return NULL;
+
+    if (self->generator == NULL || self->generator == Py_None) {
+        PyErr_Format(PyExc_KeyError, "no kernel for types '%U'", types_obj);
+        Py_DECREF(types_obj);
+        return NULL;
+    }
+
+    generated = PyObject_CallFunctionObjArgs(self->generator, types_obj, NULL);
+    if (generated == NULL) {
+        Py_DECREF(types_obj);
+        return NULL;
+    }
+
+    if (generated == Py_None) {
+        Py_DECREF(generated);
+        PyErr_Format(PyExc_KeyError, "no kernel for types '%U'", types_obj);
+        Py_DECREF(types_obj);
+        return NULL;
+    }
+    Py_DECREF(types_obj);
+
+    if (register_kernel(self, types, generated) != 0) {
+        Py_DECREF(generated);
+        return NULL;
+    }
+    Py_DECREF(generated);
+
+    return kernel_registry_lookup(&self->registry, types);
+}
+
+const kernel_registry_entry *
+registry_find_kernel(guft_KernelRegistryObject *self, const char *types)
+{
+    const kernel_registry_entry *entry;
+    size_t site;
+    uint64_t start, ns;
+
+    if (!GUFT_ATOMIC_LOAD(stats_enabled))
+        return find_kernel(self, types);
+
+    site = registry_stats_site(self);
+    start = stats_now();
+    entry = find_kernel(self, types);
+    ns = stats_now() - start;
+
+    stats_record_phase(site, GUFT_PHASE_DISPATCH, ns);
+    if (entry != NULL)
+        stats_record_phase(registry_kernel_stats_site(self, entry),
+                           GUFT_PHASE_DISPATCH, ns);
+    return entry;
+}
+
+const kernel_registry_entry *
+registry_find_kernel_for_inputs(guft_KernelRegistryObject *self, char *types)
+{
+    const kernel_registry *table = &self->registry;
+    size_t nin = ((guft_SignatureObject *)self->signature)->the_signature->
+        input_count;
+    const kernel_registry_entry *entry;
+
+    /* most kernels output the type of their first input, if any */
+    if (nin > 0) {
+        memset(types + nin, types[0], table->nops - nin);
+        entry = kernel_registry_lookup(table, types);
+        if (entry != NULL)
+            return entry;
+    }
+
+    /* otherwise the first one registered for these inputs */
+    entry = kernel_registry_lookup_inputs(table, types);
+    if (entry != NULL) {
+        memcpy(types, entry->types, table->nops);
+        return entry;
+    }
+
+    /* without inputs there is no type to ask the generator for */
+    if (nin == 0) {
+        PyErr_SetString(PyExc_KeyError, "no kernel registered to tell the "
+                        "types of the outputs");
+        return NULL;
+    }
+
+    /* maybe the generator knows */
+    return registry_find_kernel(self, types);
+}
+
+/* claim the stats site of an entry for its kernel, so a gufunc sharing the
+   name does not share its tuning. Specializations go with the entry, so
+   the first one stands for an entry that has only those */
+static void
+claim_kernel_site(const kernel_registry_entry *entry)
+{
+    const guft_kernel *kernel = &entry->kernel;
+
+    if (kernel->func == NULL && entry->specialization_count > 0)
+        kernel = &entry->specializations[0].kernel;
+    tuning_claim(entry->stats_site, (uintptr_t)kernel->func,
+                 (uintptr_t)kernel->data);
+}
+
+/* the object a kernel selected from entry was registered as */
+static PyObject *
+kernel_owner(const kernel_registry_entry *entry, const guft_kernel *kernel)
+{
+    for (size_t k = 0; k < entry->specialization_count; k++) {
+        if (kernel == &entry->specializations[k].kernel)
+            return (PyObject *)entry->specializations[k].owner;
+    }
+    return (PyObject *)entry->owner;
+}
+
+int
+registry_get_kernel(guft_KernelRegistryObject *self, char *types,
+                    int outputs_known, const size_t *dimension_sizes,
+                    int need_site, guft_kernel *kernel, PyObject **owner,
+                    size_t *kernel_stats_site)
+{
+    const kernel_registry_entry *entry;
+    const guft_kernel *selected = NULL;
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    entry = outputs_known ? registry_find_kernel(self, types) :
+        registry_find_kernel_for_inputs(self, types);
+    if (entry != NULL)
+        selected = registry_select_kernel(self, entry, dimension_sizes);
+    if (selected != NULL) {
+        *kernel = *selected;
+        *owner = kernel_owner(entry, selected);
+        Py_XINCREF(*owner);
+        *kernel_stats_site = GUFT_ATOMIC_LOAD(stats_enabled) || need_site ?
+            registry_kernel_stats_site(self, entry) : 0;
+        if (need_site && *kernel_stats_site != 0)
+            claim_kernel_site(entry);
+    }
+    GUFT_END_CRITICAL_SECTION();
+
+    return selected != NULL ? 0 : -1;
+}
+
+static void
+release_owners(guft_KernelRegistryObject *self)
+{
+    for (size_t i = 0; i < self->registry.capacity; i++) {
+        kernel_registry_entry *entry = self->registry.entries + i;
+        if (!entry->used)
+            continue;
+        Py_CLEAR(*(PyObject **)&entry->owner);
+        for (size_t k = 0; k < entry->specialization_count; k++)
+            Py_CLEAR(*(PyObject **)&entry->specializations[k].owner);
+    }
+}
+
+static int
+KernelRegistry_traverse(guft_KernelRegistryObject *self, visitproc visit,
+                        void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->signature);
+    Py_VISIT(self->generator);
+    for (size_t i = 0; i < self->registry.capacity; i++) {
+        kernel_registry_entry *entry = self->registry.entries + i;
+        if (!entry->used)
+            continue;
+        Py_VISIT((PyObject *)entry->owner);
+        for (size_t k = 0; k < entry->specialization_count; k++)
+            Py_VISIT((PyObject *)entry->specializations[k].owner);
+    }
+    return 0;
+}
+
+static int
+KernelRegistry_clear(guft_KernelRegistryObject *self)
+{
+    Py_CLEAR(self->generator);
+    release_owners(self);
+    kernel_registry_clear(&self->registry);
+    return 0;
+}
+
+static void
+KernelRegistry_dealloc(guft_KernelRegistryObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    KernelRegistry_clear(self);
+    Py_CLEAR(self->signature);
+    Py_CLEAR(self->name);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static int
+KernelRegistry_init(guft_KernelRegistryObject *self,
+                    PyObject *args,
+                    PyObject *kwds)
+{
+    guft_module_state *state = get_state_by_type(Py_TYPE(self));
+    PyObject *signature_obj, *generator = Py_None, *name = Py_None;
+    guft_SignatureObject *signature;
+    int rv = -1;
+
+    static char *kwlist[] = { "signature", "generator", "name", NULL };
+
+    if (state == NULL)
+        return -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist,
+                                     &signature_obj, &generator, &name))
+        return -1;
+
+    if (generator != Py_None && !PyCallable_Check(generator)) {
+        PyErr_SetString(PyExc_TypeError, "generator must be callable");
+        return -1;
+    }
+
+    if (name == Py_None) {
+        name = NULL; /* no stats for it */
+    } else if (!PyUnicode_Check(name)) {
+        PyErr_SetString(PyExc_TypeError, "name must be a str");
+        return -1;
+    }
+
+    signature = signature_from_object(state, signature_obj);
+    if (signature == NULL)
+        return -1;
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    if (self->signature != NULL) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "KernelRegistry can not be initialized twice");
+    } else if (kernel_registry_init(
+                   &self->registry, signature->the_signature->arg_count,
+                   signature->the_signature->input_count,
+                   signature->the_signature->dimension_variable_count) != 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "gufuncs are limited to %d operands", GUFT_MAXARGS);
+    } else {
+        Py_INCREF(signature);
+        self->signature = (PyObject *)signature;
+        Py_INCREF(generator);
+        Py_XSETREF(self->generator, generator);
+        Py_XINCREF(name);
+        self->name = name;
+        rv = 0;
+    }
+    GUFT_END_CRITICAL_SECTION();
+
+    Py_DECREF(signature);
+    return rv;
+}
+
+static PyObject *
+KernelRegistry_register(guft_KernelRegistryObject *self, PyObject *args,
+                        PyObject *kwds)
+{
+    PyObject *types_obj, *kernel_obj, *sizes_obj = Py_None;
+    char types[GUFT_MAXARGS];
+    size_t sizes[GUFT_MAX_DIMENSION_VARIABLES];
+    Py_ssize_t fixed_count = 0;
+    int status;
+
+    static char *kwlist[] = { "types", "kernel", "sizes", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|O", kwlist, &types_obj,
+                                     &kernel_obj, &sizes_obj))
+        return NULL;
+
+    if (self->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        return NULL;
+    }
+    if (normalize_types(self, types_obj, types) != 0)
+        return NULL;
+
+    if (sizes_obj != Py_None) {
+        if (self->registry.dimension_variable_count >
+            GUFT_MAX_DIMENSION_VARIABLES) {
+            PyErr_Format(PyExc_ValueError,
+                         "gufuncs are limited to %d dimension variables",
+                         GUFT_MAX_DIMENSION_VARIABLES);
+            return NULL;
+        }
+        fixed_count = specialization_sizes(self, sizes_obj, sizes);
+        if (fixed_count < 0)
+            return NULL;
+    }
+
+    /* no fixed sizes is the same as no sizes at all */
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    status = fixed_count > 0 ?
+        register_specialization(self, types, sizes, kernel_obj) :
+        register_kernel(self, types, kernel_obj);
+    GUFT_END_CRITICAL_SECTION();
+    if (status != 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+KernelRegistry_subscript(guft_KernelRegistryObject *self, PyObject *key)
+{
+    const kernel_registry_entry *entry;
+    PyObject *rv = NULL;
+    char types[GUFT_MAXARGS];
+
+    if (normalize_types(self, key, types) != 0)
+        return NULL;
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    entry = registry_find_kernel(self, types);
+    if (entry != NULL && entry->owner == NULL) {
+        PyErr_Format(PyExc_KeyError, "only specialized kernels for types %R",
+                     key);
+    } else if (entry != NULL) {
+        rv = (PyObject *)entry->owner;
+        Py_INCREF(rv);
+    }
+    GUFT_END_CRITICAL_SECTION();
+
+    return rv;
+}
+
+static Py_ssize_t
+KernelRegistry_length(guft_KernelRegistryObject *self)
+{
+    Py_ssize_t rv;
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    rv = (Py_ssize_t)self->registry.count;
+    GUFT_END_CRITICAL_SECTION();
+    return rv;
+}
+
+static PyObject *
+KernelRegistry_types(guft_KernelRegistryObject *self)
+{
+    PyObject *rv = PyList_New(0);
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    for (size_t i = 0; rv != NULL && i < self->registry.capacity; i++) {
+        kernel_registry_entry *entry = self->registry.entries + i;
+        PyObject *types;
+        if (!entry->used)
+            continue;
+        types = PyUnicode_FromStringAndSize(entry->types,
+                                            self->registry.nops);
+        if (types == NULL || PyList_Append(rv, types) < 0)
+            Py_CLEAR(rv);
+        Py_XDECREF(types);
+    }
+    GUFT_END_CRITICAL_SECTION();
+
+    return rv;
+}
+
+static PyMemberDef guft_KernelRegistryObject_members[] = {
+    {"signature", T_OBJECT, offsetof(guft_KernelRegistryObject, signature),
+     READONLY, "Signature of the gufunc"},
+    {"generator", T_OBJECT, offsetof(guft_KernelRegistryObject, generator),
+     0, "Callable called with the types on a lookup miss, or None"},
+    {"name", T_OBJECT, offsetof(guft_KernelRegistryObject, name),
+     READONLY, "Name of the gufunc in the runtime stats, or None"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef guft_KernelRegistryObject_methods[] = {
+    {"register", (PyCFunction)KernelRegistry_register,
+     METH_VARARGS | METH_KEYWORDS,
+     "register(types, kernel, sizes=None): adds or replaces the kernel for "
+     "types. With sizes, an int or None per dimension variable, the kernel "
+     "is only used for calls with those sizes"
+    },
+    {"lookup", (PyCFunction)KernelRegistry_subscript, METH_O,
+     "lookup(types): returns the kernel for types, calling the generator "
+     "on a miss. Same as registry[types]"
+    },
+    {"types", (PyCFunction)KernelRegistry_types, METH_NOARGS,
+     "Returns a list with the registered types"
+    },
+    {"call_async", (PyCFunction)registry_call_async, METH_VARARGS,
+     "call_async(*operands): runs the gufunc on buffer objects, inputs and "
+     "outputs, in the background. Returns a Future"
+    },
+    {"reduce", (PyCFunction)registry_reduce, METH_VARARGS | METH_KEYWORDS,
+     "reduce(operand, axes=0, identity=None, out=None, associative=True, "
+     "deterministic=False): reduces operand along outer axes with the "
+     "gufunc, in parallel. Returns the result"
+    },
+    {"lazy", (PyCFunction)registry_lazy, METH_VARARGS,
+     "lazy(*inputs): records the call without running it. Inputs can be "
+     "buffer objects or Lazy objects. Returns a Lazy to evaluate"
+    },
+    {"stream", (PyCFunction)registry_stream, METH_VARARGS | METH_KEYWORDS,
+     "stream(*operands, sink=None, budget=None): runs the gufunc in chunks "
+     "along the first outer axis of about budget bytes, reading the inputs "
+     "of a chunk while the previous one runs. Outputs are given, or left "
+     "out and passed to sink(start, stop, outputs) a chunk at a time"
+    },
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot guft_KernelRegistry_slots[] = {
+    {Py_tp_dealloc, (void *)KernelRegistry_dealloc},
+    {Py_tp_traverse, (void *)KernelRegistry_traverse},
+    {Py_tp_clear, (void *)KernelRegistry_clear},
+    {Py_tp_call, (void *)registry_call},
+    {Py_mp_length, (void *)KernelRegistry_length},
+    {Py_mp_subscript, (void *)KernelRegistry_subscript},
+    {Py_tp_methods, guft_KernelRegistryObject_methods},
+    {Py_tp_members, guft_KernelRegistryObject_members},
+    {Py_tp_init, (void *)KernelRegistry_init},
+    {Py_tp_new, (void *)PyType_GenericNew},
+    {Py_tp_doc, (void *)"Kernel dispatch registry for a gufunc signature"},
+    {0, NULL}
+};
+
+PyType_Spec guft_KernelRegistry_spec = {
+    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".KernelRegistry", /* name */
+    sizeof(guft_KernelRegistryObject),                    /* basicsize */
+    0,                                                    /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* flags */
+    guft_KernelRegistry_slots,                            /* slots */
+};
@@ -0,0 +1,361 @@
+#include <Python.h>
+#include <pythread.h>
+
+#include <stdlib.h>
+
+#include "background.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Future objects
+ *
+ * KernelRegistry.call_async(*operands) prepares the call with the GIL held
+ * and queues its execution as a background job (see background.h), that
+ * runs without the GIL. It returns a Future, modeled after the ones in
+ * concurrent.futures:
+ *
+ *   - result(timeout=None): waits for the call and returns its outputs, or
+ *     raises its exception.
+ *   - exception(timeout=None): waits for the call and returns its
+ *     exception, or None.
+ *   - done(): whether the call finished.
+ *   - add_done_callback(fn): fn(future) is called when the call finishes
+ *     (right away if it already did). Callbacks run in the thread finishing
+ *     the call. Adding them and finishing the call are critical sections of
+ *     the future, so no callback is lost to a race in free-threaded builds.
+ *
+ * The operands are referenced and their buffers held until the call
+ * finishes, so they stay alive and can not be resized. Their contents must
+ * not be modified meanwhile.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    prepared_call *call; /* NULL once finished */
+    int finished;
+    PyObject *result;
+    PyObject *exception; /* an instance */
+    PyObject *callbacks; /* list, NULL once finished */
+    PyThread_type_lock done_lock; /* held until finished */
+} guft_FutureObject;
+
+/* with the GIL held, in the thread that ran the call */
+static void
+complete_future(guft_FutureObject *self)
+{
+    PyObject *callbacks;
+
+    self->result = finish_prepared_call(self->call);
+    if (self->result == NULL) {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        if (value != NULL && traceback != NULL)
+            PyException_SetTraceback(value, traceback);
+        self->exception = value;
+        Py_XDECREF(type);
+        Py_XDECREF(traceback);
+    }
+    release_prepared_call(self->call);
+    free(self->call);
+    self->call = NULL;
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    self->finished = 1;
+    callbacks = self->callbacks;
+    self->callbacks = NULL;
+    GUFT_END_CRITICAL_SECTION();
+    PyThread_release_lock(self->done_lock);
+
+    for (Py_ssize_t i = 0; callbacks && i < PyList_GET_SIZE(callbacks); i++) {
+        PyObject *callback = PyList_GET_ITEM(callbacks, i);
+        PyObject *rv = PyObject_CallFunctionObjArgs(callback, (PyObject *)self,
+                                                    NULL);
+        if (rv == NULL)
+            PyErr_WriteUnraisable(callback);
+        Py_XDECREF(rv);
+    }
+    Py_XDECREF(callbacks);
+}
+
+/* the background job */
+static void
+run_future(void *ctx)
+{
+    guft_FutureObject *self = ctx;
+    PyGILState_STATE gstate;
+
+    run_prepared_call(self->call);
+
+    gstate = PyGILState_Ensure();
+    complete_future(self);
+    Py_DECREF(self); /* the reference of the job */
+    PyGILState_Release(gstate);
+}
+
+PyObject *
+registry_call_async(guft_KernelRegistryObject *self, PyObject *args)
+{
+    guft_module_state *state = get_state_by_type(Py_TYPE(self));
+    guft_FutureObject *future;
+    prepared_call *call;
+
+    if (state == NULL)
+        return NULL;
+    if (self->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        return NULL;
+    }
+
+    call = malloc(sizeof(prepared_call));
+    if (call == NULL)
+        return PyErr_NoMemory();
+    if (prepare_call(call, self, args, 0) != 0) {
+        free(call);
+        return NULL;
+    }
+
+    future = PyObject_GC_New(guft_FutureObject, state->FutureType);
+    if (future == NULL) {
+        release_prepared_call(call);
+        free(call);
+        return NULL;
+    }
+    future->call = call;
+    future->finished = 0;
+    future->result = NULL;
+    future->exception = NULL;
+    future->callbacks = PyList_New(0);
+    future->done_lock = PyThread_allocate_lock();
+    PyObject_GC_Track(future);
+    if (future->callbacks == NULL || future->done_lock == NULL) {
+        Py_DECREF(future);
+        return PyErr_NoMemory();
+    }
+    PyThread_acquire_lock(future->done_lock, WAIT_LOCK);
+
+    Py_INCREF(future); /* for the job */
+    if (background_submit(run_future, future) != 0) {
+        Py_DECREF(future);
+        Py_DECREF(future);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "could not start the background threads");
+        return NULL;
+    }
+
+    return (PyObject *)future;
+}
+
+PyObject *
+wait_for_futures(PyObject *UNUSED_VAR(self), PyObject *UNUSED_VAR(args))
+{
+    /* the jobs need the GIL to finish */
+    Py_BEGIN_ALLOW_THREADS
+    background_wait_idle();
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+/* Wait until the call finishes, for timeout seconds if it is not None.
+   Returns 1 if finished, 0 on timeout and -1 on error */
+static int
+wait_finished(guft_FutureObject *self, PyObject *timeout)
+{
+    PY_TIMEOUT_T microseconds = -1;
+    PyLockStatus status;
+
+    if (self->finished)
+        return 1;
+
+    if (timeout != Py_None) {
+        double seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return -1;
+        if (seconds < 0)
+            seconds = 0;
+        microseconds = seconds*1e6 < (double)PY_TIMEOUT_MAX ?
+            (PY_TIMEOUT_T)(seconds*1e6) : PY_TIMEOUT_MAX;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = PyThread_acquire_lock_timed(self->done_lock, microseconds, 0);
+    if (status == PY_LOCK_ACQUIRED)
+        PyThread_release_lock(self->done_lock);
+    Py_END_ALLOW_THREADS
+
+    /* finished is set before releasing done_lock */
+    return self->finished;
+}
+
+static PyObject *
+Future_result(guft_FutureObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *timeout = Py_None;
+    int finished;
+
+    static char *kwlist[] = { "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout))
+        return NULL;
+
+    finished = wait_finished(self, timeout);
+    if (finished < 0)
+        return NULL;
+    if (!finished) {
+        PyErr_SetNone(PyExc_TimeoutError);
+        return NULL;
+    }
+
+    if (self->exception != NULL) {
+        PyErr_SetObject((PyObject *)Py_TYPE(self->exception),
+                        self->exception);
+        return NULL;
+    }
+    Py_INCREF(self->result);
+    return self->result;
+}
+
+static PyObject *
+Future_exception(guft_FutureObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *timeout = Py_None;
+    int finished;
+
+    static char *kwlist[] = { "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeout))
+        return NULL;
+
+    finished = wait_finished(self, timeout);
+    if (finished < 0)
+        return NULL;
+    if (!finished) {
+        PyErr_SetNone(PyExc_TimeoutError);
+        return NULL;
+    }
+
+    if (self->exception == NULL)
+        Py_RETURN_NONE;
+    Py_INCREF(self->exception);
+    return self->exception;
+}
+
+static PyObject *
+Future_done(guft_FutureObject *self)
+{
+    return PyBool_FromLong(self->finished);
+}
+
+static PyObject *
+Future_add_done_callback(guft_FutureObject *self, PyObject *callback)
+{
+    PyObject *rv;
+    int status = 1; /* 1 if finished, so the callback is called here */
+
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "the callback must be callable");
+        return NULL;
+    }
+
+    GUFT_BEGIN_CRITICAL_SECTION(self);
+    if (!self->finished)
+        status = PyList_Append(self->callbacks, callback);
+    GUFT_END_CRITICAL_SECTION();
+    if (status < 0)
+        return NULL;
+    if (status == 0)
+        Py_RETURN_NONE;
+
+    rv = PyObject_CallFunctionObjArgs(callback, (PyObject *)self, NULL);
+    if (rv == NULL)
+        return NULL;
+    Py_DECREF(rv);
+    Py_RETURN_NONE;
+}
+
+static int
+Future_traverse(guft_FutureObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->result);
+    Py_VISIT(self->exception);
+    Py_VISIT(self->callbacks);
+    return 0;
+}
+
+static int
+Future_clear(guft_FutureObject *self)
+{
+    Py_CLEAR(self->result);
+    Py_CLEAR(self->exception);
+    /* pending callbacks are still to be called */
+    if (self->finished)
+        Py_CLEAR(self->callbacks);
+    return 0;
+}
+
+static void
+Future_dealloc(guft_FutureObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    /* the job holds a reference until the call finishes, so the call is only
+       left here if it was never submitted */
+    PyObject_GC_UnTrack(self);
+    if (self->call != NULL) {
+        release_prepared_call(self->call);
+        free(self->call);
+    }
+    Py_CLEAR(self->result);
+    Py_CLEAR(self->exception);
+    Py_CLEAR(self->callbacks);
+    if (self->done_lock != NULL)
+        PyThread_free_lock(self->done_lock);
+    PyObject_GC_Del(self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+Future_repr(guft_FutureObject *self)
+{
+    return PyUnicode_FromFormat("<%s at %p state=%s>",
+                                Py_TYPE(self)->tp_name, self,
+                                !self->finished ? "pending" :
+                                self->exception ? "raised" : "finished");
+}
+
+static PyMethodDef guft_FutureObject_methods[] = {
+    {"result", (PyCFunction)Future_result, METH_VARARGS | METH_KEYWORDS,
+     "result(timeout=None): waits for the call and returns its outputs"
+    },
+    {"exception", (PyCFunction)Future_exception,
+     METH_VARARGS | METH_KEYWORDS,
+     "exception(timeout=None): waits for the call and returns the exception "
+     "it raised, or None"
+    },
+    {"done", (PyCFunction)Future_done, METH_NOARGS,
+     "Returns whether the call finished"
+    },
+    {"add_done_callback", (PyCFunction)Future_add_done_callback, METH_O,
+     "add_done_callback(fn): calls fn(future) when the call finishes"
+    },
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot guft_Future_slots[] = {
+    {Py_tp_dealloc, (void *)Future_dealloc},
+    {Py_tp_traverse, (void *)Future_traverse},
+    {Py_tp_clear, (void *)Future_clear},
+    {Py_tp_repr, (void *)Future_repr},
+    {Py_tp_methods, guft_FutureObject_methods},
+    {Py_tp_doc, (void *)"Result of an asynchronous gufunc call"},
+    {0, NULL}
+};
+
+PyType_Spec guft_Future_spec = {
+    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".Future",   /* name */
+    sizeof(guft_FutureObject),                            /* basicsize */
+    0,                                                    /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | GUFT_TPFLAGS_NO_NEW, /* flags */
+    guft_Future_slots,                                    /* slots */
+};
@@ -0,0 +1,686 @@
+#include <Python.h>
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fusion.h"
+#include "stats.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Lazy expressions
+ *
+ * KernelRegistry.lazy(*inputs) does not run anything: it returns a Lazy
+ * object recording the call. Inputs can be buffer protocol objects or other
+ * Lazy objects, so chained calls build an expression graph. Only gufuncs
+ * with a single output can be called lazily.
+ *
+ * Lazy.evaluate(out) runs the whole expression, writing the result in out
+ * (a writable buffer object) and returning it. On evaluation:
+ *
+ *   - every call is resolved and gets its kernel. Intermediates get the
+ *     output types of the first registered kernel for their input types,
+ *     preferring the type of the first input.
+ *
+ *   - an intermediate used once, by a call over the same outer shape, is
+ *     fused with it: both run a block of outer elements at a time with the
+ *     intermediate in a small temporary (see fusion.h). Chains of such
+ *     calls end up as one fused group, and only the final output goes to
+ *     memory.
+ *
+ *   - other intermediates are materialized in full.
+ *
+ * The inputs are only read when evaluating, so changes made to them after
+ * building the expression are seen by evaluate.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    guft_KernelRegistryObject *registry;
+    PyObject *inputs; /* tuple of buffer objects and Lazy objects */
+} guft_LazyObject;
+
+#define NO_NODE ((size_t)-1)
+
+/* a call of the expression being evaluated */
+typedef struct {
+    guft_LazyObject *expr; /* borrowed */
+    const parsed_signature *ps;
+    size_t inputs[GUFT_MAXARGS]; /* node of every input, NO_NODE for
+                                    buffer objects */
+    size_t consumer; /* last node using this one, NO_NODE for the root */
+    size_t uses;
+    size_t group;
+    int temporary; /* in its group if fused, -1 otherwise */
+    char *materialized; /* output of intermediates that are not fused */
+    guft_kernel kernel; /* for the types and sizes of the call */
+    PyObject *kernel_owner; /* keeps kernel alive */
+    size_t kernel_stats_site;
+    char types[GUFT_MAXARGS];
+    size_t dimension_sizes[GUFT_MAX_DIMENSION_VARIABLES];
+    resolved_shapes resolved;
+    execution_operand operands[GUFT_MAXARGS];
+    size_t shapes[GUFT_MAXARGS][GUFT_CALL_MAXNDIM];
+    guft_intp strides[GUFT_MAXARGS][GUFT_CALL_MAXNDIM];
+    execution_plan *plan;
+} lazy_node;
+
+/* the calls fused together, rooted at the last one */
+typedef struct {
+    size_t root;
+    size_t stage_count;
+    size_t temporary_count;
+    fused_stage *stages;
+    size_t *temporary_sizes;
+    size_t *temporary_offsets;
+    execution_status status;
+    fused_group fused;
+} lazy_group;
+
+typedef struct {
+    guft_module_state *state;
+    lazy_node **nodes; /* in post order: inputs before their users */
+    size_t node_count;
+    size_t node_capacity;
+    lazy_group *groups;
+    size_t group_count;
+    Py_buffer *views;
+    size_t view_count;
+    size_t view_capacity;
+} lazy_evaluation;
+
+static PyObject *
+Lazy_new(PyTypeObject *type, PyObject *UNUSED_VAR(args),
+         PyObject *UNUSED_VAR(kwds))
+{
+    PyErr_Format(PyExc_TypeError, "cannot create '%.100s' instances, use "
+                 "KernelRegistry.lazy", type->tp_name);
+    return NULL;
+}
+
+PyObject *
+registry_lazy(guft_KernelRegistryObject *self, PyObject *args)
+{
+    guft_module_state *state = get_state_by_type(Py_TYPE(self));
+    const parsed_signature *ps;
+    guft_LazyObject *lazy;
+
+    if (state == NULL)
+        return NULL;
+    if (self->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        return NULL;
+    }
+
+    ps = ((guft_SignatureObject *)self->signature)->the_signature;
+    if (ps->output_count != 1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "only gufuncs with a single output can be lazy");
+        return NULL;
+    }
+    if ((size_t)PyTuple_GET_SIZE(args) != ps->input_count) {
+        PyErr_Format(PyExc_TypeError, "the gufunc takes %zu inputs (%zd given)",
+                     ps->input_count, PyTuple_GET_SIZE(args));
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); i++) {
+        PyObject *input = PyTuple_GET_ITEM(args, i);
+        if (!PyObject_TypeCheck(input, state->LazyType) &&
+            !PyObject_CheckBuffer(input)) {
+            PyErr_Format(PyExc_TypeError, "input %zd is neither a Lazy nor "
+                         "a buffer object, but '%.200s'", i,
+                         Py_TYPE(input)->tp_name);
+            return NULL;
+        }
+    }
+
+    lazy = PyObject_GC_New(guft_LazyObject, state->LazyType);
+    if (lazy == NULL)
+        return NULL;
+    Py_INCREF(self);
+    lazy->registry = self;
+    Py_INCREF(args);
+    lazy->inputs = args;
+    PyObject_GC_Track(lazy);
+
+    return (PyObject *)lazy;
+}
+
+static void
+release_evaluation(lazy_evaluation *ev)
+{
+    for (size_t i = 0; i < ev->node_count; i++) {
+        lazy_node *node = ev->nodes[i];
+        free(node->plan);
+        free(node->materialized);
+        Py_XDECREF(node->kernel_owner);
+        free(node);
+    }
+    free(ev->nodes);
+    for (size_t g = 0; g < ev->group_count; g++) {
+        lazy_group *group = ev->groups + g;
+        free(group->stages);
+        free(group->temporary_sizes);
+        free(group->temporary_offsets);
+        free(group->status.mask);
+    }
+    free(ev->groups);
+    for (size_t v = 0; v < ev->view_count; v++)
+        PyBuffer_Release(ev->views + v);
+    free(ev->views);
+}
+
+static Py_buffer *
+new_view(lazy_evaluation *ev, PyObject *obj, int flags)
+{
+    if (ev->view_count == ev->view_capacity) {
+        size_t capacity = ev->view_capacity ? 2*ev->view_capacity : 8;
+        Py_buffer *views = realloc(ev->views, capacity*sizeof(Py_buffer));
+        if (views == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        ev->views = views;
+        ev->view_capacity = capacity;
+    }
+
+    if (PyObject_GetBuffer(obj, ev->views + ev->view_count, flags) < 0)
+        return NULL;
+    return ev->views + ev->view_count++;
+}
+
+/* Add the calls of expr to the evaluation, inputs first. Returns the node
+   of expr, or NO_NODE with an exception set */
+static size_t
+collect_nodes(lazy_evaluation *ev, guft_LazyObject *expr)
+{
+    const parsed_signature *ps =
+        ((guft_SignatureObject *)expr->registry->signature)->the_signature;
+    lazy_node *node;
+    size_t inputs[GUFT_MAXARGS];
+    size_t index;
+
+    /* graphs are small, and a shared call is evaluated once */
+    for (size_t i = 0; i < ev->node_count; i++) {
+        if (ev->nodes[i]->expr == expr)
+            return i;
+    }
+
+    if (Py_EnterRecursiveCall(" while evaluating a lazy expression"))
+        return NO_NODE;
+    for (size_t op = 0; op < ps->input_count; op++) {
+        PyObject *input = PyTuple_GET_ITEM(expr->inputs, op);
+        inputs[op] = NO_NODE;
+        if (PyObject_TypeCheck(input, ev->state->LazyType)) {
+            inputs[op] = collect_nodes(ev, (guft_LazyObject *)input);
+            if (inputs[op] == NO_NODE) {
+                Py_LeaveRecursiveCall();
+                return NO_NODE;
+            }
+        }
+    }
+    Py_LeaveRecursiveCall();
+
+    if (ev->node_count == ev->node_capacity) {
+        size_t capacity = ev->node_capacity ? 2*ev->node_capacity : 8;
+        lazy_node **nodes = realloc(ev->nodes, capacity*sizeof(lazy_node *));
+        if (nodes == NULL) {
+            PyErr_NoMemory();
+            return NO_NODE;
+        }
+        ev->nodes = nodes;
+        ev->node_capacity = capacity;
+    }
+    node = calloc(1, sizeof(lazy_node));
+    if (node == NULL) {
+        PyErr_NoMemory();
+        return NO_NODE;
+    }
+    index = ev->node_count++;
+    ev->nodes[index] = node;
+
+    node->expr = expr;
+    node->ps = ps;
+    node->consumer = NO_NODE;
+    node->temporary = -1;
+    memcpy(node->inputs, inputs, ps->input_count*sizeof(size_t));
+    for (size_t op = 0; op < ps->input_count; op++) {
+        if (inputs[op] != NO_NODE) {
+            ev->nodes[inputs[op]]->uses++;
+            ev->nodes[inputs[op]]->consumer = index;
+        }
+    }
+
+    return index;
+}
+
+/* describe operand op of node from a buffer object */
+static int
+buffer_operand(lazy_evaluation *ev, lazy_node *node, size_t op,
+               PyObject *obj, int flags)
+{
+    execution_operand *operand = node->operands + op;
+    Py_buffer *view = new_view(ev, obj, flags);
+
+    if (view == NULL)
+        return -1;
+    if ((size_t)view->ndim > GUFT_CALL_MAXNDIM) {
+        PyErr_Format(PyExc_ValueError, "too many dimensions in operand %zu",
+                     op);
+        return -1;
+    }
+    node->types[op] = canonical_type_code(view->format,
+                                          (size_t)view->itemsize);
+    if (node->types[op] == 0) {
+        PyErr_Format(PyExc_TypeError, "unsupported format '%s' in operand %zu",
+                     view->format ? view->format : "B", op);
+        return -1;
+    }
+
+    for (int d = 0; d < view->ndim; d++)
+        node->shapes[op][d] = (size_t)view->shape[d];
+    get_view_strides(view, node->strides[op]);
+    operand->data = view->buf;
+    operand->ndim = (size_t)view->ndim;
+    operand->shape = node->shapes[op];
+    operand->strides = node->strides[op];
+    operand->itemsize = (size_t)view->itemsize;
+    operand->flags = 0;
+    return 0;
+}
+
+/* Bind the operands of a node, resolve its shapes and find its kernel.
+   The data of inputs coming from other nodes is set later */
+static int
+prepare_node(lazy_evaluation *ev, size_t index, PyObject *out)
+{
+    lazy_node *node = ev->nodes[index];
+    const parsed_signature *ps = node->ps;
+    size_t nin = ps->input_count;
+    size_t arg_ndim[GUFT_MAXARGS];
+    const size_t *arg_shapes[GUFT_MAXARGS];
+    resolve_error error = { NULL, 0, 0 };
+    execution_operand *output = node->operands + nin;
+
+    if (ps->dimension_variable_count > GUFT_MAX_DIMENSION_VARIABLES) {
+        PyErr_Format(PyExc_ValueError,
+                     "gufuncs are limited to %d dimension variables",
+                     GUFT_MAX_DIMENSION_VARIABLES);
+        return -1;
+    }
+
+    for (size_t op = 0; op < nin; op++) {
+        if (node->inputs[op] == NO_NODE) {
+            if (buffer_operand(ev, node, op,
+                               PyTuple_GET_ITEM(node->expr->inputs, op),
+                               PyBUF_RECORDS_RO) != 0)
+                return -1;
+        } else {
+            /* the output of another node */
+            const lazy_node *input = ev->nodes[node->inputs[op]];
+            const execution_operand *source =
+                input->operands + input->ps->input_count;
+
+            node->types[op] = input->types[input->ps->input_count];
+            memcpy(node->shapes[op], source->shape,
+                   source->ndim*sizeof(size_t));
+            memcpy(node->strides[op], source->strides,
+                   source->ndim*sizeof(guft_intp));
+            node->operands[op] = *source;
+            node->operands[op].shape = node->shapes[op];
+            node->operands[op].strides = node->strides[op];
+        }
+        arg_ndim[op] = node->operands[op].ndim;
+        arg_shapes[op] = node->shapes[op];
+    }
+
+    if (out != NULL) {
+        if (buffer_operand(ev, node, nin, out, PyBUF_RECORDS) != 0)
+            return -1;
+        arg_ndim[nin] = output->ndim;
+        arg_shapes[nin] = node->shapes[nin];
+    } else {
+        arg_ndim[nin] = 0;
+        arg_shapes[nin] = NULL;
+    }
+
+    node->resolved.dimension_sizes = node->dimension_sizes;
+    if (resolve_shapes(ps, arg_ndim, arg_shapes, &node->resolved,
+                       &error) != 0) {
+        PyErr_Format(PyExc_ValueError, "%s (argument %zu, axis %zu)",
+                     error.message, error.arg, error.axis);
+        return -1;
+    }
+
+    if (registry_get_kernel(node->expr->registry, node->types, out != NULL,
+                            node->dimension_sizes, 0, &node->kernel,
+                            &node->kernel_owner,
+                            &node->kernel_stats_site) != 0)
+        return -1;
+    if (out != NULL)
+        return 0;
+
+    /* intermediates are packed, in C order */
+    output->ndim = resolved_arg_shape(ps, &node->resolved, nin,
+                                      node->shapes[nin]);
+    output->itemsize = type_code_itemsize(node->types[nin]);
+    output->data = NULL;
+    output->shape = node->shapes[nin];
+    output->strides = node->strides[nin];
+    output->flags = 0;
+    if (output->itemsize == 0) {
+        PyErr_Format(PyExc_TypeError, "unsupported output type '%c'",
+                     node->types[nin]);
+        return -1;
+    }
+    for (size_t d = output->ndim, stride = output->itemsize; d-- > 0;) {
+        node->strides[nin][d] = (guft_intp)stride;
+        stride *= node->shapes[nin][d];
+    }
+
+    return 0;
+}
+
+static int
+same_outer_shape(const resolved_shapes *a, const resolved_shapes *b)
+{
+    return a->outer_ndim == b->outer_ndim &&
+        memcmp(a->outer_shape, b->outer_shape,
+               a->outer_ndim*sizeof(size_t)) == 0;
+}
+
+/* Decide which intermediates are fused, form the groups and give memory to
+   the materialized intermediates. Going from the root backwards, a node
+   joins the group of its user when fused, or starts a new one */
+static int
+plan_groups(lazy_evaluation *ev)
+{
+    ev->groups = calloc(ev->node_count, sizeof(lazy_group));
+    if (ev->groups == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (size_t i = ev->node_count; i-- > 0;) {
+        lazy_node *node = ev->nodes[i];
+        execution_operand *output = node->operands + node->ps->input_count;
+        const lazy_node *user = node->consumer != NO_NODE ?
+            ev->nodes[node->consumer] : NULL;
+
+        if (user != NULL && node->uses == 1 &&
+            node->resolved.element_count > 0 &&
+            same_outer_shape(&node->resolved, &user->resolved)) {
+            lazy_group *group = ev->groups + user->group;
+            node->group = user->group;
+            node->temporary = (int)group->temporary_count++;
+            group->stage_count++;
+            continue;
+        }
+
+        node->group = ev->group_count++;
+        ev->groups[node->group].root = i;
+        ev->groups[node->group].stage_count = 1;
+
+        if (user != NULL) {
+            size_t element_size = output->itemsize;
+            for (size_t d = 0; d < output->ndim; d++)
+                element_size *= output->shape[d];
+            node->materialized = malloc(element_size ? element_size : 1);
+            if (node->materialized == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            output->data = node->materialized;
+        }
+    }
+
+    /* groups were numbered from the root, they run in the opposite order */
+    for (size_t g = 0; g < ev->group_count/2; g++) {
+        lazy_group swap = ev->groups[g];
+        ev->groups[g] = ev->groups[ev->group_count - 1 - g];
+        ev->groups[ev->group_count - 1 - g] = swap;
+    }
+    for (size_t i = 0; i < ev->node_count; i++)
+        ev->nodes[i]->group = ev->group_count - 1 - ev->nodes[i]->group;
+
+    return 0;
+}
+
+/* Build the plans of all the nodes and the fused groups */
+static int
+build_groups(lazy_evaluation *ev)
+{
+    for (size_t g = 0; g < ev->group_count; g++) {
+        lazy_group *group = ev->groups + g;
+        size_t temporaries = group->temporary_count;
+
+        group->stages = calloc(group->stage_count, sizeof(fused_stage));
+        group->temporary_sizes = calloc(temporaries + 1, sizeof(size_t));
+        group->temporary_offsets = calloc(temporaries + 1, sizeof(size_t));
+        if (group->stages == NULL || group->temporary_sizes == NULL ||
+            group->temporary_offsets == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        group->stage_count = 0; /* counted again while adding them */
+    }
+
+    /* in post order, so the stages of every group are in execution order */
+    for (size_t i = 0; i < ev->node_count; i++) {
+        lazy_node *node = ev->nodes[i];
+        const parsed_signature *ps = node->ps;
+        guft_KernelRegistryObject *registry = node->expr->registry;
+        size_t nin = ps->input_count;
+        lazy_group *group = ev->groups + node->group;
+        fused_stage *stage = group->stages + group->stage_count++;
+
+        for (size_t op = 0; op < ps->arg_count; op++)
+            stage->temporaries[op] = -1;
+        for (size_t op = 0; op < nin; op++) {
+            const lazy_node *input = node->inputs[op] != NO_NODE ?
+                ev->nodes[node->inputs[op]] : NULL;
+            if (input == NULL)
+                continue;
+            node->operands[op].data = input->materialized;
+            stage->temporaries[op] = input->temporary;
+        }
+        stage->temporaries[nin] = node->temporary;
+
+        node->plan = malloc(execution_plan_size(ps));
+        if (node->plan == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (init_execution_plan(node->plan, ps, &node->resolved,
+                                node->operands, node->kernel) != 0) {
+            PyErr_SetString(PyExc_ValueError, "can not execute this gufunc");
+            return -1;
+        }
+        enable_plan_buffering(node->plan,
+                              GUFT_ATOMIC_LOAD(executor_buffer_size));
+        if (GUFT_ATOMIC_LOAD(stats_enabled)) {
+            node->plan->stats_site = registry_stats_site(registry);
+            node->plan->kernel_stats_site = node->kernel_stats_site;
+        }
+        stage->plan = node->plan;
+
+        if (node->temporary >= 0)
+            group->temporary_sizes[node->temporary] =
+                node->plan->operands[nin].element_size;
+
+        if (node->kernel.flags & GUFT_KERNEL_REPORTS_STATUS) {
+            if (group->status.mask == NULL) {
+                size_t count = ev->nodes[group->root]->resolved.element_count;
+                group->status.mask = calloc((count + 7)/8 + 1, 1);
+                if (group->status.mask == NULL) {
+                    PyErr_NoMemory();
+                    return -1;
+                }
+            }
+            node->plan->status = &group->status;
+        }
+    }
+
+    for (size_t g = 0; g < ev->group_count; g++) {
+        lazy_group *group = ev->groups + g;
+        fused_group *fused = &group->fused;
+
+        fused->element_count = ev->nodes[group->root]->resolved.element_count;
+        fused->stage_count = group->stage_count;
+        fused->stages = group->stages;
+        fused->temporary_count = group->temporary_count;
+        fused->temporary_sizes = group->temporary_sizes;
+        fused->temporary_offsets = group->temporary_offsets;
+        init_fused_group(fused, GUFT_ATOMIC_LOAD(executor_buffer_size));
+    }
+
+    return 0;
+}
+
+/* Number of failed elements in a status. Elements can fail in several
+   stages of a group, so the counts of the stages can not be added up */
+static size_t
+count_failures(const execution_status *status, size_t element_count)
+{
+    size_t failures = 0;
+
+    for (size_t i = 0; i < element_count; i++)
+        failures += (status->mask[i/8] >> (i % 8)) & 1;
+    return failures;
+}
+
+static PyObject *
+Lazy_evaluate(guft_LazyObject *self, PyObject *args)
+{
+    lazy_evaluation ev;
+    PyObject *out;
+    PyObject *rv = NULL;
+    size_t min_chunk = GUFT_ATOMIC_LOAD(executor_min_chunk);
+    int out_of_memory = 0;
+
+    if (!PyArg_ParseTuple(args, "O:evaluate", &out))
+        return NULL;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.state = get_state_by_type(Py_TYPE(self));
+    if (ev.state == NULL || collect_nodes(&ev, self) == NO_NODE)
+        goto done;
+    for (size_t i = 0; i < ev.node_count; i++) {
+        if (prepare_node(&ev, i, i == ev.node_count - 1 ? out : NULL) != 0)
+            goto done;
+    }
+    if (plan_groups(&ev) != 0 || build_groups(&ev) != 0)
+        goto done;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (size_t g = 0; g < ev.group_count; g++) {
+        execute_fused_parallel(&ev.groups[g].fused, min_chunk);
+        out_of_memory |= ev.groups[g].fused.out_of_memory;
+    }
+    Py_END_ALLOW_THREADS
+
+    if (out_of_memory) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (size_t g = 0; g < ev.group_count; g++) {
+        lazy_group *group = ev.groups + g;
+        size_t count = group->fused.element_count;
+
+        if (group->status.mask == NULL || group->status.failures == 0)
+            continue;
+        if (g != ev.group_count - 1) {
+            /* no way to tell which elements of the result are affected */
+            PyErr_SetString(PyExc_RuntimeError,
+                            "kernel failures in an intermediate of the "
+                            "lazy expression");
+            goto done;
+        }
+        group->status.failures = count_failures(&group->status, count);
+        raise_partial_success(ev.state, &group->status, count, out);
+        goto done;
+    }
+
+    Py_INCREF(out);
+    rv = out;
+
+ done:
+    release_evaluation(&ev);
+    return rv;
+}
+
+static int
+Lazy_traverse(guft_LazyObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->registry);
+    Py_VISIT(self->inputs);
+    return 0;
+}
+
+static int
+Lazy_clear(guft_LazyObject *self)
+{
+    Py_CLEAR(self->registry);
+    Py_CLEAR(self->inputs);
+    return 0;
+}
+
+static void
+Lazy_dealloc(guft_LazyObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    Lazy_clear(self);
+    PyObject_GC_Del(self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+Lazy_repr(guft_LazyObject *self)
+{
+    if (self->registry == NULL || self->registry->name == NULL)
+        return PyUnicode_FromFormat("<%s>", Py_TYPE(self)->tp_name);
+    return PyUnicode_FromFormat("<%s %R of %zd inputs>",
+                                Py_TYPE(self)->tp_name, self->registry->name,
+                                PyTuple_GET_SIZE(self->inputs));
+}
+
+static PyMemberDef guft_LazyObject_members[] = {
+    {"registry", T_OBJECT, offsetof(guft_LazyObject, registry), READONLY,
+     "the KernelRegistry called"},
+    {"inputs", T_OBJECT, offsetof(guft_LazyObject, inputs), READONLY,
+     "tuple with the inputs of the call"},
+    {NULL} /* Sentinel */
+};
+
+static PyMethodDef guft_LazyObject_methods[] = {
+    {"evaluate", (PyCFunction)Lazy_evaluate, METH_VARARGS,
+     "evaluate(out): runs the expression, fusing the calls where possible, "
+     "and returns out with the result"
+    },
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot guft_Lazy_slots[] = {
+    {Py_tp_dealloc, (void *)Lazy_dealloc},
+    {Py_tp_traverse, (void *)Lazy_traverse},
+    {Py_tp_clear, (void *)Lazy_clear},
+    {Py_tp_repr, (void *)Lazy_repr},
+    {Py_tp_methods, guft_LazyObject_methods},
+    {Py_tp_members, guft_LazyObject_members},
+    {Py_tp_new, (void *)Lazy_new},
+    {Py_tp_doc, (void *)"A gufunc call to be evaluated later"},
+    {0, NULL}
+};
+
+PyType_Spec guft_Lazy_spec = {
+    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".Lazy",     /* name */
+    sizeof(guft_LazyObject),                              /* basicsize */
+    0,                                                    /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,              /* flags */
+    guft_Lazy_slots,                                      /* slots */
+};
@@ -0,0 +1,491 @@
+#include <Python.h>
+#include <pythread.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "procpool.h"
+#include "nonpymodule.h"
+
+#if defined(GUFT_HAVE_PROCPOOL)
+
+#include <errno.h>
+#include <unistd.h>
+
+/* -----------------------------------------------------------------------------
+ * Process pools
+ *
+ * ProcessPool(processes=None) runs gufunc calls in worker processes (see
+ * procpool.h), one per online CPU by default, for kernels that do not
+ * scale in threads, like the ones calling back into Python that need the
+ * GIL:
+ *
+ *   - call(registry, *operands): a call to the gufunc of registry,
+ *     returning the same as calling it. The outer elements are split in a
+ *     contiguous range per worker.
+ *   - buffer(format, shape): a Buffer in shared memory. Workers use
+ *     operands in those in place; any other operand is copied to shared
+ *     memory for the call (and back for outputs). Outputs left out are
+ *     allocated as shared Buffers.
+ *   - close(): stops the workers. Also done when the pool goes away, or by
+ *     using it as a context manager.
+ *
+ * Workers are forked on the first call, so they have every kernel
+ * registered by then. Calls after a kernel was registered anywhere start
+ * new workers. Inputs overlapping outputs must be exactly the same memory
+ * (see overlap.h). Calls to the same pool from several threads run one at
+ * a time.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    procpool pool; /* shared NULL once closed */
+    size_t generation; /* of the kernels when the workers forked */
+    PyThread_type_lock lock; /* held by the running call */
+} guft_ProcessPoolObject;
+
+/* an operand copied to shared memory for a call */
+typedef struct {
+    shared_segment segment[GUFT_MAXARGS];
+    char *data[GUFT_MAXARGS]; /* where its data pointer is in the copy */
+} staged_operands;
+
+static void
+release_staged(staged_operands *staged, size_t nops)
+{
+    for (size_t op = 0; op < nops; op++)
+        destroy_shared_segment(staged->segment + op);
+}
+
+/* fork the workers, unless running ones have every kernel. Returns 0 on
+   success, -1 with an exception set */
+static int
+start_workers(guft_ProcessPoolObject *self)
+{
+    procpool *pool = &self->pool;
+
+    if (pool->started &&
+        self->generation == GUFT_ATOMIC_LOAD(kernel_generation))
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    stop_procpool(pool);
+    Py_END_ALLOW_THREADS
+
+    self->generation = GUFT_ATOMIC_LOAD(kernel_generation);
+    for (size_t i = 0; i < pool->worker_count; i++) {
+        pid_t pid;
+        int saved;
+
+        PyOS_BeforeFork();
+        pid = fork();
+        saved = errno;
+        if (pid == 0) {
+            PyOS_AfterFork_Child();
+            /* kernels that call into Python take the GIL themselves */
+            PyEval_SaveThread();
+            run_procpool_worker(pool, i);
+            _exit(0);
+        }
+        PyOS_AfterFork_Parent();
+        if (pid < 0) {
+            pool->started = 1;
+            Py_BEGIN_ALLOW_THREADS
+            stop_procpool(pool);
+            Py_END_ALLOW_THREADS
+            errno = saved;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        pool->pids[i] = pid;
+    }
+    pool->started = 1;
+    return 0;
+}
+
+/* describe operand op of call to the workers, copying it to shared memory
+   if it is not there. Returns 0 on success, -1 with an exception set */
+static int
+ship_operand(prepared_call *call, size_t op, procpool_operand *shipped,
+             staged_operands *staged)
+{
+    const execution_operand *o = call->operands + op;
+    memory_extent extent;
+    uintptr_t low, high;
+    uint64_t id;
+    size_t offset;
+
+    extent.data = o->data;
+    extent.ndim = o->ndim;
+    extent.itemsize = o->itemsize;
+    for (size_t d = 0; d < o->ndim; d++) {
+        extent.shape[d] = (guft_intp)o->shape[d];
+        extent.strides[d] = o->strides[d];
+    }
+    memory_extent_bounds(&extent, &low, &high);
+    if (low == high)
+        low = high = (uintptr_t)o->data;
+
+    if (find_shared_segment(low, high, &id, &offset) != 0) {
+        if (create_shared_segment(staged->segment + op, high - low) != 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        /* outputs too, for the elements a status kernel leaves alone */
+        memcpy(staged->segment[op].data, (const char *)low, high - low);
+        id = staged->segment[op].id;
+        offset = 0;
+        staged->data[op] = staged->segment[op].data +
+            ((uintptr_t)o->data - low);
+    }
+
+    shipped->segment = id;
+    shipped->offset = offset + ((uintptr_t)o->data - low);
+    shipped->ndim = o->ndim;
+    memcpy(shipped->shape, o->shape, o->ndim*sizeof(size_t));
+    memcpy(shipped->strides, o->strides, o->ndim*sizeof(guft_intp));
+    shipped->itemsize = o->itemsize;
+    shipped->flags = o->flags;
+    return 0;
+}
+
+/* copy the outputs staged for a call back to their memory */
+static void
+copy_back_outputs(prepared_call *call, staged_operands *staged)
+{
+    for (size_t op = call->signature->input_count; op < call->nops; op++) {
+        const execution_operand *o = call->operands + op;
+        guft_intp shape[GUFT_CALL_MAXNDIM];
+
+        if (staged->segment[op].id == 0)
+            continue;
+        for (size_t d = 0; d < o->ndim; d++)
+            shape[d] = (guft_intp)o->shape[d];
+        copy_strided(o->data, o->strides, staged->data[op], o->strides,
+                     shape, o->ndim, o->itemsize, 0);
+    }
+}
+
+/* allocate the outputs left out of call as shared Buffers */
+static int
+allocate_shared_outputs(guft_module_state *state, prepared_call *call)
+{
+    for (size_t op = call->signature->input_count; op < call->nops; op++) {
+        execution_operand *o = call->operands + op;
+        PyObject *output;
+        Py_buffer view;
+
+        if (PyTuple_GET_ITEM(call->operand_objects, op) != NULL)
+            continue;
+        output = new_shared_buffer(state, call->types[op], o->ndim,
+                                   o->shape);
+        if (output == NULL)
+            return -1;
+        PyTuple_SET_ITEM(call->operand_objects, op, output);
+        if (PyObject_GetBuffer(output, &view, PyBUF_WRITABLE) < 0)
+            return -1;
+        /* the Buffer keeps its memory until it goes away */
+        o->data = view.buf;
+        PyBuffer_Release(&view);
+    }
+    return 0;
+}
+
+/* run a prepared call in the workers. Returns 0 on success, -1 with an
+   exception set */
+static int
+run_in_workers(guft_ProcessPoolObject *self, prepared_call *call)
+{
+    procpool_task *task = procpool_task_of(&self->pool);
+    staged_operands staged;
+    shared_segment status;
+    size_t mask_size = (call->resolved.element_count + 7)/8;
+    size_t failures = 0;
+    int rv = -1, result;
+
+    memset(&staged, 0, sizeof(staged));
+    status.id = 0;
+
+    task->kernel = call->plan->kernel;
+    task->nops = call->nops;
+    task->outer_ndim = call->resolved.outer_ndim;
+    memcpy(task->outer_shape, call->resolved.outer_shape,
+           sizeof(task->outer_shape));
+    task->element_count = call->resolved.element_count;
+    memcpy(task->dimension_sizes, call->dimension_sizes,
+           call->signature->dimension_variable_count*sizeof(size_t));
+    task->buffer_size = GUFT_ATOMIC_LOAD(executor_buffer_size);
+    task->tile_size = GUFT_ATOMIC_LOAD(executor_tile_size);
+    task->status_segment = 0;
+    task->status_offset = 0;
+
+    for (size_t op = 0; op < call->nops; op++) {
+        if (ship_operand(call, op, task->operands + op, &staged) != 0)
+            goto done;
+    }
+    if (call->status.mask != NULL) {
+        if (create_shared_segment(&status, mask_size) != 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto done;
+        }
+        task->status_segment = status.id;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    result = run_procpool(&self->pool, call->signature, call->min_chunk,
+                          &failures);
+    if (result == 0)
+        copy_back_outputs(call, &staged);
+    Py_END_ALLOW_THREADS
+
+    if (result == -2) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "a worker process of the pool died");
+        goto done;
+    }
+    if (result != 0) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "a worker process of the pool could not run the "
+                        "call");
+        goto done;
+    }
+    if (call->status.mask != NULL) {
+        memcpy(call->status.mask, status.data, mask_size);
+        call->status.failures = failures;
+    }
+    rv = 0;
+
+ done:
+    destroy_shared_segment(&status);
+    release_staged(&staged, call->nops);
+    return rv;
+}
+
+static PyObject *
+ProcessPool_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "processes", NULL };
+    PyObject *processes_obj = Py_None;
+    guft_ProcessPoolObject *self;
+    size_t processes;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:ProcessPool", kwlist,
+                                     &processes_obj))
+        return NULL;
+    if (processes_obj == Py_None) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        processes = online > 0 ? (size_t)online : 1;
+        if (processes > GUFT_PROCPOOL_MAX_WORKERS)
+            processes = GUFT_PROCPOOL_MAX_WORKERS;
+    } else {
+        processes = PyLong_AsSize_t(processes_obj);
+        if (processes == (size_t)-1 && PyErr_Occurred())
+            return NULL;
+        if (processes == 0 || processes > GUFT_PROCPOOL_MAX_WORKERS) {
+            PyErr_Format(PyExc_ValueError,
+                         "processes must be between 1 and %d",
+                         GUFT_PROCPOOL_MAX_WORKERS);
+            return NULL;
+        }
+    }
+
+    self = (guft_ProcessPoolObject *)type->tp_alloc(type, 0);
+    if (self == NULL)
+        return NULL;
+    self->lock = PyThread_allocate_lock();
+    if (self->lock == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    if (init_procpool(&self->pool, processes) != 0) {
+        self->pool.shared = NULL;
+        Py_DECREF(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return (PyObject *)self;
+}
+
+/* take the lock of the pool, releasing the GIL if it has to wait */
+static void
+lock_pool(guft_ProcessPoolObject *self)
+{
+    if (!PyThread_acquire_lock(self->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(self->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void
+close_pool(guft_ProcessPoolObject *self)
+{
+    Py_BEGIN_ALLOW_THREADS
+    release_procpool(&self->pool);
+    Py_END_ALLOW_THREADS
+}
+
+static void
+ProcessPool_dealloc(guft_ProcessPoolObject *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    if (self->pool.shared != NULL)
+        close_pool(self);
+    if (self->lock != NULL)
+        PyThread_free_lock(self->lock);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+ProcessPool_call(guft_ProcessPoolObject *self, PyObject *args)
+{
+    guft_module_state *state = get_state_by_type(Py_TYPE(self));
+    PyObject *registry, *operands, *rv = NULL;
+    prepared_call *call;
+
+    if (state == NULL)
+        return NULL;
+    if (PyTuple_GET_SIZE(args) < 1 ||
+        !PyObject_TypeCheck(PyTuple_GET_ITEM(args, 0),
+                            state->KernelRegistryType)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "call takes a KernelRegistry followed by the "
+                        "operands");
+        return NULL;
+    }
+    registry = PyTuple_GET_ITEM(args, 0);
+    if (((guft_KernelRegistryObject *)registry)->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        return NULL;
+    }
+
+    operands = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    call = malloc(sizeof(prepared_call));
+    if (operands == NULL || call == NULL) {
+        Py_XDECREF(operands);
+        free(call);
+        return call == NULL ? PyErr_NoMemory() : NULL;
+    }
+
+    lock_pool(self);
+    if (self->pool.shared == NULL) {
+        PyErr_SetString(PyExc_ValueError, "the pool is closed");
+        goto unlock;
+    }
+    if (prepare_call(call, (guft_KernelRegistryObject *)registry, operands,
+                     GUFT_CALL_UNALLOCATED) != 0)
+        goto unlock;
+
+    if (call->plan->copies != NULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "calls in a process pool can not have inputs "
+                        "overlapping their outputs");
+        goto done;
+    }
+    if (allocate_shared_outputs(state, call) != 0 ||
+        start_workers(self) != 0 ||
+        run_in_workers(self, call) != 0)
+        goto done;
+    rv = finish_prepared_call(call);
+
+ done:
+    release_prepared_call(call);
+ unlock:
+    PyThread_release_lock(self->lock);
+    Py_DECREF(operands);
+    free(call);
+    return rv;
+}
+
+static PyObject *
+ProcessPool_buffer(guft_ProcessPoolObject *self, PyObject *args,
+                   PyObject *kwds)
+{
+    guft_module_state *state = get_state_by_type(Py_TYPE(self));
+    const char *format;
+    PyObject *shape_obj;
+
+    static char *kwlist[] = { "format", "shape", NULL };
+
+    if (state == NULL)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "sO:buffer", kwlist,
+                                     &format, &shape_obj))
+        return NULL;
+
+    return buffer_from_format(state, format, shape_obj, 1);
+}
+
+static PyObject *
+ProcessPool_close(guft_ProcessPoolObject *self, PyObject *UNUSED_VAR(args))
+{
+    lock_pool(self);
+    if (self->pool.shared != NULL)
+        close_pool(self);
+    PyThread_release_lock(self->lock);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ProcessPool_enter(guft_ProcessPoolObject *self, PyObject *UNUSED_VAR(args))
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+ProcessPool_exit(guft_ProcessPoolObject *self, PyObject *UNUSED_VAR(args))
+{
+    return ProcessPool_close(self, NULL);
+}
+
+static PyObject *
+ProcessPool_get_processes(guft_ProcessPoolObject *self,
+                          void *UNUSED_VAR(closure))
+{
+    return PyLong_FromSize_t(self->pool.worker_count);
+}
+
+static PyMethodDef guft_ProcessPoolObject_methods[] = {
+    {"call", (PyCFunction)ProcessPool_call, METH_VARARGS,
+     "call(registry, *operands): calls the gufunc of registry in the worker "
+     "processes"
+    },
+    {"buffer", (PyCFunction)ProcessPool_buffer,
+     METH_VARARGS | METH_KEYWORDS,
+     "buffer(format, shape): a zero filled Buffer in shared memory"
+    },
+    {"close", (PyCFunction)ProcessPool_close, METH_NOARGS,
+     "Stops the worker processes"
+    },
+    {"__enter__", (PyCFunction)ProcessPool_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction)ProcessPool_exit, METH_VARARGS, NULL},
+    {NULL} /* Sentinel */
+};
+
+static PyGetSetDef guft_ProcessPoolObject_getset[] = {
+    {"processes", (getter)ProcessPool_get_processes, NULL,
+     "number of worker processes", NULL},
+    {NULL} /* Sentinel */
+};
+
+static PyType_Slot guft_ProcessPool_slots[] = {
+    {Py_tp_dealloc, (void *)ProcessPool_dealloc},
+    {Py_tp_methods, guft_ProcessPoolObject_methods},
+    {Py_tp_getset, guft_ProcessPoolObject_getset},
+    {Py_tp_new, (void *)ProcessPool_new},
+    {Py_tp_doc, (void *)"ProcessPool(processes=None): runs gufunc calls in "
+     "worker processes, with operands in shared memory"},
+    {0, NULL}
+};
+
+PyType_Spec guft_ProcessPool_spec = {
+    THIS_MODULE_PATH"."STR(THIS_MODULE_NAME)".ProcessPool", /* name */
+    sizeof(guft_ProcessPoolObject),                       /* basicsize */
+    0,                                                    /* itemsize */
+    Py_TPFLAGS_DEFAULT,                                   /* flags */
+    guft_ProcessPool_slots,                               /* slots */
+};
+
+#endif /* GUFT_HAVE_PROCPOOL */
@@ -0,0 +1,433 @@
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "reduce.h"
+#include "threadpool.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Reductions
+ *
+ * KernelRegistry.reduce(operand, axes=0, identity=None, out=None,
+ *                       associative=True, deterministic=False)
+ *
+ * reduces operand along some of its outer axes with the gufunc of the
+ * registry, that needs two inputs and an output with the same core, like
+ * (n),(n)->(n) or (),()->(). axes are outer axes of the operand (negative
+ * ones counting from the last outer axis): an int, a sequence of ints or
+ * None for all of them. The result has the outer axes that are kept
+ * followed by the core, and goes to out or to a new Buffer.
+ *
+ * identity is where every chunk starts from: a number for all the items of
+ * the core, or a buffer with a whole core element. Without it chunks start
+ * from their first element, and reducing no elements is an error.
+ *
+ * associative=False folds the elements in order, with the kept elements
+ * still processed in parallel. deterministic=True gives the same result
+ * for any number of threads (see reduce.h).
+ */
+
+/* the three arguments must be the same dimension variables */
+static int
+check_reduction_signature(const parsed_signature *ps)
+{
+    size_t core_ndim;
+
+    if (ps->input_count != 2 || ps->output_count != 1)
+        goto fail;
+
+    core_ndim = ps->arg_dimension_count[0];
+    for (size_t arg = 1; arg < 3; arg++) {
+        if (ps->arg_dimension_count[arg] != core_ndim)
+            goto fail;
+        for (size_t d = 0; d < core_ndim; d++) {
+            if (ps->arg_shape_idx[ps->arg_shape_offsets[arg] + d] !=
+                ps->arg_shape_idx[d])
+                goto fail;
+        }
+    }
+    return 0;
+
+ fail:
+    PyErr_SetString(PyExc_TypeError,
+                    "reductions need a gufunc with two inputs and an output "
+                    "of the same core, like (n),(n)->(n)");
+    return -1;
+}
+
+/* set reduced[axis] for the outer axes in axes, NULL for the default of
+   axis 0 */
+static int
+parse_axes(PyObject *axes, size_t outer_ndim, int *reduced)
+{
+    PyObject *seq;
+    Py_ssize_t count;
+
+    memset(reduced, 0, outer_ndim*sizeof(int));
+    if (axes == NULL) {
+        if (outer_ndim == 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "the operand has no outer dimensions to reduce");
+            return -1;
+        }
+        reduced[0] = 1;
+        return 0;
+    }
+    if (axes == Py_None) {
+        for (size_t d = 0; d < outer_ndim; d++)
+            reduced[d] = 1;
+        return 0;
+    }
+
+    if (PyLong_Check(axes))
+        seq = PyTuple_Pack(1, axes);
+    else
+        seq = PySequence_Fast(axes, "axes must be an int, a sequence of "
+                              "ints or None");
+    if (seq == NULL)
+        return -1;
+
+    count = PySequence_Fast_GET_SIZE(seq);
+    for (Py_ssize_t i = 0; i < count; i++) {
+        Py_ssize_t axis = PyLong_AsSsize_t(PySequence_Fast_GET_ITEM(seq, i));
+        if (axis == -1 && PyErr_Occurred())
+            goto fail;
+        if (axis < 0)
+            axis += (Py_ssize_t)outer_ndim;
+        if (axis < 0 || (size_t)axis >= outer_ndim) {
+            PyErr_Format(PyExc_ValueError,
+                         "axis out of range for %zu outer dimensions",
+                         outer_ndim);
+            goto fail;
+        }
+        if (reduced[axis]) {
+            PyErr_Format(PyExc_ValueError, "repeated axis %zd", axis);
+            goto fail;
+        }
+        reduced[axis] = 1;
+    }
+
+    Py_DECREF(seq);
+    return 0;
+
+ fail:
+    Py_DECREF(seq);
+    return -1;
+}
+
+/* a packed core element for identity, in a malloc'd block */
+static char *
+identity_element(PyObject *identity, char type, size_t itemsize,
+                 size_t element_size)
+{
+    char *element = malloc(element_size > 0 ? element_size : 1);
+
+    if (element == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    if (PyObject_CheckBuffer(identity)) {
+        Py_buffer view;
+        int ok;
+
+        if (PyObject_GetBuffer(identity, &view, PyBUF_RECORDS_RO) < 0)
+            goto fail;
+        ok = PyBuffer_IsContiguous(&view, 'C') &&
+            (size_t)view.len == element_size &&
+            canonical_type_code(view.format, (size_t)view.itemsize) == type;
+        if (ok)
+            memcpy(element, view.buf, element_size);
+        PyBuffer_Release(&view);
+        if (!ok) {
+            PyErr_SetString(PyExc_ValueError,
+                            "identity must be a contiguous core element of "
+                            "the type of the operand");
+            goto fail;
+        }
+    } else {
+        /* a number, for every item */
+        char format[2] = { type, '\0' };
+        PyObject *packed, *struct_module = PyImport_ImportModule("struct");
+
+        if (struct_module == NULL)
+            goto fail;
+        packed = PyObject_CallMethod(struct_module, "pack", "sO", format,
+                                     identity);
+        Py_DECREF(struct_module);
+        if (packed == NULL)
+            goto fail;
+        if ((size_t)PyBytes_GET_SIZE(packed) != itemsize) {
+            Py_DECREF(packed);
+            PyErr_SetString(PyExc_ValueError, "bad identity");
+            goto fail;
+        }
+        for (size_t offset = 0; offset < element_size; offset += itemsize)
+            memcpy(element + offset, PyBytes_AS_STRING(packed), itemsize);
+        Py_DECREF(packed);
+    }
+
+    return element;
+
+ fail:
+    free(element);
+    return NULL;
+}
+
+PyObject *
+registry_reduce(guft_KernelRegistryObject *self, PyObject *args,
+                PyObject *kwargs)
+{
+    PyObject *operand_obj, *axes = NULL;
+    PyObject *identity_obj = Py_None, *out_obj = Py_None;
+    PyObject *rv = NULL;
+    int associative = 1, deterministic = 0;
+    const parsed_signature *ps;
+    Py_buffer view = { NULL }, out_view = { NULL };
+    size_t ndim, core_ndim, outer_ndim, kept_ndim = 0, reduced_ndim = 0;
+    size_t itemsize, element_size, element_size_core = 0;
+    size_t reduced_count = 1;
+    int reduced[GUFT_CALL_MAXNDIM];
+    size_t shape[GUFT_CALL_MAXNDIM]; /* of the result */
+    guft_intp packed_strides[GUFT_CALL_MAXNDIM];
+    guft_intp operand_strides[GUFT_CALL_MAXNDIM];
+    guft_intp kept_shape[GUFT_CALL_MAXNDIM];
+    guft_intp core_shape[GUFT_CALL_MAXNDIM];
+    guft_intp reduced_shape[GUFT_CALL_MAXNDIM];
+    guft_intp reduced_strides[GUFT_CALL_MAXNDIM];
+    guft_intp view_strides[GUFT_CALL_MAXNDIM];
+    guft_intp out_strides[GUFT_CALL_MAXNDIM];
+    size_t dimension_sizes[GUFT_MAX_DIMENSION_VARIABLES];
+    size_t arg_ndim[3];
+    const size_t *arg_shapes[3];
+    resolved_shapes resolved;
+    resolve_error error = { NULL, 0, 0 };
+    execution_operand acc_operand, operand, operands[3];
+    execution_plan *step = NULL, *merge = NULL;
+    guft_kernel kernel;
+    PyObject *kernel_owner = NULL;
+    size_t kernel_stats_site;
+    char *identity = NULL;
+    char type, types[3];
+    reduction red;
+    size_t chunk_count;
+
+    static char *kwlist[] = { "operand", "axes", "identity", "out",
+                              "associative", "deterministic", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOpp", kwlist,
+                                     &operand_obj, &axes, &identity_obj,
+                                     &out_obj, &associative, &deterministic))
+        goto done;
+
+    if (self->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        goto done;
+    }
+    ps = ((guft_SignatureObject *)self->signature)->the_signature;
+    if (check_reduction_signature(ps) != 0)
+        goto done;
+    if (ps->dimension_variable_count > GUFT_MAX_DIMENSION_VARIABLES) {
+        PyErr_Format(PyExc_ValueError,
+                     "gufuncs are limited to %d dimension variables",
+                     GUFT_MAX_DIMENSION_VARIABLES);
+        goto done;
+    }
+
+    if (PyObject_GetBuffer(operand_obj, &view, PyBUF_RECORDS_RO) < 0)
+        goto done;
+    type = canonical_type_code(view.format, (size_t)view.itemsize);
+    if (type == 0) {
+        PyErr_Format(PyExc_TypeError, "unsupported format '%s'",
+                     view.format ? view.format : "B");
+        goto done;
+    }
+    ndim = (size_t)view.ndim;
+    core_ndim = ps->arg_dimension_count[0];
+    if (ndim > GUFT_CALL_MAXNDIM || ndim < core_ndim) {
+        PyErr_SetString(PyExc_ValueError,
+                        "the operand does not match the signature");
+        goto done;
+    }
+    outer_ndim = ndim - core_ndim;
+    if (parse_axes(axes, outer_ndim, reduced) != 0)
+        goto done;
+    get_view_strides(&view, view_strides);
+
+    /* split the outer axes, the core goes after the kept ones */
+    for (size_t d = 0; d < outer_ndim; d++) {
+        if (reduced[d]) {
+            reduced_shape[reduced_ndim] = (guft_intp)view.shape[d];
+            reduced_strides[reduced_ndim] = view_strides[d];
+            reduced_count *= (size_t)view.shape[d];
+            reduced_ndim++;
+        } else {
+            kept_shape[kept_ndim] = (guft_intp)view.shape[d];
+            shape[kept_ndim] = (size_t)view.shape[d];
+            operand_strides[kept_ndim] = view_strides[d];
+            kept_ndim++;
+        }
+    }
+    for (size_t d = 0; d < core_ndim; d++) {
+        core_shape[d] = (guft_intp)view.shape[outer_ndim + d];
+        shape[kept_ndim + d] = (size_t)view.shape[outer_ndim + d];
+        operand_strides[kept_ndim + d] = view_strides[outer_ndim + d];
+    }
+
+    /* accumulators are packed in C order */
+    itemsize = (size_t)view.itemsize;
+    element_size = itemsize;
+    for (size_t d = kept_ndim + core_ndim; d-- > 0;) {
+        packed_strides[d] = (guft_intp)element_size;
+        element_size *= shape[d];
+        if (d == kept_ndim)
+            element_size_core = element_size;
+    }
+    element_size = core_ndim > 0 ? element_size_core : itemsize;
+
+    /* the kept shape plus the core for all the operands of the plans */
+    resolved.dimension_sizes = dimension_sizes;
+    for (size_t arg = 0; arg < 3; arg++) {
+        arg_ndim[arg] = kept_ndim + core_ndim;
+        arg_shapes[arg] = shape;
+    }
+    if (resolve_shapes(ps, arg_ndim, arg_shapes, &resolved, &error) != 0) {
+        PyErr_Format(PyExc_ValueError, "%s (argument %zu, axis %zu)",
+                     error.message, error.arg, error.axis);
+        goto done;
+    }
+
+    types[0] = types[1] = types[2] = type;
+    if (registry_get_kernel(self, types, 1, dimension_sizes, 0, &kernel,
+                            &kernel_owner, &kernel_stats_site) != 0)
+        goto done;
+    if (kernel.flags & GUFT_KERNEL_REPORTS_STATUS) {
+        PyErr_SetString(PyExc_TypeError,
+                        "reductions do not support kernels reporting "
+                        "status");
+        goto done;
+    }
+
+    acc_operand.data = NULL;
+    acc_operand.ndim = kept_ndim + core_ndim;
+    acc_operand.shape = shape;
+    acc_operand.strides = packed_strides;
+    acc_operand.itemsize = itemsize;
+    acc_operand.flags = 0;
+    operand = acc_operand;
+    operand.data = view.buf;
+    operand.strides = operand_strides;
+
+    step = malloc(execution_plan_size(ps));
+    merge = malloc(execution_plan_size(ps));
+    if (step == NULL || merge == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    operands[0] = acc_operand;
+    operands[1] = operand;
+    operands[2] = acc_operand;
+    if (init_execution_plan(step, ps, &resolved, operands,
+                            kernel) != 0)
+        goto cant_execute;
+    enable_plan_buffering(step, GUFT_ATOMIC_LOAD(executor_buffer_size));
+    operands[1] = acc_operand;
+    if (init_execution_plan(merge, ps, &resolved, operands,
+                            kernel) != 0)
+        goto cant_execute;
+
+    if (identity_obj != Py_None) {
+        identity = identity_element(identity_obj, type, itemsize,
+                                    element_size);
+        if (identity == NULL)
+            goto done;
+    } else if (reduced_count == 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "zero-size reduction with no identity");
+        goto done;
+    }
+
+    if (out_obj == Py_None) {
+        guft_module_state *state = get_state_by_type(Py_TYPE(self));
+        if (state == NULL)
+            goto done;
+        out_obj = new_buffer(state, type, kept_ndim + core_ndim, shape);
+        if (out_obj == NULL)
+            goto done;
+    } else {
+        Py_INCREF(out_obj);
+    }
+    if (PyObject_GetBuffer(out_obj, &out_view, PyBUF_RECORDS) < 0) {
+        Py_DECREF(out_obj);
+        goto done;
+    }
+    rv = out_obj;
+    {
+        int ok = (size_t)out_view.ndim == kept_ndim + core_ndim &&
+            canonical_type_code(out_view.format,
+                                (size_t)out_view.itemsize) == type;
+        for (size_t d = 0; ok && d < kept_ndim + core_ndim; d++)
+            ok = (size_t)out_view.shape[d] == shape[d];
+        if (!ok) {
+            PyErr_SetString(PyExc_ValueError,
+                            "out does not match the type and shape of the "
+                            "result");
+            Py_CLEAR(rv);
+            goto done;
+        }
+    }
+    get_view_strides(&out_view, out_strides);
+
+    red.step = step;
+    red.merge = merge;
+    red.itemsize = itemsize;
+    red.element_size = element_size;
+    red.core_ndim = core_ndim;
+    red.core_shape = core_shape;
+    red.packed_core_strides = packed_strides + kept_ndim;
+    red.kept_ndim = kept_ndim;
+    red.kept_shape = kept_shape;
+    red.kept_count = resolved.element_count;
+    red.data = view.buf;
+    red.kept_strides = operand_strides;
+    red.core_strides = operand_strides + kept_ndim;
+    red.reduced_ndim = reduced_ndim;
+    red.reduced_shape = reduced_shape;
+    red.reduced_strides = reduced_strides;
+    red.reduced_count = reduced_count;
+    red.out = out_view.buf;
+    red.out_kept_strides = out_strides;
+    red.out_core_strides = out_strides + kept_ndim;
+    red.identity = identity;
+
+    chunk_count = reduction_chunk_count(&red, associative, deterministic,
+                                        threadpool_get_thread_count(),
+                                        GUFT_ATOMIC_LOAD(executor_min_chunk));
+
+    Py_BEGIN_ALLOW_THREADS
+    execute_reduction(&red, chunk_count,
+                      GUFT_ATOMIC_LOAD(executor_buffer_size));
+    Py_END_ALLOW_THREADS
+
+    if (red.out_of_memory) {
+        PyErr_NoMemory();
+        Py_CLEAR(rv);
+    }
+    goto done;
+
+ cant_execute:
+    PyErr_SetString(PyExc_ValueError, "can not execute this reduction");
+
+ done:
+    if (out_view.obj != NULL)
+        PyBuffer_Release(&out_view);
+    if (view.obj != NULL)
+        PyBuffer_Release(&view);
+    Py_XDECREF(kernel_owner);
+    free(identity);
+    free(step);
+    free(merge);
+    return rv;
+}
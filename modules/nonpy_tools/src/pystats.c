@@ -0,0 +1,135 @@
+#include <Python.h>
+
+#include "stats.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Runtime stats
+ *
+ * Recording is off by default. set_stats_enabled(True) turns it on, then
+ * get_stats() returns a snapshot as a dict keyed by site name (a gufunc,
+ * or one of its kernels as "name[types]"):
+ *
+ *   {"calls": ..., "elements": ..., "bytes": ...,
+ *    "phases": {"resolve": {"count": ..., "total_ns": ...,
+ *                           "histogram": [...]},
+ *               "dispatch": {...}, "execute": {...}}}
+ *
+ * Histogram bucket i counts the times in [2**(i-1), 2**i) ns. Sites with
+ * nothing recorded since the last reset_stats() are left out.
+ */
+
+static PyObject *
+box_phase_counters(const stats_phase_counters *pc)
+{
+    PyObject *histogram = PyList_New(GUFT_STATS_BUCKETS);
+    size_t used = 0;
+
+    if (histogram == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < GUFT_STATS_BUCKETS; i++) {
+        PyObject *count = PyLong_FromUnsignedLongLong(pc->histogram[i]);
+        if (count == NULL) {
+            Py_DECREF(histogram);
+            return NULL;
+        }
+        PyList_SET_ITEM(histogram, i, count);
+        if (pc->histogram[i])
+            used = i + 1;
+    }
+
+    /* trailing empty buckets are not interesting */
+    if (PyList_SetSlice(histogram, used, GUFT_STATS_BUCKETS, NULL) < 0) {
+        Py_DECREF(histogram);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:N}",
+                         "count", (unsigned long long)pc->count,
+                         "total_ns", (unsigned long long)pc->total_ns,
+                         "histogram", histogram);
+}
+
+static PyObject *
+box_counters(const stats_counters *counters)
+{
+    PyObject *phases = PyDict_New();
+
+    if (phases == NULL)
+        return NULL;
+
+    for (int phase = 0; phase < GUFT_PHASE_COUNT; phase++) {
+        PyObject *boxed = box_phase_counters(counters->phases + phase);
+        if (boxed == NULL ||
+            PyDict_SetItemString(phases, stats_phase_name(phase),
+                                 boxed) < 0) {
+            Py_XDECREF(boxed);
+            Py_DECREF(phases);
+            return NULL;
+        }
+        Py_DECREF(boxed);
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:N}",
+                         "calls", (unsigned long long)counters->calls,
+                         "elements", (unsigned long long)counters->elements,
+                         "bytes", (unsigned long long)counters->bytes,
+                         "phases", phases);
+}
+
+static int
+counters_empty(const stats_counters *counters)
+{
+    if (counters->calls)
+        return 0;
+    for (int phase = 0; phase < GUFT_PHASE_COUNT; phase++) {
+        if (counters->phases[phase].count)
+            return 0;
+    }
+    return 1;
+}
+
+/* set_stats_enabled(enabled): returns whether it was enabled before */
+PyObject *
+set_stats_enabled(PyObject *UNUSED_VAR(self), PyObject *args)
+{
+    int enabled, previous = GUFT_ATOMIC_LOAD(stats_enabled);
+
+    if (!PyArg_ParseTuple(args, "p", &enabled))
+        return NULL;
+
+    stats_set_enabled(enabled);
+    return PyBool_FromLong(previous);
+}
+
+PyObject *
+get_stats(PyObject *UNUSED_VAR(self), PyObject *UNUSED_VAR(args))
+{
+    PyObject *rv = PyDict_New();
+    size_t site_count = stats_site_count();
+
+    for (size_t site = 1; rv != NULL && site <= site_count; site++) {
+        stats_counters counters;
+        PyObject *boxed;
+
+        stats_snapshot(site, &counters);
+        if (counters_empty(&counters))
+            continue;
+
+        boxed = box_counters(&counters);
+        if (boxed == NULL ||
+            PyDict_SetItemString(rv, stats_site_name(site), boxed) < 0)
+            Py_CLEAR(rv);
+        Py_XDECREF(boxed);
+    }
+
+    return rv;
+}
+
+PyObject *
+reset_stats(PyObject *UNUSED_VAR(self), PyObject *UNUSED_VAR(args))
+{
+    stats_reset();
+    Py_RETURN_NONE;
+}
@@ -0,0 +1,322 @@
+#include <Python.h>
+#include <pythread.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "background.h"
+#include "stream.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Streamed calls
+ *
+ * KernelRegistry.stream(*operands, sink=None, budget=None) runs a call in
+ * chunks of rows of its first outer axis, sized so that the operands of a
+ * chunk take about budget bytes (see stream.h). It is meant for operands
+ * larger than memory, like memory mapped files: every chunk runs as a
+ * background job while the calling thread gets the inputs of the next one
+ * into memory, so reading them overlaps with the computation.
+ *
+ * Outputs are either given, and written in place chunk by chunk (pages of
+ * memory mapped files are scheduled for write back as soon as a chunk is
+ * done), or handed to sink(start, stop, outputs) a chunk at a time, with
+ * outputs the Buffers of rows [start, stop) (or a tuple of them). Those are
+ * double buffered: the sink gets a chunk while the next one is computed.
+ * Buffers the sink keeps are not reused.
+ *
+ * Elements are walked in C order, the order of the data in C ordered
+ * files. Inputs can not overlap the outputs, unless they are exactly the
+ * same memory (see overlap.h).
+ */
+
+typedef struct {
+    stream s;
+    size_t chunk; /* running */
+    char *base[GUFT_MAXARGS];
+    PyThread_type_lock done; /* held while a chunk runs */
+} stream_run;
+
+/* the background job */
+static void
+run_chunk(void *ctx)
+{
+    stream_run *run = ctx;
+
+    execute_stream_chunk(&run->s, run->base, run->chunk);
+    PyThread_release_lock(run->done);
+}
+
+/* the outputs for a sink, double buffered */
+typedef struct {
+    PyObject *outputs[2][GUFT_MAXARGS];
+    char *data[2][GUFT_MAXARGS];
+    size_t rows[2]; /* of the Buffers in every set */
+} sink_buffers;
+
+static void
+clear_sink_buffers(sink_buffers *buffers, size_t nin, size_t nops)
+{
+    for (size_t set = 0; set < 2; set++) {
+        for (size_t op = nin; op < nops; op++)
+            Py_CLEAR(buffers->outputs[set][op]);
+    }
+}
+
+/* point the outputs of run to buffer set for the rows of chunk, creating
+   the buffers that are missing, were kept by the sink or have another
+   number of rows */
+static int
+place_sink_outputs(guft_module_state *state, prepared_call *call,
+                   stream_run *run, sink_buffers *buffers, size_t set)
+{
+    const stream *s = &run->s;
+    size_t first, rows;
+
+    stream_chunk_rows(s, run->chunk, &first, &rows);
+    for (size_t op = call->signature->input_count; op < call->nops; op++) {
+        const execution_operand *o = call->operands + op;
+        PyObject *output = buffers->outputs[set][op];
+        size_t shape[GUFT_CALL_MAXNDIM];
+
+        memcpy(shape, o->shape, o->ndim*sizeof(size_t));
+        if (s->by_row[op])
+            shape[0] = rows;
+
+        if (output != NULL &&
+            (Py_REFCNT(output) > 1 || buffers->rows[set] != rows)) {
+            Py_CLEAR(buffers->outputs[set][op]);
+            output = NULL;
+        }
+        if (output == NULL) {
+            Py_buffer view;
+
+            output = new_buffer(state, call->types[op], o->ndim, shape);
+            if (output == NULL)
+                return -1;
+            buffers->outputs[set][op] = output;
+            if (PyObject_GetBuffer(output, &view, PyBUF_WRITABLE) < 0)
+                return -1;
+            /* the Buffer keeps its memory until it goes away */
+            buffers->data[set][op] = view.buf;
+            PyBuffer_Release(&view);
+        }
+
+        /* where element 0 would be, so that the first element of the chunk
+           lands at the beginning of the Buffer */
+        run->base[op] = (char *)((uintptr_t)buffers->data[set][op] -
+                                 first*s->row_elements*
+                                 call->plan->operands[op].element_size);
+    }
+    buffers->rows[set] = rows;
+    return 0;
+}
+
+/* hand the outputs of chunk, in buffer set, to the sink */
+static int
+call_sink(PyObject *sink, prepared_call *call, const stream *s,
+          sink_buffers *buffers, size_t set, size_t chunk)
+{
+    size_t nin = call->signature->input_count;
+    size_t first, rows;
+    PyObject *outputs, *rv;
+
+    stream_chunk_rows(s, chunk, &first, &rows);
+    if (call->nops - nin == 1) {
+        outputs = buffers->outputs[set][nin];
+        Py_INCREF(outputs);
+    } else {
+        outputs = PyTuple_New((Py_ssize_t)(call->nops - nin));
+        if (outputs == NULL)
+            return -1;
+        for (size_t op = nin; op < call->nops; op++) {
+            Py_INCREF(buffers->outputs[set][op]);
+            PyTuple_SET_ITEM(outputs, (Py_ssize_t)(op - nin),
+                             buffers->outputs[set][op]);
+        }
+    }
+
+    rv = PyObject_CallFunction(sink, "nnO", (Py_ssize_t)first,
+                               (Py_ssize_t)(first + rows), outputs);
+    Py_DECREF(outputs);
+    if (rv == NULL)
+        return -1;
+    Py_DECREF(rv);
+    return 0;
+}
+
+/* run chunk in the background, prefetching the next one meanwhile, and
+   wait for it. Called without the GIL */
+static void
+run_and_prefetch(stream_run *run, size_t chunk)
+{
+    run->chunk = chunk;
+    PyThread_acquire_lock(run->done, WAIT_LOCK);
+    if (background_submit(run_chunk, run) != 0)
+        run_chunk(run);
+    if (chunk + 1 < run->s.chunk_count)
+        prefetch_stream_chunk(&run->s, chunk + 1);
+}
+
+static void
+wait_chunk(stream_run *run)
+{
+    PyThread_acquire_lock(run->done, WAIT_LOCK);
+    PyThread_release_lock(run->done);
+    release_stream_chunk(&run->s, run->chunk);
+}
+
+PyObject *
+registry_stream(guft_KernelRegistryObject *self, PyObject *args,
+                PyObject *kwargs)
+{
+    static char *kwlist[] = { "sink", "budget", NULL };
+    guft_module_state *state = get_state_by_type(Py_TYPE(self));
+    PyObject *sink = Py_None;
+    PyObject *budget_obj = Py_None;
+    Py_ssize_t budget = GUFT_DEFAULT_STREAM_BUDGET;
+    PyObject *empty, *rv = NULL;
+    prepared_call *call;
+    stream_run *run;
+    sink_buffers buffers;
+    const parsed_signature *ps;
+    unsigned int extra = 0;
+    int failed = 0;
+
+    if (state == NULL)
+        return NULL;
+    if (self->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        return NULL;
+    }
+    empty = PyTuple_New(0);
+    if (empty == NULL)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(empty, kwargs, "|$OO:stream", kwlist,
+                                     &sink, &budget_obj)) {
+        Py_DECREF(empty);
+        return NULL;
+    }
+    Py_DECREF(empty);
+
+    ps = ((guft_SignatureObject *)self->signature)->the_signature;
+    if (budget_obj != Py_None) {
+        budget = PyNumber_AsSsize_t(budget_obj, PyExc_OverflowError);
+        if (budget == -1 && PyErr_Occurred())
+            return NULL;
+    }
+    if (budget <= 0) {
+        PyErr_SetString(PyExc_ValueError, "budget must be positive");
+        return NULL;
+    }
+    if (sink != Py_None) {
+        if (!PyCallable_Check(sink)) {
+            PyErr_SetString(PyExc_TypeError, "sink must be callable");
+            return NULL;
+        }
+        if ((size_t)PyTuple_GET_SIZE(args) != ps->input_count) {
+            PyErr_SetString(PyExc_TypeError,
+                            "outputs can not be given with a sink");
+            return NULL;
+        }
+    }
+
+    call = malloc(sizeof(prepared_call));
+    run = malloc(sizeof(stream_run));
+    if (call == NULL || run == NULL) {
+        free(call);
+        free(run);
+        return PyErr_NoMemory();
+    }
+    if (prepare_call(call, self, args,
+                     GUFT_CALL_IN_ORDER |
+                     (sink != Py_None ? GUFT_CALL_UNALLOCATED : 0)) != 0) {
+        free(call);
+        free(run);
+        return NULL;
+    }
+    memset(&buffers, 0, sizeof(buffers));
+    run->done = NULL;
+
+    if (call->plan->copies != NULL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "streamed calls can not have inputs overlapping "
+                        "their outputs");
+        goto done;
+    }
+    run->done = PyThread_allocate_lock();
+    if (run->done == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /* the outputs for the sink are double buffered */
+    if (sink != Py_None) {
+        for (size_t op = ps->input_count; op < call->nops; op++)
+            extra |= 1u << op;
+    }
+    init_stream(&run->s, call->plan, &call->resolved, call->operands,
+                (size_t)budget, extra);
+    run->s.min_chunk = call->min_chunk;
+    memcpy(run->base, call->plan->args, call->nops*sizeof(char *));
+
+    if (run->s.chunk_count > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        prefetch_stream_chunk(&run->s, 0);
+        Py_END_ALLOW_THREADS
+    }
+
+    for (size_t chunk = 0; chunk < run->s.chunk_count; chunk++) {
+        if (sink != Py_None) {
+            run->chunk = chunk;
+            if (place_sink_outputs(state, call, run, &buffers,
+                                   chunk % 2) != 0)
+                goto done;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        run_and_prefetch(run, chunk);
+        Py_END_ALLOW_THREADS
+
+        /* the previous chunk goes to the sink while this one runs */
+        if (sink != Py_None && chunk > 0)
+            failed = call_sink(sink, call, &run->s, &buffers,
+                               (chunk - 1) % 2, chunk - 1) != 0;
+
+        Py_BEGIN_ALLOW_THREADS
+        wait_chunk(run);
+        Py_END_ALLOW_THREADS
+
+        if (!failed && call->plan->out_of_memory) {
+            PyErr_NoMemory();
+            failed = 1;
+        }
+        if (failed)
+            goto done;
+    }
+
+    if (sink == Py_None) {
+        rv = finish_prepared_call(call);
+    } else {
+        size_t last = run->s.chunk_count;
+        if (last > 0 && call_sink(sink, call, &run->s, &buffers,
+                                  (last - 1) % 2, last - 1) != 0)
+            goto done;
+        if (call->status.failures > 0) {
+            raise_partial_success(state, &call->status,
+                                  call->resolved.element_count, Py_None);
+            goto done;
+        }
+        Py_INCREF(Py_None);
+        rv = Py_None;
+    }
+
+ done:
+    clear_sink_buffers(&buffers, ps->input_count, call->nops);
+    if (run->done != NULL)
+        PyThread_free_lock(run->done);
+    release_prepared_call(call);
+    free(call);
+    free(run);
+    return rv;
+}
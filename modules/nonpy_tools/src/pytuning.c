@@ -0,0 +1,247 @@
+#include <Python.h>
+
+#include <stdlib.h>
+
+#include "stats.h"
+#include "tuner.h"
+#include "nonpymodule.h"
+
+/* -----------------------------------------------------------------------------
+ * Autotuning
+ *
+ * Off by default. set_tuning_enabled(True, cache=path) turns it on: the
+ * first calls of every kernel and core size bucket run as trials of
+ * candidate thread counts, chunk and buffer sizes (see tuner.h), and the
+ * winners are used by later calls and saved to the cache file, to be
+ * loaded by later runs. Names must be unique: kernels of gufuncs sharing a
+ * name are not tuned. get_tuning() returns the winners as a dict keyed by
+ * (kernel site name, bucket):
+ *
+ *   {"thread_count": ..., "min_chunk": ..., "buffer_size": ...}
+ *
+ * where a thread_count of 0 stands for all the threads of the pool.
+ * tune(registry, *operands) tunes a call offline, running it as many times
+ * as needed.
+ */
+
+/* the most calls tune() makes, well above the trials of a combination */
+#define TUNE_MAX_CALLS 1000
+
+static PyObject *
+box_params(const tuned_params *params)
+{
+    return Py_BuildValue("{s:n,s:n,s:n}",
+                         "thread_count", (Py_ssize_t)params->thread_count,
+                         "min_chunk", (Py_ssize_t)params->min_chunk,
+                         "buffer_size", (Py_ssize_t)params->buffer_size);
+}
+
+/* a path argument, or None. *bytes gets a new reference, NULL for None */
+static int
+get_path(PyObject *path, PyObject **bytes)
+{
+    *bytes = NULL;
+    if (path == Py_None)
+        return 0;
+    return PyUnicode_FSConverter(path, bytes) ? 0 : -1;
+}
+
+/* set_tuning_enabled(enabled, cache=None, learn=True): returns whether it
+   was enabled before. The winners in cache, if it exists, replace the ones
+   known, and new ones are saved there. With learn False no call runs as a
+   trial: only winners already known are used */
+PyObject *
+set_tuning_enabled(PyObject *UNUSED_VAR(self), PyObject *args,
+                   PyObject *kwargs)
+{
+    int enabled, learn = 1, previous = GUFT_ATOMIC_LOAD(tuning_enabled);
+    PyObject *cache = Py_None, *path;
+    static char *kwlist[] = { "enabled", "cache", "learn", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "p|Op:set_tuning_enabled",
+                                     kwlist, &enabled, &cache, &learn))
+        return NULL;
+    if (get_path(cache, &path) != 0)
+        return NULL;
+
+    if (path != NULL && tuning_load(PyBytes_AS_STRING(path), 1) < 0) {
+        PyErr_Format(PyExc_ValueError, "can not read a tuning cache from %R",
+                     cache);
+        Py_DECREF(path);
+        return NULL;
+    }
+    if (tuning_set_cache(path ? PyBytes_AS_STRING(path) : NULL) != 0) {
+        Py_XDECREF(path);
+        return PyErr_NoMemory();
+    }
+    Py_XDECREF(path);
+
+    tuning_set_enabled(enabled, learn);
+    return PyBool_FromLong(previous);
+}
+
+PyObject *
+get_tuning(PyObject *UNUSED_VAR(self), PyObject *UNUSED_VAR(args))
+{
+    PyObject *rv = PyDict_New();
+    size_t site_count = stats_site_count();
+
+    for (size_t site = 1; rv != NULL && site <= site_count; site++) {
+        for (size_t bucket = 0; bucket < GUFT_TUNING_BUCKETS; bucket++) {
+            tuned_params params;
+            PyObject *key, *boxed;
+
+            if (tuning_get(site, bucket, &params) != 0)
+                continue;
+
+            key = Py_BuildValue("(sn)", stats_site_name(site),
+                                (Py_ssize_t)bucket);
+            boxed = box_params(&params);
+            if (key == NULL || boxed == NULL ||
+                PyDict_SetItem(rv, key, boxed) < 0)
+                Py_CLEAR(rv);
+            Py_XDECREF(key);
+            Py_XDECREF(boxed);
+            if (rv == NULL)
+                break;
+        }
+    }
+
+    return rv;
+}
+
+PyObject *
+reset_tuning(PyObject *UNUSED_VAR(self), PyObject *UNUSED_VAR(args))
+{
+    tuning_reset();
+    Py_RETURN_NONE;
+}
+
+/* load_tuning(path): adds the winners in a cache file to the ones known,
+   replacing them. Returns how many were loaded */
+PyObject *
+load_tuning(PyObject *UNUSED_VAR(self), PyObject *args)
+{
+    PyObject *path;
+    long count;
+
+    if (!PyArg_ParseTuple(args, "O&:load_tuning", PyUnicode_FSConverter,
+                          &path))
+        return NULL;
+
+    count = tuning_load(PyBytes_AS_STRING(path), 1);
+    Py_DECREF(path);
+    if (count < 0) {
+        PyErr_Format(PyExc_ValueError, "can not read a tuning cache from %R",
+                     PyTuple_GET_ITEM(args, 0));
+        return NULL;
+    }
+    return PyLong_FromLong(count);
+}
+
+/* save_tuning(path): writes the winners known to a cache file, merged with
+   the ones already there */
+PyObject *
+save_tuning(PyObject *UNUSED_VAR(self), PyObject *args)
+{
+    PyObject *path;
+    int rv;
+
+    if (!PyArg_ParseTuple(args, "O&:save_tuning", PyUnicode_FSConverter,
+                          &path))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    rv = tuning_save(PyBytes_AS_STRING(path));
+    Py_END_ALLOW_THREADS
+    Py_DECREF(path);
+    if (rv != 0) {
+        PyErr_Format(PyExc_OSError, "can not write a tuning cache to %R",
+                     PyTuple_GET_ITEM(args, 0));
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* tune(registry, *operands): runs the call until its kernel is tuned for
+   operands of that size, whether tuning is enabled or not, and returns the
+   winners. Results of the calls are thrown away, so outputs given are
+   overwritten and per element failures are ignored */
+PyObject *
+tune(PyObject *self, PyObject *args)
+{
+    guft_module_state *state = get_module_state(self);
+    guft_KernelRegistryObject *registry;
+    PyObject *operands;
+    prepared_call *call;
+    tuned_params params;
+    size_t site = 0, bucket = 0;
+    int tuned = 0;
+
+    if (PyTuple_GET_SIZE(args) < 1 ||
+        !PyObject_TypeCheck(PyTuple_GET_ITEM(args, 0),
+                            state->KernelRegistryType)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "tune takes a KernelRegistry followed by the "
+                        "operands");
+        return NULL;
+    }
+    registry = (guft_KernelRegistryObject *)PyTuple_GET_ITEM(args, 0);
+    if (registry->signature == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "KernelRegistry not initialized");
+        return NULL;
+    }
+
+    operands = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    call = malloc(sizeof(prepared_call));
+    if (operands == NULL || call == NULL) {
+        Py_XDECREF(operands);
+        free(call);
+        return call == NULL ? PyErr_NoMemory() : NULL;
+    }
+
+    for (int i = 0; i < TUNE_MAX_CALLS && !tuned; i++) {
+        if (prepare_call(call, registry, operands, GUFT_CALL_TUNE) != 0)
+            goto fail;
+        site = call->tuning_site;
+        bucket = call->tuning_bucket;
+        if (site == 0) {
+            release_prepared_call(call);
+            PyErr_SetString(PyExc_ValueError,
+                            "only kernels of named gufuncs can be tuned");
+            goto fail;
+        }
+        if (tuning_site_shared(site)) {
+            release_prepared_call(call);
+            PyErr_SetString(PyExc_ValueError,
+                            "kernels of gufuncs sharing a name can not be "
+                            "tuned");
+            goto fail;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        run_prepared_call(call);
+        Py_END_ALLOW_THREADS
+
+        if (call->out_of_memory) {
+            release_prepared_call(call);
+            PyErr_NoMemory();
+            goto fail;
+        }
+        release_prepared_call(call);
+        tuned = tuning_get(site, bucket, &params) == 0;
+    }
+
+    free(call);
+    Py_DECREF(operands);
+    if (!tuned) {
+        PyErr_SetString(PyExc_RuntimeError, "the call could not be tuned");
+        return NULL;
+    }
+    return box_params(&params);
+
+ fail:
+    free(call);
+    Py_DECREF(operands);
+    return NULL;
+}
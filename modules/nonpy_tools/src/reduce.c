@@ -0,0 +1,283 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reduce.h"
+#include "scratch.h"
+#include "threadpool.h"
+
+/* the state of a running reduction, shared by the tasks of every phase */
+typedef struct {
+    reduction *red;
+    size_t chunk_count;
+    size_t block; /* kept elements per block */
+    size_t block_count;
+    size_t step; /* distance between the merged chunks in this level */
+    char *partials; /* chunk_count times kept_count packed elements */
+} reduction_run;
+
+size_t
+reduction_chunk_count(const reduction *red, int associative,
+                      int deterministic, size_t thread_count,
+                      size_t min_chunk)
+{
+    size_t count;
+
+    if (!associative || red->reduced_count < 2 || red->kept_count == 0)
+        return 1;
+
+    if (deterministic) {
+        count = GUFT_REDUCTION_CHUNKS;
+    } else {
+        /* the kept elements are enough parallelism */
+        if (thread_count < 2 || red->kept_count/thread_count >= min_chunk)
+            return 1;
+        count = thread_count;
+    }
+
+    if (count > red->reduced_count)
+        count = red->reduced_count;
+    while (count > 1 &&
+           red->kept_count*red->element_size >
+           GUFT_REDUCTION_MAX_PARTIALS/count)
+        count /= 2;
+    return count;
+}
+
+/* where element 0 of a packed block would be, so that element start lands
+   at the beginning of the block */
+static char *
+packed_base(const reduction *red, char *block, size_t start)
+{
+    return (char *)((uintptr_t)block - start*red->element_size);
+}
+
+/* move count kept elements starting at start between a strided layout
+   (the one of the operand or of the output) and a packed block */
+static void
+transfer_elements(const reduction *red, char *data,
+                  const guft_intp *kept_strides, const guft_intp *core_strides,
+                  char *packed, size_t start, size_t count, int to_packed)
+{
+    size_t ndim = red->kept_ndim;
+    guft_intp index[GUFT_MAXDIMS];
+    size_t rest = start;
+
+    /* C order, so the last kept axis varies fastest */
+    for (size_t d = ndim; d-- > 0;) {
+        index[d] = (guft_intp)(rest % (size_t)red->kept_shape[d]);
+        rest /= (size_t)red->kept_shape[d];
+        data += index[d]*kept_strides[d];
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        char *element = packed + i*red->element_size;
+        if (to_packed)
+            copy_strided(element, red->packed_core_strides, data,
+                         core_strides, red->core_shape, red->core_ndim,
+                         red->itemsize, 0);
+        else
+            copy_strided(data, core_strides, element,
+                         red->packed_core_strides, red->core_shape,
+                         red->core_ndim, red->itemsize, 0);
+
+        for (size_t d = ndim; d-- > 0;) {
+            data += kept_strides[d];
+            if (++index[d] < red->kept_shape[d])
+                break;
+            data -= index[d]*kept_strides[d];
+            index[d] = 0;
+        }
+    }
+}
+
+/* offset in the operand of reduced element r */
+static guft_intp
+reduced_offset(const reduction *red, size_t r)
+{
+    guft_intp offset = 0;
+
+    for (size_t d = red->reduced_ndim; d-- > 0;) {
+        size_t extent = (size_t)red->reduced_shape[d];
+        offset += (guft_intp)(r % extent)*red->reduced_strides[d];
+        r /= extent;
+    }
+    return offset;
+}
+
+/* kept elements [start, start + count) of block number index */
+static void
+block_range(const reduction_run *run, size_t index, size_t *start,
+            size_t *count)
+{
+    *start = index*run->block;
+    *count = run->red->kept_count - *start;
+    if (*count > run->block)
+        *count = run->block;
+}
+
+/* fold the reduced elements of a chunk into its partials for a block of
+   kept elements */
+static void
+fold_block(reduction_run *run, size_t chunk, size_t index)
+{
+    reduction *red = run->red;
+    size_t size = red->element_size;
+    size_t r = chunk*red->reduced_count/run->chunk_count;
+    size_t end = (chunk + 1)*red->reduced_count/run->chunk_count;
+    size_t start, count;
+    char *acc, *spare, *current, *other;
+    char *base[3];
+
+    block_range(run, index, &start, &count);
+    acc = run->partials + (chunk*red->kept_count + start)*size;
+
+    spare = scratch_acquire(count*size);
+    if (spare == NULL) {
+        red->out_of_memory = 1;
+        return;
+    }
+
+    if (red->identity != NULL) {
+        for (size_t i = 0; i < count; i++)
+            memcpy(acc + i*size, red->identity, size);
+    } else {
+        transfer_elements(red, (char *)red->data + reduced_offset(red, r),
+                          red->kept_strides, red->core_strides, acc,
+                          start, count, 1);
+        r++;
+    }
+
+    /* the kernel reads an accumulator and writes the other one, so kernels
+       need not support their output aliasing an input */
+    current = acc;
+    other = spare;
+    for (; r < end; r++) {
+        char *t;
+        base[0] = packed_base(red, current, start);
+        base[1] = (char *)red->data + reduced_offset(red, r);
+        base[2] = packed_base(red, other, start);
+        execute_plan_range_at(red->step, base, start, count);
+        t = current;
+        current = other;
+        other = t;
+    }
+    if (current != acc)
+        memcpy(acc, current, count*size);
+
+    scratch_release(spare);
+}
+
+static void
+fold_func(void *ctx, size_t start, size_t count)
+{
+    reduction_run *run = ctx;
+
+    for (size_t task = start; task < start + count; task++)
+        fold_block(run, task/run->block_count, task%run->block_count);
+}
+
+/* merge the partials of chunk into the ones of chunk - step */
+static void
+merge_block(reduction_run *run, size_t chunk, size_t index)
+{
+    reduction *red = run->red;
+    size_t size = red->element_size;
+    size_t start, count;
+    char *into, *from, *spare;
+    char *base[3];
+
+    block_range(run, index, &start, &count);
+    into = run->partials + ((chunk - run->step)*red->kept_count + start)*size;
+    from = run->partials + (chunk*red->kept_count + start)*size;
+
+    spare = scratch_acquire(count*size);
+    if (spare == NULL) {
+        red->out_of_memory = 1;
+        return;
+    }
+
+    base[0] = packed_base(red, into, start);
+    base[1] = packed_base(red, from, start);
+    base[2] = packed_base(red, spare, start);
+    execute_plan_range_at(red->merge, base, start, count);
+    memcpy(into, spare, count*size);
+
+    scratch_release(spare);
+}
+
+static void
+merge_func(void *ctx, size_t start, size_t count)
+{
+    reduction_run *run = ctx;
+
+    /* task t merges chunk (2t + 1)*step into 2t*step */
+    for (size_t task = start; task < start + count; task++) {
+        size_t pair = task/run->block_count;
+        merge_block(run, (2*pair + 1)*run->step, task%run->block_count);
+    }
+}
+
+static void
+store_func(void *ctx, size_t start, size_t count)
+{
+    reduction_run *run = ctx;
+    reduction *red = run->red;
+
+    for (size_t index = start; index < start + count; index++) {
+        size_t first, n;
+        block_range(run, index, &first, &n);
+        transfer_elements(red, red->out, red->out_kept_strides,
+                          red->out_core_strides,
+                          run->partials + first*red->element_size,
+                          first, n, 0);
+    }
+}
+
+void
+execute_reduction(reduction *red, size_t chunk_count, size_t buffer_size)
+{
+    reduction_run run;
+    size_t size = red->element_size;
+
+    red->out_of_memory = 0;
+    if (red->kept_count == 0)
+        return;
+    if (chunk_count == 0)
+        chunk_count = 1;
+
+    run.red = red;
+    run.chunk_count = chunk_count;
+    run.block = size > 0 ? buffer_size/size : red->kept_count;
+    if (run.block == 0)
+        run.block = 1;
+    if (run.block > red->kept_count)
+        run.block = red->kept_count;
+    run.block_count = (red->kept_count + run.block - 1)/run.block;
+    run.step = 0;
+
+    if (red->kept_count > SIZE_MAX/chunk_count/(size > 0 ? size : 1)) {
+        red->out_of_memory = 1;
+        return;
+    }
+    run.partials = malloc(chunk_count*red->kept_count*size + 1);
+    if (run.partials == NULL) {
+        red->out_of_memory = 1;
+        return;
+    }
+
+    /* every task is a whole block of a chunk, so min_chunk is 1 */
+    threadpool_parallel_for(chunk_count*run.block_count, 1, fold_func, &run);
+
+    for (run.step = 1; run.step < chunk_count && !red->out_of_memory;
+         run.step *= 2) {
+        size_t pairs = (chunk_count - run.step + 2*run.step - 1)/
+            (2*run.step);
+        threadpool_parallel_for(pairs*run.block_count, 1, merge_func, &run);
+    }
+
+    if (!red->out_of_memory)
+        threadpool_parallel_for(run.block_count, 1, store_func, &run);
+
+    free(run.partials);
+}
@@ -0,0 +1,91 @@
+#ifndef GUFT_REDUCE_H
+#define GUFT_REDUCE_H
+
+#include <stddef.h>
+
+#include "executor.h"
+
+/* Reductions of an operand along some of its outer axes with a binary
+   gufunc (a),(a)->(a): both inputs and the output have the same core shape
+   and type. The outer axes that are not reduced are kept, and the result
+   has an element for every combination of them.
+
+   The work is split in a grid of blocks of kept elements times chunks of
+   reduced elements. Every chunk folds its reduced elements in order into
+   packed partial results, one per kept element, and the partials of the
+   chunks are then merged as a tree: chunk 0 with 1, 2 with 3..., then 0
+   with 2 and so on. The order of the operations only depends on the number
+   of chunks, and with a single chunk the reduction is a left fold, the
+   same as a sequential loop, so it is right for any kernel. Several chunks
+   need an associative kernel.
+
+   Accumulators are packed: the core of every element contiguous in C
+   order, and element k at k times the element size.
+*/
+
+/* chunks used by deterministic reductions, no matter the thread count */
+#define GUFT_REDUCTION_CHUNKS 64
+
+/* limit to the memory for the partials of the chunks */
+#define GUFT_REDUCTION_MAX_PARTIALS (64*1024*1024)
+
+typedef struct _reduction_struct {
+    /* plans over the kept outer shape, with packed accumulators. Their
+       base pointers are not used */
+    const execution_plan *step; /* accumulator, operand -> accumulator */
+    const execution_plan *merge; /* accumulator, accumulator -> accumulator */
+
+    /* the core of an element */
+    size_t itemsize;
+    size_t element_size; /* bytes of a packed element */
+    size_t core_ndim;
+    const guft_intp *core_shape;
+    const guft_intp *packed_core_strides;
+
+    size_t kept_ndim;
+    const guft_intp *kept_shape;
+    size_t kept_count;
+
+    /* the reduced operand: where its first element is and its strides, in
+       bytes, along the kept axes, the reduced axes and in the core */
+    const char *data;
+    const guft_intp *kept_strides;
+    const guft_intp *core_strides;
+    size_t reduced_ndim;
+    const guft_intp *reduced_shape;
+    const guft_intp *reduced_strides;
+    size_t reduced_count;
+
+    /* where the result goes, with strides along the kept axes and in the
+       core */
+    char *out;
+    const guft_intp *out_kept_strides;
+    const guft_intp *out_core_strides;
+
+    /* a packed element to start every chunk from. NULL to start from the
+       first element of the chunk, that needs reduced_count > 0 */
+    const char *identity;
+
+    /* set by execute_reduction when there was no memory for the partials or
+       the accumulators. The result is not valid then */
+    int out_of_memory;
+} reduction;
+
+/* Number of chunks for a reduction. Non associative reductions and
+   reductions with enough kept elements to keep thread_count threads busy
+   use one, others one per thread. Deterministic ones use
+   GUFT_REDUCTION_CHUNKS, so the result does not depend on the number of
+   threads. Never more than the reduced elements nor than what fits in
+   GUFT_REDUCTION_MAX_PARTIALS */
+size_t
+reduction_chunk_count(const reduction *red, int associative,
+                      int deterministic, size_t thread_count,
+                      size_t min_chunk);
+
+/* Run the reduction with chunk_count chunks using the thread pool. The
+   blocks of kept elements are sized so that the accumulators of a block
+   take about buffer_size bytes. Does not touch Python objects */
+void
+execute_reduction(reduction *red, size_t chunk_count, size_t buffer_size);
+
+#endif /* GUFT_REDUCE_H */
@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "resolve.h"
+
+/* Shape resolution for a gufunc call, based on what NumPy does in
+   PyUFunc_GeneralizedFunction (_get_coredim_sizes and the broadcasting done
+   when building the NpyIter), but working on plain shapes: no Python nor
+   NumPy objects are involved.
+
+   A pass over the arguments broadcasts their leading dimensions into the
+   outer shape, and a pass over the dimension index of the signature binds
+   every dimension variable to the trailing dimensions that use it.
+*/
+
+#define RESOLVE_FAIL(msg, a, x) do {            \
+        if (error != NULL) {                    \
+            error->message = (msg);             \
+            error->arg = (a);                   \
+            error->axis = (x);                  \
+        }                                       \
+        return -1;                              \
+    } while(0)
+
+int
+resolve_shapes(const parsed_signature *ps,
+               const size_t *arg_ndim,
+               const size_t * const *arg_shapes,
+               resolved_shapes *result,
+               resolve_error *error)
+{
+    size_t *sizes = result->dimension_sizes;
+    size_t *outer = result->outer_shape;
+    size_t outer_ndim = 0;
+    size_t element_count = 1;
+
+    for (size_t arg = 0; arg < ps->arg_count; arg++) {
+        const size_t *shape = arg_shapes[arg];
+        size_t core_ndim = ps->arg_dimension_count[arg];
+        size_t ndim, arg_outer_ndim, skip;
+
+        if (shape == NULL) {
+            if (arg < ps->input_count)
+                RESOLVE_FAIL("missing input shape", arg, 0);
+            continue; /* output to be inferred */
+        }
+
+        ndim = arg_ndim[arg];
+        if (ndim < core_ndim)
+            RESOLVE_FAIL("not enough dimensions for the signature", arg, ndim);
+        arg_outer_ndim = ndim - core_ndim;
+        if (arg_outer_ndim > GUFT_MAXDIMS)
+            RESOLVE_FAIL("too many outer dimensions", arg, GUFT_MAXDIMS);
+
+        /* broadcast the outer dimensions, aligned to the right */
+        if (arg_outer_ndim > outer_ndim) {
+            size_t grow = arg_outer_ndim - outer_ndim;
+            memmove(outer + grow, outer, outer_ndim*sizeof(size_t));
+            for (size_t d = 0; d < grow; d++)
+                outer[d] = 1;
+            outer_ndim = arg_outer_ndim;
+        }
+        skip = outer_ndim - arg_outer_ndim;
+        for (size_t d = 0; d < arg_outer_ndim; d++) {
+            size_t n = shape[d];
+            if (outer[skip + d] == 1)
+                outer[skip + d] = n;
+            else if (n != 1 && n != outer[skip + d])
+                RESOLVE_FAIL("operands could not be broadcast together",
+                             arg, d);
+        }
+    }
+
+    /* bind the variables, starting from the size fixed in the signature
+       if any. The shapes are known to have all their core dimensions */
+    for (size_t var = 0; var < ps->dimension_variable_count; var++) {
+        const signature_dimension *dim = ps->dimensions + var;
+        const signature_dimension_use *use =
+            ps->dimension_uses + dim->first_use;
+        const signature_dimension_use *end = use + dim->use_count;
+        size_t fixed = ps->dimension_fixed_sizes[var];
+        size_t bound = fixed;
+
+        for (; use < end; use++) {
+            const size_t *shape = arg_shapes[use->arg];
+            size_t axis;
+            if (shape == NULL)
+                continue; /* output to be inferred */
+            axis = arg_ndim[use->arg] - ps->arg_dimension_count[use->arg] +
+                use->axis;
+            if (bound == GUFT_UNBOUND_DIMENSION)
+                bound = shape[axis];
+            else if (shape[axis] != bound && fixed != GUFT_FREE_DIMENSION)
+                RESOLVE_FAIL("core dimension does not match the size in the "
+                             "signature", use->arg, axis);
+            else if (shape[axis] != bound)
+                RESOLVE_FAIL("mismatch in core dimension", use->arg, axis);
+        }
+
+        /* only used by outputs to be inferred */
+        if (bound == GUFT_UNBOUND_DIMENSION) {
+            use = ps->dimension_uses + dim->first_use;
+            RESOLVE_FAIL("output dimension not bound by any operand",
+                         use->arg, use->axis);
+        }
+        sizes[var] = bound;
+    }
+
+    /* outputs can not be broadcast: their outer shape must be the full
+       outer shape */
+    for (size_t arg = ps->input_count; arg < ps->arg_count; arg++) {
+        const size_t *shape = arg_shapes[arg];
+        if (shape == NULL)
+            continue;
+        if (arg_ndim[arg] - ps->arg_dimension_count[arg] != outer_ndim)
+            RESOLVE_FAIL("output does not match the outer shape", arg, 0);
+        for (size_t d = 0; d < outer_ndim; d++) {
+            if (shape[d] != outer[d])
+                RESOLVE_FAIL("output does not match the outer shape", arg, d);
+        }
+    }
+
+    for (size_t d = 0; d < outer_ndim; d++) {
+        if (outer[d] != 0 && element_count > SIZE_MAX/outer[d])
+            RESOLVE_FAIL("outer shape too large", ps->arg_count, d);
+        element_count *= outer[d];
+    }
+
+    result->outer_ndim = outer_ndim;
+    result->element_count = element_count;
+    return 0;
+}
+
+size_t
+resolved_arg_shape(const parsed_signature *ps,
+                   const resolved_shapes *resolved,
+                   size_t arg,
+                   size_t *shape)
+{
+    const size_t *idx = ps->arg_shape_idx + ps->arg_shape_offsets[arg];
+    size_t core_ndim = ps->arg_dimension_count[arg];
+
+    memcpy(shape, resolved->outer_shape, resolved->outer_ndim*sizeof(size_t));
+    for (size_t d = 0; d < core_ndim; d++)
+        shape[resolved->outer_ndim + d] = resolved->dimension_sizes[idx[d]];
+
+    return resolved->outer_ndim + core_ndim;
+}
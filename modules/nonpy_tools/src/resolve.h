@@ -0,0 +1,66 @@
+#ifndef GUFT_RESOLVE_H
+#define GUFT_RESOLVE_H
+
+#include <stddef.h>
+
+#include "signature.h"
+
+/* Maximum number of dimensions of the outer (loop) shape. Same as the
+   classic NPY_MAXDIMS */
+#define GUFT_MAXDIMS 32
+
+/* value of an unbound dimension variable. The same as GUFT_FREE_DIMENSION,
+   so fixed sizes in the signature can be used as initial bindings */
+#define GUFT_UNBOUND_DIMENSION GUFT_FREE_DIMENSION
+
+typedef struct _resolved_shapes_struct {
+    size_t outer_ndim;
+    size_t outer_shape[GUFT_MAXDIMS];
+    size_t element_count; /* number of kernel elements (product of
+                             outer_shape) */
+
+    /* size of every dimension variable, as many as
+       dimension_variable_count. Caller provided */
+    size_t *dimension_sizes;
+} resolved_shapes;
+
+typedef struct _resolve_error_struct {
+    const char *message; /* static string describing the error */
+    size_t arg; /* argument where the problem was found */
+    size_t axis; /* axis in that argument */
+} resolve_error;
+
+/* Resolve a gufunc call given the shapes of its arguments. This:
+
+   - binds each dimension variable of the signature to a size, checking that
+     repeated variables match, as well as sizes fixed in the signature.
+
+   - broadcasts the outer shapes of the arguments into the outer (loop)
+     shape. Outputs take part in the outer shape but are never broadcast
+     themselves.
+
+   arg_ndim and arg_shapes have one entry per argument in the signature. An
+   output whose shape is to be inferred is passed with a NULL shape.
+   result->dimension_sizes must point to an array with room for
+   dimension_variable_count entries.
+
+   Returns 0 on success and -1 on error, filling error if not NULL.
+*/
+int
+resolve_shapes(const parsed_signature *ps,
+               const size_t *arg_ndim,
+               const size_t * const *arg_shapes,
+               resolved_shapes *result,
+               resolve_error *error);
+
+/* Write in shape the full shape of argument arg (outer shape followed by
+   its core dimensions) after resolution. shape needs room for
+   GUFT_MAXDIMS plus the core dimensions of the argument. Returns the number
+   of dimensions written */
+size_t
+resolved_arg_shape(const parsed_signature *ps,
+                   const resolved_shapes *resolved,
+                   size_t arg,
+                   size_t *shape);
+
+#endif /* GUFT_RESOLVE_H */
@@ -0,0 +1,137 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+
+#include "scratch.h"
+
+#if defined(_WIN32)
+
+#include <malloc.h>
+
+/* No per-thread pool on this platform yet, just aligned allocations */
+
+void *
+scratch_acquire(size_t size)
+{
+    return _aligned_malloc(size ? size : 1, GUFT_SCRATCH_ALIGNMENT);
+}
+
+void
+scratch_release(void *block)
+{
+    _aligned_free(block);
+}
+
+#else /* !_WIN32 */
+
+#include <pthread.h>
+
+/* Blocks are used as a stack, so nested users (like a kernel that runs
+   buffered execution itself) get their own block. Deeper nesting than
+   this falls back to plain allocations */
+#define SCRATCH_SLOTS 4
+
+typedef struct _scratch_pool_struct {
+    size_t depth;
+    void *blocks[SCRATCH_SLOTS];
+    size_t sizes[SCRATCH_SLOTS];
+} scratch_pool;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static int pool_key_ok = 0;
+
+static void
+release_pool(void *arg)
+{
+    scratch_pool *pool = arg;
+    for (size_t i = 0; i < SCRATCH_SLOTS; i++)
+        free(pool->blocks[i]);
+    free(pool);
+}
+
+static void
+create_pool_key(void)
+{
+    pool_key_ok = pthread_key_create(&pool_key, release_pool) == 0;
+}
+
+static scratch_pool *
+thread_pool(void)
+{
+    scratch_pool *pool;
+
+    pthread_once(&pool_key_once, create_pool_key);
+    if (!pool_key_ok)
+        return NULL;
+
+    pool = pthread_getspecific(pool_key);
+    if (pool == NULL) {
+        pool = calloc(1, sizeof(scratch_pool));
+        if (pool != NULL && pthread_setspecific(pool_key, pool) != 0) {
+            free(pool);
+            pool = NULL;
+        }
+    }
+    return pool;
+}
+
+static void *
+aligned_block(size_t size)
+{
+    void *block = NULL;
+    if (posix_memalign(&block, GUFT_SCRATCH_ALIGNMENT, size ? size : 1) != 0)
+        return NULL;
+    return block;
+}
+
+void *
+scratch_acquire(size_t size)
+{
+    scratch_pool *pool = thread_pool();
+    size_t slot;
+
+    if (pool == NULL || pool->depth >= SCRATCH_SLOTS) {
+        if (pool != NULL)
+            pool->depth++; /* keep the release balanced */
+        return aligned_block(size);
+    }
+
+    slot = pool->depth;
+    if (pool->sizes[slot] < size) {
+        /* grow geometrically so slowly increasing sizes do not realloc
+           every time */
+        size_t new_size = pool->sizes[slot]*2;
+        void *block;
+        if (new_size < size)
+            new_size = size;
+        block = aligned_block(new_size);
+        if (block == NULL)
+            return NULL;
+        free(pool->blocks[slot]);
+        pool->blocks[slot] = block;
+        pool->sizes[slot] = new_size;
+    }
+
+    pool->depth++;
+    return pool->blocks[slot];
+}
+
+void
+scratch_release(void *block)
+{
+    scratch_pool *pool = thread_pool();
+
+    if (pool == NULL || pool->depth == 0) {
+        free(block);
+        return;
+    }
+
+    pool->depth--;
+    if (pool->depth >= SCRATCH_SLOTS)
+        free(block); /* came from the fallback */
+}
+
+#endif /* _WIN32 */
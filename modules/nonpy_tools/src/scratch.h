@@ -0,0 +1,26 @@
+#ifndef GUFT_SCRATCH_H
+#define GUFT_SCRATCH_H
+
+#include <stddef.h>
+
+/* Per-thread pool of reusable scratch buffers.
+
+   Execution often needs temporary memory for a short time (for example the
+   buffers used by buffered execution). Instead of a malloc/free pair each
+   time, every thread keeps a few blocks around that only grow. Blocks are
+   aligned to GUFT_SCRATCH_ALIGNMENT and released when the thread exits.
+
+   Acquire and release must happen in the same thread, in LIFO order.
+*/
+
+#define GUFT_SCRATCH_ALIGNMENT 64
+
+/* Returns a block of at least size bytes, or NULL if out of memory */
+void *
+scratch_acquire(size_t size);
+
+/* Gives back the last block acquired */
+void
+scratch_release(void *block);
+
+#endif /* GUFT_SCRATCH_H */
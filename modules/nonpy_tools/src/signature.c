@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "signature.h"
 /* This code is based on the _parse_signature code in ufunc_object.c in
@@ -37,10 +38,16 @@ _is_alpha_underscore(char ch)
     return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == '_';
 }
 
+static int
+_is_digit(char ch)
+{
+    return ch >= '0' && ch <= '9';
+}
+
 static int
 _is_alnum_underscore(char ch)
 {
-    return _is_alpha_underscore(ch) || (ch >= '0' && ch <= '9');
+    return _is_alpha_underscore(ch) || _is_digit(ch);
 }
 
 /*
@@ -90,25 +97,24 @@ typedef struct _ufunc_mockup_struct {
    with a mockup ufunc object to remove the dependency.
 
    Calls to Numpy API will be either removed or changed to a standard equivalent
-   function (PyArray_malloc -> malloc, etc..)
+   function (PyArray_malloc -> malloc, etc..). Instead of setting Python
+   exceptions, errors are described in error (if not NULL)
 */
 static int
-_parse_signature(UFuncMockup *ufunc, const char *signature)
+_parse_signature(UFuncMockup *ufunc, const char *signature,
+                 signature_parse_error *error)
 {
     size_t len;
-    char const **var_names;
+    char const **var_names = NULL;
     int nd = 0;             /* number of dimension of the current argument */
     size_t cur_arg = 0;        /* index into core_num_dims&core_offsets */
     size_t cur_core_dim = 0;   /* index into core_dim_ixs */
     int i = 0;
-    char *parse_error = NULL;
+    const char *parse_error = NULL;
 
     if (signature == NULL) {
-        /*
-        PyErr_SetString(PyExc_RuntimeError,
-                        "_parse_signature with NULL signature");
-        */
-        return -1;
+        parse_error = "NULL signature";
+        goto fail;
     }
 
     len = strlen(signature);
@@ -119,26 +125,31 @@ _parse_signature(UFuncMockup *ufunc, const char *signature)
     }
     */
     /* Allocate sufficient memory to store pointers to all dimension names */
-    var_names = malloc(sizeof(char const*) * len);
+    var_names = malloc(sizeof(char const*) * (len + 1));
     if (var_names == NULL) {
-        /* PyErr_NoMemory(); */
-        return -1;
+        parse_error = "out of memory";
+        goto fail;
     }
 
     ufunc->core_enabled = 1;
     ufunc->core_num_dim_ix = 0;
-    ufunc->core_num_dims = malloc(sizeof(size_t) * ufunc->nargs);
-    ufunc->core_dim_ixs = malloc(sizeof(size_t) * len); /* shrink this later */
-    ufunc->core_offsets = malloc(sizeof(size_t) * ufunc->nargs);
+    ufunc->core_num_dims = malloc(sizeof(size_t) * (ufunc->nargs + 1));
+    ufunc->core_dim_ixs = malloc(sizeof(size_t) * (len + 1)); /* shrink this later */
+    ufunc->core_offsets = malloc(sizeof(size_t) * (ufunc->nargs + 1));
     if (ufunc->core_num_dims == NULL || ufunc->core_dim_ixs == NULL
         || ufunc->core_offsets == NULL) {
-        /* PyErr_NoMemory(); */
+        parse_error = "out of memory";
         goto fail;
     }
 
     i = _next_non_white_space(signature, 0);
     while (signature[i] != '\0') {
         /* loop over input/output arguments */
+        if (cur_arg == ufunc->nargs) {
+            /* nargs comes from the caller, there may be more */
+            parse_error = "expect end of signature";
+            goto fail;
+        }
         if (cur_arg == ufunc->nin) {
             /* expect "->" */
             if (signature[i] != '-' || signature[i+1] != '>') {
@@ -214,8 +225,13 @@ _parse_signature(UFuncMockup *ufunc, const char *signature)
         parse_error = "incomplete signature: not all arguments found";
         goto fail;
     }
-    ufunc->core_dim_ixs = realloc(ufunc->core_dim_ixs,
-            sizeof(size_t)*cur_core_dim);
+    {
+        /* shrinking, so failing just keeps the larger block */
+        size_t *shrunk = realloc(ufunc->core_dim_ixs,
+                                 sizeof(size_t)*(cur_core_dim + 1));
+        if (shrunk != NULL)
+            ufunc->core_dim_ixs = shrunk;
+    }
     /* check for trivial core-signature, e.g. "(),()->()" */
     if (cur_core_dim == 0) {
         ufunc->core_enabled = 0;
@@ -225,13 +241,9 @@ _parse_signature(UFuncMockup *ufunc, const char *signature)
 
 fail:
     free((void*)var_names);
-    if (parse_error) {
-        printf("%s at position %d in \"%s\"\n", parse_error, i, signature);
-        /*
-        PyErr_Format(PyExc_ValueError,
-                     "%s at position %d in \"%s\"",
-                     parse_error, i, signature);
-        */
+    if (error != NULL) {
+        error->message = parse_error;
+        error->position = (size_t)i;
     }
     return -1;
 }
@@ -257,6 +269,65 @@ dump_zu_array(const char *name, const size_t *array, size_t len)
 }
 
 
+/* size_t slots taken by the dimension index, after dimension_fixed_sizes */
+static size_t
+_index_slots(size_t total_dims, size_t var_count)
+{
+    size_t bytes = sizeof(signature_dimension)*var_count +
+        sizeof(signature_dimension_use)*total_dims;
+    return (bytes + sizeof(size_t) - 1)/sizeof(size_t);
+}
+
+/* point the members of the dimension index to their place in the block */
+static void
+_place_index(parsed_signature *ps)
+{
+    ps->dimensions = (signature_dimension *)
+        (ps->dimension_fixed_sizes + ps->dimension_variable_count);
+    ps->dimension_uses = (signature_dimension_use *)
+        (ps->dimensions + ps->dimension_variable_count);
+}
+
+/* fill the dimension index from arg_shape_idx. A counting sort of the uses
+   by variable: count them, turn the counts into the first use of every
+   variable, and then place the uses in argument order */
+static void
+_build_index(parsed_signature *ps)
+{
+    signature_dimension *dims = ps->dimensions;
+    size_t first = 0;
+
+    for (size_t var = 0; var < ps->dimension_variable_count; var++) {
+        dims[var].use_count = 0;
+        dims[var].defining_input = GUFT_NO_DEFINING_INPUT;
+        dims[var].flags = GUFT_DIMENSION_OUTPUT_ONLY;
+    }
+    for (size_t d = 0; d < ps->total_signature_dimensions; d++)
+        dims[ps->arg_shape_idx[d]].use_count++;
+    for (size_t var = 0; var < ps->dimension_variable_count; var++) {
+        dims[var].first_use = (uint16_t)first;
+        first += dims[var].use_count;
+        dims[var].use_count = 0;
+    }
+
+    for (size_t arg = 0; arg < ps->arg_count; arg++) {
+        const size_t *idx = ps->arg_shape_idx + ps->arg_shape_offsets[arg];
+        for (size_t axis = 0; axis < ps->arg_dimension_count[arg]; axis++) {
+            signature_dimension *dim = dims + idx[axis];
+            signature_dimension_use *use =
+                ps->dimension_uses + dim->first_use + dim->use_count++;
+            use->arg = (uint16_t)arg;
+            use->axis = (uint16_t)axis;
+            if (arg < ps->input_count &&
+                dim->defining_input == GUFT_NO_DEFINING_INPUT) {
+                dim->defining_input = (uint16_t)arg;
+                dim->flags &= ~GUFT_DIMENSION_OUTPUT_ONLY;
+            }
+        }
+    }
+}
+
+
 /* Data resulting from parsing a signature can be returned in this struct */
 
 parsed_signature *
@@ -271,11 +342,18 @@ create_parsed_signature(size_t nin,
     for (size_t i=0; i<nargs; i++)
         total_signature_dimensions += arg_dimension_count[i];
 
+    if (nargs > GUFT_MAX_SIGNATURE_INDEX ||
+        total_signature_dimensions > GUFT_MAX_SIGNATURE_INDEX)
+        return NULL;
+
     size_t total_size =
         sizeof(parsed_signature) +
         sizeof(size_t)*nargs + /* *ps_arg_dimension_count */
         sizeof(size_t)*nargs + /* *ps_arg_shape_offsets */
-        sizeof(size_t)*total_signature_dimensions; /* *ps_arg_shape_idx */
+        sizeof(size_t)*total_signature_dimensions + /* *ps_arg_shape_idx */
+        sizeof(size_t)*dimension_variable_count + /* *ps_dimension_fixed_sizes */
+        sizeof(size_t)*_index_slots(total_signature_dimensions,
+                                    dimension_variable_count);
 
     parsed_signature *ps = malloc(total_size);
     if (ps != NULL)
@@ -288,6 +366,8 @@ create_parsed_signature(size_t nin,
         ps->arg_dimension_count = ps->data;
         ps->arg_shape_offsets = ps->arg_dimension_count + nargs;
         ps->arg_shape_idx = ps->arg_shape_offsets + nargs;
+        ps->dimension_fixed_sizes =
+            ps->arg_shape_idx + total_signature_dimensions;
         for (size_t i = 0; i < nargs; i++) {
             ps->arg_dimension_count[i] = arg_dimension_count[i];
         }
@@ -297,6 +377,12 @@ create_parsed_signature(size_t nin,
         for (size_t i = 0; i < total_signature_dimensions; i++) {
             ps->arg_shape_idx[i] = arg_shape_idx[i];
         }
+        /* the NumPy grammar has no fixed sizes */
+        for (size_t i = 0; i < dimension_variable_count; i++) {
+            ps->dimension_fixed_sizes[i] = GUFT_FREE_DIMENSION;
+        }
+        _place_index(ps);
+        _build_index(ps);
     }
 
     return ps;
@@ -309,6 +395,57 @@ release_parsed_signature(parsed_signature *the_signature)
     free(the_signature);
 }
 
+/* FNV-1a style mixing of the logical contents of a parsed signature. Only
+   the parsed data is used (not the pointers), so equal signatures hash the
+   same no matter where they live in memory */
+static size_t
+_hash_zu_array(size_t h, const size_t *array, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        h ^= array[i];
+        h *= (size_t)1099511628211ULL;
+    }
+    return h;
+}
+
+size_t
+parsed_signature_hash(const parsed_signature *the_signature)
+{
+    size_t h = (size_t)14695981039346656037ULL;
+    h = _hash_zu_array(h, &the_signature->input_count, 1);
+    h = _hash_zu_array(h, &the_signature->output_count, 1);
+    h = _hash_zu_array(h, &the_signature->dimension_variable_count, 1);
+    h = _hash_zu_array(h, the_signature->arg_dimension_count,
+                       the_signature->arg_count);
+    h = _hash_zu_array(h, the_signature->arg_shape_idx,
+                       the_signature->total_signature_dimensions);
+    h = _hash_zu_array(h, the_signature->dimension_fixed_sizes,
+                       the_signature->dimension_variable_count);
+    return h;
+}
+
+int
+parsed_signature_equal(const parsed_signature *a, const parsed_signature *b)
+{
+    if (a == b)
+        return 1;
+
+    if (a->input_count != b->input_count ||
+        a->output_count != b->output_count ||
+        a->dimension_variable_count != b->dimension_variable_count ||
+        a->total_signature_dimensions != b->total_signature_dimensions)
+        return 0;
+
+    /* arg_shape_offsets is derived from arg_dimension_count, no need to
+       compare it */
+    return memcmp(a->arg_dimension_count, b->arg_dimension_count,
+                  sizeof(size_t)*a->arg_count) == 0 &&
+           memcmp(a->arg_shape_idx, b->arg_shape_idx,
+                  sizeof(size_t)*a->total_signature_dimensions) == 0 &&
+           memcmp(a->dimension_fixed_sizes, b->dimension_fixed_sizes,
+                  sizeof(size_t)*a->dimension_variable_count) == 0;
+}
+
 void print_parsed_signature(parsed_signature *the_signature)
 {
     printf("Signature attributes:\n");
@@ -327,10 +464,30 @@ void print_parsed_signature(parsed_signature *the_signature)
                   the_signature->arg_count);
     dump_zu_array("arg_shape_idx", the_signature->arg_shape_idx,
                   the_signature->total_signature_dimensions);
+    dump_zu_array("dimension_fixed_sizes",
+                  the_signature->dimension_fixed_sizes,
+                  the_signature->dimension_variable_count);
+
+    for (size_t var = 0; var < the_signature->dimension_variable_count;
+         var++) {
+        const signature_dimension *dim = the_signature->dimensions + var;
+        printf("%18s %zu:", "dimension", var);
+        if (dim->flags & GUFT_DIMENSION_OUTPUT_ONLY)
+            printf(" output only,");
+        else
+            printf(" defined by %u,", (unsigned)dim->defining_input);
+        for (size_t u = 0; u < dim->use_count; u++) {
+            const signature_dimension_use *use =
+                the_signature->dimension_uses + dim->first_use + u;
+            printf(" (%u, %u)", (unsigned)use->arg, (unsigned)use->axis);
+        }
+        printf("\n");
+    }
 }
 
 parsed_signature *
-legacy_numpy_parse_signature(const char *signature, int nin, int nargs)
+legacy_numpy_parse_signature(const char *signature, int nin, int nargs,
+                             signature_parse_error *error)
 {
     parsed_signature *result = NULL;
     UFuncMockup mockup = {0};
@@ -338,7 +495,7 @@ legacy_numpy_parse_signature(const char *signature, int nin, int nargs)
     mockup.nargs = nargs;
 
     /* print out the resulting values in mockup */
-    if (_parse_signature(&mockup, signature) == 0) 
+    if (_parse_signature(&mockup, signature, error) == 0) 
     {
         size_t total_dims = 0;
         for (size_t i=0; i<mockup.nargs;i++)
@@ -350,6 +507,10 @@ legacy_numpy_parse_signature(const char *signature, int nin, int nargs)
                                          mockup.core_num_dims,
                                          mockup.core_offsets,
                                          mockup.core_dim_ixs);
+        if (result == NULL && error != NULL) {
+            error->message = "signature too large or out of memory";
+            error->position = 0;
+        }
     }
 
     free(mockup.core_offsets);
@@ -382,7 +543,7 @@ scan_signature(const char *signature, size_t *nin, size_t *nargs)
 }
 
 parsed_signature *
-numpy_parse_signature(const char *signature)
+numpy_parse_signature(const char *signature, signature_parse_error *error)
 {
     parsed_signature *result = NULL;
     UFuncMockup mockup = {0};
@@ -390,7 +551,7 @@ numpy_parse_signature(const char *signature)
     scan_signature(signature, &mockup.nin, &mockup.nargs);
 
     /* print out the resulting values in mockup */
-    if (_parse_signature(&mockup, signature) == 0) 
+    if (_parse_signature(&mockup, signature, error) == 0) 
     {
         size_t total_dims = 0;
         for (size_t i=0; i<mockup.nargs;i++)
@@ -402,6 +563,10 @@ numpy_parse_signature(const char *signature)
                                          mockup.core_num_dims,
                                          mockup.core_offsets,
                                          mockup.core_dim_ixs);
+        if (result == NULL && error != NULL) {
+            error->message = "signature too large or out of memory";
+            error->position = 0;
+        }
     }
 
     free(mockup.core_offsets);
@@ -410,3 +575,631 @@ numpy_parse_signature(const char *signature)
 
     return result;
 }
+
+
+/* -----------------------------------------------------------------------------
+ * Single pass, allocation free parser.
+ *
+ * parse_signature_in_buffer reads the signature string once and writes the
+ * result directly into a caller supplied buffer, using the packed
+ * parsed_signature layout. The buffer is also used as scratch space while
+ * parsing, as follows (in size_t slots after the header):
+ *
+ *   - from the start, a stream with the dimension variable indices of each
+ *     argument followed by the number of dimensions of that argument.
+ *
+ *   - from the end, growing downwards, the offset in the string of the name
+ *     of each dimension variable (used to match repeated names).
+ *
+ * Once the string is parsed the stream is compacted in place into the final
+ * layout, and the names replaced by the fixed sizes. This makes the working
+ * size a bit larger than the size of the resulting parsed_signature (see
+ * parsed_signature_size).
+ *
+ * Fixed sizes are written in decimal, and are matched as names: every
+ * distinct size string in the signature is a dimension variable.
+ */
+
+/* largest fixed size accepted, so that sizes never reach
+   GUFT_FREE_DIMENSION */
+#define MAX_FIXED_SIZE_DIGITS 18
+
+/* slots needed to compact: the final layout, or the final layout but the
+   fixed sizes plus the argument counts, whatever is larger, with the
+   variables still at the end. The dimension index is built last, once the
+   names are no longer needed, but this keeps it simple */
+static size_t
+_compact_slots(size_t nargs, size_t total_dims, size_t var_count)
+{
+    size_t layout_slots = 2*nargs + total_dims + var_count +
+        _index_slots(total_dims, var_count);
+    size_t stash_slots = 3*nargs + total_dims;
+    return (layout_slots > stash_slots ? layout_slots : stash_slots) +
+        var_count;
+}
+
+static size_t
+_working_slots(size_t nargs, size_t total_dims)
+{
+    /* the stream plus the names of the variables (at most one per
+       dimension) while parsing, and what compacting needs with as many
+       variables as dimensions */
+    size_t parse_slots = nargs + 2*total_dims;
+    size_t compact_slots = _compact_slots(nargs, total_dims, total_dims);
+    return parse_slots > compact_slots ? parse_slots : compact_slots;
+}
+
+size_t
+parsed_signature_size(const parsed_signature *the_signature)
+{
+    return sizeof(parsed_signature) +
+        sizeof(size_t)*(2*the_signature->arg_count +
+                        the_signature->total_signature_dimensions +
+                        the_signature->dimension_variable_count +
+                        _index_slots(the_signature->total_signature_dimensions,
+                                     the_signature->dimension_variable_count));
+}
+
+parsed_signature *
+duplicate_parsed_signature(const parsed_signature *the_signature)
+{
+    size_t size = parsed_signature_size(the_signature);
+    size_t nargs = the_signature->arg_count;
+    parsed_signature *ps = malloc(size);
+
+    if (ps != NULL) {
+        memcpy(ps, the_signature, sizeof(parsed_signature));
+        /* the copy needs its pointers relocated into its own block */
+        ps->arg_dimension_count = ps->data;
+        ps->arg_shape_offsets = ps->arg_dimension_count + nargs;
+        ps->arg_shape_idx = ps->arg_shape_offsets + nargs;
+        ps->dimension_fixed_sizes =
+            ps->arg_shape_idx + the_signature->total_signature_dimensions;
+        memcpy(ps->arg_dimension_count, the_signature->arg_dimension_count,
+               sizeof(size_t)*nargs);
+        memcpy(ps->arg_shape_offsets, the_signature->arg_shape_offsets,
+               sizeof(size_t)*nargs);
+        memcpy(ps->arg_shape_idx, the_signature->arg_shape_idx,
+               sizeof(size_t)*the_signature->total_signature_dimensions);
+        memcpy(ps->dimension_fixed_sizes, the_signature->dimension_fixed_sizes,
+               sizeof(size_t)*the_signature->dimension_variable_count);
+        _place_index(ps);
+        memcpy(ps->dimensions, the_signature->dimensions,
+               sizeof(signature_dimension)*
+               the_signature->dimension_variable_count);
+        memcpy(ps->dimension_uses, the_signature->dimension_uses,
+               sizeof(signature_dimension_use)*
+               the_signature->total_signature_dimensions);
+    }
+
+    return ps;
+}
+
+int
+parse_signature_in_buffer(const char *signature,
+                          void *buffer,
+                          size_t buffer_size,
+                          size_t *required_size,
+                          signature_parse_error *error)
+{
+    parsed_signature *ps = buffer;
+    size_t *slots = NULL;
+    size_t slot_count = 0;
+    size_t stream_len = 0;     /* slots used from the start */
+    size_t var_count = 0;      /* slots used from the end */
+    size_t nin = 0, nargs = 0, total_dims = 0;
+    int saw_arrow = 0;
+    int writing = buffer != NULL && buffer_size >= sizeof(parsed_signature);
+    const char *parse_error = NULL;
+    int i = 0;
+
+    if (writing) {
+        slots = ps->data;
+        slot_count = (buffer_size - sizeof(parsed_signature))/sizeof(size_t);
+    }
+
+    i = _next_non_white_space(signature, 0);
+    if (signature[i] == '-' && signature[i+1] == '>') {
+        /* no inputs */
+        saw_arrow = 1;
+        i = _next_non_white_space(signature, i + 2);
+    }
+
+    for (;;) {
+        size_t nd = 0;
+        if (signature[i] != '(') {
+            parse_error = "expect '('";
+            goto fail;
+        }
+        i = _next_non_white_space(signature, i + 1);
+        while (signature[i] != ')') {
+            size_t j = 0;
+            int end;
+            if (_is_digit(signature[i])) {
+                end = i;
+                while (_is_digit(signature[end]))
+                    end++;
+                if (end - i > MAX_FIXED_SIZE_DIGITS) {
+                    parse_error = "dimension size too large";
+                    goto fail;
+                }
+            } else if (_is_alpha_underscore(signature[i])) {
+                end = _get_end_of_name(signature, i);
+            } else {
+                parse_error = "expect dimension name or size";
+                goto fail;
+            }
+            if (writing) {
+                while (j < var_count &&
+                       !_is_same_name(signature + i,
+                                      signature + slots[slot_count - 1 - j]))
+                    j++;
+                if (j == var_count && stream_len + var_count < slot_count)
+                    slots[slot_count - 1 - var_count++] = (size_t)i;
+                if (stream_len + var_count < slot_count)
+                    slots[stream_len++] = j;
+                else
+                    writing = 0; /* keep going, just to size the buffer */
+            }
+            nd++;
+            i = _next_non_white_space(signature, end);
+            if (signature[i] != ',' && signature[i] != ')') {
+                parse_error = "expect ',' or ')'";
+                goto fail;
+            }
+            if (signature[i] == ',') {
+                i = _next_non_white_space(signature, i + 1);
+                if (signature[i] == ')') {
+                    parse_error = "',' must not be followed by ')'";
+                    goto fail;
+                }
+            }
+        }
+        if (writing) {
+            if (stream_len + var_count < slot_count)
+                slots[stream_len++] = nd;
+            else
+                writing = 0;
+        }
+        nargs++;
+        total_dims += nd;
+
+        i = _next_non_white_space(signature, i + 1);
+        if (signature[i] == ',') {
+            i = _next_non_white_space(signature, i + 1);
+        } else if (signature[i] == '-' && signature[i+1] == '>') {
+            if (saw_arrow) {
+                parse_error = "unexpected '->'";
+                goto fail;
+            }
+            saw_arrow = 1;
+            nin = nargs;
+            i = _next_non_white_space(signature, i + 2);
+        } else if (signature[i] == '\0') {
+            break;
+        } else {
+            parse_error = saw_arrow ? "expect ','" : "expect ',' or '->'";
+            goto fail;
+        }
+    }
+
+    if (!saw_arrow) {
+        parse_error = "expect '->'";
+        goto fail;
+    }
+    if (nargs > GUFT_MAX_SIGNATURE_INDEX ||
+        total_dims > GUFT_MAX_SIGNATURE_INDEX) {
+        parse_error = "too many arguments or dimensions";
+        goto fail;
+    }
+
+    if (required_size != NULL) {
+        *required_size = sizeof(parsed_signature) +
+            sizeof(size_t)*_working_slots(nargs, total_dims);
+    }
+
+    if (!writing || slot_count < _compact_slots(nargs, total_dims, var_count))
+        return 1;
+
+    /* the names of the variables become their fixed sizes */
+    for (size_t j = 0; j < var_count; j++) {
+        size_t *slot = slots + slot_count - 1 - j;
+        const char *name = signature + *slot;
+        if (_is_digit(*name)) {
+            *slot = 0;
+            while (_is_digit(*name))
+                *slot = 10*(*slot) + (size_t)(*name++ - '0');
+        } else {
+            *slot = GUFT_FREE_DIMENSION;
+        }
+    }
+
+    /* compact the stream into the final layout. Walking the stream
+       backwards, every dimension index moves to a position at or after the
+       one it is read from, so nothing pending is overwritten. The argument
+       counts are stashed past the end of the final layout. */
+    {
+        size_t *counts = slots + 2*nargs + total_dims;
+        size_t read = stream_len;
+        size_t write = 2*nargs + total_dims;
+        size_t arg = nargs;
+
+        while (arg > 0) {
+            size_t nd = slots[--read];
+            arg--;
+            counts[arg] = nd;
+            for (size_t d = 0; d < nd; d++)
+                slots[--write] = slots[--read];
+        }
+
+        ps->input_count = nin;
+        ps->output_count = nargs - nin;
+        ps->arg_count = nargs;
+        ps->dimension_variable_count = var_count;
+        ps->total_signature_dimensions = total_dims;
+        ps->arg_dimension_count = slots;
+        ps->arg_shape_offsets = slots + nargs;
+        ps->arg_shape_idx = slots + 2*nargs;
+
+        write = 0;
+        for (arg = 0; arg < nargs; arg++) {
+            ps->arg_dimension_count[arg] = counts[arg];
+            ps->arg_shape_offsets[arg] = write;
+            write += counts[arg];
+        }
+
+        /* over the counts, that are no longer needed */
+        ps->dimension_fixed_sizes = slots + 2*nargs + total_dims;
+        for (size_t j = 0; j < var_count; j++)
+            ps->dimension_fixed_sizes[j] = slots[slot_count - 1 - j];
+
+        /* the names are gone, so the index can go past the layout */
+        _place_index(ps);
+        _build_index(ps);
+    }
+
+    return 0;
+
+ fail:
+    if (error != NULL) {
+        error->message = parse_error;
+        error->position = (size_t)i;
+    }
+    return -1;
+}
+
+/* -----------------------------------------------------------------------------
+ * Relocatable records
+ */
+
+#define ZU_ROUND_UP(n) \
+    (((n) + sizeof(size_t) - 1)/sizeof(size_t)*sizeof(size_t))
+
+size_t
+serialized_signature_size(const parsed_signature *the_signature,
+                          size_t text_length)
+{
+    size_t size = sizeof(serialized_signature) +
+        sizeof(size_t)*(2*the_signature->arg_count +
+                        the_signature->total_signature_dimensions +
+                        the_signature->dimension_variable_count +
+                        _index_slots(the_signature->total_signature_dimensions,
+                                     the_signature->dimension_variable_count));
+    if (text_length > 0)
+        size += ZU_ROUND_UP(text_length + 1);
+    return size;
+}
+
+void
+serialize_parsed_signature(const parsed_signature *the_signature,
+                           const char *text,
+                           size_t text_length,
+                           void *buffer)
+{
+    serialized_signature *record = buffer;
+    size_t nargs = the_signature->arg_count;
+    size_t total_dims = the_signature->total_signature_dimensions;
+    size_t var_count = the_signature->dimension_variable_count;
+    size_t *data = record->data;
+
+    if (text == NULL)
+        text_length = 0;
+
+    memset(record, 0, sizeof(serialized_signature));
+    record->magic = GUFT_SERIALIZED_SIGNATURE_MAGIC;
+    record->record_size = serialized_signature_size(the_signature,
+                                                    text_length);
+    record->input_count = the_signature->input_count;
+    record->output_count = the_signature->output_count;
+    record->arg_count = nargs;
+    record->dimension_variable_count = var_count;
+    record->total_signature_dimensions = total_dims;
+
+    /* the same order as the packed layout */
+    record->arg_dimension_count = (char *)data - (char *)record;
+    memcpy(data, the_signature->arg_dimension_count, sizeof(size_t)*nargs);
+    data += nargs;
+    record->arg_shape_offsets = (char *)data - (char *)record;
+    memcpy(data, the_signature->arg_shape_offsets, sizeof(size_t)*nargs);
+    data += nargs;
+    record->arg_shape_idx = (char *)data - (char *)record;
+    memcpy(data, the_signature->arg_shape_idx, sizeof(size_t)*total_dims);
+    data += total_dims;
+    record->dimension_fixed_sizes = (char *)data - (char *)record;
+    memcpy(data, the_signature->dimension_fixed_sizes,
+           sizeof(size_t)*var_count);
+    data += var_count;
+    /* the index as in the packed layout, padding included */
+    record->dimensions = (char *)data - (char *)record;
+    record->dimension_uses = record->dimensions +
+        sizeof(signature_dimension)*var_count;
+    memset(data, 0, sizeof(size_t)*_index_slots(total_dims, var_count));
+    memcpy(data, the_signature->dimensions,
+           sizeof(signature_dimension)*var_count);
+    memcpy((char *)record + record->dimension_uses,
+           the_signature->dimension_uses,
+           sizeof(signature_dimension_use)*total_dims);
+    data += _index_slots(total_dims, var_count);
+
+    if (text_length > 0) {
+        size_t padded = ZU_ROUND_UP(text_length + 1);
+        record->text = (char *)data - (char *)record;
+        record->text_length = text_length;
+        memset(data, 0, padded);
+        memcpy(data, text, text_length);
+    }
+}
+
+/* pointer to the count size_t array at offset in the record, NULL if it
+   does not fit */
+static const size_t *
+_record_array(const serialized_signature *record, size_t offset, size_t count)
+{
+    size_t available;
+
+    if (offset < sizeof(serialized_signature) ||
+        offset > record->record_size ||
+        offset % sizeof(size_t) != 0)
+        return NULL;
+
+    available = (record->record_size - offset)/sizeof(size_t);
+    if (count > available)
+        return NULL;
+
+    return (const size_t *)((const char *)record + offset);
+}
+
+/* whether the dimension index of a record is the inverse of its idx: every
+   variable is used, every use is in bounds and points back to its variable, in increasing order,
+   and the ranges of the variables follow each other. As many uses as
+   dimensions then means every dimension is used once */
+static int
+_check_record_index(const serialized_signature *record, const size_t *counts,
+                    const size_t *offsets, const size_t *idx)
+{
+    const signature_dimension *dims = (const signature_dimension *)
+        ((const char *)record + record->dimensions);
+    const signature_dimension_use *uses = (const signature_dimension_use *)
+        ((const char *)record + record->dimension_uses);
+    size_t nargs = record->arg_count;
+    size_t position = 0;
+
+    for (size_t var = 0; var < record->dimension_variable_count; var++) {
+        const signature_dimension *dim = dims + var;
+        uint16_t defining = GUFT_NO_DEFINING_INPUT;
+
+        if (dim->first_use != position || dim->use_count == 0)
+            return 0;
+        for (size_t u = position; u < position + dim->use_count; u++) {
+            if (u >= record->total_signature_dimensions ||
+                uses[u].arg >= nargs ||
+                uses[u].axis >= counts[uses[u].arg] ||
+                idx[offsets[uses[u].arg] + uses[u].axis] != var)
+                return 0;
+            if (u > position &&
+                (uses[u].arg < uses[u - 1].arg ||
+                 (uses[u].arg == uses[u - 1].arg &&
+                  uses[u].axis <= uses[u - 1].axis)))
+                return 0;
+            if (uses[u].arg < record->input_count &&
+                defining == GUFT_NO_DEFINING_INPUT)
+                defining = uses[u].arg;
+        }
+        if (dim->defining_input != defining ||
+            dim->flags != (defining == GUFT_NO_DEFINING_INPUT ?
+                           GUFT_DIMENSION_OUTPUT_ONLY : 0))
+            return 0;
+        position += dim->use_count;
+    }
+
+    return position == record->total_signature_dimensions;
+}
+
+int
+attach_serialized_signature(const void *buffer,
+                            size_t size,
+                            parsed_signature *header,
+                            const char **error)
+{
+    const serialized_signature *record = buffer;
+    const size_t *counts, *offsets, *idx, *fixed;
+    size_t nargs, total_dims, var_count, position;
+    const char *message;
+
+    if ((uintptr_t)buffer % sizeof(size_t) != 0) {
+        message = "misaligned record";
+        goto fail;
+    }
+    if (size < sizeof(serialized_signature) ||
+        record->magic != GUFT_SERIALIZED_SIGNATURE_MAGIC) {
+        message = "not a signature record";
+        goto fail;
+    }
+    if (record->record_size > size ||
+        record->record_size < sizeof(serialized_signature) ||
+        record->record_size % sizeof(size_t) != 0) {
+        message = "truncated record";
+        goto fail;
+    }
+
+    nargs = record->arg_count;
+    total_dims = record->total_signature_dimensions;
+    var_count = record->dimension_variable_count;
+    message = "corrupt record";
+    if (record->input_count > nargs ||
+        record->output_count != nargs - record->input_count)
+        goto fail;
+
+    counts = _record_array(record, record->arg_dimension_count, nargs);
+    offsets = _record_array(record, record->arg_shape_offsets, nargs);
+    idx = _record_array(record, record->arg_shape_idx, total_dims);
+    fixed = _record_array(record, record->dimension_fixed_sizes, var_count);
+    if (counts == NULL || offsets == NULL || idx == NULL || fixed == NULL)
+        goto fail;
+    if (nargs > GUFT_MAX_SIGNATURE_INDEX ||
+        total_dims > GUFT_MAX_SIGNATURE_INDEX ||
+        record->dimension_uses != record->dimensions +
+        sizeof(signature_dimension)*var_count ||
+        _record_array(record, record->dimensions,
+                      _index_slots(total_dims, var_count)) == NULL)
+        goto fail;
+
+    /* what the rest of the code assumes from a parsed signature */
+    position = 0;
+    for (size_t arg = 0; arg < nargs; arg++) {
+        if (offsets[arg] != position || counts[arg] > total_dims - position)
+            goto fail;
+        position += counts[arg];
+    }
+    if (position != total_dims)
+        goto fail;
+    for (size_t d = 0; d < total_dims; d++) {
+        if (idx[d] >= var_count)
+            goto fail;
+    }
+    if (!_check_record_index(record, counts, offsets, idx))
+        goto fail;
+
+    if (record->text_length > 0) {
+        const char *text;
+        if (record->text < sizeof(serialized_signature) ||
+            record->text > record->record_size ||
+            record->text_length >= record->record_size - record->text)
+            goto fail;
+        text = (const char *)record + record->text;
+        if (text[record->text_length] != '\0')
+            goto fail;
+    }
+
+    header->input_count = record->input_count;
+    header->output_count = record->output_count;
+    header->arg_count = nargs;
+    header->dimension_variable_count = var_count;
+    header->total_signature_dimensions = total_dims;
+    /* nothing writes through these, the casts only drop the const */
+    header->arg_dimension_count = (size_t *)counts;
+    header->arg_shape_offsets = (size_t *)offsets;
+    header->arg_shape_idx = (size_t *)idx;
+    header->dimension_fixed_sizes = (size_t *)fixed;
+    header->dimensions = (signature_dimension *)
+        ((const char *)record + record->dimensions);
+    header->dimension_uses = (signature_dimension_use *)
+        ((const char *)record + record->dimension_uses);
+    return 0;
+
+ fail:
+    if (error != NULL)
+        *error = message;
+    return -1;
+}
+
+size_t
+signature_table_size(const parsed_signature *const *signatures,
+                     const size_t *text_lengths,
+                     size_t count)
+{
+    size_t size = sizeof(signature_table) + sizeof(size_t)*count;
+
+    for (size_t i = 0; i < count; i++)
+        size += serialized_signature_size(signatures[i],
+                                          text_lengths ? text_lengths[i] : 0);
+    return size;
+}
+
+void
+write_signature_table(const parsed_signature *const *signatures,
+                      const char *const *texts,
+                      const size_t *text_lengths,
+                      size_t count,
+                      void *buffer)
+{
+    signature_table *table = buffer;
+    size_t offset = sizeof(signature_table) + sizeof(size_t)*count;
+
+    table->magic = GUFT_SIGNATURE_TABLE_MAGIC;
+    table->table_size = signature_table_size(signatures, text_lengths, count);
+    table->count = count;
+
+    for (size_t i = 0; i < count; i++) {
+        const char *text = texts ? texts[i] : NULL;
+        size_t text_length = text ? text_lengths[i] : 0;
+
+        table->offsets[i] = offset;
+        serialize_parsed_signature(signatures[i], text, text_length,
+                                   (char *)buffer + offset);
+        offset += serialized_signature_size(signatures[i], text_length);
+    }
+}
+
+int
+check_signature_table(const void *buffer, size_t size, size_t *count,
+                      const char **error)
+{
+    const signature_table *table = buffer;
+    parsed_signature header;
+    const char *message;
+
+    if ((uintptr_t)buffer % sizeof(size_t) != 0) {
+        message = "misaligned table";
+        goto fail;
+    }
+    if (size < sizeof(signature_table) ||
+        table->magic != GUFT_SIGNATURE_TABLE_MAGIC) {
+        message = "not a signature table";
+        goto fail;
+    }
+    if (table->table_size > size ||
+        table->count > (table->table_size - sizeof(signature_table))/
+                       sizeof(size_t)) {
+        message = "truncated table";
+        goto fail;
+    }
+
+    for (size_t i = 0; i < table->count; i++) {
+        size_t offset = table->offsets[i];
+        if (offset > table->table_size) {
+            message = "truncated table";
+            goto fail;
+        }
+        if (attach_serialized_signature((const char *)buffer + offset,
+                                        table->table_size - offset,
+                                        &header, &message) < 0)
+            goto fail;
+    }
+
+    *count = table->count;
+    return 0;
+
+ fail:
+    if (error != NULL)
+        *error = message;
+    return -1;
+}
+
+const serialized_signature *
+signature_table_entry(const void *buffer, size_t index)
+{
+    const signature_table *table = buffer;
+    return (const serialized_signature *)((const char *)buffer +
+                                          table->offsets[index]);
+}
@@ -1,6 +1,43 @@
 #ifndef GUFT_SIGNATURE_H
 #define GUFT_SIGNATURE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* value in dimension_fixed_sizes for dimension variables that can take any
+   size */
+#define GUFT_FREE_DIMENSION ((size_t)-1)
+
+/* The inverse of arg_shape_idx: where every dimension variable is used,
+   so that binding the variables of a call is a single pass over their uses
+   instead of a search over the arguments. Indices are 16 bit, so the index
+   of a typical signature takes a cache line. Signatures are limited to
+   GUFT_MAX_SIGNATURE_INDEX arguments and dimensions for that */
+#define GUFT_MAX_SIGNATURE_INDEX 0xfffe
+
+typedef struct _signature_dimension_use_struct {
+    uint16_t arg;
+    uint16_t axis; /* among the core dimensions of arg */
+} signature_dimension_use;
+
+/* value of defining_input for variables only used by outputs */
+#define GUFT_NO_DEFINING_INPUT ((uint16_t)0xffff)
+
+/* signature_dimension flags */
+#define GUFT_DIMENSION_OUTPUT_ONLY 0x1 /* not used by any input */
+
+typedef struct _signature_dimension_struct {
+    uint16_t first_use; /* of its uses in dimension_uses */
+    uint16_t use_count;
+    uint16_t defining_input; /* first input using it, the one that binds
+                                it in a call */
+    uint16_t flags;
+} signature_dimension;
+
+/* Dimensions can be given by name, like "n", or by size, like "3". Every
+   distinct name is a dimension variable, bound to a size on each call.
+   Sizes are dimension variables too, with their size fixed in the
+   signature */
 typedef struct _parsed_signature_header_struct {
     size_t input_count;
     size_t output_count;
@@ -10,6 +47,13 @@ typedef struct _parsed_signature_header_struct {
     size_t *arg_dimension_count; /* as many arg_count */
     size_t *arg_shape_offsets; /* as many arg_count */
     size_t *arg_shape_idx; /* as many as total_signature_dimensions */
+    size_t *dimension_fixed_sizes; /* as many as dimension_variable_count,
+                                      GUFT_FREE_DIMENSION if not fixed */
+    signature_dimension *dimensions; /* as many as dimension_variable_count */
+    signature_dimension_use *dimension_uses; /* as many as
+                                                total_signature_dimensions,
+                                                grouped by variable, in
+                                                argument and axis order */
 
     /* the next is the start to the variable length data pointed by the above
        members */
@@ -17,20 +61,168 @@ typedef struct _parsed_signature_header_struct {
 } parsed_signature;
 
 
-/* legacy function that requires nin and nargs just as NumPy internal code */
+typedef struct _signature_parse_error_struct {
+    const char *message; /* static string describing the error */
+    size_t position; /* offset in the signature string */
+} signature_parse_error;
+
+/* legacy function that requires nin and nargs just as NumPy internal code.
+   Returns NULL on failure, described in error if not NULL. Nothing is
+   printed */
 parsed_signature *
-legacy_numpy_parse_signature(const char *signature, int nin, int nargs);
+legacy_numpy_parse_signature(const char *signature, int nin, int nargs,
+                             signature_parse_error *error);
 
 /* like legacy_numpy_parse_signature but it figures out nin and nargs from
    the signature */
 parsed_signature *
-numpy_parse_signature(const char *signature);
+numpy_parse_signature(const char *signature, signature_parse_error *error);
 
 void
 print_parsed_signature(parsed_signature *the_signature);
 
+/* size in bytes of the packed parsed_signature block */
+size_t
+parsed_signature_size(const parsed_signature *the_signature);
+
+/* copy a parsed signature into a new malloc'd block, to be released with
+   release_parsed_signature. Useful to keep the result of
+   parse_signature_in_buffer */
+parsed_signature *
+duplicate_parsed_signature(const parsed_signature *the_signature);
+
+/* Single pass parser that does no heap allocation. The result is written in
+   the packed parsed_signature layout into buffer, that must be suitably
+   aligned for a parsed_signature. The buffer is also used as scratch space,
+   so it needs to be somewhat larger than the resulting parsed_signature.
+
+   Passing a NULL buffer works as a size query.
+
+   Returns 0 on success, 1 if the buffer is too small and -1 on a parse
+   error. On 0 and 1, required_size (if not NULL) is set to the buffer size
+   needed. On -1, error (if not NULL) describes the problem. */
+int
+parse_signature_in_buffer(const char *signature,
+                          void *buffer,
+                          size_t buffer_size,
+                          size_t *required_size,
+                          signature_parse_error *error);
+
 void
 release_parsed_signature(parsed_signature *the_signature);
 
+/* hash and equality based on the parsed contents of the signature. Two
+   signatures that only differ in the names of their dimension variables or
+   in whitespace compare equal */
+size_t
+parsed_signature_hash(const parsed_signature *the_signature);
+
+int
+parsed_signature_equal(const parsed_signature *a, const parsed_signature *b);
+
+
+/* Relocatable form of a parsed signature, for storing parsed signatures in
+   files, pickles or shared memory. It is the packed layout with the
+   pointers replaced by offsets in bytes from the start of the record, so a
+   record can be copied or mapped anywhere and used in place: attaching it
+   just points a parsed_signature header into it.
+
+   The dimension index is stored too, so attaching does not rebuild it.
+
+   Records use the native size_t, so they are meant to be read by the same
+   kind of machine that wrote them. The magic number reads differently with
+   another size_t width or byte order, and those records are rejected.
+
+   A record may also carry the signature string (normalized, no
+   whitespace) so that it can be used as a key without parsing it again.
+   Nothing checks that the string parses to the record: records are as
+   trusted as the code that wrote them */
+#define GUFT_SERIALIZED_SIGNATURE_MAGIC ((size_t)0x47465332u) /* "GFS2" */
+
+typedef struct _serialized_signature_struct {
+    size_t magic;
+    size_t record_size; /* in bytes, this header included */
+    size_t input_count;
+    size_t output_count;
+    size_t arg_count;
+    size_t dimension_variable_count;
+    size_t total_signature_dimensions;
+    /* offsets of the arrays of the parsed_signature */
+    size_t arg_dimension_count;
+    size_t arg_shape_offsets;
+    size_t arg_shape_idx;
+    size_t dimension_fixed_sizes;
+    size_t dimensions;
+    size_t dimension_uses;
+    /* offset and length of the signature string, NUL terminated. The
+       length is 0 if the record has no string */
+    size_t text;
+    size_t text_length;
+
+    size_t data[];
+} serialized_signature;
+
+/* size in bytes of the record for the_signature with a text_length long
+   string (0 for no string). Always a multiple of sizeof(size_t) */
+size_t
+serialized_signature_size(const parsed_signature *the_signature,
+                          size_t text_length);
+
+/* write the record into buffer, that must be aligned for a size_t and
+   serialized_signature_size bytes long. text can be NULL */
+void
+serialize_parsed_signature(const parsed_signature *the_signature,
+                           const char *text,
+                           size_t text_length,
+                           void *buffer);
+
+/* Check the record in the size bytes at buffer and fill header so that it
+   describes the signature in place. buffer must be aligned for a size_t,
+   and outlive header. Returns 0 on success, or -1 and a static message in
+   error (if not NULL) if the record is not valid. */
+int
+attach_serialized_signature(const void *buffer,
+                            size_t size,
+                            parsed_signature *header,
+                            const char **error);
+
+/* A table of records, so that a set of signatures can be precomputed and
+   then loaded with a single mapping, with no parsing */
+#define GUFT_SIGNATURE_TABLE_MAGIC ((size_t)0x47465431u) /* "GFT1" */
+
+typedef struct _signature_table_struct {
+    size_t magic;
+    size_t table_size; /* in bytes, this header included */
+    size_t count;
+    size_t offsets[]; /* of every record */
+} signature_table;
+
+/* size of the table for count signatures. texts and text_lengths can be
+   NULL when there are no strings */
+size_t
+signature_table_size(const parsed_signature *const *signatures,
+                     const size_t *text_lengths,
+                     size_t count);
+
+/* write the table into buffer, that must be aligned for a size_t and
+   signature_table_size bytes long */
+void
+write_signature_table(const parsed_signature *const *signatures,
+                      const char *const *texts,
+                      const size_t *text_lengths,
+                      size_t count,
+                      void *buffer);
+
+/* Check the table in the size bytes at buffer, all its records included.
+   On success returns 0 and the number of records in count. On failure
+   returns -1 and a static message in error (if not NULL) */
+int
+check_signature_table(const void *buffer, size_t size, size_t *count,
+                      const char **error);
+
+/* record number index of a checked table */
+const serialized_signature *
+signature_table_entry(const void *buffer, size_t index);
+
 
 #endif /* GUFT_SIGNATURE_H */
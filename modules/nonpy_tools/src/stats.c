@@ -0,0 +1,387 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+int stats_enabled = 0;
+
+static const char *phase_names[GUFT_PHASE_COUNT] = {
+    "resolve", "dispatch", "execute"
+};
+
+const char *
+stats_phase_name(stats_phase phase)
+{
+    return (unsigned)phase < GUFT_PHASE_COUNT ? phase_names[phase] : NULL;
+}
+
+#if defined(_WIN32)
+
+/* No per-thread counters on this platform yet: stats can not be enabled */
+
+void
+stats_set_enabled(int enabled)
+{
+    (void)enabled;
+}
+
+size_t
+stats_site(const char *name)
+{
+    (void)name;
+    return 0;
+}
+
+const char *
+stats_site_name(size_t site)
+{
+    (void)site;
+    return NULL;
+}
+
+size_t
+stats_site_count(void)
+{
+    return 0;
+}
+
+uint64_t
+stats_now(void)
+{
+    return 0;
+}
+
+void
+stats_record_call(size_t site, uint64_t elements, uint64_t bytes)
+{
+    (void)site; (void)elements; (void)bytes;
+}
+
+void
+stats_record_phase(size_t site, stats_phase phase, uint64_t ns)
+{
+    (void)site; (void)phase; (void)ns;
+}
+
+void
+stats_snapshot(size_t site, stats_counters *counters)
+{
+    (void)site;
+    memset(counters, 0, sizeof(*counters));
+}
+
+void
+stats_reset(void)
+{
+}
+
+#else /* !_WIN32 */
+
+#include <pthread.h>
+#include <time.h>
+
+/* Counters of a thread are only written by that thread. Other threads
+   read them while taking a snapshot, so the accesses are relaxed atomics
+   to make that well defined. An increment is a load and a store, as there
+   is a single writer */
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define ADD(x, v) STORE(x, LOAD(x) + (v))
+
+/* counters are allocated a page of sites at a time */
+#define SITES_PER_PAGE 16
+#define PAGE_COUNT (GUFT_STATS_MAX_SITES/SITES_PER_PAGE)
+
+#define COUNTER_WORDS (sizeof(stats_counters)/sizeof(uint64_t))
+
+typedef struct _stats_block_struct {
+    struct _stats_block_struct *next;
+    struct _stats_block_struct **prev_next;
+    stats_counters *pages[PAGE_COUNT];
+} stats_block;
+
+static struct {
+    pthread_mutex_t lock; /* protects everything below */
+    stats_block *threads; /* blocks of the live threads */
+    stats_block retired; /* counts of the threads that exited */
+    stats_block baseline; /* counts at the last reset */
+    size_t site_count;
+    char *names[GUFT_STATS_MAX_SITES + 1];
+} stats = {
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+static int block_key_ok = 0;
+
+static stats_counters *
+block_counters(stats_block *block, size_t site, int create)
+{
+    size_t page = site/SITES_PER_PAGE;
+    stats_counters *counters =
+        __atomic_load_n(&block->pages[page], __ATOMIC_ACQUIRE);
+
+    if (counters == NULL && create) {
+        counters = calloc(SITES_PER_PAGE, sizeof(stats_counters));
+        if (counters == NULL)
+            return NULL;
+        __atomic_store_n(&block->pages[page], counters, __ATOMIC_RELEASE);
+    }
+
+    return counters ? counters + site % SITES_PER_PAGE : NULL;
+}
+
+/* adds the counters of block to into, with stats.lock held */
+static void
+merge_block(stats_block *into, stats_block *block)
+{
+    for (size_t page = 0; page < PAGE_COUNT; page++) {
+        const uint64_t *src;
+        uint64_t *dst;
+        if (block->pages[page] == NULL)
+            continue;
+        dst = (uint64_t *)block_counters(into, page*SITES_PER_PAGE, 1);
+        if (dst == NULL)
+            continue; /* out of memory, the counts are lost */
+        src = (const uint64_t *)block->pages[page];
+        for (size_t i = 0; i < SITES_PER_PAGE*COUNTER_WORDS; i++)
+            dst[i] += LOAD(src[i]);
+    }
+}
+
+static void
+release_block(void *arg)
+{
+    stats_block *block = arg;
+
+    pthread_mutex_lock(&stats.lock);
+    merge_block(&stats.retired, block);
+    *block->prev_next = block->next;
+    if (block->next)
+        block->next->prev_next = block->prev_next;
+    pthread_mutex_unlock(&stats.lock);
+
+    for (size_t page = 0; page < PAGE_COUNT; page++)
+        free(block->pages[page]);
+    free(block);
+}
+
+/* a forked child must not inherit a held lock */
+static void
+prepare_fork(void)
+{
+    pthread_mutex_lock(&stats.lock);
+}
+
+static void
+after_fork(void)
+{
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static void
+create_block_key(void)
+{
+    block_key_ok = pthread_key_create(&block_key, release_block) == 0;
+    pthread_atfork(prepare_fork, after_fork, after_fork);
+}
+
+static stats_block *
+thread_block(void)
+{
+    stats_block *block;
+
+    pthread_once(&block_key_once, create_block_key);
+    if (!block_key_ok)
+        return NULL;
+
+    block = pthread_getspecific(block_key);
+    if (block != NULL)
+        return block;
+
+    block = calloc(1, sizeof(stats_block));
+    if (block == NULL)
+        return NULL;
+    if (pthread_setspecific(block_key, block) != 0) {
+        free(block);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&stats.lock);
+    block->next = stats.threads;
+    block->prev_next = &stats.threads;
+    if (stats.threads)
+        stats.threads->prev_next = &block->next;
+    stats.threads = block;
+    pthread_mutex_unlock(&stats.lock);
+
+    return block;
+}
+
+static stats_counters *
+thread_counters(size_t site)
+{
+    stats_block *block;
+
+    if (site == 0 || site > GUFT_STATS_MAX_SITES - 1)
+        return NULL;
+
+    block = thread_block();
+    return block ? block_counters(block, site, 1) : NULL;
+}
+
+void
+stats_set_enabled(int enabled)
+{
+    GUFT_ATOMIC_STORE(stats_enabled, enabled != 0);
+}
+
+size_t
+stats_site(const char *name)
+{
+    size_t site = 0;
+
+    pthread_mutex_lock(&stats.lock);
+    for (size_t i = 1; i <= stats.site_count; i++) {
+        if (strcmp(stats.names[i], name) == 0) {
+            site = i;
+            break;
+        }
+    }
+    if (site == 0 && stats.site_count < GUFT_STATS_MAX_SITES - 1) {
+        char *copy = malloc(strlen(name) + 1);
+        if (copy != NULL) {
+            strcpy(copy, name);
+            site = ++stats.site_count;
+            stats.names[site] = copy;
+        }
+    }
+    pthread_mutex_unlock(&stats.lock);
+
+    return site;
+}
+
+const char *
+stats_site_name(size_t site)
+{
+    const char *name = NULL;
+
+    pthread_mutex_lock(&stats.lock);
+    if (site > 0 && site <= stats.site_count)
+        name = stats.names[site];
+    pthread_mutex_unlock(&stats.lock);
+
+    return name;
+}
+
+size_t
+stats_site_count(void)
+{
+    size_t count;
+
+    pthread_mutex_lock(&stats.lock);
+    count = stats.site_count;
+    pthread_mutex_unlock(&stats.lock);
+
+    return count;
+}
+
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void
+stats_record_call(size_t site, uint64_t elements, uint64_t bytes)
+{
+    stats_counters *counters = thread_counters(site);
+
+    if (counters == NULL)
+        return;
+
+    ADD(counters->calls, 1);
+    ADD(counters->elements, elements);
+    ADD(counters->bytes, bytes);
+}
+
+void
+stats_record_phase(size_t site, stats_phase phase, uint64_t ns)
+{
+    stats_counters *counters = thread_counters(site);
+    stats_phase_counters *pc;
+    size_t bucket;
+
+    if (counters == NULL || (unsigned)phase >= GUFT_PHASE_COUNT)
+        return;
+
+    /* bucket i holds [2^(i-1), 2^i), with 0 in bucket 0 */
+    bucket = ns ? 64 - (size_t)__builtin_clzll(ns) : 0;
+    if (bucket >= GUFT_STATS_BUCKETS)
+        bucket = GUFT_STATS_BUCKETS - 1;
+
+    pc = counters->phases + phase;
+    ADD(pc->count, 1);
+    ADD(pc->total_ns, ns);
+    ADD(pc->histogram[bucket], 1);
+}
+
+/* sum of site over all threads, with stats.lock held */
+static void
+total_counters(size_t site, uint64_t *total)
+{
+    const uint64_t *src;
+
+    memset(total, 0, sizeof(stats_counters));
+    for (stats_block *block = stats.threads; block; block = block->next) {
+        src = (const uint64_t *)block_counters(block, site, 0);
+        for (size_t i = 0; src && i < COUNTER_WORDS; i++)
+            total[i] += LOAD(src[i]);
+    }
+
+    src = (const uint64_t *)block_counters(&stats.retired, site, 0);
+    for (size_t i = 0; src && i < COUNTER_WORDS; i++)
+        total[i] += src[i];
+}
+
+void
+stats_snapshot(size_t site, stats_counters *counters)
+{
+    uint64_t *total = (uint64_t *)counters;
+    const uint64_t *baseline;
+
+    if (site == 0 || site > GUFT_STATS_MAX_SITES - 1) {
+        memset(counters, 0, sizeof(*counters));
+        return;
+    }
+
+    pthread_mutex_lock(&stats.lock);
+    total_counters(site, total);
+    baseline = (const uint64_t *)block_counters(&stats.baseline, site, 0);
+    for (size_t i = 0; baseline && i < COUNTER_WORDS; i++)
+        total[i] -= baseline[i];
+    pthread_mutex_unlock(&stats.lock);
+}
+
+void
+stats_reset(void)
+{
+    /* counters are never written by other threads than their own, so a
+       reset just remembers the current totals to subtract them later */
+    pthread_mutex_lock(&stats.lock);
+    for (size_t site = 1; site <= stats.site_count; site++) {
+        stats_counters *baseline = block_counters(&stats.baseline, site, 1);
+        if (baseline != NULL)
+            total_counters(site, (uint64_t *)baseline);
+    }
+    pthread_mutex_unlock(&stats.lock);
+}
+
+#endif /* _WIN32 */
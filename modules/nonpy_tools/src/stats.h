@@ -0,0 +1,92 @@
+#ifndef GUFT_STATS_H
+#define GUFT_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomics.h"
+
+/* Opt-in runtime counters for gufunc calls.
+
+   Counters are kept per "site": a named thing to account for, like a gufunc
+   or one of its kernels. Sites are identified by a small integer, 0 meaning
+   no site. Every site counts calls, elements processed and bytes touched,
+   plus the time spent in each phase of a call, both as a total and as a
+   histogram with power of 2 buckets (bucket i holds times in
+   [2^(i-1), 2^i) ns).
+
+   Recording only touches memory owned by the recording thread, with no
+   locks nor atomic read-modify-write operations. Snapshots sum the counters
+   of all the threads. When disabled, the cost of instrumentation is the
+   test of stats_enabled.
+*/
+
+typedef enum {
+    GUFT_PHASE_RESOLVE = 0,
+    GUFT_PHASE_DISPATCH,
+    GUFT_PHASE_EXECUTE,
+    GUFT_PHASE_COUNT
+} stats_phase;
+
+#define GUFT_STATS_BUCKETS 40
+#define GUFT_STATS_MAX_SITES 4096
+
+typedef struct _stats_phase_counters_struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t histogram[GUFT_STATS_BUCKETS];
+} stats_phase_counters;
+
+typedef struct _stats_counters_struct {
+    uint64_t calls;
+    uint64_t elements;
+    uint64_t bytes;
+    stats_phase_counters phases[GUFT_PHASE_COUNT];
+} stats_counters;
+
+/* non zero when recording. Test it (with GUFT_ATOMIC_LOAD) before calling
+   anything else */
+extern int stats_enabled;
+
+void
+stats_set_enabled(int enabled);
+
+/* Returns the site for name, registering it if needed. Sites are never
+   released, registering the same name again returns the same site.
+   Returns 0 if there are too many sites or out of memory */
+size_t
+stats_site(const char *name);
+
+/* Name of a registered site */
+const char *
+stats_site_name(size_t site);
+
+/* Number of sites registered so far. Valid sites are 1..stats_site_count() */
+size_t
+stats_site_count(void);
+
+/* Monotonic time in ns, for timing phases */
+uint64_t
+stats_now(void);
+
+/* Record a call processing elements and touching bytes */
+void
+stats_record_call(size_t site, uint64_t elements, uint64_t bytes);
+
+/* Record ns spent in phase */
+void
+stats_record_phase(size_t site, stats_phase phase, uint64_t ns);
+
+/* Counters of site accumulated since the last reset, over all threads */
+void
+stats_snapshot(size_t site, stats_counters *counters);
+
+/* Start counting from zero again for all the sites */
+void
+stats_reset(void);
+
+/* Name of a phase, like "resolve" */
+const char *
+stats_phase_name(stats_phase phase);
+
+#endif /* GUFT_STATS_H */
@@ -0,0 +1,188 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+
+#include "overlap.h"
+#include "stream.h"
+#include "threadpool.h"
+
+#if !defined(_WIN32)
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+void
+init_stream(stream *s, const execution_plan *plan,
+            const resolved_shapes *resolved,
+            const execution_operand *operands, size_t budget,
+            unsigned int extra)
+{
+    size_t outer_ndim = resolved->outer_ndim;
+    size_t row_bytes = 0;
+
+    s->plan = plan;
+    s->operands = operands;
+    s->rows = outer_ndim > 0 ? resolved->outer_shape[0] : 1;
+    s->row_elements = s->rows > 0 ? resolved->element_count/s->rows : 0;
+    s->min_chunk = GUFT_DEFAULT_MIN_CHUNK;
+
+    for (size_t op = 0; op < plan->nops; op++) {
+        const execution_operand *o = operands + op;
+        size_t op_outer_ndim = o->ndim - plan->operands[op].core_ndim;
+        size_t bytes = s->row_elements*plan->operands[op].element_size;
+
+        s->by_row[op] = outer_ndim > 0 && op_outer_ndim == outer_ndim &&
+            o->shape[0] != 1;
+        if (!s->by_row[op])
+            continue;
+        row_bytes += bytes;
+        if (extra & (1u << op))
+            row_bytes += bytes;
+    }
+
+    s->chunk_rows = row_bytes > 0 ? budget/row_bytes : s->rows;
+    if (s->chunk_rows == 0)
+        s->chunk_rows = 1;
+    if (s->chunk_rows > s->rows)
+        s->chunk_rows = s->rows;
+    s->chunk_count = s->chunk_rows > 0 ?
+        (s->rows + s->chunk_rows - 1)/s->chunk_rows : 0;
+}
+
+void
+stream_chunk_rows(const stream *s, size_t chunk, size_t *first, size_t *rows)
+{
+    *first = chunk*s->chunk_rows;
+    *rows = s->rows - *first;
+    if (*rows > s->chunk_rows)
+        *rows = s->chunk_rows;
+}
+
+#if !defined(_WIN32)
+
+/* the pages an operand touches in a chunk, 0 if it has no memory */
+static size_t
+chunk_pages(const stream *s, size_t op, size_t chunk, size_t page,
+            char **start)
+{
+    const execution_operand *o = s->operands + op;
+    memory_extent extent;
+    uintptr_t low, high;
+    size_t first, rows;
+
+    if (o->data == NULL || o->ndim > GUFT_EXTENT_MAXDIMS)
+        return 0;
+
+    extent.data = o->data;
+    extent.ndim = o->ndim;
+    extent.itemsize = o->itemsize;
+    for (size_t d = 0; d < o->ndim; d++) {
+        extent.shape[d] = (guft_intp)o->shape[d];
+        extent.strides[d] = o->strides[d];
+    }
+    if (s->by_row[op]) {
+        stream_chunk_rows(s, chunk, &first, &rows);
+        extent.data += (guft_intp)first*o->strides[0];
+        extent.shape[0] = (guft_intp)rows;
+    }
+
+    memory_extent_bounds(&extent, &low, &high);
+    if (low == high)
+        return 0;
+    low -= low % page;
+    *start = (char *)low;
+    return (high - low + page - 1)/page;
+}
+
+void
+prefetch_stream_chunk(const stream *s, size_t chunk)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (size_t op = 0; op < s->plan->nin; op++) {
+        char *start;
+        size_t pages = chunk_pages(s, op, chunk, page, &start);
+        unsigned char sum = 0;
+
+        if (pages == 0)
+            continue;
+        /* readahead of the whole range first, then a read per page, that
+           only waits for what the readahead has not brought in yet */
+        posix_madvise(start, pages*page, POSIX_MADV_WILLNEED);
+        for (size_t p = 0; p < pages; p++)
+            sum += *(volatile unsigned char *)(start + p*page);
+        (void)sum;
+    }
+}
+
+void
+release_stream_chunk(const stream *s, size_t chunk)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (size_t op = 0; op < s->plan->nops; op++) {
+        char *start;
+        size_t pages;
+
+        /* inputs broadcast along the rows are used by every chunk */
+        if (!s->by_row[op])
+            continue;
+        pages = chunk_pages(s, op, chunk, page, &start);
+        if (pages == 0)
+            continue;
+        /* only advice: glibc ignores POSIX_MADV_DONTNEED, that would throw
+           away data on Linux, and msync fails harmlessly on memory that is
+           not a mapped file */
+        if (op < s->plan->nin)
+            posix_madvise(start, pages*page, POSIX_MADV_DONTNEED);
+        else
+            msync(start, pages*page, MS_ASYNC);
+    }
+}
+
+#else /* _WIN32 */
+
+void
+prefetch_stream_chunk(const stream *s, size_t chunk)
+{
+    (void)s;
+    (void)chunk;
+}
+
+void
+release_stream_chunk(const stream *s, size_t chunk)
+{
+    (void)s;
+    (void)chunk;
+}
+
+#endif
+
+typedef struct {
+    const execution_plan *plan;
+    char *const *base;
+    size_t start;
+} chunk_run;
+
+static void
+chunk_range_func(void *ctx, size_t start, size_t count)
+{
+    chunk_run *run = ctx;
+    execute_plan_range_at(run->plan, run->base, run->start + start, count);
+}
+
+void
+execute_stream_chunk(const stream *s, char *const *base, size_t chunk)
+{
+    chunk_run run;
+    size_t first, rows;
+
+    stream_chunk_rows(s, chunk, &first, &rows);
+    run.plan = s->plan;
+    run.base = base;
+    run.start = first*s->row_elements;
+    threadpool_parallel_for(rows*s->row_elements, s->min_chunk,
+                            chunk_range_func, &run);
+}
@@ -0,0 +1,69 @@
+#ifndef GUFT_STREAM_H
+#define GUFT_STREAM_H
+
+#include <stddef.h>
+
+#include "executor.h"
+
+/* Streamed execution of a plan, for operands larger than memory (memory
+   mapped files, or outputs handed over to a sink as they are computed).
+
+   The outer shape is split along its first axis in chunks of rows whose
+   operands take about a memory budget. The plan has to be in C order (not
+   reordered with order_execution_plan), so a chunk is a contiguous range
+   of elements, and in C ordered operands a contiguous range of bytes.
+
+   The caller runs a chunk while the next one is prefetched: its input
+   pages are advised as needed soon and then touched, so the page faults
+   happen while the kernel is busy with the previous chunk, not in the
+   kernel. Outputs in memory of the caller get their pages of a finished
+   chunk scheduled for write back, and inputs are advised as not needed.
+   The advice is a no-op where there is no mmap (Windows).
+*/
+
+/* Default memory budget of a chunk, in bytes */
+#define GUFT_DEFAULT_STREAM_BUDGET (64*1024*1024)
+
+typedef struct _stream_struct {
+    const execution_plan *plan;
+    const execution_operand *operands; /* the ones of the plan */
+    size_t rows; /* along the first outer axis */
+    size_t row_elements; /* elements in a row */
+    size_t chunk_rows;
+    size_t chunk_count;
+    size_t min_chunk; /* for the parallel execution of a chunk */
+
+    /* operands that move along the first outer axis. The others (broadcast
+       along it) are used whole by every chunk */
+    int by_row[GUFT_MAXARGS];
+} stream;
+
+/* Split the execution of plan, built for resolved and operands. The bytes
+   of the rows of every operand that moves along the first axis count
+   against budget, the ones of the operands in extra as many more times
+   (1 << op for operand op), say because they are double buffered */
+void
+init_stream(stream *s, const execution_plan *plan,
+            const resolved_shapes *resolved,
+            const execution_operand *operands, size_t budget,
+            unsigned int extra);
+
+/* First row and number of rows of a chunk */
+void
+stream_chunk_rows(const stream *s, size_t chunk, size_t *first, size_t *rows);
+
+/* Get the inputs of a chunk into memory. Blocks until they are */
+void
+prefetch_stream_chunk(const stream *s, size_t chunk);
+
+/* Done with a chunk: write back its outputs and drop its inputs, as far
+   as the system takes the advice */
+void
+release_stream_chunk(const stream *s, size_t chunk);
+
+/* Run the plan over a chunk using the thread pool. base are the base
+   pointers of the operands, as in execute_plan_range_at */
+void
+execute_stream_chunk(const stream *s, char *const *base, size_t chunk);
+
+#endif /* GUFT_STREAM_H */
@@ -0,0 +1,384 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+
+#include "threadpool.h"
+
+#if defined(_WIN32)
+
+/* No pool on this platform yet: loops just run in the calling thread */
+
+void
+threadpool_parallel_for(size_t count,
+                        size_t min_chunk,
+                        threadpool_range_func func,
+                        void *ctx)
+{
+    (void)min_chunk;
+    if (count > 0)
+        func(ctx, 0, count);
+}
+
+void
+threadpool_parallel_for_limited(size_t count,
+                                size_t min_chunk,
+                                size_t max_threads,
+                                threadpool_range_func func,
+                                void *ctx)
+{
+    (void)max_threads;
+    threadpool_parallel_for(count, min_chunk, func, ctx);
+}
+
+void
+threadpool_set_thread_count(size_t thread_count)
+{
+    (void)thread_count;
+}
+
+size_t
+threadpool_get_thread_count(void)
+{
+    return 1;
+}
+
+#else /* !_WIN32 */
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* The remaining range of a participant. Padded so that participants do not
+   share cache lines */
+typedef struct _work_queue_struct {
+    pthread_mutex_t lock;
+    size_t lo;
+    size_t hi;
+    char padding[64];
+} work_queue;
+
+static struct {
+    pthread_mutex_t lock; /* protects everything below */
+    pthread_cond_t work_cv; /* workers wait here for a loop */
+    pthread_cond_t done_cv; /* the caller waits here for the workers */
+
+    size_t thread_count; /* requested, including the caller. 0 if unset */
+    size_t worker_count; /* running workers */
+    pthread_t *workers;
+    int shutdown;
+    unsigned long start_generation; /* generation when workers started */
+
+    /* the current loop */
+    unsigned long generation;
+    size_t participants;
+    size_t active; /* workers that did not finish the loop yet */
+    threadpool_range_func func;
+    void *ctx;
+    size_t min_chunk;
+    work_queue *queues; /* one per participant, the caller is 0 */
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+/* only one loop runs in the pool at a time */
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static size_t
+online_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+/* Take the next chunk from queue q. Returns the chunk size, 0 if empty */
+static size_t
+take_chunk(work_queue *q, size_t min_chunk, size_t *start)
+{
+    size_t n = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->lo < q->hi) {
+        n = q->hi - q->lo;
+        if (n > min_chunk)
+            n = min_chunk;
+        *start = q->lo;
+        q->lo += n;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+/* Steal from victim into thief: half of what remains, or everything if
+   that is not more than a chunk. Returns 0 if nothing could be stolen */
+static int
+steal(work_queue *victim, work_queue *thief, size_t min_chunk)
+{
+    size_t lo = 0, hi = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->lo < victim->hi) {
+        size_t remaining = victim->hi - victim->lo;
+        hi = victim->hi;
+        lo = remaining > min_chunk ? victim->hi - remaining/2 : victim->lo;
+        victim->hi = lo;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (lo == hi)
+        return 0;
+
+    pthread_mutex_lock(&thief->lock);
+    thief->lo = lo;
+    thief->hi = hi;
+    pthread_mutex_unlock(&thief->lock);
+    return 1;
+}
+
+/* Process chunks until there is no work left anywhere */
+static void
+participate(size_t id, size_t participants, threadpool_range_func func,
+            void *ctx, size_t min_chunk, work_queue *queues)
+{
+    work_queue *own = queues + id;
+
+    for (;;) {
+        size_t start, n;
+        int stolen = 0;
+
+        while ((n = take_chunk(own, min_chunk, &start)) > 0)
+            func(ctx, start, n);
+
+        for (size_t i = 1; i < participants && !stolen; i++)
+            stolen = steal(queues + (id + i) % participants, own, min_chunk);
+
+        if (!stolen)
+            return;
+    }
+}
+
+static void *
+worker_main(void *arg)
+{
+    size_t id = (size_t)arg;
+    unsigned long seen;
+
+    pthread_mutex_lock(&pool.lock);
+    /* not pool.generation: a loop may have been posted before this thread
+       got the lock */
+    seen = pool.start_generation;
+    for (;;) {
+        threadpool_range_func func;
+        void *ctx;
+        size_t min_chunk, participants;
+        work_queue *queues;
+
+        while (!pool.shutdown && pool.generation == seen)
+            pthread_cond_wait(&pool.work_cv, &pool.lock);
+        if (pool.shutdown)
+            break;
+        seen = pool.generation;
+        if (id >= pool.participants)
+            continue; /* not needed for this loop */
+
+        func = pool.func;
+        ctx = pool.ctx;
+        min_chunk = pool.min_chunk;
+        participants = pool.participants;
+        queues = pool.queues;
+        pthread_mutex_unlock(&pool.lock);
+
+        participate(id, participants, func, ctx, min_chunk, queues);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active == 0)
+            pthread_cond_signal(&pool.done_cv);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* must be called with pool.lock held and no loop running */
+static void
+stop_workers(void)
+{
+    size_t count = pool.worker_count;
+    pthread_t *workers = pool.workers;
+
+    if (count == 0)
+        return;
+
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work_cv);
+    pthread_mutex_unlock(&pool.lock);
+    for (size_t i = 0; i < count; i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_lock(&pool.lock);
+
+    free(workers);
+    free(pool.queues);
+    pool.workers = NULL;
+    pool.queues = NULL;
+    pool.worker_count = 0;
+    pool.shutdown = 0;
+}
+
+/* must be called with pool.lock held and no loop running. Leaves the pool
+   with no workers if they can't be started */
+static void
+start_workers(size_t thread_count)
+{
+    size_t count = thread_count - 1;
+
+    pool.workers = malloc(count*sizeof(pthread_t));
+    pool.queues = malloc(thread_count*sizeof(work_queue));
+    if (pool.workers == NULL || pool.queues == NULL)
+        goto fail;
+
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].lo = pool.queues[i].hi = 0;
+    }
+
+    pool.start_generation = pool.generation;
+    for (size_t i = 0; i < count; i++) {
+        if (pthread_create(&pool.workers[i], NULL, worker_main,
+                           (void *)(i + 1)) != 0)
+            break;
+        pool.worker_count++;
+    }
+    if (pool.worker_count > 0)
+        return;
+
+ fail:
+    free(pool.workers);
+    free(pool.queues);
+    pool.workers = NULL;
+    pool.queues = NULL;
+}
+
+/* after a fork only the forking thread survives in the child */
+static void
+reset_after_fork(void)
+{
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_cv, NULL);
+    pthread_cond_init(&pool.done_cv, NULL);
+    pthread_mutex_init(&loop_lock, NULL);
+    pool.workers = NULL;
+    pool.queues = NULL;
+    pool.worker_count = 0;
+    pool.shutdown = 0;
+}
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void
+register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, reset_after_fork);
+}
+
+void
+threadpool_parallel_for(size_t count,
+                        size_t min_chunk,
+                        threadpool_range_func func,
+                        void *ctx)
+{
+    threadpool_parallel_for_limited(count, min_chunk, 0, func, ctx);
+}
+
+void
+threadpool_parallel_for_limited(size_t count,
+                                size_t min_chunk,
+                                size_t max_threads,
+                                threadpool_range_func func,
+                                void *ctx)
+{
+    size_t participants, share;
+
+    if (count == 0)
+        return;
+    if (min_chunk == 0)
+        min_chunk = 1;
+
+    pthread_once(&atfork_once, register_atfork);
+
+    participants = (count + min_chunk - 1)/min_chunk;
+    if (max_threads > 0 && participants > max_threads)
+        participants = max_threads;
+    if (participants < 2 || pthread_mutex_trylock(&loop_lock) != 0) {
+        func(ctx, 0, count);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.thread_count == 0)
+        pool.thread_count = online_cpu_count();
+    if (pool.worker_count == 0 && pool.thread_count > 1)
+        start_workers(pool.thread_count);
+    if (participants > pool.worker_count + 1)
+        participants = pool.worker_count + 1;
+
+    if (participants < 2) {
+        pthread_mutex_unlock(&pool.lock);
+        pthread_mutex_unlock(&loop_lock);
+        func(ctx, 0, count);
+        return;
+    }
+
+    /* even split of the range, the caller is participant 0 */
+    share = count/participants;
+    for (size_t i = 0; i < participants; i++) {
+        pool.queues[i].lo = i*share;
+        pool.queues[i].hi = (i + 1 == participants) ? count : (i + 1)*share;
+    }
+    pool.func = func;
+    pool.ctx = ctx;
+    pool.min_chunk = min_chunk;
+    pool.participants = participants;
+    pool.active = participants - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_cv);
+    pthread_mutex_unlock(&pool.lock);
+
+    participate(0, participants, func, ctx, min_chunk, pool.queues);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active > 0)
+        pthread_cond_wait(&pool.done_cv, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&loop_lock);
+}
+
+void
+threadpool_set_thread_count(size_t thread_count)
+{
+    pthread_mutex_lock(&loop_lock);
+    pthread_mutex_lock(&pool.lock);
+    if (thread_count == 0)
+        thread_count = online_cpu_count();
+    if (thread_count != pool.thread_count) {
+        stop_workers();
+        pool.thread_count = thread_count;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&loop_lock);
+}
+
+size_t
+threadpool_get_thread_count(void)
+{
+    size_t rv;
+    pthread_mutex_lock(&pool.lock);
+    if (pool.thread_count == 0)
+        pool.thread_count = online_cpu_count();
+    rv = pool.thread_count;
+    pthread_mutex_unlock(&pool.lock);
+    return rv;
+}
+
+#endif /* _WIN32 */
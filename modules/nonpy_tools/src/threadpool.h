@@ -0,0 +1,48 @@
+#ifndef GUFT_THREADPOOL_H
+#define GUFT_THREADPOOL_H
+
+#include <stddef.h>
+
+/* A persistent pool of worker threads running parallel loops over ranges
+   of elements.
+
+   Each participant (the workers plus the calling thread) starts owning an
+   even share of the range and processes it in chunks of min_chunk
+   elements. Participants that run out of work steal half of the remaining
+   range of another one, so uneven chunk costs are balanced out.
+
+   Workers never touch Python objects: the GIL can (and should) be released
+   while running a parallel loop.
+*/
+
+typedef void (*threadpool_range_func)(void *ctx, size_t start, size_t count);
+
+/* Run func over [0, count) in chunks of at least min_chunk elements using
+   the pool. Blocks until all the range is processed. If the pool is busy
+   with another loop, or has no workers, the loop runs in the calling
+   thread. */
+void
+threadpool_parallel_for(size_t count,
+                        size_t min_chunk,
+                        threadpool_range_func func,
+                        void *ctx);
+
+/* Same, with at most max_threads threads (the calling one included) taking
+   part. 0 means no limit */
+void
+threadpool_parallel_for_limited(size_t count,
+                                size_t min_chunk,
+                                size_t max_threads,
+                                threadpool_range_func func,
+                                void *ctx);
+
+/* Number of threads used by parallel loops, including the calling thread.
+   Setting it to 0 uses the number of online CPUs. Workers are started
+   lazily on the first parallel loop. */
+void
+threadpool_set_thread_count(size_t thread_count);
+
+size_t
+threadpool_get_thread_count(void);
+
+#endif /* GUFT_THREADPOOL_H */
@@ -0,0 +1,527 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#  define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+#include "threadpool.h"
+#include "tuner.h"
+
+int tuning_enabled = 0;
+int tuning_learn = 1;
+
+size_t
+tuning_bucket(size_t element_bytes)
+{
+    size_t bucket = 0;
+
+    while (element_bytes > 0) {
+        bucket++;
+        element_bytes >>= 1;
+    }
+    return bucket;
+}
+
+#if defined(_WIN32)
+
+/* No stats sites on this platform yet, so there is nothing to tune */
+
+void
+tuning_set_enabled(int enabled, int learn)
+{
+    (void)enabled;
+    (void)learn;
+}
+
+void
+tuning_params(size_t site, size_t bucket, const tuned_params *defaults,
+              int buffered, int learn, tuned_params *params, size_t *trial)
+{
+    (void)site; (void)bucket; (void)buffered; (void)learn;
+    *params = *defaults;
+    *trial = 0;
+}
+
+void
+tuning_claim(size_t site, uintptr_t func, uintptr_t data)
+{
+    (void)site; (void)func; (void)data;
+}
+
+int
+tuning_site_shared(size_t site)
+{
+    (void)site;
+    return 0;
+}
+
+int
+tuning_report(size_t site, size_t bucket, size_t trial, uint64_t ns,
+              size_t elements)
+{
+    (void)site; (void)bucket; (void)trial; (void)ns; (void)elements;
+    return 0;
+}
+
+int
+tuning_get(size_t site, size_t bucket, tuned_params *params)
+{
+    (void)site; (void)bucket; (void)params;
+    return -1;
+}
+
+void
+tuning_reset(void)
+{
+}
+
+long
+tuning_load(const char *path, int replace)
+{
+    (void)path; (void)replace;
+    return 0;
+}
+
+int
+tuning_save(const char *path)
+{
+    (void)path;
+    return -1;
+}
+
+int
+tuning_set_cache(const char *path)
+{
+    (void)path;
+    return 0;
+}
+
+int
+tuning_save_cache(void)
+{
+    return 0;
+}
+
+#else /* !_WIN32 */
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* timed calls per candidate. The fastest counts, as the others were slowed
+   down by something else */
+#define TUNING_RUNS 3
+
+#define CACHE_HEADER "# gufunctools tuning cache 1\n"
+
+static const size_t chunk_candidates[] = { 256, 1024, 4096, 16384, 65536 };
+static const size_t buffer_candidates[] = { 4096, 8192, 32768, 131072 };
+
+#define COUNT_OF(a) (sizeof(a)/sizeof((a)[0]))
+
+enum { ENTRY_NEW = 0, ENTRY_TUNING, ENTRY_TUNED };
+enum { STAGE_THREADS = 0, STAGE_CHUNK, STAGE_BUFFERS, STAGE_COUNT };
+
+/* a combination of kernel and bucket */
+typedef struct {
+    int state;
+    int buffered;
+    size_t stage;
+    size_t candidate; /* index in the stage */
+    size_t runs; /* of the candidate */
+    size_t trial; /* id of the candidate */
+    double cost; /* ns per element of the candidate, the best of its runs */
+    double best_cost;
+    tuned_params best;
+    tuned_params current;
+} tuning_entry;
+
+/* the combinations of a stats site, and the kernel that claimed it */
+typedef struct {
+    uintptr_t func;
+    uintptr_t data;
+    int shared; /* claimed by different kernels: not tuned */
+    tuning_entry entries[GUFT_TUNING_BUCKETS];
+} tuning_site;
+
+static struct {
+    pthread_mutex_t lock; /* protects everything below */
+    tuning_site *sites[GUFT_STATS_MAX_SITES + 1]; /* allocated on first use */
+    size_t next_trial;
+    char *cache;
+} tuner = {
+    PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* cache files are written by one thread at a time */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+tuning_set_enabled(int enabled, int learn)
+{
+    GUFT_ATOMIC_STORE(tuning_learn, learn);
+    GUFT_ATOMIC_STORE(tuning_enabled, enabled);
+}
+
+/* a site, NULL if out of memory. Called with the lock held */
+static tuning_site *
+get_site(size_t site)
+{
+    if (site == 0 || site > GUFT_STATS_MAX_SITES)
+        return NULL;
+    if (tuner.sites[site] == NULL)
+        tuner.sites[site] = calloc(1, sizeof(tuning_site));
+    return tuner.sites[site];
+}
+
+/* the entry of a combination, NULL if out of memory or the site is shared.
+   Called with the lock held */
+static tuning_entry *
+get_entry(size_t site, size_t bucket)
+{
+    tuning_site *s = bucket < GUFT_TUNING_BUCKETS ? get_site(site) : NULL;
+
+    if (s == NULL || s->shared)
+        return NULL;
+    return s->entries + bucket;
+}
+
+void
+tuning_claim(size_t site, uintptr_t func, uintptr_t data)
+{
+    tuning_site *s;
+
+    pthread_mutex_lock(&tuner.lock);
+    s = get_site(site);
+    if (s != NULL && s->func == 0 && s->data == 0) {
+        s->func = func;
+        s->data = data;
+    } else if (s != NULL && (s->func != func || s->data != data)) {
+        s->shared = 1;
+    }
+    pthread_mutex_unlock(&tuner.lock);
+}
+
+int
+tuning_site_shared(size_t site)
+{
+    int shared;
+
+    pthread_mutex_lock(&tuner.lock);
+    shared = site > 0 && site <= GUFT_STATS_MAX_SITES &&
+        tuner.sites[site] != NULL && tuner.sites[site]->shared;
+    pthread_mutex_unlock(&tuner.lock);
+    return shared;
+}
+
+/* candidate index of the stage, building on the best parameters so far.
+   Returns 0, or -1 if the stage has no such candidate */
+static int
+get_candidate(const tuning_entry *entry, size_t index, size_t max_threads,
+              tuned_params *candidate)
+{
+    size_t threads = entry->best.thread_count;
+
+    *candidate = entry->best;
+    switch (entry->stage) {
+    case STAGE_THREADS:
+        /* powers of 2, then all of them */
+        threads = 1;
+        for (size_t i = 0; i < index; i++) {
+            if (threads >= max_threads)
+                return -1;
+            threads *= 2;
+        }
+        candidate->thread_count = threads < max_threads ?
+            threads : max_threads;
+        return 0;
+    case STAGE_CHUNK:
+        if (threads == 1 || (threads == 0 && max_threads == 1) ||
+            index >= COUNT_OF(chunk_candidates))
+            return -1;
+        candidate->min_chunk = chunk_candidates[index];
+        return 0;
+    case STAGE_BUFFERS:
+        if (!entry->buffered || index >= COUNT_OF(buffer_candidates))
+            return -1;
+        candidate->buffer_size = buffer_candidates[index];
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* move to the next candidate, or finish. Called with the lock held */
+static void
+next_candidate(tuning_entry *entry)
+{
+    size_t max_threads = threadpool_get_thread_count();
+
+    while (entry->stage < STAGE_COUNT) {
+        if (get_candidate(entry, entry->candidate, max_threads,
+                          &entry->current) == 0) {
+            entry->runs = 0;
+            entry->cost = HUGE_VAL;
+            entry->trial = ++tuner.next_trial;
+            return;
+        }
+        entry->stage++;
+        entry->candidate = 0;
+    }
+    entry->state = ENTRY_TUNED;
+}
+
+void
+tuning_params(size_t site, size_t bucket, const tuned_params *defaults,
+              int buffered, int learn, tuned_params *params, size_t *trial)
+{
+    tuning_entry *entry;
+
+    *params = *defaults;
+    *trial = 0;
+
+    pthread_mutex_lock(&tuner.lock);
+    entry = get_entry(site, bucket);
+    if (entry != NULL && entry->state == ENTRY_NEW && learn) {
+        entry->state = ENTRY_TUNING;
+        entry->buffered = buffered;
+        entry->stage = STAGE_THREADS;
+        entry->candidate = 0;
+        entry->best = *defaults;
+        entry->best_cost = HUGE_VAL;
+        next_candidate(entry);
+    }
+    if (entry != NULL && entry->state == ENTRY_TUNED) {
+        *params = entry->best;
+    } else if (entry != NULL && entry->state == ENTRY_TUNING && learn) {
+        *params = entry->current;
+        *trial = entry->trial;
+    }
+    pthread_mutex_unlock(&tuner.lock);
+}
+
+int
+tuning_report(size_t site, size_t bucket, size_t trial, uint64_t ns,
+              size_t elements)
+{
+    tuning_entry *entry;
+    double cost;
+    int tuned = 0;
+
+    if (elements == 0)
+        return 0;
+    cost = (double)ns/(double)elements;
+
+    pthread_mutex_lock(&tuner.lock);
+    entry = get_entry(site, bucket);
+    /* runs of a previous candidate, finishing late, do not count */
+    if (entry != NULL && entry->state == ENTRY_TUNING &&
+        entry->trial == trial) {
+        if (cost < entry->cost)
+            entry->cost = cost;
+        if (++entry->runs == TUNING_RUNS) {
+            if (entry->cost < entry->best_cost) {
+                entry->best_cost = entry->cost;
+                entry->best = entry->current;
+            }
+            entry->candidate++;
+            next_candidate(entry);
+            tuned = entry->state == ENTRY_TUNED;
+        }
+    }
+    pthread_mutex_unlock(&tuner.lock);
+    return tuned;
+}
+
+int
+tuning_get(size_t site, size_t bucket, tuned_params *params)
+{
+    tuning_entry *entry;
+    int rv = -1;
+
+    pthread_mutex_lock(&tuner.lock);
+    if (site > 0 && site <= GUFT_STATS_MAX_SITES &&
+        bucket < GUFT_TUNING_BUCKETS && tuner.sites[site] != NULL &&
+        !tuner.sites[site]->shared) {
+        entry = tuner.sites[site]->entries + bucket;
+        if (entry->state == ENTRY_TUNED) {
+            *params = entry->best;
+            rv = 0;
+        }
+    }
+    pthread_mutex_unlock(&tuner.lock);
+    return rv;
+}
+
+void
+tuning_reset(void)
+{
+    pthread_mutex_lock(&tuner.lock);
+    for (size_t site = 0; site <= GUFT_STATS_MAX_SITES; site++) {
+        free(tuner.sites[site]);
+        tuner.sites[site] = NULL;
+    }
+    pthread_mutex_unlock(&tuner.lock);
+}
+
+/* Cache files are text, starting with CACHE_HEADER, followed by a line per
+   combination:
+
+       bucket thread_count min_chunk buffer_size name
+
+   where name, the name of the stats site of the kernel, is the rest of the
+   line. Lines that can not be parsed are skipped, and so are the ones of
+   shared sites, that are not written either */
+
+long
+tuning_load(const char *path, int replace)
+{
+    char line[4096];
+    long count = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return errno == ENOENT ? 0 : -1;
+    if (fgets(line, sizeof(line), f) == NULL ||
+        strcmp(line, CACHE_HEADER) != 0) {
+        fclose(f);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t bucket, threads, chunk, buffer_size, len, site;
+        tuning_entry *entry;
+        int name_start = 0;
+
+        len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n')
+            continue; /* too long, or truncated */
+        line[len - 1] = '\0';
+        if (sscanf(line, "%zu %zu %zu %zu %n", &bucket, &threads, &chunk,
+                   &buffer_size, &name_start) != 4 ||
+            name_start == 0 || line[name_start] == '\0' || chunk == 0)
+            continue;
+        site = stats_site(line + name_start);
+
+        pthread_mutex_lock(&tuner.lock);
+        entry = get_entry(site, bucket);
+        if (entry != NULL && (replace || entry->state != ENTRY_TUNED)) {
+            entry->state = ENTRY_TUNED;
+            entry->best.thread_count = threads;
+            entry->best.min_chunk = chunk;
+            entry->best.buffer_size = buffer_size;
+            count++;
+        }
+        pthread_mutex_unlock(&tuner.lock);
+    }
+
+    fclose(f);
+    return count;
+}
+
+static int
+write_cache(FILE *f)
+{
+    size_t site_count = stats_site_count();
+
+    if (fputs(CACHE_HEADER, f) == EOF)
+        return -1;
+    for (size_t site = 1; site <= site_count; site++) {
+        const char *name = stats_site_name(site);
+
+        if (name == NULL || strchr(name, '\n') != NULL)
+            continue;
+        for (size_t bucket = 0; bucket < GUFT_TUNING_BUCKETS; bucket++) {
+            tuned_params params;
+
+            if (tuning_get(site, bucket, &params) != 0)
+                continue;
+            if (fprintf(f, "%zu %zu %zu %zu %s\n", bucket,
+                        params.thread_count, params.min_chunk,
+                        params.buffer_size, name) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int
+tuning_save(const char *path)
+{
+    size_t len = strlen(path);
+    char *tmp;
+    FILE *f;
+    int rv = -1;
+
+    tmp = malloc(len + 32);
+    if (tmp == NULL)
+        return -1;
+    snprintf(tmp, len + 32, "%s.%ld.tmp", path, (long)getpid());
+
+    pthread_mutex_lock(&save_lock);
+    /* keep what other processes found meanwhile */
+    if (tuning_load(path, 0) >= 0) {
+        f = fopen(tmp, "w");
+        if (f != NULL) {
+            rv = write_cache(f);
+            if (fclose(f) != 0)
+                rv = -1;
+            if (rv == 0 && rename(tmp, path) != 0)
+                rv = -1;
+            if (rv != 0)
+                remove(tmp);
+        }
+    }
+    pthread_mutex_unlock(&save_lock);
+
+    free(tmp);
+    return rv;
+}
+
+int
+tuning_set_cache(const char *path)
+{
+    char *copy = NULL;
+
+    if (path != NULL) {
+        copy = malloc(strlen(path) + 1);
+        if (copy == NULL)
+            return -1;
+        strcpy(copy, path);
+    }
+    pthread_mutex_lock(&tuner.lock);
+    free(tuner.cache);
+    tuner.cache = copy;
+    pthread_mutex_unlock(&tuner.lock);
+    return 0;
+}
+
+int
+tuning_save_cache(void)
+{
+    char *path = NULL;
+    int rv = 0;
+
+    pthread_mutex_lock(&tuner.lock);
+    if (tuner.cache != NULL) {
+        path = malloc(strlen(tuner.cache) + 1);
+        if (path != NULL)
+            strcpy(path, tuner.cache);
+        else
+            rv = -1;
+    }
+    pthread_mutex_unlock(&tuner.lock);
+
+    if (path != NULL) {
+        rv = tuning_save(path);
+        free(path);
+    }
+    return rv;
+}
+
+#endif /* _WIN32 */
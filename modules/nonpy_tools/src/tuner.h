@@ -0,0 +1,112 @@
+#ifndef GUFT_TUNER_H
+#define GUFT_TUNER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomics.h"
+
+/* Autotuning of the execution parameters of gufunc calls: the number of
+   threads, the minimum chunk of parallel execution and the size of the
+   buffers (0 for no buffering).
+
+   Parameters are tuned per kernel of a gufunc, identified by its stats site
+   (see stats.h), and per core size bucket: the bit length of the bytes an
+   element takes over all the operands. The first calls of a combination
+   run as trials, each with a candidate setting, and time themselves; the
+   fastest trial per element wins. Parameters are tuned one after the
+   other (threads, then chunk, then buffers) starting from the defaults,
+   each keeping the winners of the previous ones, so a combination takes a
+   few dozen calls to tune.
+
+   Stats sites are named after the gufunc, so the kernels of gufuncs that
+   share a name would share their parameters. Calls claim the site for
+   their kernel first, and a site claimed by two different kernels is
+   shared: it is not tuned, and its parameters are neither used nor saved.
+
+   Winners can be saved to a cache file, a line per combination, and
+   loaded on later runs. When disabled, the cost for a call is the test of
+   tuning_enabled.
+*/
+
+typedef struct _tuned_params_struct {
+    size_t thread_count; /* 0 for all the threads of the pool */
+    size_t min_chunk;
+    size_t buffer_size;
+} tuned_params;
+
+/* core size buckets: bit lengths of a size_t */
+#define GUFT_TUNING_BUCKETS 65
+
+/* non zero when calls are tuned. Test it (with GUFT_ATOMIC_LOAD) before
+   calling anything else */
+extern int tuning_enabled;
+
+/* non zero when calls of combinations not tuned yet run as trials.
+   Otherwise only parameters already tuned (or loaded) are used */
+extern int tuning_learn;
+
+void
+tuning_set_enabled(int enabled, int learn);
+
+/* The bucket of elements taking element_bytes over all the operands */
+size_t
+tuning_bucket(size_t element_bytes);
+
+/* The parameters for a call of the kernel of site, in bucket. defaults are
+   the ones set for every call, and buffered whether the call has any
+   operand to buffer (if not the buffer size is not tuned). When the
+   combination is tuned, params are the winners and trial is 0. Otherwise,
+   with learn set, they are a candidate and trial identifies it for
+   tuning_report; without it they are the defaults and trial is 0 */
+void
+tuning_params(size_t site, size_t bucket, const tuned_params *defaults,
+              int buffered, int learn, tuned_params *params, size_t *trial);
+
+/* Claim site for the kernel of a call, identified by its function and
+   data pointers. A site claimed by another kernel becomes shared */
+void
+tuning_claim(size_t site, uintptr_t func, uintptr_t data);
+
+/* Non zero if site is shared */
+int
+tuning_site_shared(size_t site);
+
+/* Report that a call running as trial took ns for elements. Returns 1 if
+   that finished tuning its combination, 0 otherwise */
+int
+tuning_report(size_t site, size_t bucket, size_t trial, uint64_t ns,
+              size_t elements);
+
+/* The winners of a tuned combination. Returns 0, or -1 if not tuned */
+int
+tuning_get(size_t site, size_t bucket, tuned_params *params);
+
+/* Forget every parameter tuned or loaded */
+void
+tuning_reset(void);
+
+/* Load the winners in a cache file, replacing the ones known if replace is
+   set, only adding the missing ones otherwise. Returns the number of lines
+   taken, or -1 if the file can not be read or is not a cache file (a file
+   that does not exist counts as empty) */
+long
+tuning_load(const char *path, int replace);
+
+/* Write every tuned combination to a cache file, keeping the ones already
+   in it that are not known here (they may come from other processes). The
+   file is replaced atomically. Returns 0 on success, -1 on failure */
+int
+tuning_save(const char *path);
+
+/* The cache file winners are saved to as soon as they are found, NULL for
+   none. The path is copied. Returns 0, or -1 if out of memory */
+int
+tuning_set_cache(const char *path);
+
+/* Save to the cache file, if any. Returns 0 on success or when there is no
+   cache file, -1 on failure */
+int
+tuning_save_cache(void);
+
+#endif /* GUFT_TUNER_H */
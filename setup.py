@@ -3,7 +3,8 @@ from __future__ import division, print_function, absolute_import
 
 from numpy.distutils.core import setup, Extension
 from numpy.distutils import misc_util as np_misc_util
-import os, sys, copy, glob
+from distutils.core import Command
+import os, sys, copy, glob, subprocess
 
 import versioneer
 
@@ -27,9 +28,17 @@ NONUMPY_MODULE_SRC = glob.glob(
     os.path.join('modules', 'nonpy_tools', 'src', '*.c')
 )
 
+# the executor thread pool uses pthreads outside of Windows
+THREAD_LIBRARIES = [] if sys.platform == 'win32' else ['pthread']
+
+# process pools use POSIX shared memory, in librt with older glibc
+if sys.platform.startswith('linux'):
+    THREAD_LIBRARIES.append('rt')
+
 gufunctools_nonumpy_module = Extension(
     'gufunctools._nonpy_tools',
     sources = NONUMPY_MODULE_SRC,
+    libraries = THREAD_LIBRARIES,
 )
 
 EXAMPLES_MODULE_SRC = glob.glob(
@@ -42,6 +51,67 @@ gufunctools_examples_module = Extension(
     **np_misc_util.get_info('npymath')
 )
 
+# Benchmarks: "python setup.py bench" builds the extensions in place and the
+# C micro-benchmark, then runs both suites writing JSON results
+# (the benchmark binary does not link against Python)
+def _uses_python(path):
+    with open(path) as f:
+        return 'Python.h' in f.read()
+
+BENCH_C_SRC = [os.path.join('benchmarks', 'c', 'bench_core.c')] + [
+    f for f in NONUMPY_MODULE_SRC if not _uses_python(f)
+]
+
+class BenchCommand(Command):
+    description = 'build and run the benchmarks, writing results as JSON'
+    user_options = [
+        ('output=', 'o', 'file for the JSON results [default: bench.json]'),
+        ('quick', 'q', 'fewer and shorter repetitions'),
+        ('filter=', 'k', 'only run python benchmarks matching this regex'),
+    ]
+    boolean_options = ['quick']
+
+    def initialize_options(self):
+        self.output = None
+        self.quick = 0
+        self.filter = None
+
+    def finalize_options(self):
+        if self.output is None:
+            self.output = 'bench.json'
+
+    def run(self):
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+
+        self.reinitialize_command('build_ext', inplace=1)
+        self.run_command('build_ext')
+
+        build_temp = os.path.join('build', 'bench')
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        objects = compiler.compile(
+            BENCH_C_SRC, output_dir=build_temp,
+            include_dirs=[os.path.join('modules', 'nonpy_tools', 'src')],
+            extra_postargs=[] if sys.platform == 'win32' else ['-std=c99'])
+        compiler.link_executable(objects, 'bench_core',
+                                 output_dir=build_temp,
+                                 libraries=THREAD_LIBRARIES)
+        binary = os.path.join(build_temp,
+                              compiler.executable_filename('bench_core'))
+
+        command = [sys.executable,
+                   os.path.join('benchmarks', 'run_benchmarks.py'),
+                   '--c-binary', binary, '--output', self.output]
+        if self.quick:
+            command.append('--quick')
+        if self.filter:
+            command.extend(['--filter', self.filter])
+        subprocess.check_call(command)
+
+cmdclass = versioneer.get_cmdclass()
+cmdclass['bench'] = BenchCommand
+
 packages = [
     'gufunctools',
 #   'gufunctools.npy_dependent',
@@ -63,5 +133,5 @@ setup(name='gufunctools',
       packages=packages,
       license='BSD',
       long_description=open('README.rst').read(),
-      cmdclass=versioneer.get_cmdclass()
+      cmdclass=cmdclass
 )